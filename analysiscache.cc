@@ -0,0 +1,174 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstring>
+#include <iostream>
+#include "analysiscache.hh"
+
+const char ANALYSIS_MAGIC[8] = { 'A', 'N', 'A', 'L', 'Y', 'S', 'I', 'S' };
+const uint32_t ANALYSIS_VERSION = 2;
+// entries start on a cache line
+const size_t ANALYSIS_ENTRIES_OFFSET = 64;
+
+AnalysisCache::AnalysisCache() : hits(0), misses(0), header(nullptr), entries(nullptr), num_buckets(0), mapped_size(0)
+{
+}
+
+AnalysisCache::~AnalysisCache()
+{
+    close();
+}
+
+bool AnalysisCache::open(const std::string &filename, size_t size_mb)
+{
+    close();
+    int fd = ::open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        std::cerr << "Couldn't open analysis cache " << filename << std::endl;
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        return false;
+    }
+    bool created = st.st_size == 0;
+    uint64_t buckets = 1;
+    if (created) {
+        // round down to a power of two so the bucket is a mask of the key
+        uint64_t max_buckets = (size_mb << 20) / (sizeof(AnalysisEntry) * BUCKET_SIZE);
+        while (buckets * 2 <= max_buckets) {
+            buckets *= 2;
+        }
+        st.st_size = ANALYSIS_ENTRIES_OFFSET + buckets * BUCKET_SIZE * sizeof(AnalysisEntry);
+        if (ftruncate(fd, st.st_size) < 0) {
+            std::cerr << "Couldn't size analysis cache " << filename << std::endl;
+            ::close(fd);
+            return false;
+        }
+    }
+    void *data = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) {
+        std::cerr << "Couldn't map analysis cache " << filename << std::endl;
+        return false;
+    }
+    Header *mapped = (Header *)data;
+    if (created) {
+        memcpy(mapped->magic, ANALYSIS_MAGIC, sizeof(mapped->magic));
+        mapped->version = ANALYSIS_VERSION;
+        mapped->clock = 0;
+        mapped->num_buckets = buckets;
+    } else if ((size_t)st.st_size < ANALYSIS_ENTRIES_OFFSET || memcmp(mapped->magic, ANALYSIS_MAGIC, sizeof(ANALYSIS_MAGIC)) != 0 ||
+            mapped->version != ANALYSIS_VERSION ||
+            ANALYSIS_ENTRIES_OFFSET + mapped->num_buckets * BUCKET_SIZE * sizeof(AnalysisEntry) > (uint64_t)st.st_size) {
+        std::cerr << "Not an analysis cache " << filename << std::endl;
+        munmap(data, st.st_size);
+        return false;
+    }
+    madvise(data, st.st_size, MADV_RANDOM);
+    header = mapped;
+    entries = (AnalysisEntry *)((char *)data + ANALYSIS_ENTRIES_OFFSET);
+    num_buckets = mapped->num_buckets;
+    mapped_size = st.st_size;
+    return true;
+}
+
+void AnalysisCache::close()
+{
+    if (header != nullptr) {
+        munmap((void *)header, mapped_size);
+    }
+    header = nullptr;
+    entries = nullptr;
+    num_buckets = 0;
+    mapped_size = 0;
+}
+
+bool AnalysisCache::lookup(uint64_t key, int depth, AnalysisEntry &entry)
+{
+    if (!is_open()) {
+        return false;
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    AnalysisEntry *slots = bucket(key);
+    for (int i = 0; i < BUCKET_SIZE; i++) {
+        if (slots[i].check == (uint32_t)(key >> 32) && slots[i].move != 0 && slots[i].depth >= depth) {
+            slots[i].stamp = ++header->clock;
+            entry = slots[i];
+            hits++;
+            return true;
+        }
+    }
+    misses++;
+    return false;
+}
+
+void AnalysisCache::store(uint64_t key, move_t move, int score, int depth, int bound)
+{
+    if (!is_open() || move == 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    AnalysisEntry *slots = bucket(key);
+    uint32_t check = key >> 32;
+    AnalysisEntry *replace = nullptr;
+    for (int i = 0; i < BUCKET_SIZE; i++) {
+        if (slots[i].check == check && slots[i].move != 0) {
+            if (slots[i].depth > depth) {
+                slots[i].stamp = ++header->clock;
+                return;
+            }
+            replace = &slots[i];
+            break;
+        }
+        // an empty slot, otherwise the least recently used
+        if (replace == nullptr || slots[i].move == 0 ||
+                (replace->move != 0 && header->clock - slots[i].stamp > header->clock - replace->stamp)) {
+            replace = &slots[i];
+        }
+    }
+    replace->check = check;
+    replace->stamp = ++header->clock;
+    replace->move = move;
+    replace->score = score;
+    replace->depth = depth;
+    replace->bound = bound;
+    replace->played = 0;
+    replace->played_score = 0;
+}
+
+void AnalysisCache::store_played(uint64_t key, move_t played, int score)
+{
+    if (!is_open()) {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    AnalysisEntry *slots = bucket(key);
+    for (int i = 0; i < BUCKET_SIZE; i++) {
+        if (slots[i].check == (uint32_t)(key >> 32) && slots[i].move != 0) {
+            slots[i].played = compact_move(played);
+            slots[i].played_score = score;
+            return;
+        }
+    }
+}
+
+bool AnalysisCache::lookup_played(uint64_t key, move_t played, int &score)
+{
+    if (!is_open()) {
+        return false;
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    AnalysisEntry *slots = bucket(key);
+    for (int i = 0; i < BUCKET_SIZE; i++) {
+        if (slots[i].check == (uint32_t)(key >> 32) && slots[i].move != 0) {
+            if (slots[i].played == 0 || slots[i].played != compact_move(played)) {
+                return false;
+            }
+            score = slots[i].played_score;
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,72 @@
+#ifndef ANALYSIS_CACHE_HH_
+#define ANALYSIS_CACHE_HH_
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include "move.hh"
+
+// Root search results that outlive the process. The cache is a fixed size
+// file of 4-way buckets mapped shared, so a later run (or another process)
+// searching a position again can reuse the result instead of searching.
+// Writes from several processes may race; a torn entry at worst fails the
+// key check or holds a move the caller rejects as illegal.
+
+struct AnalysisEntry {
+    uint32_t check;  // key bits not used to pick the bucket
+    uint32_t stamp;  // cache clock at last use, for replacement
+    move_t move;
+    int16_t score;   // from the side to move's point of view
+    uint8_t depth;
+    uint8_t bound;   // TT_EXACT, TT_LOWER or TT_UPPER
+    // one other root move the caller asked the search about, 0 if none
+    compact_move_t played;
+    int16_t played_score;  // as the transposition table held it
+};
+
+class AnalysisCache {
+public:
+    AnalysisCache();
+    ~AnalysisCache();
+
+    // creates the file with room for size_mb megabytes of entries; an
+    // existing cache keeps its size and contents
+    bool open(const std::string &filename, size_t size_mb);
+    void close();
+    bool is_open() const { return header != nullptr; }
+    size_t capacity() const { return num_buckets * BUCKET_SIZE; }
+
+    // an entry searched to at least this depth
+    bool lookup(uint64_t key, int depth, AnalysisEntry &entry);
+    // keeps the deeper result for a position, otherwise replaces the least
+    // recently used entry in the bucket
+    void store(uint64_t key, move_t move, int score, int depth, int bound);
+    // attaches a root move's score to the result stored for key, so it is
+    // still known when a later search is answered from the cache
+    void store_played(uint64_t key, move_t played, int score);
+    bool lookup_played(uint64_t key, move_t played, int &score);
+
+    uint64_t hits;
+    uint64_t misses;
+
+    static const int BUCKET_SIZE = 4;
+
+private:
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t clock;
+        uint64_t num_buckets;
+    };
+
+    AnalysisEntry *bucket(uint64_t key) const { return entries + (key & (num_buckets - 1)) * BUCKET_SIZE; }
+
+    Header *header;
+    AnalysisEntry *entries;
+    uint64_t num_buckets;
+    size_t mapped_size;
+    // searches on several threads can share one cache
+    std::mutex lock;
+};
+
+#endif
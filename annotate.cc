@@ -2,23 +2,316 @@
 #include <stdlib.h>
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <set>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
 #include "pgn.hh"
 #include "search.hh"
 #include "evaluate.hh"
 #include "fenboard.hh"
 #include "nnueeval.hh"
+#include "book.hh"
+#include "positionindex.hh"
+#include "analysiscache.hh"
 
 namespace po = boost::program_options;
 
-int main(int argc, char **argv)
+// blocking fifo between pipeline stages; push waits while full so a fast
+// stage can't run ahead of a slow one
+template <typename T> class BoundedQueue {
+public:
+    BoundedQueue(size_t capacity) : capacity(capacity), closed(false) {}
+
+    void push(T &&item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_full.wait(lock, [this] { return items.size() < capacity; });
+        items.push_back(std::move(item));
+        not_empty.notify_one();
+    }
+
+    // returns false once the queue is closed and drained
+    bool pop(T &item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait(lock, [this] { return !items.empty() || closed; });
+        if (items.empty()) {
+            return false;
+        }
+        item = std::move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        not_empty.notify_all();
+    }
+
+private:
+    size_t capacity;
+    bool closed;
+    std::deque<T> items;
+    std::mutex mutex;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+};
+
+// how far past the oldest game not yet written the reader may go, so that
+// a slow game holds back a bounded number of finished ones
+class ReorderWindow {
+public:
+    ReorderWindow(int size) : size(size), next_written(0) {}
+
+    void wait_for(int index) {
+        std::unique_lock<std::mutex> lock(mutex);
+        room.wait(lock, [this, index] { return index < next_written + size; });
+    }
+
+    void written() {
+        std::lock_guard<std::mutex> lock(mutex);
+        next_written++;
+        room.notify_all();
+    }
+
+private:
+    int size;
+    int next_written;
+    std::mutex mutex;
+    std::condition_variable room;
+};
+
+struct GameJob {
+    int index;
+    std::map<std::string, std::string> metadata;
+    std::vector<std::pair<move_annot, move_annot> > movelist;
+};
+
+struct AnnotatedGame {
+    int index;
+    std::string pgn;
+    uint64_t nodecount;
+    uint64_t null_nodecount;
+    uint64_t low_depth_nodecount;
+};
+
+struct AnnotateOptions {
+    int depth;
+    int qdepth;
+    int tt_size_log2;
+    bool use_tt;
+    bool see_eval;
+    bool use_nnue;
+    // archive stats for each move, if given
+    const PositionIndex *index;
+    AnalysisCache *cache;
+};
+
+void annotate_game(Search *s, const AnnotateOptions &options, const GameJob &job, AnnotatedGame &result)
 {
-    std::vector<std::string> pgnfiles;
     Fenboard b;
+    std::ostringstream os;
+    b.set_starting_position();
+    s->reset();
+    result.index = job.index;
+    result.nodecount = 0;
+    result.null_nodecount = 0;
+    result.low_depth_nodecount = 0;
+
+    for (auto iter = job.metadata.begin(); iter != job.metadata.end(); iter++) {
+        os << "[" << iter->first << " \"" << iter->second << "\"]" << std::endl;
+    }
+    os << std::endl;
+
+    int plyno = 0;
+    for (auto iter = job.movelist.begin(); iter != job.movelist.end(); ) {
+        std::string move_text;
+        if (b.get_side_to_play() == White) {
+            move_text = iter->first.move;
+        } else if (iter->second.move.length() > 1){
+            move_text = iter->second.move;
+            ++iter;
+        } else {
+            break;
+        }
+        move_t move = b.read_move(move_text, b.get_side_to_play());
+        auto starttime = std::chrono::system_clock::now();
+        move_t suggested_move = s->alphabeta(b);
+        auto elapsed_usecs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now() - starttime).count();
+        int result_score = s->score;
+        os << ((plyno / 2) + 1) << (b.get_side_to_play() == White ? ". " : "... ") << move_text << " {";
+        if (move != suggested_move) {
+            int tt_value = 0;
+            bool have_value = s->root_move_score(b, move, tt_value);
+            if (have_value) {
+                if (b.get_side_to_play() == Black){
+                    tt_value = -tt_value;
+                }
+                os << " eval=" << tt_value;
+            }
+            if (!have_value || abs(result_score - tt_value) > 10) {
+                os << " best=";
+                b.print_move(suggested_move, os);
+                os << " eval=" << result_score;
+                if (have_value) {
+                    os << " loss=" << tt_value - result_score;
+                }
+            }
+        } else {
+            os << " eval=" << result_score;
+        }
+        if (options.see_eval) {
+            Acquisition<MoveSorter> move_iter(s);
+            s->psqt_coeff = 1;
+            int suggested_move_see_score = 0;
+            std::vector<move_t> line;
+            std::vector<std::pair<move_t, int> > see_scores;
+            move_iter->reset(&b, s, line, false, 0, SCORE_MIN, SCORE_MAX, true, 0, 0, true);
+            while (move_iter->has_more_moves()) {
+                move_t testmove = move_iter->next_move();
+                int score_parts[score_part_len];
+                move_iter->get_score_parts(&b, testmove, line, score_parts);
+                see_scores.push_back(std::make_pair(testmove, score_parts[score_part_exchange] + score_parts[score_part_psqt]));
+                if (testmove == suggested_move) {
+                    suggested_move_see_score = see_scores.back().second;
+                }
+            }
+            std::sort(see_scores.begin(), see_scores.end(), [](const std::pair<move_t, int> &a, const std::pair<move_t, int> &b) {
+                return a.second > b.second;
+            });
+            if (see_scores.size() > 1) {
+                if (see_scores[0].second - 100 > suggested_move_see_score) {
+                    os << " see discount:";
+                    b.print_move(see_scores[0].first, os);
+                    os << " score=" << see_scores[0].second << " suggested=";
+                    b.print_move(suggested_move, os);
+                    os << " score=" << suggested_move_see_score;
+                }
+            }
+        }
+
+        if (options.index != nullptr) {
+            std::vector<PositionStats> found;
+            options.index->find(b, found);
+            uint32_t reached = 0, played = 0;
+            uint16_t book_move = move_to_polyglot(move);
+            for (auto stats = found.begin(); stats != found.end(); stats++) {
+                reached += stats->count;
+                if (stats->move == book_move) {
+                    played = stats->count;
+                }
+            }
+            os << " seen=" << played << "/" << reached;
+        }
+
+        os << " time=" << elapsed_usecs / 1000.0 << "ms";
+        os << " nodes=" << s->nodecount << " null=" << s->null_nodecount << " low=" << s->low_depth_nodecount << " commenced=" << s->moves_commenced << " expanded=" << s->moves_expanded << " quiescent=" << s->qnodecount;
+        os << " }" << std::endl;
+        result.nodecount += s->nodecount;
+        result.null_nodecount += s->null_nodecount;
+        result.low_depth_nodecount += s->low_depth_nodecount;
+        b.apply_move(move);
+        plyno++;
+        s->reset_counters();
+    }
+    auto game_result = job.metadata.find("Result");
+    os << (game_result != job.metadata.end() ? game_result->second : "*") << std::endl << std::endl;
+    result.pgn = os.str();
+}
+
+void annotate_worker(const AnnotateOptions &options, BoundedQueue<GameJob> &games, BoundedQueue<AnnotatedGame> &annotated)
+{
     Evaluation *e;
-    Search *s;
+    if (options.use_nnue) {
+        e = new NNUEEvaluation();
+    } else {
+        e = new SimpleBitboardEvaluation();
+    }
+    Search *s = new Search(e, options.tt_size_log2);
+    s->max_depth = options.depth;
+    s->quiescent_depth = options.qdepth;
+    if (s->quiescent_depth == 0) {
+        s->use_quiescent_search = false;
+    }
+    if (!options.use_tt) {
+        s->use_transposition_table = false;
+    }
+    s->analysis_cache = options.cache;
+
+    GameJob job;
+    while (games.pop(job)) {
+        AnnotatedGame result;
+        annotate_game(s, options, job, result);
+        annotated.push(std::move(result));
+    }
+    delete s;
+    delete e;
+}
+
+// parses games in file order and hands them to the workers
+void read_games(const std::vector<std::string> &pgnfiles, int games_per_file, BoundedQueue<GameJob> &games, ReorderWindow &window, bool &read_error)
+{
+    int index = 0;
+    for (auto pgnfilename : pgnfiles) {
+        std::ifstream pgnstream(pgnfilename);
+        if (!pgnstream) {
+            std::cerr << "Cannot load " << pgnfilename << ": " << strerror(errno) << std::endl;
+            read_error = true;
+            break;
+        }
+        pgn_istream mypgn(pgnstream);
+        for (int gameno = 0; gameno < games_per_file && !pgnstream.eof(); gameno++) {
+            GameJob job;
+            job.index = index;
+            read_pgn(&mypgn, job.metadata, job.movelist);
+            if (job.movelist.empty()) {
+                continue;
+            }
+            window.wait_for(index);
+            index++;
+            games.push(std::move(job));
+        }
+    }
+    games.close();
+}
+
+// emits games in input order, holding back any that finish early
+void write_games(BoundedQueue<AnnotatedGame> &annotated, ReorderWindow &window, std::ostream &os, AnnotatedGame &totals)
+{
+    std::map<int, AnnotatedGame> pending;
+    int next_index = 0;
+    AnnotatedGame result;
+    totals.nodecount = 0;
+    totals.null_nodecount = 0;
+    totals.low_depth_nodecount = 0;
+    while (annotated.pop(result)) {
+        int index = result.index;
+        pending[index] = std::move(result);
+        for (auto iter = pending.find(next_index); iter != pending.end(); iter = pending.find(next_index)) {
+            os << iter->second.pgn << std::flush;
+            totals.nodecount += iter->second.nodecount;
+            totals.null_nodecount += iter->second.null_nodecount;
+            totals.low_depth_nodecount += iter->second.low_depth_nodecount;
+            pending.erase(iter);
+            next_index++;
+            window.written();
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<std::string> pgnfiles;
+    AnnotateOptions options = { 6, 6, 24, true, false, true, nullptr, nullptr };
+    PositionIndex index;
+    AnalysisCache cache;
+    int cache_size_mb = 64;
     int games = 1;
-    bool see_eval = false;
+    int jobs = 1;
+    int queue_size = 0;
 
     try {
 
@@ -29,10 +322,16 @@ int main(int argc, char **argv)
             ("games", po::value<int>(), "number of games to annotate")
             ("qdepth", po::value<int>(), "set quiescent depth")
             ("debug", po::value<int>(), "set debug level")
+            ("jobs", po::value<int>(), "number of search workers")
+            ("queue-size", po::value<int>(), "max games queued between stages (default 2 per worker)")
+            ("tt-size", po::value<int>(), "log2 of transposition table entries per worker")
             ("no-tt", po::bool_switch(), "turn off transposition table")
             ("search-features", po::bool_switch(), "turn on search features")
             ("see-eval", po::bool_switch(), "turn on see eval stats")
             ("no-nnue", po::bool_switch(), "disable nnue eval")
+            ("position-index", po::value<std::string>(), "report how often each move was played in this index")
+            ("analysis-cache", po::value<std::string>(), "reuse search results kept in this file")
+            ("analysis-cache-mb", po::value<int>(), "size of a new analysis cache (default 64)")
             ("input-file", po::value<std::vector<std::string> >(), "input file")
         ;
 
@@ -41,7 +340,6 @@ int main(int argc, char **argv)
         po::variables_map vm;
         po::store(po::command_line_parser(argc, argv).options(desc).positional(p).run(), vm);
         po::notify(vm);
-        int depth = 6;
 
         if (vm.count("help")) {
             std::cout << desc << std::endl;
@@ -51,37 +349,53 @@ int main(int argc, char **argv)
             search_features = 1;
         }
         if (vm["see-eval"].as<bool>()){
-            see_eval = true;
+            options.see_eval = true;
         }
         if (vm.count("input-file")) {
             pgnfiles = vm["input-file"].as<std::vector<std::string>>();
         }
         if (vm["no-nnue"].as<bool>()){
-            e = new SimpleBitboardEvaluation();
-        } else {
-            e = new NNUEEvaluation();
+            options.use_nnue = false;
         }
-        s = new Search(e);
-
         if (vm.count("depth")) {
-            depth = vm["depth"].as<int>();
+            options.depth = vm["depth"].as<int>();
         }
         if (vm.count("games")) {
             games = vm["games"].as<int>();
         }
-        s->max_depth = depth;
+        if (vm.count("jobs")) {
+            jobs = std::max(1, vm["jobs"].as<int>());
+        }
+        if (vm.count("queue-size")) {
+            queue_size = vm["queue-size"].as<int>();
+        }
+        if (vm.count("tt-size")) {
+            options.tt_size_log2 = vm["tt-size"].as<int>();
+        }
         if (vm.count("qdepth")) {
-            s->quiescent_depth = vm["qdepth"].as<int>();
-            if (s->quiescent_depth == 0) {
-                s->use_quiescent_search = false;
-            }
+            options.qdepth = vm["qdepth"].as<int>();
         }
         if (vm["no-tt"].as<bool>()) {
-            s->use_transposition_table = false;
+            options.use_tt = false;
         }
         if (vm.count("debug")) {
             search_debug = vm["debug"].as<int>();
         }
+        if (vm.count("position-index")) {
+            if (!index.open(vm["position-index"].as<std::string>())) {
+                return 1;
+            }
+            options.index = &index;
+        }
+        if (vm.count("analysis-cache-mb")) {
+            cache_size_mb = vm["analysis-cache-mb"].as<int>();
+        }
+        if (vm.count("analysis-cache")) {
+            if (!cache.open(vm["analysis-cache"].as<std::string>(), cache_size_mb)) {
+                return 1;
+            }
+            options.cache = &cache;
+        }
     }
     catch(std::exception& e) {
         std::cerr << "error: " << e.what() << "\n";
@@ -90,104 +404,34 @@ int main(int argc, char **argv)
     catch(...) {
         std::cerr << "Exception of unknown type!\n";
     }
-    // play some games
-    uint64_t total_nodecount = 0;
-    uint64_t total_null_nodecount = 0;
-    uint64_t total_low_depth_nodecount = 0;
-    for (auto pgnfilename : pgnfiles) {
-        std::ifstream pgnstream(pgnfilename);
-        if (!pgnstream) {
-            std::cout << "Cannot load " << pgnfilename << ": " << strerror(errno) << std::endl;
-            return -1;
-        }
-        pgn_istream mypgn(pgnstream);
-        for (int gameno = 0; gameno < games; gameno++) {
-            b.set_starting_position();
-            s->reset();
-            std::map<std::string, std::string> game_metadata;
-            std::vector<std::pair<move_annot, move_annot> > movelist;
-
-            read_pgn(&mypgn, game_metadata, movelist);
-            int plyno = 0;
-            for (auto iter = movelist.begin(); iter != movelist.end(); ) {
-                std::string move_text;
-                if (b.get_side_to_play() == White) {
-                    move_text = iter->first.move;
-                } else if (iter->second.move.length() > 1){
-                    move_text = iter->second.move;
-                    ++iter;
-                } else {
-                    break;
-                }
-                move_t move = b.read_move(move_text, b.get_side_to_play());
-                auto starttime = std::chrono::system_clock::now();
-                move_t suggested_move = s->alphabeta(b);
-                auto elapsed_usecs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now() - starttime).count();
-                int result_score = s->score;
-                std::cout << ((plyno / 2) + 1) << (b.get_side_to_play() == White ? ". " : "... ") << move_text;
-                if (move != suggested_move) {
-                    move_t tt_move;
-                    int tt_value = 0;
-                    int tt_alpha = SCORE_MIN, tt_beta = SCORE_MAX;
-                    if (s->read_transposition(b.get_zobrist_with_move(move), tt_move, 0, tt_alpha, tt_beta, tt_value)) {
-                        if (b.get_side_to_play() == Black){
-                            tt_value = -tt_value;
-                        }
-                        std::cout << " eval=" << tt_value;
-                    } else {
-                        std::cout << "break" << std::endl;
-
-                    }
-                    if (abs(result_score - tt_value) > 10) {
-                        std::cout << " (";
-                        b.print_move(suggested_move, std::cout);
-                        std::cout << " eval=" << result_score;
-                        std::cout << " loss=" << tt_value - result_score;
-                        std::cout << ")";
-                    }
-                }
-                if (see_eval) {
-                    Acquisition<MoveSorter> move_iter(s);
-                    s->psqt_coeff = 1;
-                    int suggested_move_see_score = 0;
-                    std::vector<move_t> line;
-                    std::vector<std::pair<move_t, int> > see_scores;
-                    move_iter->reset(&b, s, line, false, 0, SCORE_MIN, SCORE_MAX, true, 0, 0, true);
-                    while (move_iter->has_more_moves()) {
-                        move_t testmove = move_iter->next_move();
-                        int score_parts[score_part_len];
-                        move_iter->get_score_parts(&b, testmove, line, score_parts);
-                        see_scores.push_back(std::make_pair(testmove, score_parts[score_part_exchange] + score_parts[score_part_psqt]));
-                        if (testmove == suggested_move) {
-                            suggested_move_see_score = see_scores.back().second;
-                        }
-                    }
-                    std::sort(see_scores.begin(), see_scores.end(), [](const std::pair<move_t, int> &a, const std::pair<move_t, int> &b) {
-                        return a.second > b.second;
-                    });
-                    if (see_scores.size() > 1) {
-                        if (see_scores[0].second - 100 > suggested_move_see_score) {
-                            std::cout << " see discount:";
-                            b.print_move(see_scores[0].first, std::cout);
-                            std::cout << " score=" << see_scores[0].second << " suggested=";
-                            b.print_move(suggested_move, std::cout);
-                            std::cout << " score=" << suggested_move_see_score;
-                        }
-                    }
-                }
+    if (queue_size <= 0) {
+        queue_size = 2 * jobs;
+    }
 
-                std::cout << " time=" << elapsed_usecs / 1000.0 << "ms ";
-                std::cout << "Node count=" << s->nodecount << " null=" << s->null_nodecount << " low=" << s->low_depth_nodecount << " commenced=" << s->moves_commenced << " expanded=" << s->moves_expanded << " quiescent count = " << s->qnodecount;
-                std::cout << std::endl;
-                total_nodecount += s->nodecount;
-                total_null_nodecount += s->null_nodecount;
-                total_low_depth_nodecount += s->low_depth_nodecount;
-                b.apply_move(move);
-                plyno++;
-                s->reset_counters();
-            }
-            std::cout << "game over" << std::endl;
-        }
+    // reader -> workers -> ordered writer
+    BoundedQueue<GameJob> game_queue(queue_size);
+    BoundedQueue<AnnotatedGame> annotated_queue(queue_size);
+    // room for every game queued or being searched
+    ReorderWindow window(queue_size + jobs);
+    bool read_error = false;
+    AnnotatedGame totals;
+    std::thread reader(read_games, std::cref(pgnfiles), games, std::ref(game_queue), std::ref(window), std::ref(read_error));
+    std::vector<std::thread> workers;
+    for (int i = 0; i < jobs; i++) {
+        workers.push_back(std::thread(annotate_worker, std::cref(options), std::ref(game_queue), std::ref(annotated_queue)));
+    }
+    std::thread writer(write_games, std::ref(annotated_queue), std::ref(window), std::ref(std::cout), std::ref(totals));
+
+    reader.join();
+    for (auto iter = workers.begin(); iter != workers.end(); iter++) {
+        iter->join();
+    }
+    annotated_queue.close();
+    writer.join();
+
+    std::cerr << "Total nodecount=" << totals.nodecount << " null=" << totals.null_nodecount << " low=" << totals.low_depth_nodecount << std::endl;
+    if (cache.is_open()) {
+        std::cerr << "Analysis cache hits=" << cache.hits << " misses=" << cache.misses << std::endl;
     }
-    std::cout << "Total nodecount=" << total_nodecount << " null=" << total_null_nodecount << " low=" << total_low_depth_nodecount << std::endl;
-}
\ No newline at end of file
+    return read_error ? -1 : 0;
+}
@@ -0,0 +1,22 @@
+#ifndef BENCH_HH_
+#define BENCH_HH_
+
+#include <cstdint>
+#include <ostream>
+
+const int BENCH_DEPTH = 5;
+const int BENCH_TT_SIZE_LOG2 = 20;
+
+extern const char *bench_positions[];
+extern const int num_bench_positions;
+
+struct BenchResult {
+    uint64_t nodes;
+    double elapsed;
+};
+
+// searches every bench position to a fixed depth with a fresh fixed-size
+// transposition table; the node total only changes when search behaviour does
+BenchResult run_bench(std::ostream &os, int depth = BENCH_DEPTH, int tt_size_log2 = BENCH_TT_SIZE_LOG2);
+
+#endif
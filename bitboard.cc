@@ -3,12 +3,18 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <algorithm>
 #include <iostream>
 #include "bitboard.hh"
 #include "fenboard.hh"
 #include "move.hh"
 #include <cassert>
 #include <type_traits>
+#include <utility>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SLIDER_PEXT_AVAILABLE
+#endif
 
 const uint64_t file_a = 0x0101010101010101ULL;
 const uint64_t file_h = file_a << 7;
@@ -29,221 +35,100 @@ constexpr uint64_t shift_right(uint64_t x, int amount) {
     }
 }
 
-constexpr uint64_t project_bitset(uint64_t bitset, uint64_t bitmask)
-{
-    uint64_t projection = 0;
-    int location = 0;
-    for (int i = 0; i < count_bits(bitmask); i++) {
-        location = get_low_bit(bitmask, location);
-        if (location == -1) {
-            break;
-        }
-        if (bitset & (1ULL << i)) {
-            projection |= (1ULL << location);
-        }
-        location++;
-    }
-    return projection;
+constexpr int distance(int a, int b) {
+    return a > b ? a - b : b - a;
 }
 
-uint64_t bishop_slide_moves(BoardPos src, uint64_t blockboard);
-uint64_t rook_slide_moves(BoardPos src, uint64_t blockboard);
-
- template<uint64_t... args>
- struct ArrayHolder {
-     static const uint64_t data[sizeof...(args)];
- };
-
- template<uint64_t... args>
- const uint64_t ArrayHolder<args...>::data[sizeof...(args)] = { args ... };
-
- template<size_t N, template<size_t> class F, uint64_t... args>
- struct generate_array_impl {
-     typedef typename generate_array_impl<N-1, F, F<N>::value, args...>::result result;
- };
-
- template<template<size_t> class F, uint64_t... args>
- struct generate_array_impl<0, F, args...> {
-     typedef ArrayHolder<F<0>::value, args...> result;
- };
-
- template<size_t N, template<size_t> class F>
- struct generate_array {
-     typedef typename generate_array_impl<N-1, F>::result result;
- };
-
- template<template<BoardPos, BoardPos> class pred, size_t src, size_t dest>
- struct generate_bitboard {
-     static const uint64_t value = (pred<src, dest-1>::value ? (static_cast<uint64_t>(1) << (dest-1)) : 0) | generate_bitboard<pred, src, dest-1>::value;
- };
-
- template<template<BoardPos, BoardPos> class pred, size_t src>
- struct generate_bitboard<pred, src, 0> {
-     static const uint64_t value = 0;
-
- };
-
- template<template<BoardPos, BoardPos> class pred>
- struct CreateBitboard {
-     template<size_t src>
-     struct Generator {
-         static const uint64_t value = generate_bitboard<pred, src, 64>::value;
-     };
- };
-
-template<size_t src>
-struct RookBitCounter {
-    static const int value = (src % 8 == 0 || src % 8 == 7 ? 6 : 5) + (src / 8 == 0 || src / 8 == 7 ? 6 : 5) + 1;
+template<size_t N>
+struct BitboardArray {
+    uint64_t data[N];
 };
 
-template<size_t src>
-struct BishopBitCounter {
-    static const int value = max(0, 6 - max(src / 8, src % 8)) + max(0, 6 - max(7 - src/8, src %8)) + max(0, 6 - max(7 - src/8, 7 - src %8)) + max(0, 6 - max(src/8, 7 - src %8)) + 1;
-};
+typedef BitboardArray<64> SquareTable;
 
- template<int x>
- struct Abs
- {
-     const static int value = x < 0 ? -x : x;
- };
-
-struct BitArrays {
-     template<BoardPos src, BoardPos dest>
-     struct is_knight_move {
-         const static int rankdiff = Abs<((src) / 8) - ((dest) / 8)>::value;
-         const static int filediff = Abs<((src) % 8) - ((dest) % 8)>::value;
-         const static bool value = (rankdiff == 1 && filediff == 2) || (rankdiff == 2 && filediff == 1);
-     };
-     template<BoardPos src, BoardPos dest>
-     struct is_king_move {
-         const static int rankdiff = Abs<((src) / 8) - ((dest) / 8)>::value;
-         const static int filediff = Abs<((src) % 8) - ((dest) % 8)>::value;
-         const static bool value = rankdiff <= 1 && filediff <= 1 && (rankdiff > 0 || filediff > 0);
-     };
-     template<BoardPos src, BoardPos dest>
-     struct is_rook_move {
-         const static int rankdiff = (src / 8) - (dest / 8);
-         const static int filediff = (src % 8) - (dest % 8);
-         const static bool is_valid_move = (rankdiff == 0 || filediff == 0) && rankdiff != filediff;
-         const static bool value = is_valid_move;
-     };
-     template<BoardPos src, BoardPos dest>
-     struct is_bishop_move {
-         const static int rankdiff = Abs<(src / 8) - (dest / 8)>::value;
-         const static int filediff = Abs<(src % 8) - (dest % 8)>::value;
-         const static bool is_valid_move = rankdiff == filediff && filediff != 0;
-         const static bool value = is_valid_move;
-     };
-
-
-     template<BoardPos src, BoardPos dest>
-     struct is_rook_blockboard {
-         const static int rankdiff = (src / 8) - (dest / 8);
-         const static int filediff = (src % 8) - (dest % 8);
-         const static bool is_valid_move = (rankdiff == 0 || filediff == 0) && rankdiff != filediff;
-         const static bool value = is_valid_move &&
-            ((rankdiff == 0 && (dest % 8 > 0 && dest % 8 < 7)) || (filediff == 0 && (dest / 8 > 0 && dest / 8 < 7)));
-     };
-
-     template<BoardPos src, BoardPos dest>
-     struct is_bishop_blockboard {
-         const static int rankdiff = Abs<(src / 8) - (dest / 8)>::value;
-         const static int filediff = Abs<(src % 8) - (dest % 8)>::value;
-         const static bool is_valid_move = rankdiff == filediff && filediff != 0;
-         const static bool value = is_valid_move && dest / 8 > 0 && dest / 8 < 7 && dest % 8 > 0 && dest % 8 < 7;
-     };
-
-     template <bool is_white>
-     struct is_pawn_capture {
-         template<BoardPos src, BoardPos dest>
-         struct move {
-             const static int rankdiff = (src / 8) - (dest / 8);
-             const static int filediff = Abs<(src % 8) - (dest % 8)>::value;
-             const static bool value = filediff == 1 && rankdiff == (is_white ? -1 : 1);
-         };
-     };
-
-     template <bool is_white>
-     struct is_pawn_move {
-         template<BoardPos src, BoardPos dest>
-         struct move {
-             const static int rankdiff = (src / 8) - (dest / 8);
-             const static int filediff = Abs<(src % 8) - (dest % 8)>::value;
-             const static bool value = filediff == 0 && (rankdiff == (is_white ? -1 : 1));
-         };
-     };
-
-public:
-     typedef generate_array<64, CreateBitboard<BitArrays::is_knight_move>::Generator>::result knight_moves;
-     typedef generate_array<64, CreateBitboard<BitArrays::is_king_move>::Generator>::result king_moves;
-     typedef generate_array<64, CreateBitboard<BitArrays::is_bishop_move>::Generator>::result bishop_moves;
-     typedef generate_array<64, CreateBitboard<BitArrays::is_rook_move>::Generator>::result rook_moves;
-     typedef generate_array<64, CreateBitboard<BitArrays::is_rook_blockboard>::Generator>::result rook_blockboard;
-     typedef generate_array<64, CreateBitboard<BitArrays::is_bishop_blockboard>::Generator>::result bishop_blockboard;
-     typedef generate_array<64, CreateBitboard<BitArrays::is_pawn_capture<true>::move >::Generator>::result pawn_captures_white;
-     typedef generate_array<64, CreateBitboard<BitArrays::is_pawn_capture<false>::move >::Generator>::result pawn_captures_black;
-     typedef generate_array<64, CreateBitboard<BitArrays::is_pawn_move<true>::move >::Generator>::result pawn_moves_white;
-     typedef generate_array<64, CreateBitboard<BitArrays::is_pawn_move<false>::move >::Generator>::result pawn_moves_black;
-
-     typedef generate_array<64, RookBitCounter>::result rook_bitboard_bitcount;
-     typedef generate_array<64, BishopBitCounter>::result bishop_bitboard_bitcount;
-
- };
-
-//constexpr
-uint64_t bishop_slide_moves(BoardPos src, uint64_t blockboard) {
-    uint64_t x = 0;
-    for (int dr = -1; dr <= 1; dr += 2) {
-        for (int df = -1; df <= 1; df += 2) {
-            for (int n = 1; n < 8; n++) {
-                int r = src / 8 + dr * n;
-                int f = src % 8 + df * n;
-                int i = r * 8 + f;
-                if (r < 0 || r >= 8 || f < 0 || f >= 8) {
-                    break;
-                }
-                x |= (1ULL << i);
-                if (blockboard & (1ULL << i)) {
-                    break;
-                }
+// a bitboard per source square of the destinations pred(src, dest) accepts
+template<typename Pred>
+constexpr SquareTable generate_square_table(Pred pred) {
+    SquareTable table{};
+    for (int src = 0; src < 64; src++) {
+        for (int dest = 0; dest < 64; dest++) {
+            if (pred(src, dest)) {
+                table.data[src] |= (1ULL << dest);
             }
         }
     }
-    return x;
+    return table;
 }
 
-uint64_t rook_slide_moves(BoardPos src, uint64_t blockboard) {
-    // up
-    uint64_t n = 0;
-
-    for (int i = src + 8; i < 64; i+= 8) {
-        n |= (1ULL << i);
-        if (blockboard & (1ULL << i)) {
-            break;
-        }
-    }
-    for (int i = src + 1; i < 8 * (src / 8 + 1); i += 1) {
-        n |= (1ULL << i);
-        if (blockboard & (1ULL << i)) {
-            break;
-        }
-    }
-    for (int i = src - 8; i >= 0; i-= 8) {
-        n |= (1ULL << i);
-        if (blockboard & (1ULL << i)) {
-            break;
-        }
-    }
+namespace BitArrays {
+    constexpr SquareTable knight_moves = generate_square_table([](int src, int dest) {
+        int rankdiff = distance(src / 8, dest / 8);
+        int filediff = distance(src % 8, dest % 8);
+        return (rankdiff == 1 && filediff == 2) || (rankdiff == 2 && filediff == 1);
+    });
+    constexpr SquareTable king_moves = generate_square_table([](int src, int dest) {
+        int rankdiff = distance(src / 8, dest / 8);
+        int filediff = distance(src % 8, dest % 8);
+        return rankdiff <= 1 && filediff <= 1 && (rankdiff > 0 || filediff > 0);
+    });
+    constexpr SquareTable rook_moves = generate_square_table([](int src, int dest) {
+        return (src / 8 == dest / 8 || src % 8 == dest % 8) && src != dest;
+    });
+    constexpr SquareTable bishop_moves = generate_square_table([](int src, int dest) {
+        return distance(src / 8, dest / 8) == distance(src % 8, dest % 8) && src != dest;
+    });
+
+    // the squares whose occupancy changes a slider's attacks: the last square
+    // of each ray never does
+    constexpr SquareTable rook_blockboard = generate_square_table([](int src, int dest) {
+        return rook_moves.data[src] & (1ULL << dest) &&
+            ((src / 8 == dest / 8 && dest % 8 > 0 && dest % 8 < 7) || (src % 8 == dest % 8 && dest / 8 > 0 && dest / 8 < 7));
+    });
+    constexpr SquareTable bishop_blockboard = generate_square_table([](int src, int dest) {
+        return bishop_moves.data[src] & (1ULL << dest) && dest / 8 > 0 && dest / 8 < 7 && dest % 8 > 0 && dest % 8 < 7;
+    });
+
+    constexpr SquareTable pawn_captures_white = generate_square_table([](int src, int dest) {
+        return distance(src % 8, dest % 8) == 1 && dest / 8 - src / 8 == 1;
+    });
+    constexpr SquareTable pawn_captures_black = generate_square_table([](int src, int dest) {
+        return distance(src % 8, dest % 8) == 1 && src / 8 - dest / 8 == 1;
+    });
+    constexpr SquareTable pawn_moves_white = generate_square_table([](int src, int dest) {
+        return src % 8 == dest % 8 && dest / 8 - src / 8 == 1;
+    });
+    constexpr SquareTable pawn_moves_black = generate_square_table([](int src, int dest) {
+        return src % 8 == dest % 8 && src / 8 - dest / 8 == 1;
+    });
+}
 
-    for (int i = src - 1; i >= 8 * (src / 8); i-= 1) {
-        n |= (1ULL << i);
-        if (blockboard & (1ULL << i)) {
-            break;
+constexpr SquarePairTable generate_square_pair_table(bool whole_line) {
+    SquarePairTable table{};
+    for (int src = 0; src < 64; src++) {
+        for (int dest = 0; dest < 64; dest++) {
+            bool lateral = BitArrays::rook_moves.data[src] & (1ULL << dest);
+            bool diag = BitArrays::bishop_moves.data[src] & (1ULL << dest);
+            if (!lateral && !diag) {
+                continue;
+            }
+            if (whole_line) {
+                // both ends see the rest of the line but not themselves
+                uint64_t ends = (1ULL << src) | (1ULL << dest);
+                table[src][dest] = ends | (lateral ? rook_slide_moves(src, 0) & rook_slide_moves(dest, 0) : bishop_slide_moves(src, 0) & bishop_slide_moves(dest, 0));
+            } else {
+                int step = (dest / 8 > src / 8 ? 8 : dest / 8 < src / 8 ? -8 : 0) + (dest % 8 > src % 8 ? 1 : dest % 8 < src % 8 ? -1 : 0);
+                for (int i = src + step; i != dest; i += step) {
+                    table[src][dest] |= (1ULL << i);
+                }
+            }
         }
     }
-    return n;
+    return table;
 }
 
+constinit const SquarePairTable between_squares = generate_square_pair_table(false);
+constinit const SquarePairTable line_squares = generate_square_pair_table(true);
+
 void display_bitboard(uint64_t n, int rank, int file)
 {
     for (int i = 7; i >= 0; i--) {
@@ -269,27 +154,75 @@ std::string bp_to_string(BoardPos bp)
     return s;
 }
 
-// see https://www.chessprogramming.org/Magic_Bitboards and magicsquares.cc
+// see https://www.chessprogramming.org/Magic_Bitboards; every square's
+// attacks sit at its offset in one shared table
+// generated by magicsquares --reduced-iterations 1000000 --candidates 8 --seed 1
+constexpr size_t SLIDE_ATTACK_TABLE_SIZE = 107648;
+
 constexpr uint64_t lateral_slide_magic_factor[] = {
-    0x35fdab5668f5011, 0x6aa948ad66b11ee1, 0x7c912a277579ff35, 0x6b4b4b442c29af1d, 0x1001021e61c77001, 0x7817e7e762d1304d, 0x1b7581f77f908249, 0x17a400105c143c3d,
-    0x7ab014ca25f5899d, 0x661236234996fb, 0x23a79dde279aaa99, 0x54c1ffb13e12e69, 0x43abb0030e54dfff, 0x1273000866242007, 0x459db9c336813a63, 0x53b01c417b76bf9d,
-    0x7fccc1996c70ab6f, 0x76de788c255032f3, 0x55a61e275e4e2615, 0x31e0e0023b7e3a75, 0x2ea3dba814584cff, 0x3e52a24f4469123f, 0x4e864af148d2d455, 0xd1eb533640cda9d,
-    0x1c71c5ba2dbb6ead, 0x546247234208035, 0x6248ede1e35be85, 0x131771ab4b4ac7c3, 0x26c44044408eca8d, 0xfe42865091052f7, 0x1cc0b34f0019e8c5, 0x59d1f5665e620051,
-    0x6bc95b9a45348ec3, 0x67b17060276819c7, 0x3ab126086d2d36ad, 0x138380d531bb67f3, 0x6af14ef63ababaaf, 0x31b645e810f0f103, 0x45e7c35538e56af1, 0x3d241f026c36f07d,
-    0x3459e94e6912b3cb, 0x413a28bf2740e80b, 0x693c28d2c76f6f7, 0x6f7b27c81b17e4fd, 0x768a0afd7db00117, 0x6fd6026e005a000b, 0x64886797415bdb53, 0x2fdd7fc32ce19ae5,
-    0x57e6636722ad56b, 0x282547f37411852b, 0xd530cf734e61047, 0x400553d440976897, 0x525c7b3f269e6fff, 0x7ad892242e9336d9, 0x35d94a2b0242909b, 0x3011b06242ce7e83,
-    0x6df47ffd76feb769, 0x4b204069400292a1, 0x6897f04820017825, 0x173550010098608d, 0x1012580059172c17, 0x280a180a098c0035, 0x236f18890c0a00c1, 0x1cd88f2871994861,
+    0x2080081220400080, 0x8040002000401000, 0x100102001000841, 0x8880041000080080, 0x2200200200100804, 0x200010410088200, 0x400212400820830, 0x8100004282052100,
+    0x4048801040002084, 0x508400448201002, 0xa08808020001000, 0x1802000810402200, 0x21000801000410, 0x84800400020080, 0xc0008103a0401, 0x4002001508820044,
+    0x8200248002864000, 0x8010820040210208, 0x830808010082000, 0x4083210010010008, 0x110110008010004, 0x42008080020400, 0x4000040001080290, 0x284020004004081,
+    0x10812980004000, 0x8100500040002001, 0x2e1004300200110, 0x90100201000, 0x1128008080080401, 0x2940020080800400, 0x2000180400268910, 0x2000008a00104409,
+    0x2001400081800060, 0x10040810a002200, 0x851006802000, 0x200a02004010, 0x80040080800801, 0x202000401010008, 0x4040a082c000110, 0x91000041001c86,
+    0xa8000c02000c00e, 0x8000802102020040, 0x4000408a00220010, 0x50020b00110020, 0x210040008008080, 0x82000804010100, 0x80020001008080, 0x4100820024,
+    0x400180006180, 0xa020003884400080, 0x200a004088102200, 0x1c100008008080, 0x800800040080, 0x10040080020080, 0x8010080102100400, 0x1000062018300,
+    0x4904029008001, 0x8088201042018502, 0x880810420020800a, 0x2012000810200442, 0x202001008052002, 0x1000204000801, 0x100210852100884, 0x220c0108408022,
+};
+
+constexpr uint32_t lateral_slide_magic_offset[] = {
+    0, 16384, 18432, 20480, 22528, 24576, 26624, 4096,
+    28672, 65536, 66560, 67584, 68608, 69632, 70656, 30720,
+    32768, 71680, 72704, 73728, 74752, 75776, 76800, 34816,
+    36864, 77824, 78848, 79872, 80896, 81920, 82944, 38912,
+    40960, 83968, 84992, 86016, 87040, 88064, 89088, 43008,
+    45056, 90112, 91136, 92160, 93184, 94208, 95232, 47104,
+    49152, 96256, 97280, 98304, 99328, 100352, 101376, 51200,
+    8192, 53248, 55296, 57344, 59392, 61440, 63488, 12288,
+};
+
+constexpr uint8_t lateral_slide_magic_bits[] = {
+    12, 11, 11, 11, 11, 11, 11, 12,
+    11, 10, 10, 10, 10, 10, 10, 11,
+    11, 10, 10, 10, 10, 10, 10, 11,
+    11, 10, 10, 10, 10, 10, 10, 11,
+    11, 10, 10, 10, 10, 10, 10, 11,
+    11, 10, 10, 10, 10, 10, 10, 11,
+    11, 10, 10, 10, 10, 10, 10, 11,
+    12, 11, 11, 11, 11, 11, 11, 12,
 };
 
 constexpr uint64_t diag_slide_magic_factor[] = {
-    0x2e51637d05f70c79, 0x5aa0cdaf632af055, 0x3a34e741750be7a5, 0x359ae4095d15071d, 0x317f3740608e6567, 0x21d2037c74ef1c4f, 0x569c3bea52d18b41, 0x77cbb43107f05b9,
-    0x2fe9bb2a2a05588b, 0x645974ad5847dbf3, 0x140f3a7b1f3d042f, 0x2b35fac20c2c25a1, 0x19f17c7c1a8e2441, 0x10b62aee762c7d9d, 0x40410ae906fdb9c9, 0x2c12b9e93ec1139b,
-    0x74e40fb142d06ef1, 0x3e1571b136472cd5, 0x2ab6296c4a257719, 0x60a6cf7271d1a9bb, 0x4241a5a7333820a1, 0x7b97f4b440c04e7d, 0x5c68a02f285748fd, 0x78a2d6160fb1c089,
-    0x6f6ebe325f22f47d, 0x4fe34b741e38cbc3, 0x1568b20964026183, 0x75b6e8012460a239, 0x25ec2c81438e3535, 0x13f6f07d4feffd85, 0x5f106b647511f7d1, 0x3afe9c8e231b71c3,
-    0x47baa577407150db, 0x14c66a3817371ac9, 0x4258922b065608c5, 0x54ff06007fd7ff7f, 0x3eb2f5a45d2c8ba3, 0x52ecc33da36c23, 0x112365962ae9a115, 0x74c203a12837a383,
-    0xe52869f68c14ba1, 0x523b0a4b09f86c57, 0x39b6fd082af0d5f9, 0x2a675e0119d0c38d, 0x3ef24fae0057bfd7, 0x64f9e40d11813f5d, 0x7752cee53c6ab735, 0x4fc2da202ab8a0c7,
-    0x6558a2561ebf6d19, 0x3cae48f571ef179d, 0x7d98f7d42beecd27, 0x12ace70d78dc49a9, 0x2446ab1537236f0d, 0x423e1a2b0fe26aa7, 0x5f38c51c3566cfc1, 0x3223bd877a337de7,
-    0x4242ab144471e9db, 0x25a85e8873b58743, 0x6d26bb8377861c65, 0x576aed2626567297, 0x25522ea14b852c77, 0x7d7e6d8d5a59afc1, 0x2b8affb124f757a1, 0x56da1bad028ad193,
+    0x1005010408020040, 0x4088880808404812, 0x91001004110c002, 0x84182240c0a00011, 0x1002021020001c10, 0x106482004002008, 0x222080108080410, 0x3080140401080822,
+    0x1000100438048410, 0x800028202041100, 0x2084040424004001, 0x8007020a02028001, 0x8d20450c0000002, 0x1c00511042100000, 0x8000022082484022, 0x250028203016100,
+    0x8411020210408, 0x20029948011240, 0x60405020802140, 0x2098200104010001, 0x101020820080030, 0x40400808080400, 0x200c110243480809, 0x402200209141200,
+    0x3008400162040100, 0xc441380810822800, 0x8490028080300, 0x8040040012110010, 0x800840002802029, 0x801410006100621, 0x12410a1084021140, 0x225a004000240208,
+    0x4004210500c81000, 0x1081102200300400, 0x1002004100100104, 0x110800040040, 0x5008120400041100, 0x82080202004040, 0x8010010110ca0080, 0x8801030300403400,
+    0x2410821010004241, 0x200200b248012008, 0x8841010814200202, 0x1011201104c808, 0x2082602008810100, 0x400801010011b0, 0x48100118010000a0, 0x15120a82080100,
+    0x84240402080040, 0x411401200000, 0x40a010049108840, 0x200040304090408, 0x30824008220041, 0x4661420204010083, 0x50a08010c1c0462, 0x4002044424004400,
+    0x3812008401011004, 0x800008080c82000, 0x410000504010400, 0x22a0a0204, 0xa800000a12620200, 0x4114420430100240, 0x28400212240120, 0x400801025604c2,
+};
+
+constexpr uint32_t diag_slide_magic_offset[] = {
+    105984, 106240, 106272, 106304, 106336, 106368, 106400, 106048,
+    106432, 106464, 106496, 106528, 106560, 106592, 106624, 106656,
+    106688, 106720, 104448, 104576, 104704, 104832, 106752, 106784,
+    106816, 106848, 104960, 102400, 102912, 105088, 106880, 106912,
+    106944, 106976, 105216, 103424, 103936, 105344, 107008, 107040,
+    107072, 107104, 105472, 105600, 105728, 105856, 107136, 107168,
+    107200, 107232, 107264, 107296, 107328, 107360, 107392, 107424,
+    106112, 107456, 107488, 107520, 107552, 107584, 107616, 106176,
+};
+
+constexpr uint8_t diag_slide_magic_bits[] = {
+    6, 5, 5, 5, 5, 5, 5, 6,
+    5, 5, 5, 5, 5, 5, 5, 5,
+    5, 5, 7, 7, 7, 7, 5, 5,
+    5, 5, 7, 9, 9, 7, 5, 5,
+    5, 5, 7, 9, 9, 7, 5, 5,
+    5, 5, 7, 7, 7, 7, 5, 5,
+    5, 5, 5, 5, 5, 5, 5, 5,
+    6, 5, 5, 5, 5, 5, 5, 6,
 };
 
 struct BitboardCaptures {
@@ -304,10 +237,10 @@ struct BitboardCaptures {
 };
 
 const uint64_t *BitboardCaptures::PregeneratedCapturesWhite[7] = {
-     NULL, BitArrays::pawn_captures_white::data, BitArrays::knight_moves::data, NULL, NULL, NULL, BitArrays::king_moves::data
+     NULL, BitArrays::pawn_captures_white.data, BitArrays::knight_moves.data, NULL, NULL, NULL, BitArrays::king_moves.data
 };
 const uint64_t *BitboardCaptures::PregeneratedCapturesBlack[7] = {
-     NULL, BitArrays::pawn_captures_black::data, BitArrays::knight_moves::data, NULL, NULL, NULL, BitArrays::king_moves::data
+     NULL, BitArrays::pawn_captures_black.data, BitArrays::knight_moves.data, NULL, NULL, NULL, BitArrays::king_moves.data
 };
 
 const uint64_t **BitboardCaptures::PregeneratedCaptures[2] = {
@@ -316,70 +249,239 @@ const uint64_t **BitboardCaptures::PregeneratedCaptures[2] = {
 };
 
 const uint64_t *BitboardCaptures::PregeneratedMovesWhite[7] = {
-     NULL, BitArrays::pawn_moves_white::data, BitArrays::knight_moves::data, NULL, NULL, NULL, BitArrays::king_moves::data
+     NULL, BitArrays::pawn_moves_white.data, BitArrays::knight_moves.data, NULL, NULL, NULL, BitArrays::king_moves.data
 };
 const uint64_t *BitboardCaptures::PregeneratedMovesBlack[7] = {
-     NULL, BitArrays::pawn_moves_black::data, BitArrays::knight_moves::data, NULL, NULL, NULL, BitArrays::king_moves::data
+     NULL, BitArrays::pawn_moves_black.data, BitArrays::knight_moves.data, NULL, NULL, NULL, BitArrays::king_moves.data
 };
 
 const uint64_t *BitboardCaptures::PregeneratedMoves[15] = {
-    NULL, BitArrays::pawn_moves_white::data, BitArrays::knight_moves::data, NULL, NULL, NULL, BitArrays::king_moves::data, NULL,
-    NULL, BitArrays::pawn_moves_black::data, BitArrays::knight_moves::data, NULL, NULL, NULL, BitArrays::king_moves::data
+    NULL, BitArrays::pawn_moves_white.data, BitArrays::knight_moves.data, NULL, NULL, NULL, BitArrays::king_moves.data, NULL,
+    NULL, BitArrays::pawn_moves_black.data, BitArrays::knight_moves.data, NULL, NULL, NULL, BitArrays::king_moves.data
 };
 
-static uint64_t **initialize_rook_magic()
+struct SlideMagic {
+    uint64_t block_board;
+    uint64_t factor;
+    const uint64_t *attacks;
+    int shift;
+};
+
+// the squares from each square to the edge of the board in one direction,
+// lateral then diagonal
+constexpr BitboardArray<8 * 64> generate_rays() {
+    constexpr int directions[8][2] = { { 1, 0 }, { 0, 1 }, { -1, 0 }, { 0, -1 }, { 1, 1 }, { 1, -1 }, { -1, -1 }, { -1, 1 } };
+    BitboardArray<8 * 64> rays{};
+    for (int dir = 0; dir < 8; dir++) {
+        for (int start_pos = 0; start_pos < 64; start_pos++) {
+            for (int n = 1; n < 8; n++) {
+                int r = start_pos / 8 + directions[dir][0] * n;
+                int f = start_pos % 8 + directions[dir][1] * n;
+                if (r < 0 || r >= 8 || f < 0 || f >= 8) {
+                    break;
+                }
+                rays.data[dir * 64 + start_pos] |= (1ULL << (r * 8 + f));
+            }
+        }
+    }
+    return rays;
+}
+
+constexpr BitboardArray<8 * 64> rays = generate_rays();
+
+// the same as rook_slide_moves and bishop_slide_moves, a ray at a time: the
+// ray stops at the nearest blocker, so cut off what lies beyond it
+constexpr uint64_t ray_slide_moves(int start_pos, uint64_t blockers, bool is_diag) {
+    uint64_t moves = 0;
+    for (int dir = is_diag * 4; dir < is_diag * 4 + 4; dir++) {
+        uint64_t ray = rays.data[dir * 64 + start_pos];
+        uint64_t blocked = ray & blockers;
+        if (blocked) {
+            // nearest is the lowest bit on rays heading up the board, else the highest
+            ray ^= rays.data[dir * 64 + (blocked >> start_pos ? __builtin_ctzll(blocked) : 63 - __builtin_clzll(blocked))];
+        }
+        moves |= ray;
+    }
+    return moves;
+}
+
+// fills in a square's slot with the attacks for every occupancy of its
+// blockboard, indexed by the magic hash, or for PEXT by the occupancy's rank
+// among the blockboard's subsets: the order they're enumerated in here
+constexpr void fill_slide_attacks(uint64_t *attacks, int start_pos, bool is_diag, SliderBackend layout)
 {
-    uint64_t **rook_magic = new uint64_t *[64];
-    for (int start_pos = 0; start_pos < 64; start_pos++) {
+    uint64_t block_board = is_diag ? BitArrays::bishop_blockboard.data[start_pos] : BitArrays::rook_blockboard.data[start_pos];
+    uint64_t factor = is_diag ? diag_slide_magic_factor[start_pos] : lateral_slide_magic_factor[start_pos];
+    int shift = 64 - (is_diag ? diag_slide_magic_bits[start_pos] : lateral_slide_magic_bits[start_pos]);
+    uint64_t blockers = 0;
+    size_t i = 0;
+    do {
+        uint64_t resolved = ray_slide_moves(start_pos, blockers, is_diag);
+        size_t hash_index = layout == slider_pext ? i++ : (blockers * factor) >> shift;
+        // a factor with a bit less, or a slot overlapping another, only
+        // collides where the attacks agree
+        assert(layout == slider_pext || attacks[hash_index] == 0 || attacks[hash_index] == resolved);
+        attacks[hash_index] = resolved;
+        blockers = (blockers - block_board) & block_board;
+    } while (blockers != 0);
+}
 
-        int array_size_nbits = BitArrays::rook_bitboard_bitcount::data[start_pos];
-        rook_magic[start_pos] = new uint64_t[1ULL << array_size_nbits];
-        memset(rook_magic[start_pos], 0, sizeof(uint64_t) * (1ULL << array_size_nbits));
-        uint64_t block_board = BitArrays::rook_blockboard::data[start_pos];
-        uint64_t magic_factor = lateral_slide_magic_factor[start_pos];
-        for (unsigned int i = 0; i < (1ULL << (array_size_nbits - 1)); i++) {
-            uint64_t projection = project_bitset(i, block_board);
-            uint64_t hash_index = (projection * magic_factor)  >> (64 - array_size_nbits);
-            uint64_t resolved = rook_slide_moves(start_pos, projection);
-            assert(rook_magic[start_pos][hash_index] == 0 || rook_magic[start_pos][hash_index] == resolved);
-            rook_magic[start_pos][hash_index] = resolved;
+// PEXT needs every slot at the full width of its blockboard, sharing no
+// entries with another slot; the magics found so far are all like that
+constexpr bool slide_attack_table_fits_pext()
+{
+    for (int i = 0; i < 128; i++) {
+        bool is_diag = i >= 64;
+        int start_pos = i % 64;
+        uint64_t block_board = is_diag ? BitArrays::bishop_blockboard.data[start_pos] : BitArrays::rook_blockboard.data[start_pos];
+        int bits = is_diag ? diag_slide_magic_bits[start_pos] : lateral_slide_magic_bits[start_pos];
+        uint32_t offset = is_diag ? diag_slide_magic_offset[start_pos] : lateral_slide_magic_offset[start_pos];
+        if (bits != count_bits(block_board)) {
+            return false;
+        }
+        for (int j = 0; j < i; j++) {
+            uint32_t other = j >= 64 ? diag_slide_magic_offset[j % 64] : lateral_slide_magic_offset[j % 64];
+            int other_bits = j >= 64 ? diag_slide_magic_bits[j % 64] : lateral_slide_magic_bits[j % 64];
+            if (offset < other + (1U << other_bits) && other < offset + (1U << bits)) {
+                return false;
+            }
         }
     }
-    return rook_magic;
+    return true;
+}
+
+// each square's slot is worked out as a constant of its own, since the whole
+// table in one constant expression is over clang's default constexpr step
+// limit; only copying the slots into place is done in one go
+template<int start_pos, bool is_diag, SliderBackend layout>
+struct SlideAttacks {
+    static constexpr int bits = is_diag ? diag_slide_magic_bits[start_pos] : lateral_slide_magic_bits[start_pos];
+    static constexpr BitboardArray<1ULL << bits> slot = [] {
+        BitboardArray<1ULL << bits> attacks{};
+        fill_slide_attacks(attacks.data, start_pos, is_diag, layout);
+        return attacks;
+    }();
+};
+
+template<size_t N>
+constexpr void place_slide_attacks(BitboardArray<SLIDE_ATTACK_TABLE_SIZE> &table, uint32_t offset, const BitboardArray<N> &slot)
+{
+    for (size_t i = 0; i < N; i++) {
+        if (slot.data[i] != 0) {
+            table.data[offset + i] = slot.data[i];
+        }
+    }
+}
+
+template<SliderBackend layout, size_t... start_pos>
+constexpr BitboardArray<SLIDE_ATTACK_TABLE_SIZE> generate_slide_attack_table(std::index_sequence<start_pos...>)
+{
+    BitboardArray<SLIDE_ATTACK_TABLE_SIZE> table{};
+    (place_slide_attacks(table, lateral_slide_magic_offset[start_pos], SlideAttacks<start_pos, false, layout>::slot), ...);
+    (place_slide_attacks(table, diag_slide_magic_offset[start_pos], SlideAttacks<start_pos, true, layout>::slot), ...);
+    return table;
 }
 
+// built in the order of the backend a BMI2 build will most likely pick, and
+// rewritten in place if another one is picked, so there's one table whichever
+// backend runs
+#ifdef __BMI2__
+constexpr SliderBackend slide_attack_built_layout = slide_attack_table_fits_pext() ? slider_pext : slider_magic;
+#else
+constexpr SliderBackend slide_attack_built_layout = slider_magic;
+#endif
+alignas(64) constinit static BitboardArray<SLIDE_ATTACK_TABLE_SIZE> slide_attack_table = generate_slide_attack_table<slide_attack_built_layout>(std::make_index_sequence<64>());
+static SliderBackend slide_attack_layout = slide_attack_built_layout;
 
+static void lay_out_slide_attacks(SliderBackend layout)
+{
+    if (layout == slide_attack_layout) {
+        return;
+    }
+    memset(slide_attack_table.data, 0, sizeof(slide_attack_table.data));
+    for (int start_pos = 0; start_pos < 64; start_pos++) {
+        fill_slide_attacks(slide_attack_table.data + lateral_slide_magic_offset[start_pos], start_pos, false, layout);
+        fill_slide_attacks(slide_attack_table.data + diag_slide_magic_offset[start_pos], start_pos, true, layout);
+    }
+    slide_attack_layout = layout;
+}
 
-static uint64_t **initialize_bishop_magic()
+constexpr std::array<SlideMagic, 64> generate_slide_magics(bool is_diag)
 {
-    uint64_t **bishop_magic = new uint64_t *[64];
+    std::array<SlideMagic, 64> magics{};
     for (int start_pos = 0; start_pos < 64; start_pos++) {
+        magics[start_pos].block_board = is_diag ? BitArrays::bishop_blockboard.data[start_pos] : BitArrays::rook_blockboard.data[start_pos];
+        magics[start_pos].factor = is_diag ? diag_slide_magic_factor[start_pos] : lateral_slide_magic_factor[start_pos];
+        magics[start_pos].attacks = slide_attack_table.data + (is_diag ? diag_slide_magic_offset[start_pos] : lateral_slide_magic_offset[start_pos]);
+        magics[start_pos].shift = 64 - (is_diag ? diag_slide_magic_bits[start_pos] : lateral_slide_magic_bits[start_pos]);
+    }
+    return magics;
+}
 
-        int array_size_nbits = BitArrays::bishop_bitboard_bitcount::data[start_pos];
-        bishop_magic[start_pos] = new uint64_t[1ULL << array_size_nbits];
-        memset(bishop_magic[start_pos], 0, sizeof(uint64_t) * (1ULL << array_size_nbits));
-        uint64_t block_board = BitArrays::bishop_blockboard::data[start_pos];
-        uint64_t magic_factor = diag_slide_magic_factor[start_pos];
-        for (unsigned int i = 0; i < (1ULL << (array_size_nbits - 1)); i++) {
-            uint64_t projection = project_bitset(i, block_board);
-            uint64_t hash_index = (projection * magic_factor)  >> (64 - array_size_nbits);
-            uint64_t resolved = bishop_slide_moves(start_pos, projection);
-            assert(bishop_magic[start_pos][hash_index] == 0 || bishop_magic[start_pos][hash_index] == resolved);
-            bishop_magic[start_pos][hash_index] = resolved;
-        }
+constexpr std::array<SlideMagic, 64> rook_slide_magic = generate_slide_magics(false);
+constexpr std::array<SlideMagic, 64> bishop_slide_magic = generate_slide_magics(true);
+
+#ifdef SLIDER_PEXT_AVAILABLE
+// inlined when built with -mbmi2 (or -march=native on a BMI2 machine),
+// otherwise a call that's only taken once the cpu is known to support it
+__attribute__((target("bmi2")))
+static uint64_t pext_slide_moves(const uint64_t *attacks, uint64_t blockers, uint64_t block_board)
+{
+    return attacks[_pext_u64(blockers, block_board)];
+}
+#endif
+
+static bool cpu_has_fast_pext()
+{
+#ifdef SLIDER_PEXT_AVAILABLE
+    __builtin_cpu_init();
+    // AMD before Zen 3 implements PEXT in microcode, slower than a magic multiply
+    return __builtin_cpu_supports("bmi2") && !__builtin_cpu_is("amdfam15h") && !__builtin_cpu_is("amdfam17h");
+#else
+    return false;
+#endif
+}
+
+static SliderBackend initialize_slider_backend()
+{
+    SliderBackend backend = cpu_has_fast_pext() && slide_attack_table_fits_pext() ? slider_pext : slider_magic;
+    lay_out_slide_attacks(backend);
+    return backend;
+}
+
+SliderBackend Bitboard::slider_backend = initialize_slider_backend();
+
+bool Bitboard::set_slider_backend(SliderBackend backend)
+{
+    if (backend == slider_pext) {
+#ifdef SLIDER_PEXT_AVAILABLE
+        __builtin_cpu_init();
+        if (!__builtin_cpu_supports("bmi2") || !slide_attack_table_fits_pext()) {
+            return false;
+        }
+#else
+        return false;
+#endif
     }
-    return bishop_magic;
+    lay_out_slide_attacks(backend);
+    slider_backend = backend;
+    return true;
 }
 
-const uint64_t **Bitboard::rook_magic = const_cast<const uint64_t **>(initialize_rook_magic());
-const uint64_t **Bitboard::bishop_magic = const_cast<const uint64_t **>(initialize_bishop_magic());
+const char *slider_backend_name(SliderBackend backend)
+{
+    return backend == slider_pext ? "pext" : "magic";
+}
 
 
 Bitboard::Bitboard()
-    : side_to_play(White), castle(0), hash(0)
+    : side_to_play(White), castle(0), hash(0), pawn_hash(0)
 {
     memset(piece_bitmasks, 0, sizeof(piece_bitmasks));
     enpassant_file = -1;
+    // a search rarely goes deeper than this, with the game before it
+    states.reserve(256);
+    clear_history();
 }
 
 void Bitboard::set_piece(unsigned char rank, unsigned char file, piece_t piece)
@@ -404,13 +506,22 @@ void Bitboard::set_piece(unsigned char rank, unsigned char file, piece_t piece)
 
         update_zobrist_hashing_piece(rank, file, piece, true);
     }
+    forget_king_safety();
+}
+
+void Bitboard::toggle_piece(int square, piece_t piece)
+{
+    uint64_t bit = 1ULL << square;
+    int offset = get_color(piece) * (bb_king + 1);
+    piece_bitmasks[offset + bb_all] ^= bit;
+    piece_bitmasks[offset + (piece & PIECE_MASK)] ^= bit;
 }
 
 
  // FIX: add source piece, move-gives-check
  // for non-promote
 void Bitboard::make_moves(Color side_to_play,
-         std::vector<move_t> &dest,
+         MoveList &dest,
          int source_pos,
          unsigned char source_piece,
          uint64_t dest_squares,
@@ -468,7 +579,7 @@ void Bitboard::make_moves(Color side_to_play,
 
  // FIX: add source piece
 void Bitboard::make_pawn_moves(Color side_to_play,
-         std::vector<move_t> &dest,
+         MoveList &dest,
          uint64_t source_squares,
          int dest_offset,
          bool all_give_check) const
@@ -587,32 +698,37 @@ move_t Bitboard::make_move(Color side_to_play, unsigned char srcrank, unsigned c
 
 uint64_t Bitboard::get_rook_moves(int start_pos, uint64_t blockers) const {
     // returns bits that rook at start_pos has access to, including bits in blockers
-    uint64_t block_board = BitArrays::rook_blockboard::data[start_pos];
-    uint64_t mask = block_board & blockers;
-    uint64_t magic_index = (lateral_slide_magic_factor[start_pos] * mask);
-    return rook_magic[start_pos][magic_index >> (64 - BitArrays::rook_bitboard_bitcount::data[start_pos])];
+    const SlideMagic &magic = rook_slide_magic[start_pos];
+#ifdef SLIDER_PEXT_AVAILABLE
+    if (slider_backend == slider_pext) {
+        return pext_slide_moves(magic.attacks, blockers, magic.block_board);
+    }
+#endif
+    return magic.attacks[((blockers & magic.block_board) * magic.factor) >> magic.shift];
 }
 
 uint64_t Bitboard::get_bishop_moves(int start_pos, uint64_t blockers) const {
     // returns bits that bishop at start_pos has access to, including bits in blockers
-    uint64_t block_board = BitArrays::bishop_blockboard::data[start_pos];
-    uint64_t mask = block_board & blockers;
-    uint64_t magic_index = (diag_slide_magic_factor[start_pos] * mask);
-    return bishop_magic[start_pos][magic_index >> (64 - BitArrays::bishop_bitboard_bitcount::data[start_pos])];
+    const SlideMagic &magic = bishop_slide_magic[start_pos];
+#ifdef SLIDER_PEXT_AVAILABLE
+    if (slider_backend == slider_pext) {
+        return pext_slide_moves(magic.attacks, blockers, magic.block_board);
+    }
+#endif
+    return magic.attacks[((blockers & magic.block_board) * magic.factor) >> magic.shift];
 }
 
 uint64_t Bitboard::get_blocking_squares(int src, int dest, uint64_t blockers) const
 {
-    // returns bits that break connection from src <-> dest
-    if ((src / 8 == dest / 8) || (src % 8 == dest % 8)) {
-        // same rank or file
-        return get_rook_moves(src, blockers) & get_rook_moves(dest, blockers);
-    }
-    else if (BitArrays::bishop_moves::data[src] & (1ULL << dest)) {
-        return get_bishop_moves(src, blockers) & get_bishop_moves(dest, blockers);
-    }
-
-    return 0;
+    // returns bits that break connection from src <-> dest: the squares
+    // between when they're empty, the one piece in the way, or nothing when
+    // there's more than one
+    uint64_t between = between_squares[src][dest];
+    uint64_t in_the_way = between & blockers;
+    if (in_the_way == 0) {
+        return between;
+    }
+    return (in_the_way & (in_the_way - 1)) == 0 ? in_the_way : 0;
 }
 
 
@@ -626,13 +742,19 @@ bool Bitboard::king_in_check(Color color) const
 
 /* returns squares of color pieces that attack this square */
 uint64_t Bitboard::square_attackers(int dest, Color color) const
+{
+    return square_attackers(dest, color, piece_bitmasks);
+}
+
+/* as above, for a hypothetical board given by its piece bitmasks */
+uint64_t Bitboard::square_attackers(int dest, Color color, const uint64_t *bitmasks) const
 {
     uint64_t attackers = 0;
 
-    uint64_t all_pieces = piece_bitmasks[bb_all] | piece_bitmasks[bb_all + (bb_king + 1)];
-    uint64_t bishop_attackers = piece_bitmasks[color * (bb_king + 1) + bb_bishop];
-    uint64_t rook_attackers = piece_bitmasks[color * (bb_king + 1) + bb_rook];
-    uint64_t queen_attackers = piece_bitmasks[color * (bb_king + 1) + bb_queen];
+    uint64_t all_pieces = bitmasks[bb_all] | bitmasks[bb_all + (bb_king + 1)];
+    uint64_t bishop_attackers = bitmasks[color * (bb_king + 1) + bb_bishop];
+    uint64_t rook_attackers = bitmasks[color * (bb_king + 1) + bb_rook];
+    uint64_t queen_attackers = bitmasks[color * (bb_king + 1) + bb_queen];
 
     piece_t pnk_pieces[3] = { bb_pawn, bb_knight, bb_king };
     /* rook or queen attacks */
@@ -641,7 +763,7 @@ uint64_t Bitboard::square_attackers(int dest, Color color) const
 
     for (int i = 0; i < 3; i++) {
         int piece_type = pnk_pieces[i];
-        attackers |= BitboardCaptures::PregeneratedCaptures[1 - color][piece_type][dest] & piece_bitmasks[color * (bb_king + 1) + piece_type];
+        attackers |= BitboardCaptures::PregeneratedCaptures[1 - color][piece_type][dest] & bitmasks[color * (bb_king + 1) + piece_type];
     }
 
 
@@ -673,98 +795,195 @@ uint64_t Bitboard::computed_covered_squares(Color color, int include_flags) cons
     return squares;
 }
 
-piece_t peek_least_valuable_piece(const char piece_count[bb_king]) {
-    for (int i = 0; i < bb_king; i++) {
-        if (piece_count[i] > 0) {
-            return i + 1;
+ExchangePieces Bitboard::exchange_pieces() const
+{
+    ExchangePieces pieces;
+    uint64_t queens = get_bitmask(White, bb_queen) | get_bitmask(Black, bb_queen);
+    pieces.lateral = queens | get_bitmask(White, bb_rook) | get_bitmask(Black, bb_rook);
+    pieces.diag = queens | get_bitmask(White, bb_bishop) | get_bitmask(Black, bb_bishop);
+    pieces.knights = get_bitmask(White, bb_knight) | get_bitmask(Black, bb_knight);
+    pieces.kings = get_bitmask(White, bb_king) | get_bitmask(Black, bb_king);
+    pieces.pawns[White] = get_bitmask(White, bb_pawn);
+    pieces.pawns[Black] = get_bitmask(Black, bb_pawn);
+    return pieces;
+}
+
+/* pieces of either color attacking square, given the occupancy */
+uint64_t Bitboard::exchange_attackers(int square, uint64_t occupied, const ExchangePieces &pieces) const
+{
+    return (get_rook_moves(square, occupied) & pieces.lateral)
+        | (get_bishop_moves(square, occupied) & pieces.diag)
+        | (BitboardCaptures::PregeneratedCaptures[Black][bb_pawn][square] & pieces.pawns[White])
+        | (BitboardCaptures::PregeneratedCaptures[White][bb_pawn][square] & pieces.pawns[Black])
+        | (BitArrays::knight_moves.data[square] & pieces.knights)
+        | (BitArrays::king_moves.data[square] & pieces.kings);
+}
+
+piece_t Bitboard::least_valuable_attacker(uint64_t attackers, Color color, uint64_t &source) const
+{
+    for (piece_t piece_type = bb_pawn; piece_type <= bb_king; piece_type++) {
+        uint64_t pieces = attackers & get_bitmask(color, piece_type);
+        if (pieces) {
+            source = pieces & -pieces;
+            return piece_type;
         }
     }
     return 0;
 }
 
-piece_t pop_least_valuable_piece(char piece_count[bb_king]) {
-    for (int i = 0; i < bb_king; i++) {
-        if (piece_count[i] > 0) {
-            piece_count[i]--;
-            return i + 1;
-        }
+/* sliders that see square once a removed piece has left a line to it */
+uint64_t Bitboard::exchange_xrays(int square, piece_t removed, uint64_t occupied, const ExchangePieces &pieces) const
+{
+    uint64_t xrays = 0;
+    // pawns attack diagonally and knights never stand on a line to the square
+    if (removed == bb_pawn || removed == bb_bishop || removed == bb_queen || removed == bb_king) {
+        xrays |= get_bishop_moves(square, occupied) & pieces.diag;
     }
-    return 0;
+    if (removed == bb_rook || removed == bb_queen || removed == bb_king) {
+        xrays |= get_rook_moves(square, occupied) & pieces.lateral;
+    }
+    return xrays & occupied;
+}
+
+// gain[d] is what the side making capture d nets if the exchange stops after
+// it, see https://www.chessprogramming.org/SEE_-_The_Swap_Algorithm
+int Bitboard::static_exchange_swap(Color side_to_play, int square, piece_t current_piece, uint64_t source, piece_t capturer, uint64_t occupied, uint64_t attackers, const ExchangePieces &pieces) const
+{
+    int gain[34];
+    int depth = 0;
+    Color color = side_to_play;
+    gain[0] = PIECE_VALUE[current_piece];
+    do {
+        depth++;
+        // if the piece just moved to the square is taken
+        gain[depth] = PIECE_VALUE[capturer] - gain[depth - 1];
+        occupied &= ~source;
+        attackers = (attackers | exchange_xrays(square, capturer, occupied, pieces)) & occupied;
+        color = get_opposite_color(color);
+        capturer = least_valuable_attacker(attackers, color, source);
+    } while (capturer != 0);
+
+    while (--depth) {
+        gain[depth - 1] = -std::max(-gain[depth - 1], gain[depth]);
+    }
+    return gain[0];
 }
 
 // side_to_play meaning the first side to capture the current_piece at square
 // return net result of the exchange, positive means side_to_play gains material
 int Bitboard::static_exchange_eval(Color side_to_play, int square, piece_t current_piece, piece_t capturer) const {
-    char attacker_count[bb_king];
-    char defender_count[bb_king];
-    memset(attacker_count, 0, sizeof(attacker_count));
-    memset(defender_count, 0, sizeof(defender_count));
-    uint64_t all_pieces = get_bitmask(side_to_play, bb_all) | get_bitmask(get_opposite_color(side_to_play), bb_all);
-    uint64_t queen_pieces = get_bitmask(side_to_play, bb_queen) | get_bitmask(get_opposite_color(side_to_play), bb_queen);
-    uint64_t bishop_pieces = queen_pieces | get_bitmask(side_to_play, bb_bishop) | get_bitmask(get_opposite_color(side_to_play), bb_bishop);
-    uint64_t rook_pieces = queen_pieces | get_bitmask(side_to_play, bb_rook) | get_bitmask(get_opposite_color(side_to_play), bb_rook);
-
-    for (piece_t attacker = bb_pawn; attacker <= bb_king; attacker++) {
-        int attacker_idx = attacker - 1;
-        switch(attacker) {
-            case bb_pawn: {
-                int attackers = count_bits(BitboardCaptures::PregeneratedCaptures[get_opposite_color(side_to_play)][attacker][square]
-                                    & get_bitmask(side_to_play, attacker));
-                int defenders = count_bits(BitboardCaptures::PregeneratedCaptures[side_to_play][attacker][square]
-                                    & get_bitmask(get_opposite_color(side_to_play), attacker));
-                attacker_count[attacker_idx] = attackers;
-                defender_count[attacker_idx] = defenders;
-            }
-            break;
-            case bb_knight: case bb_king: {
-                uint64_t dest_sq = BitboardCaptures::PregeneratedMoves[attacker][square];
-                attacker_count[attacker_idx] = count_bits(dest_sq & get_bitmask(side_to_play, attacker));
-                defender_count[attacker_idx] = count_bits(dest_sq & get_bitmask(get_opposite_color(side_to_play), attacker));
-            }
-            break;
-            case bb_rook: case bb_queen: case bb_bishop: {
-                if (attacker == bb_rook || attacker == bb_queen) {
-                    uint64_t dest_sq = get_rook_moves(square, all_pieces & ~rook_pieces);
-                    attacker_count[attacker_idx] += count_bits(dest_sq & get_bitmask(side_to_play, attacker));
-                    defender_count[attacker_idx] += count_bits(dest_sq & get_bitmask(get_opposite_color(side_to_play), attacker));
-                }
-                if (attacker == bb_bishop || attacker == bb_queen) {
-                    uint64_t dest_sq = get_bishop_moves(square, all_pieces & ~bishop_pieces);
-                    attacker_count[attacker_idx] += count_bits(dest_sq & get_bitmask(side_to_play, attacker));
-                    defender_count[attacker_idx] += count_bits(dest_sq & get_bitmask(get_opposite_color(side_to_play), attacker));
-                }
-            }
-            break;
-        }
+    if (capturer == 0 && side_to_play != this->side_to_play && (opponent_covered_squares() & (1ULL << square)) == 0) {
+        return 0;
     }
+    uint64_t occupied = get_bitmask(White, bb_all) | get_bitmask(Black, bb_all);
+    ExchangePieces pieces = exchange_pieces();
+    uint64_t attackers = exchange_attackers(square, occupied, pieces);
+    uint64_t source = 0;
 
-    // step 1: capture piece
-    int net_score = PIECE_VALUE[current_piece];
-    piece_t current_occupier;
     if (capturer == 0) {
-        current_occupier = pop_least_valuable_piece(attacker_count);
-    } else {
-        current_occupier = capturer;
-        if (capturer != bb_pawn) {
-            // pieces other than pawns can't capture twice
-            attacker_count[capturer - 1]--;
+        capturer = least_valuable_attacker(attackers, side_to_play, source);
+        if (capturer == 0) {
+            return 0;
         }
+    } else {
+        uint64_t pieces = attackers & get_bitmask(side_to_play, capturer);
+        source = pieces & -pieces;
     }
+    return static_exchange_swap(side_to_play, square, current_piece, source, capturer, occupied, attackers, pieces);
+}
 
-    return net_score - static_exchange_negamax(current_occupier, defender_count, attacker_count);
+void Bitboard::exchange_setup(move_t move, int &square, piece_t &current_piece, uint64_t &source, uint64_t &occupied) const
+{
+    square = get_dest_pos(move);
+    current_piece = get_captured_piece(move) & PIECE_MASK;
+    source = 1ULL << get_source_pos(move);
+    occupied = get_bitmask(White, bb_all) | get_bitmask(Black, bb_all);
+    if (get_actor(move) == bb_pawn && current_piece != 0 && (occupied & (1ULL << square)) == 0) {
+        // en passant: the captured pawn is beside the source
+        occupied &= ~(1ULL << (get_source_pos(move) / 8 * 8 + square % 8));
+    }
 }
 
-int Bitboard::static_exchange_negamax(piece_t current_occupier, char attackers[bb_king], char defenders[bb_king]) const {
-    // first capture with least valuable attacker
-    piece_t next_capturer = pop_least_valuable_piece(attackers);
-    if (next_capturer == 0) {
-        return 0;
+int Bitboard::static_exchange_eval(move_t move) const
+{
+    int square;
+    piece_t current_piece;
+    uint64_t source, occupied;
+    exchange_setup(move, square, current_piece, source, occupied);
+    ExchangePieces pieces = exchange_pieces();
+    return static_exchange_swap(side_to_play, square, current_piece, source, get_actor(move), occupied, exchange_attackers(square, occupied, pieces) & occupied, pieces);
+}
+
+// see https://www.chessprogramming.org/SEE_-_The_Swap_Algorithm#Alpha-Beta_like_SEE:
+// swap is how far the side that just captured is above threshold, given up
+// if the piece it's left on the square is taken
+bool Bitboard::see_ge(move_t move, int threshold) const
+{
+    int square;
+    piece_t current_piece;
+    uint64_t source, occupied;
+    exchange_setup(move, square, current_piece, source, occupied);
+
+    int swap = PIECE_VALUE[current_piece] - threshold;
+    if (swap < 0) {
+        return false;
+    }
+    swap = PIECE_VALUE[get_actor(move)] - swap;
+    if (swap <= 0) {
+        return true;
+    }
+
+    occupied &= ~source;
+    ExchangePieces pieces = exchange_pieces();
+    uint64_t attackers = exchange_attackers(square, occupied, pieces);
+    Color color = side_to_play;
+    bool result = true;
+    while (true) {
+        color = get_opposite_color(color);
+        attackers &= occupied;
+        piece_t capturer = least_valuable_attacker(attackers, color, source);
+        if (capturer == 0) {
+            break;
+        }
+        result = !result;
+        if (capturer == bb_king) {
+            // the king can only take when nothing can take it back
+            return (attackers & get_bitmask(get_opposite_color(color), bb_all)) ? !result : result;
+        }
+        swap = PIECE_VALUE[capturer] - swap;
+        if (swap < result) {
+            break;
+        }
+        occupied &= ~source;
+        attackers |= exchange_xrays(square, capturer, occupied, pieces);
     }
-    int subline = static_exchange_negamax(next_capturer, defenders, attackers);
-    return std::max(0, PIECE_VALUE[current_occupier] - subline);
+    return result;
 }
 
-void Bitboard::get_moves(Color side_to_play, bool checks, bool captures_or_promo, const PackedMoveIterator &packed, std::vector<move_t> &moves) const
+void Bitboard::static_exchange_targets(Color side_to_play, uint64_t targets, int scores[64]) const
+{
+    int square = -1;
+    if (side_to_play != this->side_to_play) {
+        // the opponent's attack map is cached with king safety, so squares
+        // it doesn't reach score 0 without looking for attackers
+        uint64_t uncovered = targets & ~opponent_covered_squares();
+        while ((square = get_low_bit(uncovered, square + 1)) >= 0) {
+            scores[square] = 0;
+        }
+        targets &= ~uncovered;
+        square = -1;
+    }
+    uint64_t occupied = get_bitmask(White, bb_all) | get_bitmask(Black, bb_all);
+    ExchangePieces pieces = exchange_pieces();
+    while ((square = get_low_bit(targets, square + 1)) >= 0) {
+        uint64_t attackers = exchange_attackers(square, occupied, pieces);
+        uint64_t source;
+        piece_t capturer = least_valuable_attacker(attackers, side_to_play, source);
+        scores[square] = capturer ? static_exchange_swap(side_to_play, square, get_piece(square) & PIECE_MASK, source, capturer, occupied, attackers, pieces) : 0;
+    }
+}
+
+void Bitboard::get_moves(Color side_to_play, bool checks, bool captures_or_promo, const PackedMoveIterator &packed, MoveList &moves) const
 {
     int one_rank_forward = (side_to_play == White ? 8 : -8);
     uint64_t promo_rank = (side_to_play == White ? rank_7 : rank_2);
@@ -788,7 +1007,7 @@ void Bitboard::get_moves(Color side_to_play, bool checks, bool captures_or_promo
         }
 
         if (promo_pawns != 0) {
-            std::vector<move_t> promo_moves;
+            MoveList promo_moves;
             // we don't know if it's actually check yet so just guess that it might be
             make_pawn_moves(side_to_play, promo_moves, promo_pawns & ~check_mask_src_move_one, one_rank_forward, false);
             for (auto iter = promo_moves.begin(); iter != promo_moves.end(); iter++) {
@@ -845,50 +1064,327 @@ void Bitboard::get_moves(Color side_to_play, bool checks, bool captures_or_promo
 
 }
 
-move_t Bitboard::reinterpret_move(move_t hint, uint64_t &opp_covered_squares) const
+void Bitboard::get_moves(Color side_to_play, bool checks, bool captures_or_promo, const PackedMoveIterator &packed, std::vector<move_t> &moves) const
 {
-    int start_pos = get_source_pos(hint);
-    int dest_pos = get_dest_pos(hint);
-    piece_t source_piece = get_actor(hint);
-    piece_t dest_piece = get_piece(dest_pos);
-    uint64_t my_pieces = get_bitmask(side_to_play, bb_all);
+    MoveList list;
+    get_moves(side_to_play, checks, captures_or_promo, packed, list);
+    moves.insert(moves.end(), list.begin(), list.end());
+}
 
-    PackedMoveIterator pm;
-    std::vector<move_t> moves(8);
+void MoveList::sort_by_score(size_t start)
+{
+    std::pair<int, move_t> scored[MAX_MOVES];
+    for (size_t i = start; i < count; i++) {
+        scored[i - start] = std::make_pair(scores[i], moves[i]);
+    }
+    std::sort(scored, scored + (count - start), [](const std::pair<int, move_t> &a, const std::pair<int, move_t> &b) {
+        return a.first > b.first;
+    });
+    for (size_t i = start; i < count; i++) {
+        scores[i] = scored[i - start].first;
+        moves[i] = scored[i - start].second;
+    }
+}
 
-    // no self captures
-    if ((my_pieces & (1ULL << dest_pos)) != 0) {
+int Bitboard::count_moves(Color side_to_play, const PackedMoveIterator &packed) const
+{
+    uint64_t promo_rank = (side_to_play == White ? rank_7 : rank_2);
+    int count = count_bits(packed.king_move.dest_squares);
+    for (auto iter = packed.begin(); iter != packed.end(); iter++) {
+        count += count_bits(iter->dest_squares);
+    }
+    count += count_bits(packed.pawn_move_one) + count_bits(packed.pawn_move_two)
+        + count_bits(packed.capture_award) + count_bits(packed.capture_hward);
+    // each promotion expands to four moves
+    count += 3 * (count_bits(packed.pawn_move_one & promo_rank) + count_bits(packed.capture_award & promo_rank)
+        + count_bits(packed.capture_hward & promo_rank));
+    return count;
+}
+
+move_t Bitboard::decode_move(compact_move_t move) const
+{
+    int start_pos = get_compact_source_pos(move);
+    int dest_pos = get_compact_dest_pos(move);
+    if ((get_bitmask(side_to_play, bb_all) & (1ULL << start_pos)) == 0) {
         return 0;
     }
+    piece_t source_piece = get_piece(start_pos) & PIECE_MASK;
+    if (source_piece != bb_king || abs(start_pos % 8 - dest_pos % 8) != 2) {
+        return find_move_to(side_to_play, source_piece, dest_pos, 1ULL << start_pos, get_compact_promotion(move));
+    }
 
-    get_packed_legal_moves(get_side_to_play(), pm, opp_covered_squares, start_pos, source_piece & PIECE_MASK);
-    bool is_capture_promote = dest_piece != 0 || (source_piece == bb_pawn && (dest_pos / 8 == 0 || dest_pos / 8 == 7));
-    get_moves(get_side_to_play(), true, is_capture_promote, pm, moves);
-    get_moves(get_side_to_play(), false, is_capture_promote, pm, moves);
+    // castling isn't found walking back from the destination
+    PackedMoveIterator pm;
+    MoveList moves;
+    uint64_t opp_covered_squares = 0;
+    get_packed_legal_moves(side_to_play, pm, opp_covered_squares, start_pos, bb_king);
+    get_moves(side_to_play, true, false, pm, moves);
+    get_moves(side_to_play, false, false, pm, moves);
     for (auto iter = moves.begin(); iter != moves.end(); iter++) {
-        if (get_dest_pos(*iter) == dest_pos && get_source_pos(*iter) == start_pos) {
+        if (get_dest_pos(*iter) == dest_pos) {
             return *iter;
         }
     }
     return 0;
 }
 
-void Bitboard::get_packed_legal_moves(Color side_to_play, PackedMoveIterator &moves, uint64_t &opp_covered_squares, int source_sq, piece_t source_piece) const
+move_t Bitboard::find_move_to(Color color, piece_t piece_type, int dest_pos, uint64_t source_squares, piece_t promote) const
+{
+    Color opp = get_opposite_color(color);
+    uint64_t dest_bit = 1ULL << dest_pos;
+    uint64_t all_pieces = get_bitmask(White, bb_all) | get_bitmask(Black, bb_all);
+    uint64_t my_pieces = get_bitmask(color, piece_type);
+    int one_rank_forward = (color == White ? 8 : -8);
+    bool last_rank = dest_pos / 8 == (color == White ? 7 : 0);
+    int capture_pos = dest_pos;
+
+    if ((get_bitmask(color, bb_all) & dest_bit) || (promote != 0) != (piece_type == bb_pawn && last_rank)
+            || (piece_type == bb_pawn && dest_pos / 8 == (color == White ? 0 : 7))) {
+        return 0;
+    }
+
+    // walk back from the destination to the pieces that could have moved there
+    uint64_t candidates = 0;
+    switch (piece_type) {
+    case bb_pawn:
+        if (get_bitmask(opp, bb_all) & dest_bit) {
+            candidates = BitboardCaptures::PregeneratedCaptures[opp][bb_pawn][dest_pos];
+        } else if (enpassant_file != -1 && dest_pos == make_board_pos(color == White ? 5 : 2, enpassant_file)) {
+            candidates = BitboardCaptures::PregeneratedCaptures[opp][bb_pawn][dest_pos];
+            capture_pos = dest_pos - one_rank_forward;
+        }
+        if (!(all_pieces & dest_bit)) {
+            int one_back = dest_pos - one_rank_forward;
+            candidates |= 1ULL << one_back;
+            if (!(all_pieces & (1ULL << one_back)) && dest_pos / 8 == (color == White ? 3 : 4)) {
+                candidates |= 1ULL << (one_back - one_rank_forward);
+            }
+        }
+        break;
+    case bb_knight:
+    case bb_king:
+        candidates = BitboardCaptures::PregeneratedCaptures[color][piece_type][dest_pos];
+        break;
+    case bb_bishop:
+        candidates = get_bishop_moves(dest_pos, all_pieces);
+        break;
+    case bb_rook:
+        candidates = get_rook_moves(dest_pos, all_pieces);
+        break;
+    case bb_queen:
+        candidates = get_bishop_moves(dest_pos, all_pieces) | get_rook_moves(dest_pos, all_pieces);
+        break;
+    default:
+        return 0;
+    }
+    candidates &= my_pieces & source_squares;
+
+    piece_t captured_piece = get_piece(capture_pos) & PIECE_MASK;
+    piece_t result_piece = promote != 0 ? promote : piece_type;
+    move_t found = 0;
+    int src = -1;
+    while ((src = get_low_bit(candidates, src + 1)) > -1) {
+        // play the move on a copy of the bitmasks to check both kings
+        uint64_t bitmasks[2 * (bb_king + 1)];
+        std::copy(piece_bitmasks, piece_bitmasks + 2 * (bb_king + 1), bitmasks);
+        uint64_t *mine = bitmasks + color * (bb_king + 1);
+        uint64_t *theirs = bitmasks + opp * (bb_king + 1);
+        mine[piece_type] &= ~(1ULL << src);
+        mine[bb_all] = (mine[bb_all] & ~(1ULL << src)) | dest_bit;
+        mine[result_piece] |= dest_bit;
+        if (captured_piece != EMPTY) {
+            theirs[captured_piece] &= ~(1ULL << capture_pos);
+            theirs[bb_all] &= ~(1ULL << capture_pos);
+        }
+        if (square_attackers(get_low_bit(mine[bb_king], 0), opp, bitmasks) != 0) {
+            // pinned, or doesn't resolve check
+            continue;
+        }
+        if (found != 0) {
+            // ambiguous
+            return 0;
+        }
+        bool gives_check = square_attackers(get_low_bit(theirs[bb_king], 0), color, bitmasks) != 0;
+        found = make_move(color, src / 8, src % 8, piece_type, dest_pos / 8, dest_pos % 8, get_piece(dest_pos), promote, gives_check);
+    }
+    return found;
+}
+
+void Bitboard::get_pseudo_legal_moves(Color side_to_play, MoveList &moves, bool quiets_only) const
 {
+    PackedMoveIterator packed;
+    get_nk_pseudo_moves(side_to_play, bb_king, packed, true, true);
+    if (packed.num_packed_moves == 0) {
+        packed.king_move.dest_squares = 0;
+    } else {
+        packed.king_move = packed.packed_moves[0];
+        packed.num_packed_moves = 0;
+    }
+    get_nk_pseudo_moves(side_to_play, bb_knight, packed, true, true);
+    get_slide_pseudo_moves(side_to_play, packed, true, INCLUDE_ALL, -1, bb_all, 0, true);
+    get_pawn_pseudo_moves(side_to_play, packed.pawn_move_one, packed.pawn_move_two, packed.capture_award, packed.capture_hward);
+
+    // with no check squares everything comes out as a non-check, except the
+    // promotions, which make_pawn_moves checks itself
+    size_t start = moves.size();
+    if (!quiets_only) {
+        get_moves(side_to_play, true, true, packed, moves);
+        get_moves(side_to_play, false, true, packed, moves);
+    }
+    get_moves(side_to_play, false, false, packed, moves);
+    for (size_t i = start; i < moves.size(); i++) {
+        moves[i] &= ~GIVES_CHECK;
+    }
+}
+
+void Bitboard::bitmasks_after_move(move_t move, uint64_t *bitmasks) const
+{
+    Color opp = get_opposite_color(side_to_play);
+    uint64_t *mine = bitmasks + side_to_play * (bb_king + 1);
+    uint64_t *theirs = bitmasks + opp * (bb_king + 1);
+    int source_pos = get_source_pos(move);
+    int dest_pos = get_dest_pos(move);
+    piece_t actor = get_actor(move);
+    piece_t promotion = get_promotion(move);
+    uint64_t moved = (1ULL << source_pos) | (1ULL << dest_pos);
+
+    std::copy(piece_bitmasks, piece_bitmasks + 2 * (bb_king + 1), bitmasks);
+    piece_t captured = get_captured_piece(move) & PIECE_MASK;
+    int capture_pos = dest_pos;
+    if ((move & ENPASSANT_FLAG) == ENPASSANT_FLAG) {
+        captured = bb_pawn;
+        capture_pos = make_board_pos(source_pos / 8, dest_pos % 8);
+    }
+    if (captured != EMPTY) {
+        theirs[captured] &= ~(1ULL << capture_pos);
+        theirs[bb_all] &= ~(1ULL << capture_pos);
+    }
+    mine[actor] &= ~(1ULL << source_pos);
+    mine[promotion != 0 ? promotion : actor] |= 1ULL << dest_pos;
+    mine[bb_all] ^= moved;
+    if (actor == bb_king && abs(source_pos % 8 - dest_pos % 8) == 2) {
+        // the rook jumps over the king
+        int rook_pos = dest_pos > source_pos ? source_pos + 3 : source_pos - 4;
+        uint64_t rook_moved = (1ULL << rook_pos) | (1ULL << ((source_pos + dest_pos) / 2));
+        mine[bb_rook] ^= rook_moved;
+        mine[bb_all] ^= rook_moved;
+    }
+}
+
+bool Bitboard::is_legal(move_t move) const
+{
+    Color opp = get_opposite_color(side_to_play);
+    int source_pos = get_source_pos(move);
+    int dest_pos = get_dest_pos(move);
+    piece_t actor = get_actor(move);
+    int king_square = get_low_bit(get_bitmask(side_to_play, bb_king), 0);
+
+    if (actor == bb_king && abs(source_pos % 8 - dest_pos % 8) == 2) {
+        // not out of, through or into check
+        int step = dest_pos > source_pos ? 1 : -1;
+        for (int square = source_pos; square != dest_pos + step; square += step) {
+            if (square_attackers(square, opp) != 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+    // only a pinned piece can expose the king
+    const KingSafety &safety = king_safety();
+    if (safety.checkers == 0 && actor != bb_king && (move & ENPASSANT_FLAG) != ENPASSANT_FLAG && (safety.pinned_pieces & (1ULL << source_pos)) == 0) {
+        return true;
+    }
+    if (actor == bb_king) {
+        // the attack map sees through the king, so it covers stepping back
+        // along a checker's line too
+        return (opponent_covered_squares() & (1ULL << dest_pos)) == 0;
+    }
+
+    uint64_t bitmasks[2 * (bb_king + 1)];
+    bitmasks_after_move(move, bitmasks);
+    if (actor == bb_king) {
+        king_square = dest_pos;
+    }
+    return square_attackers(king_square, opp, bitmasks) == 0;
+}
+
+bool Bitboard::gives_check(move_t move) const
+{
+    Color opp = get_opposite_color(side_to_play);
+    int source_pos = get_source_pos(move);
+    int dest_pos = get_dest_pos(move);
+    piece_t actor = get_actor(move);
+    if (get_promotion(move) == 0 && (move & ENPASSANT_FLAG) != ENPASSANT_FLAG && !(actor == bb_king && abs(source_pos % 8 - dest_pos % 8) == 2)) {
+        // a check square, or a piece in front of the king stepping off its
+        // line. Leaving the source can't open a line from the destination:
+        // the piece would have been giving check already
+        const KingSafety &safety = king_safety();
+        if (safety.check_squares[actor] & (1ULL << dest_pos)) {
+            return true;
+        }
+        int opp_king_square = get_low_bit(get_bitmask(opp, bb_king), 0);
+        return (safety.discoverers & (1ULL << source_pos)) && (line_squares[opp_king_square][source_pos] & (1ULL << dest_pos)) == 0;
+    }
+
+    // castling, en passant and promotions are played out
+    uint64_t bitmasks[2 * (bb_king + 1)];
+    bitmasks_after_move(move, bitmasks);
+    int opp_king_square = get_low_bit(bitmasks[opp * (bb_king + 1) + bb_king], 0);
+    return square_attackers(opp_king_square, side_to_play, bitmasks) != 0;
+}
+
+const KingSafety &Bitboard::king_safety() const
+{
+    KingSafety &safety = states.back().king_safety;
+    if (!safety.known) {
+        Color opp = get_opposite_color(side_to_play);
+        int king_square = get_low_bit(get_bitmask(side_to_play, bb_king), 0);
+        int opp_king_square = get_low_bit(get_bitmask(opp, bb_king), 0);
+        safety.checkers = square_attackers(king_square, opp);
+        safety.pawn_advance_pinned = safety.pawn_capture_award_pinned = safety.pawn_capture_hward_pinned = 0;
+        safety.pinned_pieces = get_blocking_pieces(king_square, side_to_play, side_to_play, safety.immobile_pinned_pieces, safety.pawn_advance_pinned, safety.pawn_capture_award_pinned, safety.pawn_capture_hward_pinned);
+        safety.pawn_advance_discovers = safety.pawn_capture_award_discovers = safety.pawn_capture_hward_discovers = 0;
+        safety.discoverers = get_blocking_pieces(opp_king_square, opp, side_to_play, safety.total_discoverers, safety.pawn_advance_discovers, safety.pawn_capture_award_discovers, safety.pawn_capture_hward_discovers);
+        uint64_t occupied = get_bitmask(White, bb_all) | get_bitmask(Black, bb_all);
+        safety.check_squares[bb_pawn] = BitboardCaptures::PregeneratedCaptures[opp][bb_pawn][opp_king_square];
+        safety.check_squares[bb_knight] = BitboardCaptures::PregeneratedCaptures[opp][bb_knight][opp_king_square];
+        safety.check_squares[bb_bishop] = get_bishop_moves(opp_king_square, occupied);
+        safety.check_squares[bb_rook] = get_rook_moves(opp_king_square, occupied);
+        safety.check_squares[bb_queen] = safety.check_squares[bb_bishop] | safety.check_squares[bb_rook];
+        safety.check_squares[bb_king] = 0;
+        safety.known = true;
+    }
+    return safety;
+}
+
+uint64_t Bitboard::opponent_covered_squares() const
+{
+    KingSafety &safety = states.back().king_safety;
+    if (!safety.covered_known) {
+        safety.opp_covered_squares = computed_covered_squares(get_opposite_color(side_to_play), INCLUDE_ALL);
+        safety.covered_known = true;
+    }
+    return safety.opp_covered_squares;
+}
+
+void Bitboard::get_packed_legal_moves(Color side_to_play, PackedMoveIterator &moves, uint64_t &opp_covered_squares, int source_sq, piece_t source_piece, MoveGenType gen_type) const
+{
+    assert(gen_type != GEN_EVASIONS || (in_check && source_piece == bb_all));
+    assert(side_to_play == this->side_to_play);
     uint64_t my_king = get_bitmask(side_to_play, bb_king);
     int king_square = get_low_bit(my_king, 0);
     uint64_t opp_king = get_bitmask(get_opposite_color(side_to_play), bb_king);
-    uint64_t all_pieces = get_bitmask(side_to_play, bb_all) | get_bitmask(get_opposite_color(side_to_play), bb_all);
+    uint64_t opp_pieces = get_bitmask(get_opposite_color(side_to_play), bb_all);
+    uint64_t all_pieces = get_bitmask(side_to_play, bb_all) | opp_pieces;
     int opp_king_square = get_low_bit(opp_king, 0);
-    uint64_t king_attackers = 0;
     moves.pawn_check_squares = BitboardCaptures::PregeneratedCaptures[get_opposite_color(side_to_play)][bb_pawn][opp_king_square];
-    uint64_t total_blocking_pieces;
-    uint64_t pawn_advance_discovers = 0, pawn_capture_award_discovers = 0, pawn_capture_hward_discovers = 0;
-    uint64_t blocking_pieces = get_blocking_pieces(opp_king_square, get_opposite_color(side_to_play), side_to_play, total_blocking_pieces, pawn_advance_discovers, pawn_capture_award_discovers, pawn_capture_hward_discovers);
-
-    if (in_check) {
-        king_attackers = square_attackers(king_square, get_opposite_color(side_to_play));
-    }
+    const KingSafety &safety = king_safety();
+    uint64_t king_attackers = safety.checkers;
+    uint64_t total_blocking_pieces = safety.total_discoverers;
+    uint64_t pawn_advance_discovers = safety.pawn_advance_discovers;
+    uint64_t pawn_capture_award_discovers = safety.pawn_capture_award_discovers;
+    uint64_t pawn_capture_hward_discovers = safety.pawn_capture_hward_discovers;
+    uint64_t blocking_pieces = safety.discoverers;
 
     // filter out illegal moves
     if (source_piece == bb_king || source_piece == bb_all) {
@@ -897,16 +1393,19 @@ void Bitboard::get_packed_legal_moves(Color side_to_play, PackedMoveIterator &mo
         if (moves.num_packed_moves == 0) {
             moves.king_move.dest_squares = 0;
         } else {
-            if (opp_covered_squares == 0) {
-                opp_covered_squares = computed_covered_squares(get_opposite_color(side_to_play), INCLUDE_ALL);
-            }
             moves.king_move = moves.packed_moves[0];
             moves.num_packed_moves = 0;
+            if (gen_type == GEN_CAPTURES) {
+                moves.king_move.dest_squares &= opp_pieces;
+            }
+            if (moves.king_move.dest_squares != 0 && opp_covered_squares == 0) {
+                opp_covered_squares = opponent_covered_squares();
+            }
             // don't move into check
             moves.king_move.dest_squares &= ~opp_covered_squares;
             // castling: don't move out of check
             if (in_check) {
-                moves.king_move.dest_squares &= BitArrays::king_moves::data[king_square];
+                moves.king_move.dest_squares &= BitArrays::king_moves.data[king_square];
             }
             // or through check king-side
             if (opp_covered_squares & (1ULL << (king_square + 1))) {
@@ -938,23 +1437,16 @@ void Bitboard::get_packed_legal_moves(Color side_to_play, PackedMoveIterator &mo
                     moves.king_move.check_squares |= qs_castle_dest;
                 }
             }
+            if (gen_type == GEN_QUIET_CHECKS) {
+                moves.king_move.dest_squares &= moves.king_move.check_squares & ~opp_pieces;
+            }
         }
     }
 
 
     if (count_bits(king_attackers) < 2 && source_piece != bb_king) {
-        // if in double-check, don't bother generating non-king moves
-        if (source_piece == bb_all || source_piece == bb_knight) {
-            get_nk_pseudo_moves(side_to_play, bb_knight, moves, true);
-        }
-        if (source_piece != bb_knight && source_piece != bb_pawn) {
-            get_slide_pseudo_moves(side_to_play, moves, true, INCLUDE_ALL, source_sq, source_piece);
-        }
-        if (source_piece == bb_pawn || source_piece == bb_all) {
-            get_pawn_pseudo_moves(side_to_play, moves.pawn_move_one, moves.pawn_move_two, moves.capture_award, moves.capture_hward);
-        }
-
-        // filter non-king moves
+        // if in double-check, don't bother generating non-king moves;
+        // otherwise work out where they may go to answer a check
         uint64_t legal_dest_squares = ~0;
         uint64_t legal_enpassant_captures = 0;
         uint64_t legal_captures = king_attackers;
@@ -973,29 +1465,61 @@ void Bitboard::get_packed_legal_moves(Color side_to_play, PackedMoveIterator &mo
             legal_dest_squares = legal_blocks | legal_captures;
         }
 
+        if (gen_type == GEN_EVASIONS) {
+            // pinned pieces can't get between the king and another checker
+            get_piece_moves_to(side_to_play, moves, legal_dest_squares, safety.pinned_pieces);
+        } else {
+            if (source_piece == bb_all || source_piece == bb_knight) {
+                get_nk_pseudo_moves(side_to_play, bb_knight, moves, true);
+            }
+            if (source_piece != bb_knight && source_piece != bb_pawn) {
+                get_slide_pseudo_moves(side_to_play, moves, true, INCLUDE_ALL, source_sq, source_piece);
+            }
+        }
+        if (source_piece == bb_pawn || source_piece == bb_all) {
+            get_pawn_pseudo_moves(side_to_play, moves.pawn_move_one, moves.pawn_move_two, moves.capture_award, moves.capture_hward);
+        }
+        // knights and sliders are cut down to the kind of move asked for
+        // before the pin checks; pawns are sorted out below
+        uint64_t piece_dest_squares = legal_dest_squares;
+        if (gen_type == GEN_CAPTURES) {
+            piece_dest_squares &= opp_pieces;
+        } else if (gen_type == GEN_QUIET_CHECKS) {
+            piece_dest_squares &= ~all_pieces;
+        }
+
         // filter out moving pinned pieces
-        uint64_t immobile_pinned_pieces = 0;
-        uint64_t pawn_advance_illegal = 0, pawn_capture_award_illegal = 0, pawn_capture_hward_illegal = 0;
-        uint64_t pinned_pieces = get_blocking_pieces(king_square, side_to_play, side_to_play, immobile_pinned_pieces, pawn_advance_illegal, pawn_capture_award_illegal, pawn_capture_hward_illegal);
+        uint64_t immobile_pinned_pieces = safety.immobile_pinned_pieces;
+        uint64_t pawn_advance_illegal = safety.pawn_advance_pinned;
+        uint64_t pawn_capture_award_illegal = safety.pawn_capture_award_pinned;
+        uint64_t pawn_capture_hward_illegal = safety.pawn_capture_hward_pinned;
+        uint64_t pinned_pieces = safety.pinned_pieces;
 
         // apply filters to nbrq
         for (auto iter = moves.begin(); iter != moves.end(); iter++) {
+            iter->dest_squares &= piece_dest_squares;
+            if (iter->dest_squares == 0) {
+                continue;
+            }
             if ((1ULL << iter->source_pos) & immobile_pinned_pieces) {
                 iter->dest_squares = 0;
+                continue;
             }
             else if ((1ULL << iter->source_pos) & pinned_pieces) {
                 if (opp_covered_squares == 0) {
-                    opp_covered_squares = computed_covered_squares(get_opposite_color(side_to_play), INCLUDE_ALL);
+                    opp_covered_squares = opponent_covered_squares();
                 }
                 iter->dest_squares = pinned_piece_legal_dest(iter->piece_type, iter->source_pos, iter->dest_squares, side_to_play, opp_covered_squares);
             }
-            iter->dest_squares &= legal_dest_squares;
             // add discovered checks
             if (total_blocking_pieces & (1ULL << iter->source_pos)) {
                 iter->check_squares = iter->dest_squares;
             } else if (blocking_pieces & (1ULL << moves.king_move.source_pos)) {
                 iter->check_squares |= iter->dest_squares & ~pinned_piece_legal_dest(bb_king, iter->source_pos, iter->dest_squares, get_opposite_color(side_to_play), ~0);
             }
+            if (gen_type == GEN_QUIET_CHECKS) {
+                iter->dest_squares &= iter->check_squares;
+            }
         }
 
         if (source_piece == bb_all || source_piece == bb_pawn) {
@@ -1004,11 +1528,24 @@ void Bitboard::get_packed_legal_moves(Color side_to_play, PackedMoveIterator &mo
             moves.pawn_move_two = moves.pawn_move_two & shift_right(legal_dest_squares, one_rank_forward*2) & ~pawn_advance_illegal;
             moves.capture_award = moves.capture_award & shift_right(legal_dest_squares|legal_enpassant_captures, one_rank_forward - 1) & ~pawn_capture_award_illegal;
             moves.capture_hward = moves.capture_hward & shift_right(legal_dest_squares|legal_enpassant_captures, one_rank_forward + 1) & ~pawn_capture_hward_illegal;
+            uint64_t promo_rank = (side_to_play == White ? rank_7 : rank_2);
+            if (gen_type == GEN_CAPTURES) {
+                moves.pawn_move_one &= promo_rank;
+                moves.pawn_move_two = 0;
+            } else if (gen_type == GEN_QUIET_CHECKS) {
+                moves.pawn_move_one &= ~promo_rank;
+                moves.capture_award = 0;
+                moves.capture_hward = 0;
+            }
 
             // add pawn discovered checks
             moves.advance_gives_check |= (moves.pawn_move_one | moves.pawn_move_two) & pawn_advance_discovers;
             moves.capture_award_gives_check |= moves.capture_award & pawn_capture_award_discovers;
             moves.capture_hward_gives_check |= moves.capture_hward & pawn_capture_hward_discovers;
+            if (gen_type == GEN_QUIET_CHECKS) {
+                moves.pawn_move_one &= moves.advance_gives_check | shift_right(moves.pawn_check_squares, one_rank_forward);
+                moves.pawn_move_two &= moves.advance_gives_check | shift_right(moves.pawn_check_squares, 2 * one_rank_forward);
+            }
         }
     }
 
@@ -1087,8 +1624,8 @@ uint64_t Bitboard::get_blocking_pieces(int king_pos, Color king_color, Color blo
     /** returns pinned pieces or blocked pieces (piece who can move with discovered check).
         immobile_pinned_pieces are subset that definitely have no squares they can move without discovering check
         pawn_cannot_advance are subset that cannot advance without discovering check */
-    uint64_t bishop_moves = BitArrays::bishop_moves::data[king_pos];
-    uint64_t rook_moves = BitArrays::rook_moves::data[king_pos];
+    uint64_t bishop_moves = BitArrays::bishop_moves.data[king_pos];
+    uint64_t rook_moves = BitArrays::rook_moves.data[king_pos];
     uint64_t opp_diag_pieces = get_bitmask(get_opposite_color(king_color), bb_bishop) | get_bitmask(get_opposite_color(king_color), bb_queen);
     uint64_t opp_lat_pieces = get_bitmask(get_opposite_color(king_color), bb_rook) | get_bitmask(get_opposite_color(king_color), bb_queen);
     uint64_t my_pieces = get_bitmask(king_color, bb_all);
@@ -1112,9 +1649,9 @@ uint64_t Bitboard::get_blocking_pieces(int king_pos, Color king_color, Color blo
         // pawns are immobile if greater than one square from pinner
         pinned_pieces |= pins;
         immobile_pinned_pieces |= (pins & (get_bitmask(blocked_piece_color, bb_rook) | get_bitmask(blocked_piece_color, bb_knight)));
-        // immobile_pinned_pieces |= (pins & get_bitmask(blocked_piece_color, bb_pawn)) & ~BitArrays::king_moves::data[start_pos];
+        // immobile_pinned_pieces |= (pins & get_bitmask(blocked_piece_color, bb_pawn)) & ~BitArrays::king_moves.data[start_pos];
         pawn_cannot_advance |= pins;
-        uint64_t pinned_squares = get_blocking_squares(start_pos, king_pos, (1ULL << start_pos) | (1ULL << king_pos)) | (1ULL << start_pos);
+        uint64_t pinned_squares = between_squares[start_pos][king_pos] | (1ULL << start_pos);
         pawn_cannot_capture_award |= pins & shift_right(shift_right(my_pawns, -one_rank_forward + 1) & ~pinned_squares, one_rank_forward - 1);
         pawn_cannot_capture_award |= shift_right(ep_capturable & pinned_squares & pins, -1) & my_pawns;
         pawn_cannot_capture_hward |= pins & shift_right(shift_right(my_pawns, -one_rank_forward - 1) & ~pinned_squares, one_rank_forward + 1);
@@ -1231,6 +1768,46 @@ void Bitboard::get_slide_pseudo_moves(Color color, PackedMoveIterator &move_repr
 
 }
 
+// the knight and slider moves onto targets, in the order get_nk_pseudo_moves
+// and get_slide_pseudo_moves give them; only pieces that reach a target are
+// looked at, found by looking back from the targets
+void Bitboard::get_piece_moves_to(Color color, PackedMoveIterator &move_repr, uint64_t targets, uint64_t exclude_pieces) const
+{
+    uint64_t all_pieces = get_bitmask(White, bb_all) | get_bitmask(Black, bb_all);
+    int opponent_king_square = get_low_bit(get_bitmask(get_opposite_color(color), bb_king), 0);
+    uint64_t knight_reach = 0, diag_reach = 0, lateral_reach = 0;
+    int target = -1;
+    while ((target = get_low_bit(targets, target + 1)) >= 0) {
+        knight_reach |= BitArrays::knight_moves.data[target];
+        diag_reach |= get_bishop_moves(target, all_pieces);
+        lateral_reach |= get_rook_moves(target, all_pieces);
+    }
+    uint64_t diag_checks = get_bishop_moves(opponent_king_square, all_pieces);
+    uint64_t lateral_checks = get_rook_moves(opponent_king_square, all_pieces);
+
+    const piece_t piece_types[] = { bb_knight, bb_bishop, bb_rook, bb_queen };
+    for (piece_t piece_type : piece_types) {
+        bool diag = piece_type == bb_bishop || piece_type == bb_queen;
+        bool lateral = piece_type == bb_rook || piece_type == bb_queen;
+        uint64_t reach = piece_type == bb_knight ? knight_reach : (diag ? diag_reach : 0) | (lateral ? lateral_reach : 0);
+        uint64_t actors = get_bitmask(color, piece_type) & reach & ~exclude_pieces;
+        int start_pos = -1;
+        while ((start_pos = get_low_bit(actors, start_pos + 1)) >= 0) {
+            PackedMoves &pm = move_repr.append();
+            pm.piece_type = piece_type;
+            pm.source_pos = start_pos;
+            if (piece_type == bb_knight) {
+                pm.dest_squares = BitArrays::knight_moves.data[start_pos] & targets;
+                pm.check_squares = BitArrays::knight_moves.data[opponent_king_square];
+            } else {
+                pm.dest_squares = ((diag ? get_bishop_moves(start_pos, all_pieces) : 0) | (lateral ? get_rook_moves(start_pos, all_pieces) : 0)) & targets;
+                pm.check_squares = (diag ? diag_checks : 0) | (lateral ? lateral_checks : 0);
+            }
+            pm.check_squares &= pm.dest_squares;
+        }
+    }
+}
+
 void Bitboard::get_nk_pseudo_moves(Color color, piece_t piece_type, PackedMoveIterator &move_repr, bool remove_self_captures, bool omit_check_calc) const
 {
     uint64_t my_pieces = get_bitmask(color, bb_all);
@@ -1455,6 +2032,12 @@ void Bitboard::apply_move(move_t move)
 
     // std::cout << "applying move " << move_to_uci(move) << std::endl;
 
+    piece_t captured_piece = get_captured_piece(move, get_opposite_color(color));
+    if ((move & ENPASSANT_FLAG) == ENPASSANT_FLAG) {
+        captured_piece = make_piece(bb_pawn, get_opposite_color(color));
+    }
+    push_state(captured_piece, captured_piece != EMPTY || (sourcepiece & PIECE_MASK) == bb_pawn);
+
     if (get_captured_piece(move) > 0 || (sourcepiece & PIECE_MASK) == bb_pawn) {
         moves_since_progress = 0;
     } else if (color == White) {
@@ -1543,12 +2126,73 @@ void Bitboard::apply_move(move_t move)
 #endif
 	assert(piece_bitmasks[(bb_king + 1) + bb_king] > 0);
 	assert(piece_bitmasks[bb_king] > 0);
-    int found_count = 1;
-    auto old_count = seen_positions.find(hash);
-    if (old_count != seen_positions.end()) {
-        found_count += old_count->second;
+}
+
+void Bitboard::apply_null_move()
+{
+    assert(!in_check);
+    push_state(EMPTY, true);
+    set_enpassant_file(-1);
+    set_side_to_play(get_opposite_color(side_to_play));
+}
+
+void Bitboard::undo_null_move()
+{
+    side_to_play = get_opposite_color(side_to_play);
+    pop_state();
+}
+
+void Bitboard::push_state(piece_t captured_piece, bool irreversible)
+{
+    short reversible_plies = irreversible ? 0 : states.back().reversible_plies + 1;
+    StateInfo &state = states.emplace_back();
+    state.hash = hash;
+    state.pawn_hash = pawn_hash;
+    state.castle = castle;
+    state.enpassant_file = enpassant_file;
+    state.moves_since_progress = moves_since_progress;
+    state.in_check = in_check;
+    state.captured_piece = captured_piece;
+    state.reversible_plies = reversible_plies;
+    state.king_safety.known = false;
+    state.king_safety.covered_known = false;
+}
+
+void Bitboard::pop_state()
+{
+    assert(states.size() > 1);
+    const StateInfo &state = states.back();
+    hash = state.hash;
+    pawn_hash = state.pawn_hash;
+    castle = state.castle;
+    enpassant_file = state.enpassant_file;
+    moves_since_progress = state.moves_since_progress;
+    in_check = state.in_check;
+    states.pop_back();
+}
+
+void Bitboard::clear_history()
+{
+    states.clear();
+    StateInfo &root = states.emplace_back();
+    root.captured_piece = EMPTY;
+    root.reversible_plies = 0;
+    root.king_safety.known = false;
+    root.king_safety.covered_known = false;
+}
+
+int Bitboard::times_seen() const
+{
+    // states[i] holds the hash from before move i; only positions with the
+    // same side to play since the last irreversible move can match
+    int count = 1;
+    size_t current = states.size() - 1;
+    for (size_t plies = 2; plies <= (size_t)states.back().reversible_plies; plies += 2) {
+        if (states[current - plies + 1].hash == hash) {
+            count++;
+        }
     }
-    seen_positions[hash] = found_count;
+    return count;
 }
 
 uint64_t Bitboard::get_zobrist_with_move(move_t move) const {
@@ -1640,95 +2284,36 @@ uint64_t Bitboard::get_zobrist_with_move(move_t move) const {
 
 void Bitboard::undo_move(move_t move)
 {
-    unsigned char destrank, destfile, sourcerank, sourcefile;
-    get_source(move, sourcerank, sourcefile);
-    get_dest(move, destrank, destfile);
+    int source_pos = get_source_pos(move);
+    int dest_pos = get_dest_pos(move);
+    Color color = get_opposite_color(side_to_play);
+    piece_t moved_piece = make_piece(get_actor(move), color);
+    piece_t promote = get_promotion(move, color);
+    piece_t captured_piece = states.back().captured_piece;
 
     // std::cout << "undoing move " << move_to_uci(move) << std::endl;
 
-    // pop seen positions
-//    std::cout << "old hash: " << hash << " - ";
-    auto iter = seen_positions.find(hash);
-//    bool fail = (iter == seen_positions.end());
-    if (iter != seen_positions.end()) {
-        if (iter->second <= 1) {
-            seen_positions.erase(iter);
-        } else {
-            seen_positions[hash]--;
-        }
-
-    } else {
-        std::cout << "Error undoing move " << move_to_uci(move) << " in ";
-        ((Fenboard*)this)->get_fen(std::cout);
-        std::cout << std::endl;
-        abort();
-    }
-
-
-    piece_t moved_piece = get_piece(destrank, destfile);
-    Color color = get_color(moved_piece);
-    piece_t captured_piece = get_captured_piece(move);
+    // the hashes come back with the state, so the pieces are put back as is
+    toggle_piece(dest_pos, promote ? promote : moved_piece);
+    toggle_piece(source_pos, moved_piece);
     if (captured_piece != EMPTY) {
-        captured_piece = make_piece(captured_piece & PIECE_MASK, get_opposite_color(color));
+        // en passant took the pawn beside the source
+        toggle_piece((move & ENPASSANT_FLAG) == ENPASSANT_FLAG ? source_pos / 8 * 8 + dest_pos % 8 : dest_pos, captured_piece);
     }
-    in_check = (move & MOVE_FROM_CHECK) == MOVE_FROM_CHECK;
-
-    // flags
-    set_side_to_play(color);
-
-    if ((move & INVALIDATES_CASTLE_K) != 0) {
-        set_can_castle(color, true, true);
-    }
-    if ((move & INVALIDATES_CASTLE_Q) != 0) {
-        set_can_castle(color, false, true);
-    }
-    // promote
-    piece_t promote = get_promotion(move);
-    if (promote & PIECE_MASK) {
-        moved_piece = make_piece(bb_pawn, color);
-    }
-
-    set_piece(sourcerank, sourcefile, moved_piece);
-    set_piece(destrank, destfile, captured_piece);
 
     // castle: put the rook back
-    if ((moved_piece & PIECE_MASK) == bb_king && sourcefile == 4 && (destfile == 2 || destfile == 6)) {
-        int rook = make_piece(bb_rook, color);
-        unsigned char rook_dest_file = 8, rook_source_file = 8;
-        switch (destfile) {
-            case 2:
-                rook_source_file = 0;
-                rook_dest_file = 3;
-                break;
-            case 6:
-                rook_source_file = 7;
-                rook_dest_file = 5;
-                break;
-        }
-        set_piece(destrank, rook_source_file, rook);
-        set_piece(destrank, rook_dest_file, EMPTY);
-    }
-
-    // en passant capture
-    if ((move & ENPASSANT_FLAG) == ENPASSANT_FLAG) {
-        set_piece(sourcerank, destfile, make_piece(bb_pawn, get_opposite_color(color)));
-    }
-    int new_enpassant_file = (move >> ENPASSANT_POS) & 0xf;
-    if (new_enpassant_file > 8) {
-        new_enpassant_file = -1;
+    if ((moved_piece & PIECE_MASK) == bb_king && source_pos % 8 == 4 && (dest_pos % 8 == 2 || dest_pos % 8 == 6)) {
+        piece_t rook = make_piece(bb_rook, color);
+        bool kingside = dest_pos % 8 == 6;
+        toggle_piece(kingside ? source_pos + 3 : source_pos - 4, rook);
+        toggle_piece(kingside ? source_pos + 1 : source_pos - 1, rook);
     }
-    set_enpassant_file(new_enpassant_file);
 
+    side_to_play = color;
     if (color == Black) {
         move_count--;
     }
-
-    // std::cout << " -> " << hash << std::endl;
-
-    // std::cout << " undo ";
-    // ((Fenboard*)this)->print_move(move, std::cout);
-    // std::cout << " capt " << static_cast<int>(captured_piece) << std::endl;
-
+    pop_state();
 }
 
 char fen_repr(unsigned char p)
@@ -1807,6 +2392,9 @@ void Bitboard::update_zobrist_hashing_piece(unsigned char rank, unsigned char fi
 {
     // uint64_t oldhash = hash;
     hash ^= zobrist_hashing_piece(rank, file, piece);
+    if ((piece & PIECE_MASK) == bb_pawn) {
+        pawn_hash ^= zobrist_hashing_piece(rank, file, piece);
+    }
     // std::cout << "z piece " << named_piece(piece) << (char)(file + 'a') << (char) (rank + '1') << " " << std::hex << oldhash << " -> " << hash << std::endl;
 }
 
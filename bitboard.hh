@@ -3,14 +3,15 @@
 
 #define HAS_FFSLL
 
+#include <array>
 #include <vector>
-#include <unordered_map>
 #include <cstdint>
 #include <cstdlib>
 #include <cassert>
 #include <iostream>
 #include <strings.h>
 #include <stdalign.h>
+#include <bit>
 #include "move.hh"
 
 const int PIECE_VALUE[] = { 0, 1, 3, 3, 5, 9, 1000 };
@@ -40,11 +41,7 @@ const int Mod67BitPos[] = {
 };
 
 constexpr int count_bits(uint64_t bitset) {
-    int c = 0;
-    for (c = 0; bitset; c++) {
-        bitset &= (bitset - 1);
-    }
-    return c;
+    return std::popcount(bitset);
 }
 
 constexpr int get_low_bit(uint64_t bitset, unsigned int start) {
@@ -62,6 +59,61 @@ constexpr int get_low_bit(uint64_t bitset, unsigned int start) {
 #endif
 }
 
+// deposits the low bits of bitset onto the set bits of bitmask, like PDEP
+constexpr uint64_t project_bitset(uint64_t bitset, uint64_t bitmask)
+{
+    uint64_t projection = 0;
+    int location = 0;
+    for (int i = 0; i < count_bits(bitmask); i++) {
+        location = get_low_bit(bitmask, location);
+        if (location == -1) {
+            break;
+        }
+        if (bitset & (1ULL << i)) {
+            projection |= (1ULL << location);
+        }
+        location++;
+    }
+    return projection;
+}
+
+// squares a slider on src attacks given the occupancy, worked out a step at
+// a time; the lookup tables are built from these at compile time
+constexpr uint64_t slide_moves(BoardPos src, uint64_t blockboard, const int (*directions)[2]) {
+    uint64_t x = 0;
+    for (int d = 0; d < 4; d++) {
+        for (int n = 1; n < 8; n++) {
+            int r = src / 8 + directions[d][0] * n;
+            int f = src % 8 + directions[d][1] * n;
+            if (r < 0 || r >= 8 || f < 0 || f >= 8) {
+                break;
+            }
+            x |= (1ULL << (r * 8 + f));
+            if (blockboard & (1ULL << (r * 8 + f))) {
+                break;
+            }
+        }
+    }
+    return x;
+}
+
+constexpr uint64_t bishop_slide_moves(BoardPos src, uint64_t blockboard) {
+    constexpr int directions[4][2] = { { -1, -1 }, { -1, 1 }, { 1, -1 }, { 1, 1 } };
+    return slide_moves(src, blockboard, directions);
+}
+
+constexpr uint64_t rook_slide_moves(BoardPos src, uint64_t blockboard) {
+    constexpr int directions[4][2] = { { 1, 0 }, { 0, 1 }, { -1, 0 }, { 0, -1 } };
+    return slide_moves(src, blockboard, directions);
+}
+
+typedef std::array<std::array<uint64_t, 64>, 64> SquarePairTable;
+// squares strictly between two squares sharing a rank, file or diagonal, 0
+// when they don't
+extern const SquarePairTable between_squares;
+// the whole rank, file or diagonal through two squares, 0 when there's none
+extern const SquarePairTable line_squares;
+
 
 constexpr int sign(int value) {
     if (value > 0) {
@@ -80,8 +132,58 @@ constexpr int max(int a, int b) {
 }
 
 
+// how sliding piece attacks are looked up: a magic multiply, or PEXT where
+// the cpu does PEXT quickly; both index the same packed table
+enum SliderBackend { slider_magic, slider_pext };
+const char *slider_backend_name(SliderBackend backend);
+
 class Bitboard;
 
+// no position has more than 218 legal moves
+const int MAX_MOVES = 256;
+
+// generated moves, held inline so that generating them never touches the
+// allocator. Each move has a score slot for callers that order them
+class MoveList {
+public:
+    MoveList() : count(0) {}
+
+    void push_back(move_t move) {
+        assert(count < MAX_MOVES);
+        moves[count++] = move;
+    }
+    void clear() { count = 0; }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    move_t *begin() { return moves; }
+    move_t *end() { return moves + count; }
+    const move_t *begin() const { return moves; }
+    const move_t *end() const { return moves + count; }
+    move_t &operator[](size_t index) { return moves[index]; }
+    move_t operator[](size_t index) const { return moves[index]; }
+
+    // keeps the order of the moves after iter, and their scores
+    move_t *erase(move_t *iter) {
+        size_t index = iter - moves;
+        for (size_t i = index + 1; i < count; i++) {
+            moves[i - 1] = moves[i];
+            scores[i - 1] = scores[i];
+        }
+        count--;
+        return iter;
+    }
+
+    int &score(size_t index) { return scores[index]; }
+    // orders the moves from start on by descending score
+    void sort_by_score(size_t start);
+
+private:
+    move_t moves[MAX_MOVES];
+    int scores[MAX_MOVES];
+    size_t count;
+};
+
 struct PackedMoves {
     alignas(64) uint64_t dest_squares;
     uint64_t check_squares;
@@ -93,6 +195,20 @@ struct PackedMoves {
     }
 };
 
+// which legal moves get_packed_legal_moves produces, so that a search phase
+// only pays for the moves it's going to try
+enum MoveGenType {
+    GEN_ALL,
+    // captures, en passant included, and promotions
+    GEN_CAPTURES,
+    // moves that give check without capturing or promoting
+    GEN_QUIET_CHECKS,
+    // every move out of check, for the side to play in check: king moves, and
+    // otherwise only captures of a lone checker or blocks of its line, found
+    // from those squares rather than by walking every piece
+    GEN_EVASIONS,
+};
+
 const int max_packed_moves = 16;
 struct PackedMoveIterator {
     uint64_t pawn_check_squares; // in dest space
@@ -144,6 +260,60 @@ struct PackedMoveIterator {
     }
 };
 
+// the pieces of both colors that could take part in an exchange, grouped by
+// how they attack, so several exchanges on one board can share them
+struct ExchangePieces {
+    uint64_t lateral;
+    uint64_t diag;
+    uint64_t knights;
+    uint64_t kings;
+    uint64_t pawns[2];
+};
+
+// king safety for the side to play, worked out the first time move
+// generation needs it and kept until the position changes
+struct KingSafety {
+    bool known;
+    // opp_covered_squares is filled in separately, only when asked for
+    bool covered_known;
+    // pieces giving check, found on the board rather than taken from in_check
+    uint64_t checkers;
+    // own pieces pinned to the king, and the subsets that can't move at all
+    // or can't advance or capture towards each side without exposing it
+    uint64_t pinned_pieces;
+    uint64_t immobile_pinned_pieces;
+    uint64_t pawn_advance_pinned;
+    uint64_t pawn_capture_award_pinned;
+    uint64_t pawn_capture_hward_pinned;
+    // own pieces in front of the opponent king that may discover check
+    uint64_t discoverers;
+    uint64_t total_discoverers;
+    uint64_t pawn_advance_discovers;
+    uint64_t pawn_capture_award_discovers;
+    uint64_t pawn_capture_hward_discovers;
+    // squares each piece type would check the opponent king from
+    uint64_t check_squares[bb_king + 1];
+    // squares the opponent attacks
+    uint64_t opp_covered_squares;
+};
+
+// one per ply: what apply_move overwrites, so undo_move restores it instead
+// of working it back out from the move
+struct StateInfo {
+    uint64_t hash;
+    uint64_t pawn_hash;
+    char castle;
+    char enpassant_file;
+    short moves_since_progress;
+    bool in_check;
+    piece_t captured_piece;
+    // plies back to the last capture, pawn move or null move; none of the
+    // positions before it can come up again
+    short reversible_plies;
+    // of the position the move leads to
+    mutable KingSafety king_safety;
+};
+
 class Bitboard
 {
     friend class SimpleBitboardEvaluation;
@@ -173,14 +343,59 @@ public:
     }
     void set_piece(unsigned char rank, unsigned char file, piece_t);
 
-    void get_packed_legal_moves(Color side_to_play, PackedMoveIterator &moves, uint64_t &opp_covered_squares, int source_sq=-1, piece_t source_piece=bb_all) const;
+    void get_packed_legal_moves(Color side_to_play, PackedMoveIterator &moves, uint64_t &opp_covered_squares, int source_sq=-1, piece_t source_piece=bb_all, MoveGenType gen_type=GEN_ALL) const;
+    void get_moves(Color side_to_play, bool checks, bool captures_or_promo, const PackedMoveIterator &packed, MoveList &moves) const;
+    // as above, appending to a vector for the tools
     void get_moves(Color side_to_play, bool checks, bool captures_or_promo, const PackedMoveIterator &packed, std::vector<move_t> &moves) const;
-    // return a move from source_sq to dest_sq, if there are any.  If it's promo use =Q
-    move_t reinterpret_move(move_t hint, uint64_t &opp_covered_squares) const;
+    // number of moves get_moves would produce, without materializing them
+    int count_moves(Color side_to_play, const PackedMoveIterator &packed) const;
+    // moves that may leave the king in check, castling through check
+    // included, and carry no GIVES_CHECK flag; check each one with is_legal
+    // and gives_check when it's picked. quiets_only leaves out captures and
+    // promotions, for the search's last move phase
+    void get_pseudo_legal_moves(Color side_to_play, MoveList &moves, bool quiets_only=false) const;
+    // whether a pseudo-legal move of the side to play leaves its king safe.
+    // Skips the attack test for unpinned pieces when king_safety finds no
+    // checkers, so it doesn't rely on in_check; king steps are looked up in
+    // opponent_covered_squares
+    bool is_legal(move_t move) const;
+    // whether a legal move of the side to play checks the opponent, from
+    // king_safety's check squares and discoverers except for castling, en
+    // passant and promotions
+    bool gives_check(move_t move) const;
+    // the legal move matching a compact move for the side to play, with all
+    // of its flags restored. 0 if it isn't legal here
+    move_t decode_move(compact_move_t move) const;
+    // the legal move of a piece_type piece from one of source_squares to dest_pos,
+    // found from the destination without generating moves. 0 if there are none or several
+    move_t find_move_to(Color side_to_play, piece_t piece_type, int dest_pos, uint64_t source_squares, piece_t promote) const;
+    // material side_to_play nets capturing current_piece on square with a
+    // capturer piece (or its least valuable attacker when 0), after both sides
+    // recapture with their least valuable piece while it pays, x-rays included.
+    // 0 straight from the cached opponent_covered_squares when the opponent
+    // of the side to play doesn't reach square
     int static_exchange_eval(Color side_to_play, int square, piece_t current_piece, piece_t capturer) const;
-    int static_exchange_negamax(piece_t current_occupier, char attackers[bb_king], char defenders[bb_king]) const;
+    // as above for a capture by the side to play
+    int static_exchange_eval(move_t move) const;
+    // whether the exchange nets at least threshold, stopping as soon as it's known
+    bool see_ge(move_t move, int threshold) const;
+    // static_exchange_eval for side_to_play capturing with its least valuable
+    // attacker on each square of targets, grouping the pieces by how they
+    // attack once for all of them; scores for other squares are left alone.
+    // For the opponent of the side to play, squares outside the cached
+    // opponent_covered_squares score 0 without an attacker scan
+    void static_exchange_targets(Color side_to_play, uint64_t targets, int scores[64]) const;
 
     bool king_in_check(Color) const;
+    // whether the side to play is in check, as recorded by the last move
+    bool is_in_check() const { return in_check; }
+    // squares the opponent of the side to play attacks, cached per position
+    uint64_t opponent_covered_squares() const;
+    // drops the cached king safety; the setters below call it
+    void forget_king_safety() {
+        states.back().king_safety.known = false;
+        states.back().king_safety.covered_known = false;
+    }
     uint64_t get_bitmask(Color color, piece_t piece_type) const {
         return piece_bitmasks[color * (bb_king + 1) + (PIECE_MASK & piece_type)];
     }
@@ -199,6 +414,7 @@ public:
         }
         if (old_castle != castle) {
             update_zobrist_hashing_castle(color, kingside, enabled);
+            forget_king_safety();
         }
     }
 
@@ -206,6 +422,7 @@ public:
     void set_side_to_play(Color stp) {
         if (stp != side_to_play) {
             update_zobrist_hashing_move();
+            forget_king_safety();
         }
         side_to_play = stp;
     }
@@ -217,6 +434,7 @@ public:
         if (newfile != enpassant_file) {
             update_zobrist_hashing_enpassant(enpassant_file, false);
             update_zobrist_hashing_enpassant(newfile, true);
+            forget_king_safety();
         }
         enpassant_file = newfile;
     }
@@ -228,13 +446,13 @@ protected:
             unsigned char captured_piece, unsigned char promote, bool gives_check) const;
 
     // for non-promote
-    void make_moves(Color side_to_play, std::vector<move_t> &dest,
+    void make_moves(Color side_to_play, MoveList &dest,
             int srcfile,
             unsigned char source_piece,
             uint64_t dest_squares, uint64_t dest_gives_check) const;
 
     void make_pawn_moves(Color side_to_play,
-             std::vector<move_t> &dest,
+             MoveList &dest,
              uint64_t source_squares,
              int dest_offset, bool gives_check) const;
 
@@ -269,10 +487,20 @@ private:
     bool removes_check(piece_t piece_type, int start_pos, int dest_pos, Color color, uint64_t covered_squares) const;
     uint64_t computed_covered_squares(Color color, int include_flags) const;
 
+    const KingSafety &king_safety() const;
     uint64_t square_attackers(int dest, Color color) const;
+    uint64_t square_attackers(int dest, Color color, const uint64_t *bitmasks) const;
+    // the piece bitmasks after the side to play makes move
+    void bitmasks_after_move(move_t move, uint64_t *bitmasks) const;
     uint64_t removes_check_dest(piece_t piece_type, int start_pos, uint64_t dest_squares, Color color, uint64_t covered_squares, uint64_t attackers) const;
     uint64_t remove_discovered_checks(piece_t piece_type, int start_pos, uint64_t dest_squares, Color color, uint64_t covered_squares) const;
     uint64_t get_blocking_squares(int src, int dest, uint64_t blockers) const;
+    ExchangePieces exchange_pieces() const;
+    uint64_t exchange_attackers(int square, uint64_t occupied, const ExchangePieces &pieces) const;
+    piece_t least_valuable_attacker(uint64_t attackers, Color color, uint64_t &source) const;
+    uint64_t exchange_xrays(int square, piece_t removed, uint64_t occupied, const ExchangePieces &pieces) const;
+    void exchange_setup(move_t move, int &square, piece_t &current_piece, uint64_t &source, uint64_t &occupied) const;
+    int static_exchange_swap(Color side_to_play, int square, piece_t current_piece, uint64_t source, piece_t capturer, uint64_t occupied, uint64_t attackers, const ExchangePieces &pieces) const;
     uint64_t get_bishop_moves(int start_pos, uint64_t blockers) const;
     uint64_t get_rook_moves(int start_pos, uint64_t blockers) const;
 
@@ -280,33 +508,47 @@ private:
     uint64_t get_blocking_pieces(int king_pos, Color king_color, Color blocked_piece_color, uint64_t &immobile_pinned_pieces, uint64_t &pawn_cannot_advance, uint64_t &pawn_cannot_capture_award, uint64_t &pawn_cannot_capture_hward) const;
     void get_slide_pseudo_moves(Color color, PackedMoveIterator &move_repr, bool remove_self_captures, int include_flags, int start_pos = -1, piece_t piece_type = 0, uint64_t exclude_pieces = 0, bool omit_check_calc = false) const;
     void get_nk_pseudo_moves(Color color, piece_t piece_type, PackedMoveIterator &move_repr, bool remove_self_captures, bool omit_check_calc=false) const;
+    void get_piece_moves_to(Color color, PackedMoveIterator &move_repr, uint64_t targets, uint64_t exclude_pieces) const;
     void get_pawn_pseudo_moves(Color color, uint64_t &move_one, uint64_t &move_two, uint64_t &capture_award, uint64_t &capture_hward) const;
     void get_slide_pseudo_moves_inner(Color color, PackedMoveIterator &move_repr, piece_t piece_type, int start_pos, int opponent_king_square, bool remove_self_captures, uint64_t exclude_pieces, bool omit_check_calc) const;
     void get_slide_pseudo_moves_single(Color color, PackedMoveIterator &move_repr, piece_t piece_type, int start_pos, int opponent_king_square, bool remove_self_captures, bool omit_check_calc, uint64_t all_pieces, uint64_t my_pieces, uint64_t &rook_attacking_sq, uint64_t &bishop_attacking_sq) const;
 
-    const static uint64_t **rook_magic;
-    const static uint64_t **bishop_magic;
+    static SliderBackend slider_backend;
+
+public:
+    // picked at startup from the cpu; false if it can't run the backend.
+    // Switching rewrites the attack table in the new backend's order, so no
+    // other thread may be generating moves meanwhile
+    static bool set_slider_backend(SliderBackend backend);
+    static SliderBackend get_slider_backend() { return slider_backend; }
 
 
 public:
     void apply_move(move_t);
     void undo_move(move_t);
-    int times_seen() {
-        auto iter = seen_positions.find(hash);
-        if (iter != seen_positions.end()) {
-            return iter->second;
-        } else {
-            return 0;
-        }
-    }
+    // passes the turn; not while in check
+    void apply_null_move();
+    void undo_null_move();
+    // how many times the position has been reached, this one included
+    int times_seen() const;
     uint64_t get_hash() const { return hash; }
+    // zobrist key over pawns only, for the evaluation's pawn hash table
+    uint64_t get_pawn_hash() const { return pawn_hash; }
 
     uint64_t get_zobrist_with_move(move_t) const;
 
 protected:
-    std::unordered_map<uint64_t, int> seen_positions;
+    // makes the current position the first of the history
+    void clear_history();
 private:
+    std::vector<StateInfo> states;
+    void push_state(piece_t captured_piece, bool irreversible);
+    void pop_state();
+    // adds or removes a piece without touching the hashes
+    void toggle_piece(int square, piece_t piece);
+
     uint64_t hash;
+    uint64_t pawn_hash;
 
     uint64_t zobrist_hashing_piece(unsigned char rank, unsigned char file, piece_t piece) const;
     uint64_t zobrist_hashing_castle(Color, bool kingside) const;
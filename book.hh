@@ -0,0 +1,54 @@
+#ifndef BOOK_HH_
+#define BOOK_HH_
+
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+#include "fenboard.hh"
+
+// one 16 byte record of a Polyglot .bin book, stored big-endian and sorted by key
+struct PolyglotEntry {
+    uint64_t key;
+    uint16_t move;
+    uint16_t weight;
+    uint32_t learn;
+};
+
+// the Polyglot zobrist key of a position, as used to index .bin books
+uint64_t polyglot_key(const Fenboard &b);
+
+// the legal move a book move refers to in this position, or 0
+move_t polyglot_to_move(const Fenboard &b, uint16_t book_move);
+// the book encoding of a move, with castling as the king taking its rook
+uint16_t move_to_polyglot(move_t move);
+// sorts entries by key, heaviest first, and writes them as a .bin book
+bool write_polyglot_book(const std::string &filename, std::vector<PolyglotEntry> &entries);
+
+class PolyglotBook {
+public:
+    PolyglotBook();
+    ~PolyglotBook();
+
+    bool open(const std::string &filename);
+    void close();
+    bool is_open() const { return entries != nullptr; }
+    size_t size() const { return num_entries; }
+
+    // all entries for a position, decoded to host byte order
+    void find(uint64_t key, std::vector<PolyglotEntry> &found) const;
+    // a book move for the position: the heaviest with best set, otherwise
+    // chosen at random in proportion to weight. 0 when out of book
+    move_t probe(const Fenboard &b, bool best = false);
+    void seed(unsigned seed) { random.seed(seed); }
+
+private:
+    PolyglotEntry read_entry(size_t index) const;
+
+    const unsigned char *entries;
+    size_t num_entries;
+    size_t mapped_size;
+    std::mt19937 random;
+};
+
+#endif
@@ -9,6 +9,7 @@
 #include "search.hh"
 #include "move.hh"
 #include "nnueeval.hh"
+#include "analysiscache.hh"
 namespace po = boost::program_options;
 
 void print_line(Fenboard &b, Search &s, move_t first_move)
@@ -23,7 +24,9 @@ void print_line(Fenboard &b, Search &s, move_t first_move)
         int ignore;
         int alpha = VERY_BAD;
         int beta = VERY_GOOD;
-        if (s.read_transposition(b.get_hash(), next_move, 0, alpha, beta, ignore)) {
+        compact_move_t tt_move;
+        if (s.read_transposition(b.get_hash(), tt_move, 0, alpha, beta, ignore)) {
+            next_move = b.decode_move(tt_move);
             std::cout << " " << move_to_uci(next_move);
         } else {
             break;
@@ -60,6 +63,8 @@ int main(int argc, char **argv)
             ("moves", po::bool_switch(), "list moves")
             ("only", po::value<std::string>(), "only move to consider")
             ("no-nnue", po::bool_switch(), "disable nnue eval")
+            ("analysis-cache", po::value<std::string>(), "reuse search results kept in this file")
+            ("analysis-cache-mb", po::value<int>(), "size of a new analysis cache (default 64)")
         ;
 
         po::variables_map vm;
@@ -81,6 +86,14 @@ int main(int argc, char **argv)
             e = new NNUEEvaluation();
         }
         Search s(e);
+        AnalysisCache cache;
+        if (vm.count("analysis-cache")) {
+            int size_mb = vm.count("analysis-cache-mb") ? vm["analysis-cache-mb"].as<int>() : 64;
+            if (!cache.open(vm["analysis-cache"].as<std::string>(), size_mb)) {
+                return 1;
+            }
+            s.analysis_cache = &cache;
+        }
 
         s.recapture_first_bonus = 0;
 
@@ -209,7 +222,7 @@ int main(int argc, char **argv)
                     int result_score = s.score;
                     std::cout << ((plyno / 2) + 1) << (b.get_side_to_play() == White ? ". " : "... ") << move_text;
                     if (move != suggested_move) {
-                        move_t tt_move;
+                        compact_move_t tt_move;
                         int tt_value = 0;
                         int tt_alpha = SCORE_MIN, tt_beta = SCORE_MAX;
                         if (s.read_transposition(b.get_zobrist_with_move(move), tt_move, 0, tt_alpha, tt_beta, tt_value)) {
@@ -288,7 +301,7 @@ int main(int argc, char **argv)
                 std::cout << "      ";
                 print_line(b, s, move);
 
-                move_t tt_move;
+                compact_move_t tt_move;
                 int tt_value = 0, tt_alpha = SCORE_MIN, tt_beta = SCORE_MAX;
                 std::cout << " ";
                 if (s.read_transposition(b.get_hash(), tt_move, 0, tt_alpha, tt_beta, tt_value)) {
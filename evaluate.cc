@@ -51,18 +51,99 @@ int SimpleEvaluation::compute_scores(int qct, int bct, int rct, int nct, int pct
         rfopenfile*RFOPENFILE_SCORE + qscore+QSCORE_SCORE;
 }
 
+static const uint64_t file_masks[] = {
+    0x0101010101010101,
+    0x0202020202020202,
+    0x0404040404040404,
+    0x0808080808080808,
+    0x1010101010101010,
+    0x2020202020202020,
+    0x4040404040404040,
+    0x8080808080808080
+};
+
+const uint64_t RP_MASK = 0x8181818181818181;
+
+PawnHashTable::PawnHashTable(int size_log2)
+    : hits(0), misses(0), table(1ULL << size_log2), mask((1ULL << size_log2) - 1)
+{
+    reset();
+}
+
+void PawnHashTable::reset()
+{
+    // a zeroed entry is the correct result for a board without pawns, whose key is 0
+    memset(table.data(), 0, sizeof(PawnHashEntry) * table.size());
+}
+
+const PawnHashEntry &PawnHashTable::probe(const Bitboard &b)
+{
+    uint64_t key = b.get_pawn_hash();
+    PawnHashEntry &entry = table[key & mask];
+    if (entry.key == key) {
+        hits++;
+    } else {
+        misses++;
+        compute(b, entry);
+        entry.key = key;
+    }
+    return entry;
+}
+
+void PawnHashTable::compute(const Bitboard &b, PawnHashEntry &entry) const
+{
+    uint64_t white_pawns = b.get_bitmask(White, bb_pawn);
+    uint64_t black_pawns = b.get_bitmask(Black, bb_pawn);
+
+    entry.files[White] = 0;
+    entry.files[Black] = 0;
+    entry.dblpawn = 0;
+    for (int file = 0; file < 8; file++) {
+        uint64_t white_file = white_pawns & file_masks[file];
+        uint64_t black_file = black_pawns & file_masks[file];
+        entry.white_rank[file] = 0;
+        entry.black_rank[file] = 0;
+        if (white_file) {
+            entry.white_rank[file] = (63 - __builtin_clzll(white_file)) / 8;
+            entry.files[White] |= 1 << file;
+            entry.dblpawn += count_bits(white_file) - 1;
+        }
+        if (black_file) {
+            entry.black_rank[file] = get_low_bit(black_file, 0) / 8;
+            entry.files[Black] |= 1 << file;
+            entry.dblpawn -= count_bits(black_file) - 1;
+        }
+    }
+    entry.pct = count_bits(white_pawns) - count_bits(black_pawns);
+    entry.rpct = count_bits(white_pawns & RP_MASK) - count_bits(black_pawns & RP_MASK);
+
+    const char *pawns = entry.white_rank;
+    const char *bpawns = entry.black_rank;
+    entry.isopawn = 0;
+    entry.ppawn = 0;
+    for (int i = 0; i < 8; i++) {
+        if (pawns[i] != 0 && (i == 0 || pawns[i - 1] == 0) && (i == 7 || pawns[i+1] == 0)) {
+            entry.isopawn += 1;
+        }
+        if (bpawns[i] != 0 && (i == 0 || bpawns[i-1] == 0) && (i == 7 || bpawns[i+1] == 0)) {
+            entry.isopawn -= 1;
+        }
+        if (pawns[i] != 0 && pawns[i] > bpawns[i] && (i == 0 || pawns[i] >= bpawns[i-1]) && (i == 7 || pawns[i] >= bpawns[i+1])) {
+            entry.ppawn += 1;
+        }
+        if (bpawns[i] != 0 && (pawns[i] == 0 || pawns[i] > bpawns[i]) && (i == 0 || pawns[i-1] == 0 || pawns[i-1] >= bpawns[i]) && (i == 7 || pawns[i+1] == 0 || pawns[i+1] >= bpawns[i])) {
+            entry.ppawn -= 1;
+        }
+    }
+}
+
+SimpleEvaluation::SimpleEvaluation(int pawn_hash_size_log2)
+    : pawn_table(pawn_hash_size_log2)
+{
+}
+
 void count_pieces(Fenboard &b, int file, int &black, int &white, piece_t piece, int rank_to_exclude)
 {
-    static const uint64_t file_masks[] = {
-        0x0101010101010101,
-        0x0202020202020202,
-        0x0404040404040404,
-        0x0808080808080808,
-        0x1010101010101010,
-        0x2020202020202020,
-        0x4040404040404040,
-        0x8080808080808080
-    };
     static const uint64_t rank_masks[] = {
         0x00000000000000ff,
         0x000000000000ff00,
@@ -178,126 +259,72 @@ int SimpleEvaluation::delta_evaluate(Fenboard &b, move_t move, int previous_scor
 
 int SimpleEvaluation::evaluate(const Fenboard &b) {
     // piece count scores
-    int qct = 0, bct = 0, rct = 0, nct = 0, pct = 0, rpct = 0;
-    // pawn structure scores
-    char pawns[16];
-    memset(pawns, 0, sizeof(pawns));
-    int ppawn = 0, isopawn = 0, dblpawn = 0;
+    int qct = 0, bct = 0, rct = 0, nct = 0;
     // piece position scores
     int nscore = 0, bscore = 0, kscore = 0, rhopenfile = 0, rfopenfile = 0,  qscore = 0;
 
-    for (int rank = 0; rank < 8; rank++) {
-        for (int file = 0; file < 8; file++) {
-            piece_t piece = b.get_piece(rank, file);
-            if (piece & PIECE_MASK) {
-                int accum = 1;
-                int colorindex = 0;
-                if (piece & BlackMask) {
-                    accum = -1;
-                    colorindex = 1;
-                }
-                switch (piece & PIECE_MASK) {
-                case bb_queen:
-                    qct += accum;
-                    qscore += accum * diagonal_moves(rank, file);
-                    break;
-                case bb_bishop:
-                    bct += accum;
-                    bscore += accum * diagonal_moves(rank, file);
-                    break;
-                case bb_rook:
-                    rct += accum;
-                    if (colorindex == 1 && pawns[file+8] == 0) {
-                        rhopenfile--;
-                        if (pawns[file] == 0) {
-                            rfopenfile--;
-                        }
-                    } else if (colorindex == 0) {
-                        bool whitepawn = false, blackpawn = false;
-                        for (int rr = rank + 1; rr < 7; rr++) {
-                            piece_t candpawn = b.get_piece(rr, file);
-                            if (candpawn == bb_pawn) {
-                                whitepawn = true;
-                                break;
-                            } else if (candpawn == (bb_pawn | BlackMask)) {
-                                blackpawn = true;
-                            }
-                        }
-                        if (whitepawn == false) {
-                            rhopenfile++;
-                            if (blackpawn == false) {
-                                rfopenfile++;
-                            }
-                        }
-                    }
-                    break;
-                case bb_knight:
-                    nct += accum;
-                    nscore += distance_from_center(rank, file) * accum;
-                    break;
-                case bb_king:
-                    kscore += distance_from_center(rank, file) * accum;
-                    break;
-                case bb_pawn:
-                    pct += accum;
-                    if (file == 0 || file == 7) {
-                        rpct += accum;
-                    }
-                    if (pawns[colorindex * 8 + file] != 0) {
-                        dblpawn += accum;
-                    }
-                    if (colorindex == 0 || pawns[colorindex * 8 + file] == 0) {
-                        pawns[colorindex * 8 + file] = rank;
-                    }
-                    break;
-                }
-            }
+    const PawnHashEntry &pawns = pawn_table.probe(b);
+    uint64_t white_pawns = b.get_bitmask(White, bb_pawn);
+    uint64_t black_pawns = b.get_bitmask(Black, bb_pawn);
+
+    for (Color color = White; color <= Black; color = static_cast<Color>(color + 1)) {
+        int accum = color == White ? 1 : -1;
+        int pos = 0;
+
+        qct += accum * count_bits(b.get_bitmask(color, bb_queen));
+        while ((pos = get_low_bit(b.get_bitmask(color, bb_queen), pos)) > -1) {
+            qscore += accum * diagonal_moves(pos / 8, pos % 8);
+            pos++;
         }
-    }
-    for (int i = 0; i < 8; i++) {
-        if (pawns[i] != 0 && (i == 0 || pawns[i - 1] == 0) && (i == 7 || pawns[i+1] == 0)) {
-            isopawn += 1;
+        bct += accum * count_bits(b.get_bitmask(color, bb_bishop));
+        pos = 0;
+        while ((pos = get_low_bit(b.get_bitmask(color, bb_bishop), pos)) > -1) {
+            bscore += accum * diagonal_moves(pos / 8, pos % 8);
+            pos++;
         }
-        if (pawns[i+8] != 0 && (i == 0 || pawns[i+7] == 0) && (i == 7 || pawns[i+9] == 0)) {
-            isopawn -= 1;
+        nct += accum * count_bits(b.get_bitmask(color, bb_knight));
+        pos = 0;
+        while ((pos = get_low_bit(b.get_bitmask(color, bb_knight), pos)) > -1) {
+            nscore += accum * distance_from_center(pos / 8, pos % 8);
+            pos++;
         }
-        if (pawns[i] != 0 && pawns[i] > pawns[i+8] && (i == 0 || pawns[i] >= pawns[i+7]) && (i == 7 || pawns[i] >= pawns[i+9])) {
-            ppawn += 1;
+        pos = 0;
+        while ((pos = get_low_bit(b.get_bitmask(color, bb_king), pos)) > -1) {
+            kscore += accum * distance_from_center(pos / 8, pos % 8);
+            pos++;
         }
-        if (pawns[i+8] != 0 && (pawns[i] == 0 || pawns[i] > pawns[i+8]) && (i == 0 || pawns[i-1] == 0 || pawns[i-1] >= pawns[i+8]) && (i == 7 || pawns[i+1] == 0 || pawns[i+1] >= pawns[i+8])) {
-            ppawn -= 1;
+        rct += accum * count_bits(b.get_bitmask(color, bb_rook));
+        pos = 0;
+        while ((pos = get_low_bit(b.get_bitmask(color, bb_rook), pos)) > -1) {
+            // only pawns in front of the rook close its file
+            uint64_t ahead = file_masks[pos % 8];
+            if (color == White) {
+                ahead &= ~((2ULL << pos) - 1);
+            } else {
+                ahead &= (1ULL << pos) - 1;
+            }
+            uint64_t own_pawns = color == White ? white_pawns : black_pawns;
+            if ((own_pawns & ahead) == 0) {
+                rhopenfile += accum;
+                if (((white_pawns | black_pawns) & ahead) == 0) {
+                    rfopenfile += accum;
+                }
+            }
+            pos++;
         }
     }
-    return compute_scores(qct, bct, rct, nct, pct, rpct, ppawn, isopawn, dblpawn, nscore, bscore, kscore, rhopenfile, rfopenfile, qscore);
+    return compute_scores(qct, bct, rct, nct, pawns.pct, pawns.rpct, pawns.ppawn, pawns.isopawn, pawns.dblpawn,
+            nscore, bscore, kscore, rhopenfile, rfopenfile, qscore);
 }
 
 void SimpleBitboardEvaluation::get_features(const Fenboard &b, int *features) {
     int piece_counts[bb_king+1];
     int piece_scores[bb_king+1];
-    int white_pawns[8];
-    int black_pawns[8];
-    memset(white_pawns, 0, sizeof(white_pawns));
-    memset(black_pawns, 0, sizeof(black_pawns));
-
-    int isopawn = 0;
-    int ppawn = 0;
-    int dblpawn = 0;
+
     int rhopenfile = 0;
     int rfopenfile = 0;
 
-    piece_counts[bb_pawn] = count_bits(b.piece_bitmasks[bb_pawn]) - count_bits(b.piece_bitmasks[bb_pawn + bb_king + 1]);
-
-    int white_pawn_files = 0;
-    uint64_t white_pawns_bitset = b.piece_bitmasks[bb_pawn];
-    for (int rank = 2; rank <= 6; rank++) {
-        white_pawn_files |= (white_pawns_bitset >> (rank * 8));
-    }
-    uint64_t black_pawns_bitset = b.get_bitmask(Black, bb_pawn);
-    int black_pawn_files = 0;
-    for (int rank = 2; rank <= 6; rank++) {
-        black_pawn_files |= (black_pawns_bitset >> (rank * 8));
-    }
-    dblpawn += count_bits(white_pawn_files) - count_bits(black_pawn_files) - piece_counts[bb_pawn];
+    const PawnHashEntry &pawns = pawn_table.probe(b);
 
     for (int i = bb_knight; i <= bb_king; i++) {
         piece_counts[i] = count_bits(b.piece_bitmasks[i]) - count_bits(b.piece_bitmasks[i + bb_king + 1]);
@@ -318,9 +345,9 @@ void SimpleBitboardEvaluation::get_features(const Fenboard &b, int *features) {
 */
     int start_pos = 0;
     while ((start_pos = get_low_bit(b.piece_bitmasks[bb_rook], start_pos)) > -1) {
-        if (white_pawns[start_pos%8] == 0) {
+        if ((pawns.files[White] & (1 << (start_pos % 8))) == 0) {
             rhopenfile++;
-            if (black_pawns[start_pos%8] == 0) {
+            if ((pawns.files[Black] & (1 << (start_pos % 8))) == 0) {
                 rfopenfile++;
             }
         }
@@ -328,43 +355,24 @@ void SimpleBitboardEvaluation::get_features(const Fenboard &b, int *features) {
     }
     start_pos = 0;
     while ((start_pos = get_low_bit(b.piece_bitmasks[bb_rook + bb_king + 1], start_pos)) > -1) {
-        if (black_pawns[start_pos%8] == 0) {
+        if ((pawns.files[Black] & (1 << (start_pos % 8))) == 0) {
             rhopenfile--;
-            if (white_pawns[start_pos%8] == 0) {
+            if ((pawns.files[White] & (1 << (start_pos % 8))) == 0) {
                 rfopenfile--;
             }
         }
         start_pos ++;
     }
 
-
-    for (int i = 0; i < 8; i++) {
-        if (white_pawns[i] > 0 && (i == 0 || white_pawns[i-1] == 0) && (i == 7 || white_pawns[i+1] == 0)) {
-            isopawn++;
-        }
-        if (white_pawns[i] > black_pawns[i] && (i == 0 || white_pawns[i] > black_pawns[i-1]) && (i == 7 || white_pawns[i] > black_pawns[i+1])) {
-            ppawn++;
-        }
-
-        if (black_pawns[i] > 0 && (i == 0 || black_pawns[i-1] == 0) && (i == 7 || black_pawns[i+1] == 0)) {
-            isopawn--;
-        }
-        if (black_pawns[i] > 0 && black_pawns[i] < white_pawns[i] && (i == 0 || white_pawns[i-1] > black_pawns[i]) && (i == 7 || white_pawns[i+1] > black_pawns[i])) {
-            ppawn++;
-        }
-    }
-
-    const uint64_t RP_MASK = 0x8181818181818181;
-    int rpct = count_bits(b.piece_bitmasks[bb_pawn] & RP_MASK) - count_bits(b.piece_bitmasks[bb_pawn + bb_king + 1] & RP_MASK);
     features[0] = piece_counts[bb_queen];
     features[1] = piece_counts[bb_rook];
     features[2] = piece_counts[bb_bishop];
     features[3] = piece_counts[bb_knight];
-    features[4] = piece_counts[bb_pawn];
-    features[5] = rpct;
-    features[6] = ppawn;
-    features[7] = isopawn;
-    features[8] = dblpawn;
+    features[4] = pawns.pct;
+    features[5] = pawns.rpct;
+    features[6] = pawns.ppawn;
+    features[7] = pawns.isopawn;
+    features[8] = pawns.dblpawn;
     features[9] = piece_scores[bb_knight];
     features[10] = piece_scores[bb_bishop];
     features[11] = piece_scores[bb_king];
@@ -3,9 +3,42 @@
 
 #include "search.hh"
 #include "fenboard.hh"
+#include <vector>
+
+// pawn-structure terms, which only change when a pawn moves or is captured
+struct PawnHashEntry {
+    uint64_t key;
+    // most advanced pawn per file, 0 if none
+    char white_rank[8];
+    char black_rank[8];
+    // bit n set if the side has a pawn on file n
+    unsigned char files[2];
+    short pct;
+    short rpct;
+    short ppawn;
+    short isopawn;
+    short dblpawn;
+};
+
+class PawnHashTable {
+public:
+    PawnHashTable(int size_log2);
+    const PawnHashEntry &probe(const Bitboard &b);
+    void reset();
+
+    uint64_t hits;
+    uint64_t misses;
+
+private:
+    void compute(const Bitboard &b, PawnHashEntry &entry) const;
+
+    std::vector<PawnHashEntry> table;
+    uint64_t mask;
+};
 
 class SimpleEvaluation : public Evaluation {
 public:
+    SimpleEvaluation(int pawn_hash_size_log2=12);
     // returns positive score for white winning
     virtual int evaluate(const Fenboard &b);
     virtual int delta_evaluate(Fenboard &b, move_t move, int previous_score);
@@ -15,6 +48,8 @@ public:
 protected:
     int compute_scores(int qct, int bct, int rct, int nct, int pct, int rpct, int ppawn,
         int isopawn, int dblpawn, int nscore, int bscore, int kscore, int rhopenfile, int rfopenfile, int qscore) const;
+
+    PawnHashTable pawn_table;
 private:
     int delta_evaluate_piece(Fenboard &b, piece_t piece, int rank, int file) const;
 };
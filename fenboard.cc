@@ -137,8 +137,7 @@ void Fenboard::set_fen(const std::string &fen)
                 break;
         }
     }
-    seen_positions.clear();
-    seen_positions[get_hash()] = 1;
+    clear_history();
 
     this->in_check = this->king_in_check(get_side_to_play());
 }
@@ -261,6 +260,21 @@ move_t Fenboard::read_move(const std::string &s, Color color) const
             }
         }
     } else {
+        if (destrank != INVALID && destfile != INVALID && color == get_side_to_play()) {
+            // usually the destination and disambiguation pin down the source
+            uint64_t source_squares = ~0ULL;
+            if (srcrank != INVALID) {
+                source_squares &= 0xffULL << (8 * srcrank);
+            }
+            if (srcfile != INVALID) {
+                source_squares &= 0x0101010101010101ULL << srcfile;
+            }
+            move_t move = find_move_to(color, piece & PIECE_MASK, make_board_pos(destrank, destfile), source_squares, promotion);
+            if (move != 0) {
+                return move;
+            }
+        }
+        // ambiguous or unusual moves are matched against the generated legal moves
         MoveSorter ms;
         std::vector<move_t> line;
         ms.reset(this, NULL, line);
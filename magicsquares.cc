@@ -1,108 +1,281 @@
-#include <map>
+#include <algorithm>
+#include <atomic>
+#include <random>
 #include <stdio.h>
 #include <stdlib.h>
-#include <strings.h>
+#include <string.h>
+#include <thread>
 #include <vector>
 #include "bitboard.hh"
 
+// Searches for "fancy" magic factors: one per square and slider, mapping
+// every occupancy of the square's blockboard to an index of popcount
+// (blockboard) bits, or one bit fewer where occupancies with the same attacks
+// can be made to collide. The per-square tables are then packed into a
+// single array, letting a table overlap earlier ones wherever the entries
+// agree or are unused. Prints the constants for bitboard.cc, which builds
+// the packed table from them at compile time.
 
-void find_magic(int iterations, int start_pos, uint64_t &factor, uint64_t &addend, bool is_diag) {
+struct SquareMagics {
+    int start_pos;
+    bool is_diag;
     uint64_t block_board;
+    int nbits;
+    std::vector<uint64_t> projections;
+    std::vector<uint64_t> resolutions;
+    // valid factors found with their index bits, tried in order when packing
+    std::vector<std::pair<uint64_t, int> > factors;
+    uint64_t factor;
+    uint32_t offset;
+    int bits;
+};
+
+// occupied squares that can block the slider; the last square of each ray
+// never changes its attacks, so it's left out
+uint64_t blocker_mask(int start_pos, bool is_diag)
+{
+    const uint64_t file_a = 0x0101010101010101ULL;
+    const uint64_t rank_1 = 0xffULL;
+    uint64_t own_rank = rank_1 << (start_pos / 8 * 8);
+    uint64_t own_file = file_a << (start_pos % 8);
+    uint64_t edges = ((rank_1 | rank_1 << 56) & ~own_rank) | ((file_a | file_a << 7) & ~own_file);
     if (is_diag) {
-        block_board = BitArrays::bishop_blockboard::data[start_pos];
-    } else {
-        block_board = BitArrays::rook_blockboard::data[start_pos];
-    }
-    int array_size_nbits = count_bits(block_board) + 1;
-
-    uint64_t data[1ULL << array_size_nbits];
-    uint64_t v, b = 0;
-    int iter;
-    bool failed = false;
-    uint64_t projections_memo[1ULL << (array_size_nbits - 1)];
-    uint64_t resolutions_memo[1ULL << (array_size_nbits - 1)];
-
-    for (int i = 0; i < (1ULL << (array_size_nbits - 1)); i++) {
-        projections_memo[i] = project_bitset(i, block_board);
-        if (is_diag) {
-            resolutions_memo[i] = bishop_slide_moves(start_pos, projections_memo[i]);
-        } else {
-            resolutions_memo[i] = rook_slide_moves(start_pos, projections_memo[i]);
-        }
+        return bishop_slide_moves(start_pos, 0) & ~edges;
     }
+    return rook_slide_moves(start_pos, 0) & ~edges;
+}
 
-    for (iter = 0; iter < iterations; iter++) {
-        v = (static_cast<uint64_t>(random()) << 32) | random();
-        v |= 1;
-        failed = false;
+void prepare(SquareMagics &square)
+{
+    square.block_board = blocker_mask(square.start_pos, square.is_diag);
+    square.nbits = count_bits(square.block_board);
+    for (uint64_t i = 0; i < (1ULL << square.nbits); i++) {
+        uint64_t projection = project_bitset(i, square.block_board);
+        square.projections.push_back(projection);
+        square.resolutions.push_back(square.is_diag ? bishop_slide_moves(square.start_pos, projection) : rook_slide_moves(square.start_pos, projection));
+    }
+}
 
-        memset(data, 0, sizeof(data));
-        for (int i = 0; i < (1ULL << (array_size_nbits - 1)); i++) {
-            uint64_t projection = projections_memo[i];
-            uint64_t hash_index = (projection * v + b)  >> (64 - array_size_nbits);
-            uint64_t resolved = resolutions_memo[i];
-            if (data[hash_index] != 0 && data[hash_index] != resolved) {
+// the table a factor produces, 0 where no occupancy lands; attacks are never empty
+bool fill_table(const SquareMagics &square, uint64_t factor, int bits, std::vector<uint64_t> &table)
+{
+    table.assign(1ULL << bits, 0);
+    for (size_t i = 0; i < square.projections.size(); i++) {
+        uint64_t hash_index = (square.projections[i] * factor) >> (64 - bits);
+        if (table[hash_index] != 0 && table[hash_index] != square.resolutions[i]) {
+            return false;
+        }
+        table[hash_index] = square.resolutions[i];
+    }
+    return true;
+}
 
-                failed = true;
+void find_magics(SquareMagics &square, int bits, int candidates, int iterations, std::mt19937_64 &random)
+{
+    std::vector<uint64_t> table;
+    int found = 0;
+    for (int iter = 0; iter < iterations && found < candidates; iter++) {
+        // sparse factors are far more likely to work
+        uint64_t v = random() & random() & random();
+        if (count_bits((square.block_board * v) >> 56) < 6) {
+            continue;
+        }
+        if (fill_table(square, v, bits, table) && std::find(square.factors.begin(), square.factors.end(), std::make_pair(v, bits)) == square.factors.end()) {
+            square.factors.push_back(std::make_pair(v, bits));
+            found++;
+        }
+    }
+}
+
+// lowest offset where the table fits alongside what's already placed
+uint32_t find_offset(const std::vector<uint64_t> &packed, const std::vector<uint64_t> &table)
+{
+    std::vector<uint32_t> used;
+    for (size_t i = 0; i < table.size(); i++) {
+        if (table[i] != 0) {
+            used.push_back(i);
+        }
+    }
+    for (uint32_t offset = 0; ; offset++) {
+        bool fits = true;
+        for (auto iter = used.begin(); iter != used.end(); iter++) {
+            uint32_t slot = offset + *iter;
+            if (slot >= packed.size()) {
+                break;
+            }
+            if (packed[slot] != 0 && packed[slot] != table[*iter]) {
+                fits = false;
                 break;
             }
-            data[hash_index] = resolved;
-        }
-        if (!failed) {
-            printf("Found v=%llx; b=%llx after %d iter\n", v, b, iter);
-            factor = v;
-            addend = b;
-            break;
         }
-        if (iter % 100000 == 0) {
-            printf(".");
+        if (fits) {
+            return offset;
         }
     }
-    if (failed) {
-        printf("Failed after %d iter\n", iter);
-        factor = 0;
-        addend = 0;
+}
+
+void place(std::vector<uint64_t> &packed, const std::vector<uint64_t> &table, uint32_t offset)
+{
+    if (packed.size() < offset + table.size()) {
+        packed.resize(offset + table.size(), 0);
+    }
+    for (size_t i = 0; i < table.size(); i++) {
+        if (table[i] != 0) {
+            packed[offset + i] = table[i];
+        }
     }
 }
 
-int main(int argc, char **argv) {
-    setbuf(stdout, NULL);
-
-    int iterations = 10*1000*1000;
-    if (argc > 1) {
-        iterations = atoi(argv[1]);
-    }
-    uint64_t lat_addends[64];
-    uint64_t lat_factors[64];
-    uint64_t diag_addends[64];
-    uint64_t diag_factors[64];
-    for (int i = 0; i < 64; i++) {
-        find_magic(iterations, i, lat_factors[i], lat_addends[i], false);
-        printf(".");
-        find_magic(iterations, i, diag_factors[i], diag_addends[i], true);
-        printf(".");
+// packs the largest tables first, trying each square's factors on worker
+// threads and keeping whichever ends soonest
+size_t pack(std::vector<SquareMagics> &squares, int threads)
+{
+    std::vector<SquareMagics *> order;
+    for (auto iter = squares.begin(); iter != squares.end(); iter++) {
+        order.push_back(&*iter);
     }
-    printf("\n");
+    std::stable_sort(order.begin(), order.end(), [](const SquareMagics *a, const SquareMagics *b) {
+        return a->nbits > b->nbits;
+    });
 
-    printf("constexpr uint64_t lateral_slide_magic_factor[] = {\n");
-    for (int i = 0; i < 8; i++) {
-        printf("    ");
-        for (int j = 0; j < 8; j++) {
-            printf("0x%llx, ", lat_factors[i * 8 + j]);
+    std::vector<uint64_t> packed;
+    for (auto square = order.begin(); square != order.end(); square++) {
+        size_t num_factors = (*square)->factors.size();
+        std::vector<uint32_t> offsets(num_factors);
+        std::vector<size_t> ends(num_factors);
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads; t++) {
+            workers.emplace_back([&, t]() {
+                std::vector<uint64_t> table;
+                for (size_t i = t; i < num_factors; i += threads) {
+                    fill_table(**square, (*square)->factors[i].first, (*square)->factors[i].second, table);
+                    offsets[i] = find_offset(packed, table);
+                    ends[i] = std::max(packed.size(), offsets[i] + table.size());
+                }
+            });
         }
-        printf("\n");
+        for (auto iter = workers.begin(); iter != workers.end(); iter++) {
+            iter->join();
+        }
+        size_t best = 0;
+        for (size_t i = 1; i < num_factors; i++) {
+            if (ends[i] < ends[best] || (ends[i] == ends[best] && offsets[i] < offsets[best])) {
+                best = i;
+            }
+        }
+        std::vector<uint64_t> table;
+        (*square)->factor = (*square)->factors[best].first;
+        (*square)->bits = (*square)->factors[best].second;
+        (*square)->offset = offsets[best];
+        fill_table(**square, (*square)->factor, (*square)->bits, table);
+        place(packed, table, offsets[best]);
+        fprintf(stderr, ".");
     }
-    printf("};\n");
-    printf("\n");
-    printf("constexpr uint64_t diag_slide_magic_factor[] = {\n");
-    for (int i = 0; i < 8; i++) {
-        printf("    ");
-        for (int j = 0; j < 8; j++) {
-            printf("0x%llx, ", diag_factors[i * 8 + j]);
+    fprintf(stderr, "\n");
+    return packed.size();
+}
+
+enum { print_factor, print_offset, print_bits };
+
+void print_array(const char *type, const char *name, const std::vector<SquareMagics> &squares, bool is_diag, int field)
+{
+    printf("constexpr %s %s[] = {\n", type, name);
+    for (int rank = 0; rank < 8; rank++) {
+        printf("   ");
+        for (int file = 0; file < 8; file++) {
+            const SquareMagics &square = squares[(rank * 8 + file) * 2 + is_diag];
+            if (field == print_offset) {
+                printf(" %u,", square.offset);
+            } else if (field == print_bits) {
+                printf(" %d,", square.bits);
+            } else {
+                printf(" 0x%llx,", (unsigned long long)square.factor);
+            }
         }
         printf("\n");
     }
     printf("};\n");
+}
+
+int main(int argc, char **argv) {
+    int iterations = 100 * 1000 * 1000;
+    int reduced_iterations = 1000 * 1000;
+    int candidates = 8;
+    int threads = std::max(1u, std::thread::hardware_concurrency());
+    uint64_t seed = 1;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--iterations" && i + 1 < argc) {
+            iterations = atoi(argv[++i]);
+        } else if (arg == "--reduced-iterations" && i + 1 < argc) {
+            reduced_iterations = atoi(argv[++i]);
+        } else if (arg == "--candidates" && i + 1 < argc) {
+            candidates = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--threads" && i + 1 < argc) {
+            threads = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--seed" && i + 1 < argc) {
+            seed = strtoull(argv[++i], nullptr, 10);
+        } else {
+            fprintf(stderr, "Usage: %s [--iterations n] [--reduced-iterations n] [--candidates n] [--threads n] [--seed n]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    // rook and bishop for each square, interleaved
+    std::vector<SquareMagics> squares(128);
+    for (int i = 0; i < 128; i++) {
+        squares[i].start_pos = i / 2;
+        squares[i].is_diag = i % 2 == 1;
+        prepare(squares[i]);
+    }
 
+    std::atomic<int> next(0);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&]() {
+            for (int i = next++; i < 128; i = next++) {
+                // seeded per square so the output doesn't depend on the thread count
+                std::mt19937_64 random(seed * 128 + i);
+                find_magics(squares[i], squares[i].nbits - 1, candidates, reduced_iterations, random);
+                find_magics(squares[i], squares[i].nbits, candidates, iterations, random);
+                fprintf(stderr, ".");
+            }
+        });
+    }
+    for (auto iter = workers.begin(); iter != workers.end(); iter++) {
+        iter->join();
+    }
+    fprintf(stderr, "\n");
+    for (auto iter = squares.begin(); iter != squares.end(); iter++) {
+        if (iter->factors.empty()) {
+            fprintf(stderr, "No magic for %s on %c%c after %d iterations\n", iter->is_diag ? "bishop" : "rook", 'a' + iter->start_pos % 8, '1' + iter->start_pos / 8, iterations);
+            return 1;
+        }
+    }
+
+    size_t unpacked = 0;
+    for (auto iter = squares.begin(); iter != squares.end(); iter++) {
+        unpacked += 1ULL << iter->nbits;
+    }
+    size_t size = pack(squares, threads);
+    int reduced = 0;
+    for (auto iter = squares.begin(); iter != squares.end(); iter++) {
+        reduced += iter->bits < iter->nbits;
+    }
+    fprintf(stderr, "%zu attack entries (%zu without sharing), %d squares with a bit less\n", size, unpacked, reduced);
+
+    printf("// generated by magicsquares --reduced-iterations %d --candidates %d --seed %llu\n", reduced_iterations, candidates, (unsigned long long)seed);
+    printf("constexpr size_t SLIDE_ATTACK_TABLE_SIZE = %zu;\n\n", size);
+    print_array("uint64_t", "lateral_slide_magic_factor", squares, false, print_factor);
+    printf("\n");
+    print_array("uint32_t", "lateral_slide_magic_offset", squares, false, print_offset);
+    printf("\n");
+    print_array("uint8_t", "lateral_slide_magic_bits", squares, false, print_bits);
+    printf("\n");
+    print_array("uint64_t", "diag_slide_magic_factor", squares, true, print_factor);
+    printf("\n");
+    print_array("uint32_t", "diag_slide_magic_offset", squares, true, print_offset);
+    printf("\n");
+    print_array("uint8_t", "diag_slide_magic_bits", squares, true, print_bits);
     return 0;
 }
@@ -0,0 +1,398 @@
+#include <boost/program_options.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <random>
+#include <set>
+#include <thread>
+#include <unordered_map>
+#include "book.hh"
+#include "fenboard.hh"
+#include "pgn.hh"
+
+namespace po = boost::program_options;
+
+// builds a Polyglot repertoire book for one player from their games, scoring
+// their moves against how the whole population of games continued
+
+const int NUM_SHARDS = 64;
+
+struct BookNode {
+    uint64_t polyglot;
+    uint32_t white_wins;
+    uint32_t draws;
+    uint32_t black_wins;
+    // polyglot encoded move and the zobrist hash it leads to
+    std::vector<std::pair<uint16_t, uint64_t> > moves;
+
+    uint32_t games() const { return white_wins + draws + black_wins; }
+    void add_result(int result) {
+        switch (result) {
+            case RESULT_WHITE: white_wins++; break;
+            case RESULT_DRAW: draws++; break;
+            case RESULT_BLACK: black_wins++; break;
+        }
+    }
+};
+
+struct GameStats {
+    uint32_t white_wins;
+    uint32_t draws;
+    uint32_t black_wins;
+    uint16_t move;
+};
+
+// positions keyed by zobrist hash, split into independently locked shards so
+// workers replaying different games rarely contend
+class PositionTable {
+public:
+    void add_result(uint64_t hash, uint64_t polyglot, int result) {
+        Shard &shard = shards[hash % NUM_SHARDS];
+        std::lock_guard<std::mutex> guard(shard.lock);
+        BookNode &node = get_node(shard, hash, polyglot);
+        node.add_result(result);
+    }
+
+    void add_move(uint64_t hash, uint64_t polyglot, uint16_t move, uint64_t dest_hash, uint64_t dest_polyglot, int result) {
+        add_result(dest_hash, dest_polyglot, result);
+        Shard &shard = shards[hash % NUM_SHARDS];
+        std::lock_guard<std::mutex> guard(shard.lock);
+        BookNode &node = get_node(shard, hash, polyglot);
+        for (auto iter = node.moves.begin(); iter != node.moves.end(); iter++) {
+            if (iter->first == move) {
+                return;
+            }
+        }
+        node.moves.emplace_back(move, dest_hash);
+    }
+
+    // only once all workers are done
+    const BookNode *find(uint64_t hash) const {
+        const Shard &shard = shards[hash % NUM_SHARDS];
+        auto iter = shard.nodes.find(hash);
+        return iter == shard.nodes.end() ? nullptr : &iter->second;
+    }
+
+    // insertion order depends on thread timing, so make move order deterministic
+    void sort_moves() {
+        for (int i = 0; i < NUM_SHARDS; i++) {
+            for (auto iter = shards[i].nodes.begin(); iter != shards[i].nodes.end(); iter++) {
+                std::sort(iter->second.moves.begin(), iter->second.moves.end());
+            }
+        }
+    }
+
+    size_t size() const {
+        size_t total = 0;
+        for (int i = 0; i < NUM_SHARDS; i++) {
+            total += shards[i].nodes.size();
+        }
+        return total;
+    }
+
+private:
+    struct Shard {
+        std::mutex lock;
+        std::unordered_map<uint64_t, BookNode> nodes;
+    };
+
+    BookNode &get_node(Shard &shard, uint64_t hash, uint64_t polyglot) {
+        auto inserted = shard.nodes.try_emplace(hash);
+        if (inserted.second) {
+            inserted.first->second = { polyglot, 0, 0, 0, {} };
+        }
+        return inserted.first->second;
+    }
+
+    Shard shards[NUM_SHARDS];
+};
+
+class BookBuilder {
+public:
+    BookBuilder(const std::string &player, int max_ply) : player(player), max_ply(max_ply), games(0) {}
+
+    // workers take turns reading games from the shared stream and replay them in parallel
+    void build(pgn_input_stream *input, int jobs) {
+        std::mutex input_lock;
+        std::vector<std::thread> workers;
+        for (int i = 0; i < jobs; i++) {
+            workers.emplace_back([this, input, &input_lock]() {
+                Fenboard b;
+                while (true) {
+                    std::map<std::string, std::string> metadata;
+                    std::vector<std::pair<move_annot, move_annot> > movelist;
+                    {
+                        std::lock_guard<std::mutex> guard(input_lock);
+                        if (!input->is_readable()) {
+                            break;
+                        }
+                        read_pgn(input, metadata, movelist);
+                    }
+                    if (!movelist.empty()) {
+                        add_game(b, metadata, movelist);
+                    }
+                }
+            });
+        }
+        for (auto iter = workers.begin(); iter != workers.end(); iter++) {
+            iter->join();
+        }
+        population.sort_moves();
+        repertoire.sort_moves();
+    }
+
+    void add_game(Fenboard &b, std::map<std::string, std::string> &metadata, const std::vector<std::pair<move_annot, move_annot> > &movelist) {
+        int result = parse_game_result(metadata["Result"]);
+        bool am_white = metadata["White"] == player;
+        bool am_black = metadata["Black"] == player;
+        if (metadata.count("FEN")) {
+            b.set_fen(metadata["FEN"]);
+        } else {
+            b.set_starting_position();
+        }
+        uint64_t hash = b.get_hash();
+        uint64_t polyglot = polyglot_key(b);
+        population.add_result(hash, polyglot, result);
+        if (am_white) {
+            repertoire.add_result(hash, polyglot, result);
+        }
+
+        int ply = 1;
+        for (auto iter = movelist.begin(); iter != movelist.end() && ply < max_ply; iter++) {
+            for (const move_annot *annot : { &iter->first, &iter->second }) {
+                if (annot->move.length() <= 1 || ply >= max_ply) {
+                    break;
+                }
+                Color color = b.get_side_to_play();
+                move_t move = b.read_move(annot->move, color);
+                b.apply_move(move);
+                uint64_t dest_hash = b.get_hash();
+                uint64_t dest_polyglot = polyglot_key(b);
+                uint16_t book_move = move_to_polyglot(move);
+                population.add_move(hash, polyglot, book_move, dest_hash, dest_polyglot, result);
+                if ((am_white && color == White) || (am_black && color == Black)) {
+                    repertoire.add_move(hash, polyglot, book_move, dest_hash, dest_polyglot, result);
+                }
+                hash = dest_hash;
+                polyglot = dest_polyglot;
+                ply++;
+            }
+        }
+        games++;
+    }
+
+    // Walks the tree from a position. On the player's moves it picks among
+    // continuations played often enough, scored by result with a UCB-style
+    // confidence term, and emits all of them weighted by score. On the
+    // opponent's moves it sums over everything the population played.
+    GameStats tree_search(uint64_t hash, bool white_to_move, bool as_white, int max_depth) {
+        const BookNode *node = white_to_move == as_white ? repertoire.find(hash) : population.find(hash);
+        if (node == nullptr) {
+            return { 0, 0, 0, 0 };
+        }
+        if (node->moves.empty() || max_depth < 0) {
+            return { node->white_wins, node->draws, node->black_wins, 0 };
+        }
+        if (node->moves.size() == 1 || node->games() <= 1) {
+            return { node->white_wins, node->draws, node->black_wins, node->moves[0].first };
+        }
+
+        if (white_to_move == as_white) {
+            struct Choice {
+                uint16_t move;
+                const BookNode *dest;
+                double score;
+            };
+            std::vector<Choice> choices;
+            uint32_t total_games = node->games();
+            for (auto iter = node->moves.begin(); iter != node->moves.end(); iter++) {
+                GameStats stats = tree_search(iter->second, !white_to_move, as_white, max_depth - 1);
+                uint32_t num_games = stats.white_wins + stats.draws + stats.black_wins;
+                // remove options with less than 5% of moves or only one instance
+                if (num_games * 20 < total_games || num_games <= 1) {
+                    continue;
+                }
+                double raw_score = ((double)stats.white_wins - stats.black_wins) / num_games;
+                double bound = std::sqrt(std::log(total_games) / num_games);
+                double score = std::log(num_games + 1) * (as_white ? 1 + raw_score / bound : 1 - raw_score / bound);
+                choices.push_back({ iter->first, repertoire.find(iter->second), score });
+            }
+
+            const BookNode *best_dest = nullptr;
+            uint16_t best_move = 0;
+            if (choices.empty()) {
+                // too sparse to score, fall back on the most successful move for white
+                int64_t best_score = INT64_MIN;
+                for (auto iter = node->moves.begin(); iter != node->moves.end(); iter++) {
+                    const BookNode *dest = repertoire.find(iter->second);
+                    int64_t score = (int64_t)dest->white_wins - dest->black_wins;
+                    if (score > best_score) {
+                        best_score = score;
+                        best_move = iter->first;
+                        best_dest = dest;
+                    }
+                }
+            } else {
+                double total_score = 0;
+                for (auto iter = choices.begin(); iter != choices.end(); iter++) {
+                    total_score += iter->score;
+                }
+                size_t chosen;
+                if (choices.size() == 1 || total_score <= 0) {
+                    chosen = std::uniform_int_distribution<size_t>(0, choices.size() - 1)(random);
+                    for (auto iter = choices.begin(); iter != choices.end(); iter++) {
+                        emit(node->polyglot, iter->move, 1);
+                    }
+                } else {
+                    std::vector<double> weights;
+                    for (auto iter = choices.begin(); iter != choices.end(); iter++) {
+                        weights.push_back(std::max(0.0, iter->score));
+                        emit(node->polyglot, iter->move, iter->score);
+                    }
+                    chosen = std::discrete_distribution<size_t>(weights.begin(), weights.end())(random);
+                }
+                best_move = choices[chosen].move;
+                best_dest = choices[chosen].dest;
+            }
+            return { best_dest->white_wins, best_dest->draws, best_dest->black_wins, best_move };
+        } else {
+            // assume opponent moves according to distribution in pgn
+            GameStats total = { 0, 0, 0, 0 };
+            uint32_t mode_games = 0;
+            for (auto iter = node->moves.begin(); iter != node->moves.end(); iter++) {
+                GameStats stats = tree_search(iter->second, !white_to_move, as_white, max_depth - 1);
+                total.white_wins += stats.white_wins;
+                total.draws += stats.draws;
+                total.black_wins += stats.black_wins;
+                uint32_t num_games = stats.white_wins + stats.draws + stats.black_wins;
+                if (num_games > mode_games) {
+                    mode_games = num_games;
+                    total.move = iter->first;
+                }
+            }
+            return total;
+        }
+    }
+
+    void emit(uint64_t polyglot, uint16_t move, double weight) {
+        if (weight <= 0 || !emitted.insert(std::make_pair(polyglot, move)).second) {
+            return;
+        }
+        PolyglotEntry entry = { polyglot, move, (uint16_t)std::min(65535.0, weight * WEIGHT_MULTIPLIER), 0 };
+        entries.push_back(entry);
+    }
+
+    // white repertoire from the start, black repertoire against every first move
+    void write_repertoire(uint64_t root, int max_depth) {
+        tree_search(root, true, true, max_depth);
+        const BookNode *node = population.find(root);
+        if (node != nullptr) {
+            for (auto iter = node->moves.begin(); iter != node->moves.end(); iter++) {
+                tree_search(iter->second, false, false, max_depth);
+            }
+        }
+    }
+
+    const double WEIGHT_MULTIPLIER = 100;
+
+    std::string player;
+    int max_ply;
+    std::atomic<uint64_t> games;
+    PositionTable population;
+    PositionTable repertoire;
+    std::mt19937 random;
+    std::set<std::pair<uint64_t, uint16_t> > emitted;
+    std::vector<PolyglotEntry> entries;
+};
+
+int main(int argc, char **argv)
+{
+    std::string player;
+    std::string output_file;
+    std::vector<std::string> pgnfiles;
+    int jobs = std::max(1u, std::thread::hardware_concurrency());
+    int max_ply = 20;
+    int max_depth = 20;
+    unsigned seed = 0;
+
+    try {
+        po::options_description desc("Allowed options");
+        desc.add_options()
+            ("help", "produce help message")
+            ("player", po::value<std::string>(), "name of the player whose repertoire to build")
+            ("output", po::value<std::string>(), "polyglot .bin file to write")
+            ("jobs", po::value<int>(), "number of worker threads")
+            ("max-ply", po::value<int>(), "plies of each game to add (default 20)")
+            ("max-depth", po::value<int>(), "plies to search the repertoire tree (default 20)")
+            ("seed", po::value<unsigned>(), "random seed for choosing lines")
+            ("input-file", po::value<std::vector<std::string> >(), "pgn files, or - for stdin")
+        ;
+
+        po::positional_options_description p;
+        p.add("input-file", -1);
+        po::variables_map vm;
+        po::store(po::command_line_parser(argc, argv).options(desc).positional(p).run(), vm);
+        po::notify(vm);
+
+        if (vm.count("help") || !vm.count("player") || !vm.count("output")) {
+            std::cout << "Usage: " << argv[0] << " --player name --output book.bin [file.pgn ...]" << std::endl;
+            std::cout << "Reads stdin without pgn files, eg. zstdcat games.pgn.zst | " << argv[0] << " ..." << std::endl;
+            std::cout << desc << std::endl;
+            return vm.count("help") ? 0 : 1;
+        }
+        player = vm["player"].as<std::string>();
+        output_file = vm["output"].as<std::string>();
+        if (vm.count("input-file")) {
+            pgnfiles = vm["input-file"].as<std::vector<std::string>>();
+        }
+        if (vm.count("jobs")) {
+            jobs = std::max(1, vm["jobs"].as<int>());
+        }
+        if (vm.count("max-ply")) {
+            max_ply = vm["max-ply"].as<int>();
+        }
+        if (vm.count("max-depth")) {
+            max_depth = vm["max-depth"].as<int>();
+        }
+        if (vm.count("seed")) {
+            seed = vm["seed"].as<unsigned>();
+        }
+    }
+    catch(std::exception& e) {
+        std::cerr << "error: " << e.what() << "\n";
+        return 1;
+    }
+
+    if (pgnfiles.empty()) {
+        pgnfiles.push_back("-");
+    }
+    BookBuilder builder(player, max_ply);
+    builder.random.seed(seed);
+    for (auto iter = pgnfiles.begin(); iter != pgnfiles.end(); iter++) {
+        std::ifstream file;
+        if (*iter != "-") {
+            file.open(*iter);
+            if (!file) {
+                std::cerr << "Cannot load " << *iter << std::endl;
+                return 1;
+            }
+        }
+        pgn_istream input(*iter == "-" ? std::cin : file);
+        builder.build(&input, jobs);
+    }
+    std::cout << "Parsed " << builder.games << " games, " << builder.population.size() << " positions, "
+        << builder.repertoire.size() << " in " << player << "'s repertoire" << std::endl;
+
+    Fenboard b;
+    b.set_starting_position();
+    builder.write_repertoire(b.get_hash(), max_depth);
+    if (!write_polyglot_book(output_file, builder.entries)) {
+        return 1;
+    }
+    std::cout << "Wrote " << builder.entries.size() << " entries to " << output_file << std::endl;
+    return 0;
+}
@@ -0,0 +1,462 @@
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "bench.hh"
+#include "fenboard.hh"
+#include "evaluate.hh"
+#include "nnueeval.hh"
+#include "perft.hh"
+#include "pgn.hh"
+#include "search.hh"
+
+// times the engine's hot primitives over a fixed corpus of positions
+
+struct Stopwatch {
+    void start() { started = std::chrono::steady_clock::now(); }
+    void stop() { seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count(); }
+    std::chrono::steady_clock::time_point started;
+    double seconds = 0;
+};
+
+struct Corpus {
+    std::vector<Fenboard> boards;
+    std::vector<std::vector<move_t> > moves;
+    // whole games from the start position, as SAN and as UCI
+    std::vector<std::vector<std::string> > san_games;
+    std::vector<std::vector<std::string> > uci_games;
+};
+
+// a benchmark runs one round over the corpus, returning the number of operations timed
+typedef uint64_t (*bench_fn)(Corpus &corpus, Stopwatch &timer);
+
+static uint64_t sink = 0;
+
+void load_pgn(const std::string &filename, std::vector<std::string> &fens, Corpus &corpus, size_t max_positions)
+{
+    std::ifstream pgnfile(filename);
+    if (!pgnfile) {
+        std::cout << "Cannot load " << filename << std::endl;
+        return;
+    }
+    pgn_istream pgn(pgnfile);
+    size_t replayed_moves = 0;
+    while (!pgnfile.eof() && replayed_moves < max_positions) {
+        std::map<std::string, std::string> game_metadata;
+        std::vector<std::pair<move_annot, move_annot> > movelist;
+        read_pgn(&pgn, game_metadata, movelist);
+        if (movelist.empty()) {
+            continue;
+        }
+        corpus.san_games.emplace_back();
+        corpus.uci_games.emplace_back();
+        Fenboard b;
+        b.set_starting_position();
+        for (auto iter = movelist.begin(); iter != movelist.end(); iter++) {
+            for (const move_annot *annot : { &iter->first, &iter->second }) {
+                if (annot->move.length() <= 1) {
+                    break;
+                }
+                move_t move = b.read_move(annot->move, b.get_side_to_play());
+                corpus.san_games.back().push_back(annot->move);
+                corpus.uci_games.back().push_back(move_to_uci(move));
+                b.apply_move(move);
+                replayed_moves++;
+                if (fens.size() < max_positions) {
+                    fens.push_back(board_to_fen(&b));
+                }
+            }
+        }
+    }
+}
+
+void load_puzzles(const std::string &filename, std::vector<std::string> &fens, size_t max_positions)
+{
+    std::ifstream puzzles(filename);
+    if (!puzzles) {
+        std::cout << "Cannot load " << filename << std::endl;
+        return;
+    }
+    std::string line;
+    while (std::getline(puzzles, line) && fens.size() < max_positions) {
+        // PuzzleId,FEN,Moves,...
+        size_t start = line.find(',');
+        size_t stop = line.find(',', start + 1);
+        if (start == std::string::npos || stop == std::string::npos || line.rfind("PuzzleId", 0) == 0) {
+            continue;
+        }
+        fens.push_back(line.substr(start + 1, stop - start - 1));
+    }
+}
+
+uint64_t bench_packed_legal_moves(Corpus &corpus, Stopwatch &timer)
+{
+    timer.start();
+    for (auto iter = corpus.boards.begin(); iter != corpus.boards.end(); iter++) {
+        PackedMoveIterator packed;
+        uint64_t opp_covered_squares = 0;
+        // as in a new position, not from what the last round cached
+        iter->forget_king_safety();
+        iter->get_packed_legal_moves(iter->get_side_to_play(), packed, opp_covered_squares);
+        sink += packed.num_packed_moves + opp_covered_squares;
+    }
+    timer.stop();
+    return corpus.boards.size();
+}
+
+// what a quiescence node generates: the captures, expanded
+uint64_t bench_capture_moves(Corpus &corpus, Stopwatch &timer)
+{
+    MoveList moves;
+    uint64_t ops = 0;
+    timer.start();
+    for (auto iter = corpus.boards.begin(); iter != corpus.boards.end(); iter++) {
+        PackedMoveIterator packed;
+        uint64_t opp_covered_squares = 0;
+        Color side_to_play = iter->get_side_to_play();
+        iter->forget_king_safety();
+        iter->get_packed_legal_moves(side_to_play, packed, opp_covered_squares, -1, bb_all, iter->is_in_check() ? GEN_EVASIONS : GEN_CAPTURES);
+        moves.clear();
+        iter->get_moves(side_to_play, true, true, packed, moves);
+        iter->get_moves(side_to_play, false, true, packed, moves);
+        ops++;
+        sink += moves.size();
+    }
+    timer.stop();
+    return ops;
+}
+
+uint64_t bench_get_moves(Corpus &corpus, Stopwatch &timer)
+{
+    MoveList moves;
+    uint64_t ops = 0;
+    for (auto iter = corpus.boards.begin(); iter != corpus.boards.end(); iter++) {
+        PackedMoveIterator packed;
+        uint64_t opp_covered_squares = 0;
+        Color side_to_play = iter->get_side_to_play();
+        iter->get_packed_legal_moves(side_to_play, packed, opp_covered_squares);
+        timer.start();
+        moves.clear();
+        iter->get_moves(side_to_play, true, true, packed, moves);
+        iter->get_moves(side_to_play, true, false, packed, moves);
+        iter->get_moves(side_to_play, false, true, packed, moves);
+        iter->get_moves(side_to_play, false, false, packed, moves);
+        timer.stop();
+        ops += moves.size();
+    }
+    return ops;
+}
+
+// what a node's move sorter costs when the first move cuts off, and when
+// every move is tried
+uint64_t bench_move_sorter(Corpus &corpus, Stopwatch &timer, bool all_moves)
+{
+    MoveSorter sorter;
+    std::vector<move_t> line;
+    uint64_t ops = 0;
+    timer.start();
+    for (auto iter = corpus.boards.begin(); iter != corpus.boards.end(); iter++) {
+        iter->forget_king_safety();
+        sorter.reset(&*iter, NULL, line);
+        while (sorter.has_more_moves()) {
+            sink += sorter.next_move();
+            if (!all_moves) {
+                break;
+            }
+        }
+        ops++;
+    }
+    timer.stop();
+    return ops;
+}
+
+uint64_t bench_move_sorter_first(Corpus &corpus, Stopwatch &timer)
+{
+    return bench_move_sorter(corpus, timer, false);
+}
+
+uint64_t bench_move_sorter_all(Corpus &corpus, Stopwatch &timer)
+{
+    return bench_move_sorter(corpus, timer, true);
+}
+
+uint64_t bench_apply_undo(Corpus &corpus, Stopwatch &timer)
+{
+    uint64_t ops = 0;
+    timer.start();
+    for (size_t i = 0; i < corpus.boards.size(); i++) {
+        Fenboard &b = corpus.boards[i];
+        for (auto move = corpus.moves[i].begin(); move != corpus.moves[i].end(); move++) {
+            b.apply_move(*move);
+            b.undo_move(*move);
+        }
+        ops += corpus.moves[i].size();
+    }
+    timer.stop();
+    return ops;
+}
+
+uint64_t bench_static_exchange(Corpus &corpus, Stopwatch &timer)
+{
+    uint64_t ops = 0;
+    timer.start();
+    for (size_t i = 0; i < corpus.boards.size(); i++) {
+        const Fenboard &b = corpus.boards[i];
+        for (auto move = corpus.moves[i].begin(); move != corpus.moves[i].end(); move++) {
+            if (get_captured_piece(*move) != 0) {
+                sink += b.static_exchange_eval(*move);
+                ops++;
+            }
+        }
+    }
+    timer.stop();
+    return ops;
+}
+
+uint64_t bench_see_ge(Corpus &corpus, Stopwatch &timer)
+{
+    uint64_t ops = 0;
+    timer.start();
+    for (size_t i = 0; i < corpus.boards.size(); i++) {
+        const Fenboard &b = corpus.boards[i];
+        for (auto move = corpus.moves[i].begin(); move != corpus.moves[i].end(); move++) {
+            if (get_captured_piece(*move) != 0) {
+                sink += b.see_ge(*move, 0);
+                ops++;
+            }
+        }
+    }
+    timer.stop();
+    return ops;
+}
+
+uint64_t bench_decode_move(Corpus &corpus, Stopwatch &timer)
+{
+    uint64_t ops = 0;
+    timer.start();
+    for (size_t i = 0; i < corpus.boards.size(); i++) {
+        const Fenboard &b = corpus.boards[i];
+        for (auto move = corpus.moves[i].begin(); move != corpus.moves[i].end(); move++) {
+            sink += b.decode_move(compact_move(*move));
+        }
+        ops += corpus.moves[i].size();
+    }
+    timer.stop();
+    return ops;
+}
+
+uint64_t bench_zobrist_with_move(Corpus &corpus, Stopwatch &timer)
+{
+    uint64_t ops = 0;
+    timer.start();
+    for (size_t i = 0; i < corpus.boards.size(); i++) {
+        const Fenboard &b = corpus.boards[i];
+        for (auto move = corpus.moves[i].begin(); move != corpus.moves[i].end(); move++) {
+            sink += b.get_zobrist_with_move(*move);
+        }
+        ops += corpus.moves[i].size();
+    }
+    timer.stop();
+    return ops;
+}
+
+uint64_t bench_simple_evaluate(Corpus &corpus, Stopwatch &timer)
+{
+    static SimpleEvaluation eval;
+    timer.start();
+    for (auto iter = corpus.boards.begin(); iter != corpus.boards.end(); iter++) {
+        sink += eval.evaluate(*iter);
+    }
+    timer.stop();
+    return corpus.boards.size();
+}
+
+uint64_t bench_nnue_evaluate(Corpus &corpus, Stopwatch &timer)
+{
+    static NNUEEvaluation eval(false);
+    timer.start();
+    for (auto iter = corpus.boards.begin(); iter != corpus.boards.end(); iter++) {
+        sink += eval.evaluate(*iter);
+    }
+    timer.stop();
+    return corpus.boards.size();
+}
+
+uint64_t bench_nnue_delta_evaluate(Corpus &corpus, Stopwatch &timer)
+{
+    static NNUEEvaluation eval(false);
+    uint64_t ops = 0;
+    for (size_t i = 0; i < corpus.boards.size(); i++) {
+        Fenboard &b = corpus.boards[i];
+        // loads the accumulator the deltas are taken against
+        int score = eval.evaluate(b);
+        timer.start();
+        for (auto move = corpus.moves[i].begin(); move != corpus.moves[i].end(); move++) {
+            sink += eval.delta_evaluate(b, *move, score);
+        }
+        timer.stop();
+        ops += corpus.moves[i].size();
+    }
+    return ops;
+}
+
+uint64_t bench_tt_probe(Corpus &corpus, Stopwatch &timer)
+{
+    static TranspositionTable *table = nullptr;
+    if (table == nullptr) {
+        // populate with the corpus positions; probes of their children are mostly misses
+        table = new TranspositionTable(20);
+        table->reset();
+        for (size_t i = 0; i < corpus.boards.size(); i++) {
+            move_t best = corpus.moves[i].empty() ? 0 : corpus.moves[i][0];
+            table->insert_tt_entry(corpus.boards[i].get_hash(), best, i & 0xfff, 4, TT_EXACT);
+        }
+    }
+    uint64_t ops = 0;
+    timer.start();
+    for (size_t i = 0; i < corpus.boards.size(); i++) {
+        const Fenboard &b = corpus.boards[i];
+        compact_move_t move;
+        int16_t value;
+        unsigned char depth, type;
+        sink += table->fetch_tt_entry(b.get_hash(), move, value, depth, type);
+        for (auto child = corpus.moves[i].begin(); child != corpus.moves[i].end(); child++) {
+            sink += table->fetch_tt_entry(b.get_zobrist_with_move(*child), move, value, depth, type);
+        }
+        ops += corpus.moves[i].size() + 1;
+    }
+    timer.stop();
+    return ops;
+}
+
+uint64_t replay_games(const std::vector<std::vector<std::string> > &games, Stopwatch &timer)
+{
+    uint64_t ops = 0;
+    timer.start();
+    for (auto game = games.begin(); game != games.end(); game++) {
+        Fenboard b;
+        b.set_starting_position();
+        for (auto move = game->begin(); move != game->end(); move++) {
+            b.apply_move(b.read_move(*move, b.get_side_to_play()));
+        }
+        sink += b.get_hash();
+        ops += game->size();
+    }
+    timer.stop();
+    return ops;
+}
+
+uint64_t bench_replay_san(Corpus &corpus, Stopwatch &timer)
+{
+    return replay_games(corpus.san_games, timer);
+}
+
+uint64_t bench_replay_uci(Corpus &corpus, Stopwatch &timer)
+{
+    return replay_games(corpus.uci_games, timer);
+}
+
+void run(const char *name, bench_fn fn, Corpus &corpus, int rounds)
+{
+    std::vector<double> ns_per_op;
+    uint64_t ops = 0;
+    // warm up caches and lazily built tables
+    Stopwatch warmup;
+    fn(corpus, warmup);
+    for (int round = 0; round < rounds; round++) {
+        Stopwatch timer;
+        ops = fn(corpus, timer);
+        ns_per_op.push_back(timer.seconds * 1e9 / std::max<uint64_t>(ops, 1));
+    }
+    double mean = 0, variance = 0;
+    for (auto iter = ns_per_op.begin(); iter != ns_per_op.end(); iter++) {
+        mean += *iter / rounds;
+    }
+    for (auto iter = ns_per_op.begin(); iter != ns_per_op.end(); iter++) {
+        variance += (*iter - mean) * (*iter - mean) / rounds;
+    }
+    std::cout << std::left << std::setw(28) << name << std::right
+        << std::setw(12) << ops
+        << std::setw(12) << std::fixed << std::setprecision(1) << mean
+        << std::setw(10) << std::sqrt(variance)
+        << std::setw(12) << std::setprecision(2) << (mean > 0 ? 1e3 / mean : 0)
+        << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+    std::string pgn_file = "games/Fischer.pgn";
+    std::string puzzle_file = "lichess_db_puzzle.csv.head";
+    int rounds = 10;
+    size_t max_positions = 2000;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--pgn" && i + 1 < argc) {
+            pgn_file = argv[++i];
+        } else if (arg == "--puzzles" && i + 1 < argc) {
+            puzzle_file = argv[++i];
+        } else if (arg == "--rounds" && i + 1 < argc) {
+            rounds = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--positions" && i + 1 < argc) {
+            max_positions = atoi(argv[++i]);
+        } else if (arg == "--sliders" && i + 1 < argc) {
+            std::string sliders = argv[++i];
+            if (!Bitboard::set_slider_backend(sliders == "pext" ? slider_pext : slider_magic)) {
+                std::cerr << "This cpu can't look up sliders with " << sliders << std::endl;
+                return 1;
+            }
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--pgn file.pgn] [--puzzles file.csv] [--rounds n] [--positions n] [--sliders magic|pext]" << std::endl;
+            return 1;
+        }
+    }
+
+    std::vector<std::string> fens;
+    Corpus corpus;
+    load_pgn(pgn_file, fens, corpus, max_positions);
+    load_puzzles(puzzle_file, fens, max_positions);
+    if (fens.empty()) {
+        for (int i = 0; i < num_bench_positions; i++) {
+            fens.push_back(bench_positions[i]);
+        }
+    }
+
+    uint64_t total_moves = 0;
+    for (auto iter = fens.begin(); iter != fens.end(); iter++) {
+        corpus.boards.emplace_back();
+        corpus.boards.back().set_fen(*iter);
+        corpus.moves.emplace_back();
+        get_legal_moves(corpus.boards.back(), corpus.moves.back());
+        total_moves += corpus.moves.back().size();
+    }
+    std::cout << "Corpus: " << corpus.boards.size() << " positions, " << total_moves << " legal moves, " << rounds << " rounds, "
+        << slider_backend_name(Bitboard::get_slider_backend()) << " sliders" << std::endl;
+    std::cout << std::left << std::setw(28) << "primitive" << std::right
+        << std::setw(12) << "ops/round" << std::setw(12) << "ns/op" << std::setw(10) << "stddev" << std::setw(12) << "Mops/s" << std::endl;
+
+    run("get_packed_legal_moves", bench_packed_legal_moves, corpus, rounds);
+    run("get_moves (per move)", bench_get_moves, corpus, rounds);
+    run("captures (per position)", bench_capture_moves, corpus, rounds);
+    run("MoveSorter first move", bench_move_sorter_first, corpus, rounds);
+    run("MoveSorter all moves", bench_move_sorter_all, corpus, rounds);
+    run("apply_move+undo_move", bench_apply_undo, corpus, rounds);
+    run("static_exchange_eval", bench_static_exchange, corpus, rounds);
+    run("see_ge", bench_see_ge, corpus, rounds);
+    run("decode_move", bench_decode_move, corpus, rounds);
+    run("get_zobrist_with_move", bench_zobrist_with_move, corpus, rounds);
+    run("SimpleEvaluation::evaluate", bench_simple_evaluate, corpus, rounds);
+    run("NNUE evaluate", bench_nnue_evaluate, corpus, rounds);
+    run("NNUE delta_evaluate", bench_nnue_delta_evaluate, corpus, rounds);
+    run("TranspositionTable probe", bench_tt_probe, corpus, rounds);
+    if (!corpus.san_games.empty()) {
+        run("replay SAN (read+apply)", bench_replay_san, corpus, rounds);
+        run("replay UCI (read+apply)", bench_replay_uci, corpus, rounds);
+    }
+
+    // keeps the results observable so the timed calls aren't optimized away
+    std::cout << "checksum " << sink << std::endl;
+    return 0;
+}
@@ -1,6 +1,8 @@
 #ifndef MOVE_H_
 #define MOVE_H_
 
+#include <cstdint>
+
 typedef unsigned char piece_t;
 const piece_t bb_all = 0;
 const piece_t bb_pawn = 1;
@@ -130,5 +132,30 @@ inline unsigned char get_board_file(BoardPos bp)
     return bp % MEMORY_FILES - (MEMORY_FILES - LOGICAL_FILES) / 2;
 }
 
+// A move reduced to what identifies it in a position, for tables that store
+// many of them: dest in bits 0-5 and source in bits 6-11 as in move_t, the
+// promotion piece in bits 12-14. Bitboard::decode_move restores the move_t.
+typedef uint16_t compact_move_t;
+
+constexpr compact_move_t compact_move(move_t move)
+{
+    return (move & 0xfff) | (get_promotion(move) << 12);
+}
+
+constexpr BoardPos get_compact_source_pos(compact_move_t move)
+{
+    return (move >> 6) & 0x3f;
+}
+
+constexpr BoardPos get_compact_dest_pos(compact_move_t move)
+{
+    return move & 0x3f;
+}
+
+constexpr piece_t get_compact_promotion(compact_move_t move)
+{
+    return (move >> 12) & PIECE_MASK;
+}
+
 
 #endif
@@ -26,6 +26,20 @@ class TrainingPosition(ctypes.Structure):
         ('black_q_castle', ctypes.c_int8),
         ('cp_eval', ctypes.c_float),
         ('padding', ctypes.c_float),
+        # the C++ struct is 8-byte aligned, so arrays of it have a 216 byte stride
+        ('alignment', ctypes.c_uint8 * 4),
+    ]
+
+class PackedPosition(ctypes.Structure):
+    # 32 byte on-disk record written by trainlib's convert_to_packed
+    _fields_ = [
+        ('occupancy', ctypes.c_uint64),
+        ('pieces', ctypes.c_uint8 * 16),
+        ('eval', ctypes.c_int16),
+        ('flags', ctypes.c_uint8),
+        ('enpassant_file', ctypes.c_int8),
+        ('result', ctypes.c_uint8),
+        ('reserved', ctypes.c_uint8 * 3),
     ]
 
 def mirror_vertical(board):
@@ -100,7 +114,24 @@ class NNUEModel:
         self.wdl_output = wdl_output
         self.TrainLib.create_training_iterator.restype = ctypes.c_void_p
         self.TrainLib.create_training_iterator.argtypes = (ctypes.c_char_p, ctypes.c_int)
+        self.TrainLib.create_parallel_training_iterator.restype = ctypes.c_void_p
+        self.TrainLib.create_parallel_training_iterator.argtypes = (ctypes.POINTER(ctypes.c_char_p), ctypes.c_int, ctypes.c_int, ctypes.c_uint, ctypes.c_int)
+        self.TrainLib.convert_to_packed.restype = ctypes.c_int64
+        self.TrainLib.convert_to_packed.argtypes = (ctypes.POINTER(ctypes.c_char_p), ctypes.c_int, ctypes.c_char_p, ctypes.c_int, ctypes.c_uint)
+        self.TrainLib.create_packed_iterator.restype = ctypes.c_void_p
+        self.TrainLib.create_packed_iterator.argtypes = (ctypes.c_char_p, ctypes.c_int, ctypes.c_uint)
+        self.TrainLib.packed_position_count.restype = ctypes.c_int64
+        self.TrainLib.packed_position_count.argtypes = (ctypes.c_void_p, )
+        self.TrainLib.read_packed_position_at.restype = ctypes.c_bool
+        self.TrainLib.read_packed_position_at.argtypes = (ctypes.c_void_p, ctypes.c_int64, ctypes.POINTER(TrainingPosition))
+        self.TrainLib.read_packed_records.argtypes = (ctypes.c_void_p, ctypes.POINTER(PackedPosition), ctypes.c_int)
+        self.TrainLib.rewind_packed_iterator.restype = ctypes.c_bool
+        self.TrainLib.rewind_packed_iterator.argtypes = (ctypes.c_void_p, )
+        self.TrainLib.create_prefetching_iterator.restype = ctypes.c_void_p
+        self.TrainLib.create_prefetching_iterator.argtypes = (ctypes.c_void_p, ctypes.c_int)
         self.TrainLib.read_position.argtypes = (ctypes.c_void_p, ctypes.POINTER(TrainingPosition))
+        self.TrainLib.read_positions.argtypes = (ctypes.c_void_p, ctypes.POINTER(TrainingPosition), ctypes.c_int)
+        self.TrainLib.read_positions_split.argtypes = (ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p, ctypes.c_int)
         self.TrainLib.delete_training_iterator.argtypes = (ctypes.c_void_p, )
 
     def _num_king_buckets(self):
@@ -207,24 +238,52 @@ class NNUEModel:
                 result += 'q'
         return result
 
-    def fast_result_iterator(self, pgn_filenames, batch_size, freq=7, seed=0):
+    def convert_to_packed(self, input_filenames, output_filename, freq=7, seed=0):
+        """ samples pgn (or .pgn.zst) files and fen lists once into a packed .bin file that
+        fast_result_iterator can read each epoch without decompressing or replaying games """
+        if not isinstance(input_filenames, list):
+            input_filenames = [input_filenames]
+        filenames = (ctypes.c_char_p * len(input_filenames))(*[f.encode('utf-8') for f in input_filenames])
+        return self.TrainLib.convert_to_packed(filenames, len(input_filenames), output_filename.encode('utf-8'), freq, seed)
+
+    def read_position_arrays(self, iter, max_n):
+        """ reads up to max_n positions into numpy arrays: piece bitmasks (n, 24) with the
+        mirrored ones last, king indexes (n, 2), castle rights (n, 4) and evals (n,) """
+        bitmasks = np.empty((max_n, 24), dtype=np.uint64)
+        king_indexes = np.empty((max_n, 2), dtype=np.int32)
+        castle_rights = np.empty((max_n, 4), dtype=np.int8)
+        cp_evals = np.empty(max_n, dtype=np.float32)
+        filled = self.TrainLib.read_positions_split(iter, bitmasks.ctypes.data, king_indexes.ctypes.data, castle_rights.ctypes.data, cp_evals.ctypes.data, max_n)
+        return bitmasks[:filled], king_indexes[:filled], castle_rights[:filled], cp_evals[:filled]
+
+    def fast_result_iterator(self, pgn_filenames, batch_size, freq=7, seed=0, workers=None):
+        """ workers=None reads files one at a time on this thread, with packed .bin files
+        shuffled; otherwise all pgn files are read together by that many threads (0 for one
+        per core) in no particular order """
         board_step_size = 64 * len(self.white_piece_list)
-        tp = TrainingPosition()
+        tps = (TrainingPosition * batch_size)()
 
         if not isinstance(pgn_filenames, list):
             pgn_filenames = [pgn_filenames]
 
+        if workers is not None:
+            filenames = (ctypes.c_char_p * len(pgn_filenames))(*[f.encode('utf-8') for f in pgn_filenames])
+            sources = [(', '.join(pgn_filenames), lambda: self.TrainLib.create_parallel_training_iterator(filenames, len(pgn_filenames), freq, seed, workers))]
+        else:
+            sources = [(f, lambda f=f: self.TrainLib.create_packed_iterator(f.encode('utf-8'), 1, seed) if f.endswith('.bin')
+                else self.TrainLib.create_training_iterator(f.encode('utf-8'), freq, seed)) for f in pgn_filenames]
 
-        for pgn_filename in pgn_filenames:
-            iter = self.TrainLib.create_training_iterator(pgn_filename.encode('utf-8'), freq, seed)
+        for pgn_filename, create_iterator in sources:
+            iter = self.TrainLib.create_prefetching_iterator(create_iterator(), batch_size)
             has_more = 1
             cp_evals = []
             myboards = []
             theirboards = []
             poscount = 0
             while has_more:
-                has_more = self.TrainLib.read_position(iter, ctypes.byref(tp))
-                if has_more:
+                filled = self.TrainLib.read_positions(iter, tps, batch_size)
+                has_more = filled == batch_size
+                for tp in tps[:filled]:
                     feat = np.unpackbits(np.array(tp.piece_bitmasks, dtype=np.ubyte))
                     myboard = self.EMPTY.copy()
                     theirboard = self.EMPTY.copy()
@@ -310,7 +369,7 @@ class NNUEModel:
             metrics=metrics)
         return model
 
-    def train(self, train_pgn, valid_pgn, profile=False, batch_size=128, steps_per_epoch=256, include_side_pts=True, copy_model=None, **fit_args):
+    def train(self, train_pgn, valid_pgn, profile=False, batch_size=128, steps_per_epoch=256, include_side_pts=True, copy_model=None, workers=None, **fit_args):
         model = self.make_nnue_model_mirror(include_centipawns=True, include_side_pts=include_side_pts, copy_model=copy_model)
         model.summary()
         output_sig = []
@@ -322,7 +381,7 @@ class NNUEModel:
         sign = ((tf.TensorSpec(shape=(None, self.INPUT_LENGTH), dtype=tf.uint8, name='side_0'),
                 tf.TensorSpec(shape=(None, self.INPUT_LENGTH), dtype=tf.uint8, name='side_1')),
                 tuple(output_sig))
-        tf_data_generator = tf.data.Dataset.from_generator(lambda: self.fast_result_iterator(train_pgn, batch_size=batch_size),
+        tf_data_generator = tf.data.Dataset.from_generator(lambda: self.fast_result_iterator(train_pgn, batch_size=batch_size, workers=workers),
              output_signature=sign)
         validation_data_generator = tf.data.Dataset.from_generator(lambda: self.fast_result_iterator(valid_pgn, batch_size=batch_size),
             output_signature=sign)
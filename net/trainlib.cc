@@ -5,6 +5,17 @@
 #include "pgn.hh"
 #include <stdlib.h>
 #include <random>
+#include <algorithm>
+#include <numeric>
+#include <cmath>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <zstd.h>
 
 struct TrainingPosition {
@@ -90,24 +101,181 @@ struct zstd_pgn_input : pgn_input_stream {
 };
 
 
-struct TrainingIterator {
+// Compact on-disk training record. Pieces are listed in square order of
+// the occupancy bitmask, one nibble each (PNBRQK = 0-5, pnbrqk = 6-11,
+// the TrainingPosition bitmask order), low nibble first.
+struct PackedPosition {
+    uint64_t occupancy;
+    uint8_t pieces[16];
+    int16_t eval;       // centipawns from white's point of view
+    uint8_t flags;      // PACKED_* bits
+    int8_t enpassant_file;
+    uint8_t result;     // PACKED_RESULT_*
+    uint8_t reserved[3];
+};
+static_assert(sizeof(PackedPosition) == 32, "packed position records must stay 32 bytes");
+
+const uint8_t PACKED_BLACK_TO_MOVE = 1;
+const uint8_t PACKED_WHITE_K_CASTLE = 2;
+const uint8_t PACKED_WHITE_Q_CASTLE = 4;
+const uint8_t PACKED_BLACK_K_CASTLE = 8;
+const uint8_t PACKED_BLACK_Q_CASTLE = 16;
+
+const uint8_t PACKED_RESULT_BLACK_WIN = 0;
+const uint8_t PACKED_RESULT_DRAW = 1;
+const uint8_t PACKED_RESULT_WHITE_WIN = 2;
+const uint8_t PACKED_RESULT_UNKNOWN = 3;
+
+// files start with this header followed by the records
+struct PackedFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+};
+const char PACKED_MAGIC[8] = { 'T', 'R', 'A', 'I', 'N', 'P', 'O', 'S' };
+const uint32_t PACKED_VERSION = 1;
+
+int mirror_idx_vertical(int idx) {
+    return idx ^ 56;
+}
+
+uint64_t mirror_bitmap_vertical(uint64_t x) {
+    return  ( (x << 56)                           ) |
+            ( (x << 40) & 0x00ff000000000000ULL ) |
+            ( (x << 24) & 0x0000ff0000000000ULL ) |
+            ( (x <<  8) & 0x000000ff00000000ULL ) |
+            ( (x >>  8) & 0x00000000ff000000ULL ) |
+            ( (x >> 24) & 0x0000000000ff0000ULL ) |
+            ( (x >> 40) & 0x000000000000ff00ULL ) |
+            ( (x >> 56) );
+}
+
+// bitmasks are PNBRQKpnbrqk
+void set_training_position(const uint64_t *bitmasks, uint8_t castle_flags, float cp_eval, TrainingPosition *tp)
+{
+    for (int i = 0; i < 12; i++) {
+        tp->piece_bitmasks[i] = bitmasks[i];
+        tp->piece_bitmasks_mirrored[i >= 6 ? i - 6 : i + 6] = mirror_bitmap_vertical(bitmasks[i]);
+    }
+    tp->white_king_index = get_low_bit(bitmasks[5], 0);
+    tp->black_king_index_mirrored = mirror_idx_vertical(get_low_bit(bitmasks[11], 0));
+    tp->white_k_castle = (castle_flags & PACKED_WHITE_K_CASTLE) != 0;
+    tp->white_q_castle = (castle_flags & PACKED_WHITE_Q_CASTLE) != 0;
+    tp->black_k_castle = (castle_flags & PACKED_BLACK_K_CASTLE) != 0;
+    tp->black_q_castle = (castle_flags & PACKED_BLACK_Q_CASTLE) != 0;
+    tp->cp_eval = cp_eval;
+}
+
+void get_piece_bitmasks(const Bitboard &b, uint64_t *bitmasks)
+{
+    for (int i = 0; i < 12; i++) {
+        bitmasks[i] = b.piece_bitmasks[i + 1 + (i >= 6 ? 1 : 0)];
+    }
+}
+
+uint8_t get_castle_flags(const Bitboard &b)
+{
+    return (b.can_castle(White, true) ? PACKED_WHITE_K_CASTLE : 0) |
+        (b.can_castle(White, false) ? PACKED_WHITE_Q_CASTLE : 0) |
+        (b.can_castle(Black, true) ? PACKED_BLACK_K_CASTLE : 0) |
+        (b.can_castle(Black, false) ? PACKED_BLACK_Q_CASTLE : 0);
+}
+
+uint8_t parse_result(const std::string &result)
+{
+    if (result == "1-0") {
+        return PACKED_RESULT_WHITE_WIN;
+    } else if (result == "0-1") {
+        return PACKED_RESULT_BLACK_WIN;
+    } else if (result == "1/2-1/2") {
+        return PACKED_RESULT_DRAW;
+    }
+    return PACKED_RESULT_UNKNOWN;
+}
+
+// returns false if the position has more than 32 pieces
+bool pack_position(const Bitboard &b, float cp_eval, uint8_t result, PackedPosition *pp)
+{
+    uint64_t bitmasks[12];
+    get_piece_bitmasks(b, bitmasks);
+    memset(pp, 0, sizeof(PackedPosition));
+    for (int i = 0; i < 12; i++) {
+        pp->occupancy |= bitmasks[i];
+    }
+    if (count_bits(pp->occupancy) > 32) {
+        return false;
+    }
+    int pos = 0, n = 0;
+    while ((pos = get_low_bit(pp->occupancy, pos)) > -1) {
+        int piece = 0;
+        while (!(bitmasks[piece] & (1ULL << pos))) {
+            piece++;
+        }
+        pp->pieces[n / 2] |= piece << (4 * (n % 2));
+        n++;
+        pos++;
+    }
+    pp->eval = (int16_t) std::max(-32767.0f, std::min(32767.0f, std::round(cp_eval * 100)));
+    pp->flags = get_castle_flags(b) | (b.get_side_to_play() == Black ? PACKED_BLACK_TO_MOVE : 0);
+    pp->enpassant_file = b.get_enpassant_file();
+    pp->result = result;
+    return true;
+}
+
+void unpack_position(const PackedPosition &pp, TrainingPosition *tp)
+{
+    uint64_t bitmasks[12] = { 0 };
+    int pos = 0, n = 0;
+    while ((pos = get_low_bit(pp.occupancy, pos)) > -1) {
+        bitmasks[(pp.pieces[n / 2] >> (4 * (n % 2))) & 0xf] |= 1ULL << pos;
+        n++;
+        pos++;
+    }
+    set_training_position(bitmasks, pp.flags, pp.eval / 100.0f, tp);
+}
+
+// anything that hands out training positions to python
+struct PositionSource {
+    virtual bool read_position(TrainingPosition *tp) = 0;
+    // fills up to max_n positions, returning fewer only once the source is exhausted
+    virtual int read_positions(TrainingPosition *out, int max_n) {
+        int filled = 0;
+        while (filled < max_n && read_position(out + filled)) {
+            filled++;
+        }
+        return filled;
+    }
+    virtual ~PositionSource() {}
+
+    // staging for read_positions_split, kept between calls
+    std::vector<TrainingPosition> split_chunk;
+};
+
+struct TrainingIterator : PositionSource {
 public:
     TrainingIterator(const char *filename, int move_freq)
-        : fs(filename), ply(0), next_ply(0), distrib(1, move_freq), gen(rd())
+        : fs(filename), want_metadata(false), ply(0), next_ply(0), distrib(1, move_freq), gen(rd())
     {
         open_stream(filename);
     }
     TrainingIterator(const char *filename, int move_freq, unsigned int seed)
-        : fs(filename), ply(0), next_ply(0), distrib(1, move_freq), gen(seed)
+        : fs(filename), want_metadata(false), ply(0), next_ply(0), distrib(1, move_freq), gen(seed)
     {
         open_stream(filename);
     }
+    // takes ownership of an already opened stream
+    TrainingIterator(pgn_input_stream *input_stream, int move_freq, unsigned int seed)
+        : input_stream(input_stream), want_metadata(false), ply(0), next_ply(0), distrib(1, move_freq), gen(seed)
+    {
+    }
     ~TrainingIterator() {
         delete input_stream;
     }
     bool read_position(TrainingPosition *tp);
+    bool read_packed_position(PackedPosition *pp);
 private:
-    bool process_game(TrainingPosition *tp);
+    bool next_position(float &cp_eval);
+    bool process_game(float &cp_eval);
     void open_stream(const std::string &filename) {
         if (fs.fail()) {
             std::cerr << "Couldn't open " << filename <<  std::endl;
@@ -122,6 +290,7 @@ private:
 
     std::ifstream fs;
     pgn_input_stream *input_stream;
+    bool want_metadata;
     std::map<std::string, std::string> game_metadata;
     std::vector<std::pair<move_annot, move_annot> > movelist;
 
@@ -133,9 +302,593 @@ private:
     std::mt19937 gen; // mersenne_twister_engine seeded with rd()
 };
 
+struct MappedFile {
+    MappedFile(const std::string &filename) : data(nullptr), size(0), filename(filename) {
+        int fd = open(filename.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0) {
+            std::cerr << "Couldn't open " << filename << std::endl;
+            abort();
+        }
+        size = st.st_size;
+        if (size > 0) {
+            data = (const char*) mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED) {
+                std::cerr << "Couldn't map " << filename << std::endl;
+                abort();
+            }
+            madvise((void*) data, size, MADV_SEQUENTIAL);
+        }
+        close(fd);
+    }
+    ~MappedFile() {
+        if (size > 0) {
+            munmap((void*) data, size);
+        }
+    }
+
+    const char *data;
+    size_t size;
+    std::string filename;
+};
+
+// A pgn stream over one slice of a mapped file. It yields the games whose
+// [Event line starts inside the slice: lines before the first [Event are
+// skipped, and the last game is read to its end past the slice boundary.
+struct chunk_pgn_input : pgn_input_stream {
+    chunk_pgn_input(bool at_file_start) : seeking(!at_file_start), finished(false), has_pending(false) {}
+
+    bool is_readable() const {
+        return !finished && (has_pending || raw_readable());
+    }
+    void read_line(std::string &line) {
+        if (has_pending || fill_pending()) {
+            line.append(pending);
+            has_pending = false;
+        }
+    }
+
+protected:
+    virtual bool raw_readable() const = 0;
+    // reads the next line, reporting whether it started past the end of the slice
+    virtual void read_raw_line(std::string &line, bool &started_past_end) = 0;
+
+private:
+    bool fill_pending() {
+        while (!finished && raw_readable()) {
+            bool started_past_end = false;
+            pending.clear();
+            read_raw_line(pending, started_past_end);
+            bool game_start = pending.compare(0, 7, "[Event ") == 0;
+            if (seeking) {
+                if (!game_start) {
+                    continue;
+                }
+                seeking = false;
+            }
+            if (started_past_end && game_start) {
+                break;
+            }
+            has_pending = true;
+            return true;
+        }
+        finished = true;
+        return false;
+    }
+
+    bool seeking;
+    bool finished;
+    bool has_pending;
+    std::string pending;
+};
+
+struct memory_pgn_input : chunk_pgn_input {
+    memory_pgn_input(const MappedFile *file, size_t begin, size_t end)
+        : chunk_pgn_input(begin == 0), file(file), pos(begin), end(end) {}
+
+protected:
+    bool raw_readable() const {
+        return pos < file->size;
+    }
+    void read_raw_line(std::string &line, bool &started_past_end) {
+        started_past_end = pos >= end;
+        const char *start = file->data + pos;
+        const char *next_newline = (const char*) memchr(start, '\n', file->size - pos);
+        size_t length = next_newline != NULL ? next_newline - start : file->size - pos;
+        line.append(start, length);
+        pos += length + 1;
+    }
+
+private:
+    const MappedFile *file;
+    size_t pos;
+    size_t end;
+};
+
+// decodes from a frame boundary in a mapped .zst file; ZSTD_decompressStream
+// stops at each frame end, so every output buffer belongs to a single frame
+struct zstd_chunk_input : chunk_pgn_input {
+    zstd_chunk_input(const MappedFile *file, size_t begin, size_t end)
+        : chunk_pgn_input(begin == 0), chunk_length(end - begin), frame_done(true), frame_past_end(false), read_position(0)
+    {
+        zstd_input.src = file->data + begin;
+        zstd_input.size = file->size - begin;
+        zstd_input.pos = 0;
+        buffer_out_length = ZSTD_DStreamOutSize();
+        buffer_out = (char*) malloc(buffer_out_length);
+        zstd_output.dst = buffer_out;
+        zstd_output.size = buffer_out_length;
+        zstd_output.pos = 0;
+        dctx = ZSTD_createDCtx();
+    }
+    ~zstd_chunk_input() {
+        ZSTD_freeDCtx(dctx);
+        free(buffer_out);
+    }
+
+protected:
+    bool raw_readable() const {
+        return read_position < zstd_output.pos || zstd_input.pos < zstd_input.size || !frame_done;
+    }
+    void read_raw_line(std::string &line, bool &started_past_end) {
+        bool started = false;
+        while (true) {
+            if (read_position < zstd_output.pos) {
+                if (!started) {
+                    started = true;
+                    started_past_end = frame_past_end;
+                }
+                char *start = buffer_out + read_position;
+                char *next_newline = (char*) memchr(start, '\n', zstd_output.pos - read_position);
+                if (next_newline != NULL) {
+                    line.append(start, next_newline - start);
+                    read_position += next_newline - start + 1;
+                    return;
+                }
+                line.append(start, zstd_output.pos - read_position);
+                read_position = zstd_output.pos;
+            } else if (zstd_input.pos < zstd_input.size || !frame_done) {
+                if (frame_done) {
+                    frame_past_end = zstd_input.pos >= chunk_length;
+                }
+                zstd_output.pos = 0;
+                read_position = 0;
+                size_t input_pos = zstd_input.pos;
+                size_t ret = ZSTD_decompressStream(dctx, &zstd_output, &zstd_input);
+                if (ZSTD_isError(ret)) {
+                    std::cerr << ZSTD_getErrorName(ret) << std::endl;
+                    abort();
+                }
+                frame_done = ret == 0;
+                if (!frame_done && zstd_output.pos == 0 && zstd_input.pos == input_pos) {
+                    // truncated final frame
+                    frame_done = true;
+                    zstd_input.pos = zstd_input.size;
+                }
+            } else {
+                return;
+            }
+        }
+    }
+
+private:
+    size_t chunk_length;
+    bool frame_done;
+    bool frame_past_end;
+    size_t read_position;
+    ZSTD_inBuffer zstd_input;
+    ZSTD_outBuffer zstd_output;
+    char *buffer_out;
+    size_t buffer_out_length;
+    ZSTD_DCtx *dctx;
+};
+
+// bounded multi-producer multi-consumer ring (Vyukov): each cell carries a
+// sequence number so producers and consumers only contend on their own index
+template <typename T> class LockFreeQueue {
+public:
+    LockFreeQueue(int size_log2) : cells(1ULL << size_log2), mask((1ULL << size_log2) - 1), enqueue_pos(0), dequeue_pos(0) {
+        for (size_t i = 0; i < cells.size(); i++) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    bool try_push(const T &item) {
+        size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        while (true) {
+            Cell &cell = cells[pos & mask];
+            size_t seq = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+            if (diff == 0) {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.data = item;
+                    cell.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool try_pop(T &item) {
+        size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+        while (true) {
+            Cell &cell = cells[pos & mask];
+            size_t seq = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+            if (diff == 0) {
+                if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    item = cell.data;
+                    cell.sequence.store(pos + mask + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T data;
+    };
+    std::vector<Cell> cells;
+    size_t mask;
+    alignas(64) std::atomic<size_t> enqueue_pos;
+    alignas(64) std::atomic<size_t> dequeue_pos;
+};
+
+const int PARALLEL_QUEUE_SIZE_LOG2 = 16;
+
+// Splits its input into chunks (whole files, byte ranges of plain pgn and
+// groups of zstd frames) and replays them on worker threads, each chunk
+// with its own TrainingIterator so sampling and filtering are unchanged.
+// Positions arrive in no particular order.
+struct ParallelTrainingIterator : PositionSource {
+public:
+    ParallelTrainingIterator(const std::vector<std::string> &filenames, int move_freq, unsigned int seed, int num_workers);
+    ~ParallelTrainingIterator();
+    bool read_position(TrainingPosition *tp);
+private:
+    struct Chunk {
+        const MappedFile *file;
+        size_t begin;
+        size_t end;
+        bool compressed;
+    };
+    void add_chunks(const MappedFile *file, int chunks_per_file);
+    void worker();
+
+    std::vector<MappedFile*> files;
+    std::vector<Chunk> chunks;
+    int move_freq;
+    unsigned int seed;
+    LockFreeQueue<TrainingPosition> queue;
+    std::atomic<size_t> next_chunk;
+    std::atomic<int> workers_running;
+    std::atomic<bool> stopping;
+    std::vector<std::thread> workers;
+};
+
+ParallelTrainingIterator::ParallelTrainingIterator(const std::vector<std::string> &filenames, int move_freq, unsigned int seed, int num_workers)
+    : move_freq(move_freq), seed(seed), queue(PARALLEL_QUEUE_SIZE_LOG2), next_chunk(0), workers_running(0), stopping(false)
+{
+    if (num_workers < 1) {
+        num_workers = std::max(1U, std::thread::hardware_concurrency());
+    }
+    if (this->seed == 0) {
+        std::random_device rd;
+        this->seed = rd();
+    }
+    // with fewer files than workers, split each file so every worker has something to do
+    int chunks_per_file = (num_workers + filenames.size() - 1) / std::max<size_t>(filenames.size(), 1);
+    for (auto iter = filenames.begin(); iter != filenames.end(); iter++) {
+        files.push_back(new MappedFile(*iter));
+        add_chunks(files.back(), chunks_per_file);
+    }
+    workers_running = num_workers;
+    for (int i = 0; i < num_workers; i++) {
+        workers.push_back(std::thread(&ParallelTrainingIterator::worker, this));
+    }
+}
+
+ParallelTrainingIterator::~ParallelTrainingIterator()
+{
+    stopping = true;
+    for (auto iter = workers.begin(); iter != workers.end(); iter++) {
+        iter->join();
+    }
+    for (auto iter = files.begin(); iter != files.end(); iter++) {
+        delete *iter;
+    }
+}
+
+void ParallelTrainingIterator::add_chunks(const MappedFile *file, int chunks_per_file)
+{
+    size_t target_size = file->size / chunks_per_file + 1;
+    size_t chunk_begin = 0;
+    if (file->filename.find(".zst") != std::string::npos) {
+        // chunk boundaries have to fall on frame boundaries
+        size_t offset = 0;
+        while (offset < file->size) {
+            size_t frame_size = ZSTD_findFrameCompressedSize(file->data + offset, file->size - offset);
+            if (ZSTD_isError(frame_size)) {
+                break;
+            }
+            offset += frame_size;
+            if (offset - chunk_begin >= target_size && offset < file->size) {
+                chunks.push_back({ file, chunk_begin, offset, true });
+                chunk_begin = offset;
+            }
+        }
+        chunks.push_back({ file, chunk_begin, file->size, true });
+    } else {
+        for (int i = 1; i < chunks_per_file; i++) {
+            chunks.push_back({ file, chunk_begin, chunk_begin + target_size, false });
+            chunk_begin += target_size;
+        }
+        chunks.push_back({ file, chunk_begin, file->size, false });
+    }
+}
+
+void ParallelTrainingIterator::worker()
+{
+    size_t chunk_index;
+    while (!stopping && (chunk_index = next_chunk++) < chunks.size()) {
+        const Chunk &chunk = chunks[chunk_index];
+        pgn_input_stream *stream;
+        if (chunk.compressed) {
+            stream = new zstd_chunk_input(chunk.file, chunk.begin, chunk.end);
+        } else {
+            stream = new memory_pgn_input(chunk.file, chunk.begin, chunk.end);
+        }
+        TrainingIterator iter(stream, move_freq, seed + chunk_index);
+        TrainingPosition tp;
+        while (!stopping && iter.read_position(&tp)) {
+            while (!queue.try_push(tp)) {
+                if (stopping) {
+                    break;
+                }
+                std::this_thread::yield();
+            }
+        }
+    }
+    workers_running--;
+}
+
+bool ParallelTrainingIterator::read_position(TrainingPosition *tp)
+{
+    while (true) {
+        if (queue.try_pop(*tp)) {
+            return true;
+        }
+        if (workers_running == 0) {
+            // a worker may have pushed just before finishing
+            return queue.try_pop(*tp);
+        }
+        std::this_thread::yield();
+    }
+}
+
+// Reads the next batch from another source on a background thread while
+// the caller consumes the current one.
+struct PrefetchingIterator : PositionSource {
+public:
+    PrefetchingIterator(PositionSource *source, int batch_size)
+        : source(source), batch_size(std::max(batch_size, 1)), current_pos(0), ready(false), done(false), stopping(false)
+    {
+        prefetcher = std::thread(&PrefetchingIterator::prefetch, this);
+    }
+    ~PrefetchingIterator() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+        prefetcher.join();
+        delete source;
+    }
+    bool read_position(TrainingPosition *tp) {
+        return read_positions(tp, 1) == 1;
+    }
+    int read_positions(TrainingPosition *out, int max_n) {
+        int filled = 0;
+        while (filled < max_n) {
+            if (current_pos == current.size() && !next_batch()) {
+                break;
+            }
+            size_t count = std::min<size_t>(max_n - filled, current.size() - current_pos);
+            memcpy(out + filled, current.data() + current_pos, count * sizeof(TrainingPosition));
+            filled += count;
+            current_pos += count;
+        }
+        return filled;
+    }
+private:
+    bool next_batch() {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this] { return ready || done; });
+        if (!ready) {
+            return false;
+        }
+        current.swap(next);
+        current_pos = 0;
+        ready = false;
+        cv.notify_all();
+        return !current.empty();
+    }
+    void prefetch() {
+        std::vector<TrainingPosition> batch;
+        while (true) {
+            batch.resize(batch_size);
+            batch.resize(source->read_positions(batch.data(), batch_size));
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this] { return !ready || stopping; });
+            if (stopping) {
+                break;
+            }
+            next.swap(batch);
+            ready = true;
+            done = (int) next.size() < batch_size;
+            cv.notify_all();
+            if (done) {
+                break;
+            }
+        }
+    }
+
+    PositionSource *source;
+    int batch_size;
+    std::vector<TrainingPosition> current;
+    size_t current_pos;
+    std::vector<TrainingPosition> next;
+    bool ready;
+    bool done;
+    bool stopping;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::thread prefetcher;
+};
+
+// Random access over a file written by convert_to_packed. With shuffle,
+// every pass visits the records in a fresh random order.
+struct PackedPositionReader : PositionSource {
+public:
+    PackedPositionReader(const char *filename, bool shuffle, unsigned int seed)
+        : file(filename), shuffle(shuffle), gen(seed), next_index(0)
+    {
+        const PackedFileHeader *header = (const PackedFileHeader*) file.data;
+        if (file.size < sizeof(PackedFileHeader) || memcmp(header->magic, PACKED_MAGIC, sizeof(PACKED_MAGIC)) != 0
+                || header->version != PACKED_VERSION || header->record_size != sizeof(PackedPosition)) {
+            std::cerr << filename << " is not a packed position file" << std::endl;
+            abort();
+        }
+        records = (const PackedPosition*) (file.data + sizeof(PackedFileHeader));
+        num_records = (file.size - sizeof(PackedFileHeader)) / sizeof(PackedPosition);
+        if (shuffle) {
+            madvise((void*) file.data, file.size, MADV_RANDOM);
+            order.resize(num_records);
+            std::iota(order.begin(), order.end(), 0);
+            std::shuffle(order.begin(), order.end(), gen);
+        }
+    }
+    bool read_position(TrainingPosition *tp) {
+        PackedPosition pp;
+        if (!read_packed_position(&pp)) {
+            return false;
+        }
+        unpack_position(pp, tp);
+        return true;
+    }
+    bool read_packed_position(PackedPosition *pp) {
+        if (next_index >= num_records) {
+            return false;
+        }
+        *pp = records[shuffle ? order[next_index] : next_index];
+        next_index++;
+        return true;
+    }
+    // starts another pass, reshuffling if enabled
+    void rewind() {
+        next_index = 0;
+        if (shuffle) {
+            std::shuffle(order.begin(), order.end(), gen);
+        }
+    }
+    bool read_position_at(uint64_t index, TrainingPosition *tp) const {
+        if (index >= num_records) {
+            return false;
+        }
+        unpack_position(records[index], tp);
+        return true;
+    }
+    uint64_t size() const {
+        return num_records;
+    }
+private:
+    MappedFile file;
+    const PackedPosition *records;
+    uint64_t num_records;
+    bool shuffle;
+    std::mt19937 gen;
+    std::vector<uint64_t> order;
+    uint64_t next_index;
+};
+
+// Inputs ending in .pgn or .pgn.zst are sampled like TrainingIterator;
+// anything else is a FEN list with lines "fen[,eval[,result]]", eval in
+// pawns from white's point of view. Returns the number of records written.
+int64_t convert_positions(const std::vector<std::string> &inputs, const std::string &output, int move_freq, unsigned int seed)
+{
+    std::ofstream out(output, std::ios::binary);
+    if (!out) {
+        std::cerr << "Couldn't open " << output << std::endl;
+        return -1;
+    }
+    PackedFileHeader header;
+    memcpy(header.magic, PACKED_MAGIC, sizeof(PACKED_MAGIC));
+    header.version = PACKED_VERSION;
+    header.record_size = sizeof(PackedPosition);
+    out.write((const char*) &header, sizeof(header));
+
+    int64_t count = 0;
+    PackedPosition pp;
+    for (auto iter = inputs.begin(); iter != inputs.end(); iter++) {
+        if (iter->find(".pgn") != std::string::npos) {
+            MappedFile file(*iter);
+            pgn_input_stream *stream;
+            if (iter->find(".zst") != std::string::npos) {
+                stream = new zstd_chunk_input(&file, 0, file.size);
+            } else {
+                stream = new memory_pgn_input(&file, 0, file.size);
+            }
+            TrainingIterator ti(stream, move_freq, seed);
+            while (ti.read_packed_position(&pp)) {
+                out.write((const char*) &pp, sizeof(pp));
+                count++;
+            }
+            continue;
+        }
+        std::ifstream fens(*iter);
+        if (!fens) {
+            std::cerr << "Couldn't open " << *iter << std::endl;
+            return -1;
+        }
+        Fenboard b;
+        std::string line;
+        while (std::getline(fens, line)) {
+            if (line.empty() || line[0] == '#') {
+                continue;
+            }
+            size_t first_comma = line.find(',');
+            size_t second_comma = first_comma == std::string::npos ? first_comma : line.find(',', first_comma + 1);
+            b.set_fen(line.substr(0, first_comma));
+            float cp_eval = 0;
+            if (first_comma != std::string::npos) {
+                std::string eval = line.substr(first_comma + 1, second_comma == std::string::npos ? std::string::npos : second_comma - first_comma - 1);
+                if (!eval.empty()) {
+                    cp_eval = std::stof(eval);
+                }
+            }
+            uint8_t result = second_comma == std::string::npos ? PACKED_RESULT_UNKNOWN : parse_result(line.substr(second_comma + 1));
+            if (pack_position(b, cp_eval, result, &pp)) {
+                out.write((const char*) &pp, sizeof(pp));
+                count++;
+            }
+        }
+    }
+    return out ? count : -1;
+}
+
 extern "C" {
 
-TrainingIterator *create_training_iterator(const char *filename, int move_freq, unsigned int seed) {
+PositionSource *create_training_iterator(const char *filename, int move_freq, unsigned int seed) {
     TrainingIterator *ti;
     if (seed == 0) {
         ti = new TrainingIterator(filename, move_freq);
@@ -144,23 +897,162 @@ TrainingIterator *create_training_iterator(const char *filename, int move_freq,
     }
     return ti;
 }
-bool read_position(TrainingIterator *iter, TrainingPosition *tp) {
+// filenames is a list of num_files paths; num_workers <= 0 uses every core
+PositionSource *create_parallel_training_iterator(const char **filenames, int num_files, int move_freq, unsigned int seed, int num_workers) {
+    std::vector<std::string> files(filenames, filenames + num_files);
+    return new ParallelTrainingIterator(files, move_freq, seed, num_workers);
+}
+
+// wraps source, which is then owned and deleted by the returned iterator
+PositionSource *create_prefetching_iterator(PositionSource *source, int batch_size) {
+    return new PrefetchingIterator(source, batch_size);
+}
+
+bool read_position(PositionSource *iter, TrainingPosition *tp) {
     return iter->read_position(tp);
 }
 
-void delete_training_iterator(TrainingIterator *ti) {
+int64_t convert_to_packed(const char **inputs, int num_inputs, const char *output, int move_freq, unsigned int seed) {
+    if (seed == 0) {
+        std::random_device rd;
+        seed = rd();
+    }
+    return convert_positions(std::vector<std::string>(inputs, inputs + num_inputs), output, move_freq, seed);
+}
+
+// seed 0 picks a random shuffle
+PositionSource *create_packed_iterator(const char *filename, int shuffle, unsigned int seed) {
+    if (seed == 0) {
+        std::random_device rd;
+        seed = rd();
+    }
+    return new PackedPositionReader(filename, shuffle != 0, seed);
+}
+
+// the packed reader behind iter, or null with a message if it's another source
+static PackedPositionReader *packed_reader(PositionSource *iter, const char *caller) {
+    PackedPositionReader *reader = dynamic_cast<PackedPositionReader*>(iter);
+    if (reader == nullptr) {
+        std::cerr << caller << " needs an iterator from create_packed_iterator" << std::endl;
+    }
+    return reader;
+}
+
+// -1 if iter isn't a packed iterator
+int64_t packed_position_count(PositionSource *iter) {
+    PackedPositionReader *reader = packed_reader(iter, "packed_position_count");
+    return reader != nullptr ? (int64_t) reader->size() : -1;
+}
+
+bool read_packed_position_at(PositionSource *iter, int64_t index, TrainingPosition *tp) {
+    PackedPositionReader *reader = packed_reader(iter, "read_packed_position_at");
+    return reader != nullptr && reader->read_position_at(index, tp);
+}
+
+// -1 if iter isn't a packed iterator
+int read_packed_records(PositionSource *iter, PackedPosition *out, int max_n) {
+    PackedPositionReader *reader = packed_reader(iter, "read_packed_records");
+    if (reader == nullptr) {
+        return -1;
+    }
+    int filled = 0;
+    while (filled < max_n && reader->read_packed_position(out + filled)) {
+        filled++;
+    }
+    return filled;
+}
+
+bool rewind_packed_iterator(PositionSource *iter) {
+    PackedPositionReader *reader = packed_reader(iter, "rewind_packed_iterator");
+    if (reader == nullptr) {
+        return false;
+    }
+    reader->rewind();
+    return true;
+}
+
+int read_positions(PositionSource *iter, TrainingPosition *out, int max_n) {
+    return iter->read_positions(out, max_n);
+}
+
+// Writes max_n positions into separate contiguous arrays, any of which may
+// be null: bitmasks gets 24 per position (12 piece bitmasks then the 12
+// mirrored ones), king_indexes 2 (white, black mirrored), castle_rights 4
+// (white k, white q, black k, black q) and cp_evals 1.
+int read_positions_split(PositionSource *iter, uint64_t *bitmasks, int32_t *king_indexes, int8_t *castle_rights, float *cp_evals, int max_n) {
+    const int chunk_size = 1024;
+    std::vector<TrainingPosition> &chunk = iter->split_chunk;
+    chunk.resize(chunk_size);
+    int filled = 0;
+    while (filled < max_n) {
+        int wanted = std::min(chunk_size, max_n - filled);
+        int count = iter->read_positions(chunk.data(), wanted);
+        for (int i = 0; i < count; i++, filled++) {
+            const TrainingPosition &tp = chunk[i];
+            if (bitmasks != nullptr) {
+                memcpy(bitmasks + filled * 24, tp.piece_bitmasks, sizeof(tp.piece_bitmasks));
+                memcpy(bitmasks + filled * 24 + 12, tp.piece_bitmasks_mirrored, sizeof(tp.piece_bitmasks_mirrored));
+            }
+            if (king_indexes != nullptr) {
+                king_indexes[filled * 2] = tp.white_king_index;
+                king_indexes[filled * 2 + 1] = tp.black_king_index_mirrored;
+            }
+            if (castle_rights != nullptr) {
+                castle_rights[filled * 4] = tp.white_k_castle;
+                castle_rights[filled * 4 + 1] = tp.white_q_castle;
+                castle_rights[filled * 4 + 2] = tp.black_k_castle;
+                castle_rights[filled * 4 + 3] = tp.black_q_castle;
+            }
+            if (cp_evals != nullptr) {
+                cp_evals[filled] = tp.cp_eval;
+            }
+        }
+        if (count < wanted) {
+            break;
+        }
+    }
+    return filled;
+}
+
+void delete_training_iterator(PositionSource *ti) {
     delete ti;
 }
 
 }
 
 bool TrainingIterator::read_position(TrainingPosition *tp)
+{
+    float cp_eval;
+    if (!next_position(cp_eval)) {
+        return false;
+    }
+    uint64_t bitmasks[12];
+    get_piece_bitmasks(b, bitmasks);
+    set_training_position(bitmasks, get_castle_flags(b), cp_eval, tp);
+    return true;
+}
+
+bool TrainingIterator::read_packed_position(PackedPosition *pp)
+{
+    // the game result is only in the metadata
+    want_metadata = true;
+    float cp_eval;
+    while (next_position(cp_eval)) {
+        if (pack_position(b, cp_eval, parse_result(game_metadata["Result"]), pp)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// leaves the board at the next sampled position
+bool TrainingIterator::next_position(float &cp_eval)
 {
     while (1) {
         // game is too short or has no annotations: skip
         if (movelist.size() > 3 && !movelist[0].first.eval.empty()) {
             next_ply = ply + distrib(gen);
-            bool found_position = process_game(tp);
+            bool found_position = process_game(cp_eval);
             if (found_position) {
                 return true;
             }
@@ -173,7 +1065,7 @@ bool TrainingIterator::read_position(TrainingPosition *tp)
         if (!input_stream->is_readable()) {
             return false;
         }
-        read_pgn(input_stream, game_metadata, movelist, false);
+        read_pgn(input_stream, game_metadata, movelist, want_metadata);
 //        std::cout << "Read " << game_metadata["Site"] << std::endl;
         ply = 0;
         b.set_starting_position();
@@ -181,22 +1073,7 @@ bool TrainingIterator::read_position(TrainingPosition *tp)
     return false;
 }
 
-int mirror_idx_vertical(int idx) {
-    return idx ^ 56;
-}
-
-uint64_t mirror_bitmap_vertical(uint64_t x) {
-    return  ( (x << 56)                           ) |
-            ( (x << 40) & 0x00ff000000000000ULL ) |
-            ( (x << 24) & 0x0000ff0000000000ULL ) |
-            ( (x <<  8) & 0x000000ff00000000ULL ) |
-            ( (x >>  8) & 0x00000000ff000000ULL ) |
-            ( (x >> 24) & 0x0000000000ff0000ULL ) |
-            ( (x >> 40) & 0x000000000000ff00ULL ) |
-            ( (x >> 56) );
-}
-
-bool TrainingIterator::process_game(TrainingPosition *tp)
+bool TrainingIterator::process_game(float &cp_eval)
 {
     while (ply < movelist.size()) {
         std::string move_text, next_move_text;
@@ -224,22 +1101,11 @@ bool TrainingIterator::process_game(TrainingPosition *tp)
             std::string score = side_to_play == White ? movelist[ply/2].first.eval : movelist[ply/2].second.eval;
             if (score.find('#') == std::string::npos) {
                 try {
-                    tp->cp_eval = std::stof(score);
+                    cp_eval = std::stof(score);
                 } catch (const std::invalid_argument& ia) {
                     std::cerr << "Invalid score value: " << score << std::endl;
                     return false;
                 }
-
-                for (int i = 0; i < 12; i++) {
-                    tp->piece_bitmasks[i] = b.piece_bitmasks[i + 1 + (i >= 6 ? 1 : 0)];
-                    tp->piece_bitmasks_mirrored[i >= 6 ? i - 6 : i + 6] = mirror_bitmap_vertical(b.piece_bitmasks[i + 1 + (i >= 6 ? 1 : 0)]);
-                }
-                tp->white_king_index = get_low_bit(b.piece_bitmasks[bb_king], 0);
-                tp->black_king_index_mirrored = mirror_idx_vertical(get_low_bit(b.piece_bitmasks[bb_king + bb_king + 1], 0));
-                tp->white_k_castle = b.can_castle(White, true);
-                tp->white_q_castle = b.can_castle(White, false);
-                tp->black_k_castle = b.can_castle(Black, true);
-                tp->black_q_castle = b.can_castle(Black, false);
                 ply++;
                 return true;
             }
@@ -254,23 +1120,41 @@ int main(int argc, char **argv)
 {
     TrainingPosition tp;
     std::cout << sizeof(tp) << std::endl;
+    if (argc > 3 && std::string(argv[1]) == "--convert") {
+        // trainlib --convert out.bin input...
+        int64_t count = convert_to_packed((const char **) argv + 3, argc - 3, argv[2], 5, 0);
+        printf("Wrote %lld positions\n", (long long) count);
+        return count < 0 ? 1 : 0;
+    }
     if (argc > 1) {
         int count = 0;
         int maxcount = 1000;
         if (argc > 2) {
             maxcount = std::atoi(argv[2]);
         }
-        TrainingIterator *ti = create_training_iterator(argv[1], 5, 0);
-        TrainingPosition tp;
-        bool has_more = true;
-        while (has_more) {
-            has_more = read_position(ti, &tp);
-            count += 1;
-            if (count > maxcount) {
+        PositionSource *ti;
+        if (std::string(argv[1]).find(".bin") != std::string::npos) {
+            ti = create_packed_iterator(argv[1], 1, 0);
+        } else if (argc > 3) {
+            // trainlib file count workers
+            const char *filenames[] = { argv[1] };
+            ti = create_parallel_training_iterator(filenames, 1, 5, 0, std::atoi(argv[3]));
+        } else {
+            ti = create_training_iterator(argv[1], 5, 0);
+        }
+        const int batch_size = 4096;
+        ti = create_prefetching_iterator(ti, batch_size);
+        std::vector<TrainingPosition> batch(batch_size);
+        while (count < maxcount) {
+            int wanted = std::min(batch_size, maxcount - count);
+            int filled = read_positions(ti, batch.data(), wanted);
+            count += filled;
+            if (filled < wanted) {
                 break;
             }
         }
         printf("Read %d positions\n", count);
+        delete_training_iterator(ti);
     }
     return 0;
 }
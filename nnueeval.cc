@@ -91,12 +91,12 @@ int NNUEEvaluation::delta_evaluate(Fenboard &b, move_t move, int previous_score)
     if (use_backup) {
         if ((b.get_side_to_play() == White && previous_score > 400)
             || (b.get_side_to_play() == Black && previous_score < -400)) {
-            return backup.delta_evaluate(b, move, previous_score);
+            return SimpleEvaluation::delta_evaluate(b, move, previous_score);
         }
         if (get_captured_piece(move) == 0 &&
             ((b.get_side_to_play() == White && previous_score < -400)
             || (b.get_side_to_play() == Black && previous_score > 400))) {
-            return backup.delta_evaluate(b, move, previous_score);
+            return SimpleEvaluation::delta_evaluate(b, move, previous_score);
         }
     }
 
@@ -99,8 +99,8 @@ private:
     mvector<MODEL_FIRST_LAYER_WIDTH, int16_t> dense_1_layer;
     int psqt_cached;
     nnue_model *model;
+    // falls back on the SimpleEvaluation it derives from, pawn table included
     bool use_backup;
-    SimpleEvaluation backup;
 
     const bias_promotion<MODEL_DENSE_LAYERS, MODEL_HIDDEN_LAYER_WIDTH, int8_t> model_dense_bias_promoted;
     const weight_promotion<MODEL_DENSE_LAYERS-1, MODEL_HIDDEN_LAYER_WIDTH, MODEL_HIDDEN_LAYER_WIDTH, int8_t> model_dense_weights_promoted;
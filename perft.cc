@@ -0,0 +1,156 @@
+#include "perft.hh"
+#include <thread>
+
+static uint64_t perft_key(uint64_t hash, int depth)
+{
+    return hash ^ (depth * 0x9e3779b97f4a7c15ULL);
+}
+
+PerftHashTable::PerftHashTable(int size_log2)
+    : table(1ULL << size_log2), mask((1ULL << size_log2) - 1)
+{
+    for (uint64_t i = 0; i <= mask; i++) {
+        table[i].check.store(0, std::memory_order_relaxed);
+        table[i].count.store(0, std::memory_order_relaxed);
+    }
+}
+
+bool PerftHashTable::probe(uint64_t hash, int depth, uint64_t &count) const
+{
+    uint64_t key = perft_key(hash, depth);
+    const PerftEntry &entry = table[key & mask];
+    uint64_t stored_count = entry.count.load(std::memory_order_relaxed);
+    if ((entry.check.load(std::memory_order_relaxed) ^ stored_count) != key || stored_count == 0) {
+        return false;
+    }
+    count = stored_count;
+    return true;
+}
+
+void PerftHashTable::insert(uint64_t hash, int depth, uint64_t count)
+{
+    uint64_t key = perft_key(hash, depth);
+    PerftEntry &entry = table[key & mask];
+    entry.count.store(count, std::memory_order_relaxed);
+    entry.check.store(key ^ count, std::memory_order_relaxed);
+}
+
+void get_legal_moves(const Fenboard &b, MoveList &moves)
+{
+    PackedMoveIterator packed;
+    uint64_t opp_covered_squares = 0;
+    Color side_to_play = b.get_side_to_play();
+
+    b.get_packed_legal_moves(side_to_play, packed, opp_covered_squares);
+    b.get_moves(side_to_play, true, true, packed, moves);
+    b.get_moves(side_to_play, true, false, packed, moves);
+    b.get_moves(side_to_play, false, true, packed, moves);
+    b.get_moves(side_to_play, false, false, packed, moves);
+}
+
+void get_legal_moves(const Fenboard &b, std::vector<move_t> &moves)
+{
+    MoveList list;
+    get_legal_moves(b, list);
+    moves.insert(moves.end(), list.begin(), list.end());
+}
+
+uint64_t perft(Fenboard &b, int depth, PerftHashTable *table, bool pseudo_legal)
+{
+    if (depth <= 0) {
+        return 1;
+    }
+    if (depth == 1 && pseudo_legal) {
+        MoveList moves;
+        uint64_t count = 0;
+        b.get_pseudo_legal_moves(b.get_side_to_play(), moves);
+        for (auto iter = moves.begin(); iter != moves.end(); iter++) {
+            count += b.is_legal(*iter);
+        }
+        return count;
+    }
+    if (depth == 1) {
+        // bulk count the last ply
+        PackedMoveIterator packed;
+        uint64_t opp_covered_squares = 0;
+        b.get_packed_legal_moves(b.get_side_to_play(), packed, opp_covered_squares);
+        return b.count_moves(b.get_side_to_play(), packed);
+    }
+
+    uint64_t count = 0;
+    if (table != nullptr && table->probe(b.get_hash(), depth, count)) {
+        return count;
+    }
+
+    MoveList moves;
+    if (pseudo_legal) {
+        b.get_pseudo_legal_moves(b.get_side_to_play(), moves);
+    } else {
+        get_legal_moves(b, moves);
+    }
+    for (auto iter = moves.begin(); iter != moves.end(); iter++) {
+        move_t move = *iter;
+        if (pseudo_legal) {
+            // only now that the move is tried
+            if (!b.is_legal(move)) {
+                continue;
+            }
+            if (b.gives_check(move)) {
+                move |= GIVES_CHECK;
+            }
+        }
+        b.apply_move(move);
+        count += perft(b, depth - 1, table, pseudo_legal);
+        b.undo_move(move);
+    }
+
+    if (table != nullptr) {
+        table->insert(b.get_hash(), depth, count);
+    }
+    return count;
+}
+
+std::vector<std::pair<move_t, uint64_t> > perft_divide(const Fenboard &b, int depth, int threads, PerftHashTable *table, bool pseudo_legal)
+{
+    MoveList moves;
+    if (pseudo_legal) {
+        MoveList pseudo_legal_moves;
+        b.get_pseudo_legal_moves(b.get_side_to_play(), pseudo_legal_moves);
+        for (auto iter = pseudo_legal_moves.begin(); iter != pseudo_legal_moves.end(); iter++) {
+            if (b.is_legal(*iter)) {
+                moves.push_back(b.gives_check(*iter) ? *iter | GIVES_CHECK : *iter);
+            }
+        }
+    } else {
+        get_legal_moves(b, moves);
+    }
+
+    std::vector<std::pair<move_t, uint64_t> > results;
+    for (auto iter = moves.begin(); iter != moves.end(); iter++) {
+        results.push_back(std::make_pair(*iter, 0));
+    }
+    if (depth <= 0) {
+        return results;
+    }
+
+    std::atomic<unsigned int> next_move(0);
+    auto worker = [&]() {
+        Fenboard local = b;
+        unsigned int i;
+        while ((i = next_move.fetch_add(1)) < results.size()) {
+            local.apply_move(results[i].first);
+            results[i].second = perft(local, depth - 1, table, pseudo_legal);
+            local.undo_move(results[i].first);
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (int i = 1; i < threads; i++) {
+        workers.push_back(std::thread(worker));
+    }
+    worker();
+    for (auto iter = workers.begin(); iter != workers.end(); iter++) {
+        iter->join();
+    }
+    return results;
+}
@@ -0,0 +1,39 @@
+#ifndef PERFT_HH_
+#define PERFT_HH_
+
+#include <atomic>
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include "fenboard.hh"
+
+// leaf counts keyed by zobrist hash and remaining depth, safe to share between threads
+class PerftHashTable {
+public:
+    PerftHashTable(int size_log2);
+    PerftHashTable(const PerftHashTable &) = delete;
+    PerftHashTable &operator=(const PerftHashTable &) = delete;
+    bool probe(uint64_t hash, int depth, uint64_t &count) const;
+    void insert(uint64_t hash, int depth, uint64_t count);
+
+private:
+    struct PerftEntry {
+        // key ^ count, so a torn write from another thread fails verification
+        std::atomic<uint64_t> check;
+        std::atomic<uint64_t> count;
+    };
+    std::vector<PerftEntry> table;
+    uint64_t mask;
+};
+
+void get_legal_moves(const Fenboard &b, MoveList &moves);
+void get_legal_moves(const Fenboard &b, std::vector<move_t> &moves);
+// pseudo_legal generates with get_pseudo_legal_moves and checks legality and
+// gives-check one move at a time, which has to give the same counts; it's a
+// cross-check of the legal generator, and makes every leaf move where the
+// legal generator bulk-counts the last ply
+uint64_t perft(Fenboard &b, int depth, PerftHashTable *table = nullptr, bool pseudo_legal = false);
+// leaf counts for each root move, with root moves handed out to worker threads
+std::vector<std::pair<move_t, uint64_t> > perft_divide(const Fenboard &b, int depth, int threads = 1, PerftHashTable *table = nullptr, bool pseudo_legal = false);
+
+#endif
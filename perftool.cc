@@ -0,0 +1,150 @@
+#include <boost/program_options.hpp>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <thread>
+#include "fenboard.hh"
+#include "perft.hh"
+namespace po = boost::program_options;
+
+struct PerftTimer {
+    PerftTimer() : start(std::chrono::steady_clock::now()) {}
+    double elapsed() const {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    std::chrono::steady_clock::time_point start;
+};
+
+uint64_t run_divide(const Fenboard &b, int depth, int threads, PerftHashTable *table, bool pseudo_legal, bool verbose)
+{
+    uint64_t total = 0;
+    auto results = perft_divide(b, depth, threads, table, pseudo_legal);
+    for (auto iter = results.begin(); iter != results.end(); iter++) {
+        if (verbose) {
+            std::cout << move_to_uci(iter->first) << ": " << iter->second << std::endl;
+        }
+        total += iter->second;
+    }
+    return total;
+}
+
+// each line is "<fen> ;D1 20 ;D2 400 ..."
+int run_suite(const std::string &filename, int max_depth, int threads, PerftHashTable *table, bool pseudo_legal)
+{
+    std::ifstream suite(filename);
+    if (!suite) {
+        std::cout << "Cannot load " << filename << std::endl;
+        return 1;
+    }
+    int failures = 0;
+    uint64_t nodes = 0;
+    double elapsed = 0;
+    std::string line;
+    while (std::getline(suite, line)) {
+        size_t semi = line.find(';');
+        if (line.empty() || semi == std::string::npos) {
+            continue;
+        }
+        std::string fen = line.substr(0, semi);
+        Fenboard b;
+        b.set_fen(fen);
+
+        std::istringstream expectations(line.substr(semi));
+        std::string depth_text;
+        uint64_t expected;
+        while (expectations >> depth_text >> expected) {
+            int depth = atoi(depth_text.c_str() + 2);
+            if (depth > max_depth) {
+                break;
+            }
+            PerftTimer timer;
+            uint64_t count = run_divide(b, depth, threads, table, pseudo_legal, false);
+            elapsed += timer.elapsed();
+            nodes += count;
+            if (count != expected) {
+                std::cout << "FAIL " << fen << " depth " << depth << ": expected " << expected << " got " << count << std::endl;
+                failures++;
+            }
+        }
+    }
+    std::cout << "Perft suite: " << failures << " failures, " << nodes << " nodes at " << nodes / elapsed / 1e6 << " Mnodes/sec" << std::endl;
+    return failures > 0 ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+    try {
+        po::options_description desc("Allowed options");
+        desc.add_options()
+            ("help", "produce help message")
+            ("fen", po::value<std::string>(), "set board state")
+            ("depth", po::value<int>()->default_value(5), "perft depth, or max depth for --suite")
+            ("threads", po::value<int>()->default_value(std::thread::hardware_concurrency()), "worker threads for divide")
+            ("hash", po::value<int>()->default_value(0), "log2 of perft hash table entries, 0 to disable")
+            ("suite", po::value<std::string>(), "check counts from an epd file such as perftsuite.epd")
+            ("sliders", po::value<std::string>()->default_value("auto"), "slider attack lookup: auto, magic, pext, or compare to time both")
+            ("pseudo-legal", po::bool_switch(), "cross-check: generate pseudo-legal moves and check each one as it's played")
+        ;
+
+        po::variables_map vm;
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+        po::notify(vm);
+
+        if (vm.count("help")) {
+            std::cout << desc << std::endl;
+            return 0;
+        }
+
+        int depth = vm["depth"].as<int>();
+        int threads = std::max(1, vm["threads"].as<int>());
+        bool pseudo_legal = vm["pseudo-legal"].as<bool>();
+        std::string sliders = vm["sliders"].as<std::string>();
+        std::vector<SliderBackend> backends;
+        if (sliders == "magic" || sliders == "compare") {
+            backends.push_back(slider_magic);
+        }
+        if (sliders == "pext" || sliders == "compare") {
+            backends.push_back(slider_pext);
+        }
+        if (backends.empty()) {
+            backends.push_back(Bitboard::get_slider_backend());
+        }
+
+        int result = 0;
+        for (auto backend = backends.begin(); backend != backends.end(); backend++) {
+            if (!Bitboard::set_slider_backend(*backend)) {
+                std::cerr << "This cpu can't look up sliders with " << slider_backend_name(*backend) << std::endl;
+                return 1;
+            }
+            std::cout << "Sliders: " << slider_backend_name(*backend) << std::endl;
+            // a fresh table each time, so cached counts don't hide the second backend's speed
+            std::unique_ptr<PerftHashTable> table;
+            if (vm["hash"].as<int>() > 0) {
+                table = std::make_unique<PerftHashTable>(vm["hash"].as<int>());
+            }
+
+            if (vm.count("suite")) {
+                result |= run_suite(vm["suite"].as<std::string>(), depth, threads, table.get(), pseudo_legal);
+            } else {
+                Fenboard b;
+                if (vm.count("fen")) {
+                    b.set_fen(vm["fen"].as<std::string>());
+                } else {
+                    b.set_starting_position();
+                }
+                PerftTimer timer;
+                uint64_t total = run_divide(b, depth, threads, table.get(), pseudo_legal, backends.size() == 1);
+                double elapsed = timer.elapsed();
+                std::cout << std::endl << "Nodes searched: " << total << " in " << elapsed << "s at " << total / elapsed / 1e6 << " Mnodes/sec" << std::endl;
+            }
+        }
+        return result;
+    }
+    catch(std::exception& e) {
+        std::cerr << "error: " << e.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
@@ -2,318 +2,386 @@
 #include <iostream>
 #include <stdlib.h>
 
-void read_annotation(const std::string &buf, int start_pos, int end_pos, std::string &eval, std::string &clock);
-bool is_result(const std::string &candidate_move);
-
-void skip_whitespace(const std::string &line, int &pos) {
-    while (pos < line.length() && (line[pos] == ' ' || line[pos] == '\n' || line[pos] == '\r')) {
-        pos++;
-    }
+static bool is_pgn_space(char c)
+{
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t';
 }
 
-bool read_move_annot(const std::string &line, int &start_pos, move_annot &move)
+static bool is_pgn_delimiter(char c)
 {
-    int start_move, end_move;
+    return is_pgn_space(c) || c == '{' || c == '}' || c == '(' || c == ')' || c == '[' || c == ']' || c == ';' || c == '$';
+}
 
-    int pos = line.find('.', start_pos);
+static bool is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
 
-    if (pos < 0 || line.substr(start_pos, pos - start_pos).find_first_of("0123456789") != 0) {
-        pos = start_pos;
-        move.moveno = 0;
-    } else {
-        move.moveno = atoi(line.substr(start_pos, pos - start_pos).c_str());
-        move.is_white = (line[++pos] != '.');
+bool pgn_tokenizer::next(pgn_token &token)
+{
+    token.value = std::string_view();
+    token.number = 0;
+    token.is_white = false;
+    if (!pending_glyphs.empty()) {
+        token.type = PGN_NAG;
+        token.text = pending_glyphs;
+        pending_glyphs = std::string_view();
+        return true;
     }
-
-    // skip any spaces or extra periods
-    while (pos < line.length() && (line[pos] == ' ' || line[pos] == '.'))
+    while (pos < text.size() && is_pgn_space(text[pos])) {
         pos++;
-    start_move = pos;
-    end_move = line.find(' ', pos);
-    if (start_move == -1 || end_move == -1) {
-        return false;
-    }
-    if (line[end_move-1] == ')') {
-        end_move--;
-        pos--;
     }
-    pos = end_move;
-    move.move = line.substr(start_move, end_move - start_move);
-    // results like 1/2-1/2 or random punctuation aren't moves
-    if (is_result(move.move) || (move.move.find_first_of("0123456789Oabcdefgh") == std::string::npos)) {
+    if (pos >= text.size()) {
         return false;
     }
-    skip_whitespace(line, pos);
-
-    // lichess move annotations: eg. 1. e4 { [%eval 0.2] [%clk 0:05:00] } 1... e5 { [%eval 0.17] [%clk 0:05:00] }
-    if (line[pos] == '{') {
-        int end_annotation = line.find('}', pos);
-        if (end_annotation > pos) {
-            read_annotation(line, pos, end_annotation, move.eval, move.clock);
-            pos = end_annotation + 1;
-        } else {
-            std::cerr << "Unterminated move metadata around " << line.substr(pos - 5, 10) << std::endl;
-            return false;
-        }
-    }
-    start_pos = pos;
-    return true;
-}
 
-void clean_line(std::vector<move_annot> &moveline) {
-    // removes doubled moves
-    move_annot *min_move;
-    bool is_first = true;
-
-    for (auto iter = moveline.rbegin(); iter != moveline.rend(); iter++) {
-        if (is_first) {
-            min_move = &moveline.back();
-            is_first = false;
-        } else {
-            // case one: moving backwards
-            if (iter->moveno < min_move->moveno || (iter->moveno == min_move->moveno && iter->is_white && !min_move->is_white)) {
-                min_move = &*iter;
+    size_t end;
+    switch (text[pos]) {
+        case '[': {
+            end = pos + 1;
+            while (end < text.size() && !is_pgn_space(text[end]) && text[end] != ']' && text[end] != '"') {
+                end++;
             }
-            // case two: same or forwards -> omit
-            else {
-                // stupid c++ hack because moveline.erase(iter) doesn't work for reverse iter
-                moveline.erase((iter+1).base());
+            token.type = PGN_TAG;
+            token.text = text.substr(pos + 1, end - pos - 1);
+            size_t open_quote = text.find('"', end);
+            size_t close_bracket = text.find(']', end);
+            if (open_quote != std::string_view::npos && open_quote < close_bracket) {
+                size_t close_quote = open_quote + 1;
+                while (close_quote < text.size() && text[close_quote] != '"') {
+                    // skip escaped characters
+                    close_quote += text[close_quote] == '\\' ? 2 : 1;
+                }
+                close_quote = std::min(close_quote, text.size());
+                token.value = text.substr(open_quote + 1, close_quote - open_quote - 1);
+                close_bracket = text.find(']', close_quote);
             }
+            pos = close_bracket == std::string_view::npos ? text.size() : close_bracket + 1;
+            return true;
         }
-    }
-}
-
-void read_pgn_options(pgn_input_stream *input, std::map<std::string, std::string> &metadata, movelist_tree &movelist)
-{
-    std::string line;
-    int pos = 0;
-    while (input->is_readable()) {
-        std::string buf;
-        input->read_line(buf);
-        line.append(buf);
-        if (line[line.length() - 1] == '\r') {
-            line = line.substr(0, line.length() - 1);
-        }
-        if (line[0] == '[') {
-            if (!movelist.empty()) {
-                break;
+        case '{':
+            end = text.find('}', pos + 1);
+            if (end == std::string_view::npos) {
+                unterminated_comment = true;
+                end = text.size();
             }
-            int spacepos = line.find(' ');
-            int lastquote = line.rfind('"');
-            metadata[line.substr(1, spacepos-1)] = line.substr(spacepos+2, lastquote-spacepos-2);
-            // don't need this content anymore
-            line.clear();
-        }
-        else if (buf.size() <= 1 && line.size() > 2) {
-            // newline ends the game
+            token.type = PGN_COMMENT;
+            token.text = text.substr(pos + 1, end - pos - 1);
+            pos = std::min(end + 1, text.size());
+            return true;
+        case ';':
+            end = text.find('\n', pos + 1);
+            if (end == std::string_view::npos) {
+                end = text.size();
+            }
+            token.type = PGN_COMMENT;
+            token.text = text.substr(pos + 1, end - pos - 1);
+            pos = end;
+            return true;
+        case '(':
+            token.type = PGN_VARIATION_START;
+            token.text = text.substr(pos++, 1);
+            return true;
+        case ')':
+            token.type = PGN_VARIATION_END;
+            token.text = text.substr(pos++, 1);
+            return true;
+        case '$':
+            end = pos + 1;
+            while (end < text.size() && is_digit(text[end])) {
+                token.number = token.number * 10 + text[end] - '0';
+                end++;
+            }
+            token.type = PGN_NAG;
+            token.text = text.substr(pos, end - pos);
+            pos = end;
+            return true;
+        default:
             break;
-        }
-        else if (line.size() > 0) {
-            // process actual moves
-            line.append(" ");
-        }
     }
-    if (metadata.empty() && line.size() > 2) {
-        std::cerr << "Error: no pgn header, are you sure this is pgn? " << std::endl;
-        abort();
-    }
-
-    movelist_tree linestack;
-    linestack.push_back(std::vector<move_annot>());
-
-    while (pos < line.size() && pos >= 0) {
-        // 1. e4 g6 2. Ne2 Bg7 3.
-        move_annot move;
 
-        skip_whitespace(line, pos);
-
-        if (line[pos] == '(') {
-            linestack.push_back(linestack.back());
-            pos++;
-        }
-        else if (line[pos] == ')') {
-            clean_line(linestack.back());
-            movelist.push_back(linestack.back());
-            linestack.pop_back();
-            pos++;
-        }
-        else {
-            if (!read_move_annot(line, pos, move)) {
-                break;
-            }
-            if (move.moveno == 0 && linestack.back().back().is_white) {
-                // guess moveno matches previous move since often omitted
-                move.moveno = linestack.back().back().moveno;
-                move.is_white = false;
-            }
-            linestack.back().push_back(move);
+    // a run of ordinary characters: a move number, result or move
+    end = pos;
+    while (end < text.size() && !is_pgn_delimiter(text[end])) {
+        end++;
+    }
+    std::string_view word = text.substr(pos, end - pos);
+    if (is_result(word) || word == "*") {
+        token.type = PGN_RESULT;
+        token.text = word;
+        pos = end;
+        return true;
+    }
+    size_t digits = 0;
+    while (digits < word.size() && is_digit(word[digits])) {
+        token.number = token.number * 10 + word[digits] - '0';
+        digits++;
+    }
+    if (digits > 0 && digits < word.size() && word[digits] == '.') {
+        size_t dots = digits;
+        while (dots < word.size() && word[dots] == '.') {
+            dots++;
         }
-
+        token.type = PGN_MOVE_NUMBER;
+        token.text = word.substr(0, dots);
+        token.is_white = dots - digits == 1;
+        // "12.e4" carries on with the move
+        pos += dots;
+        return true;
     }
+    token.number = 0;
 
-    for (auto iter = linestack.begin(); iter != linestack.end(); iter++) {
-        movelist.push_back(*iter);
+    size_t move_end = word.size();
+    while (move_end > 0 && (word[move_end - 1] == '!' || word[move_end - 1] == '?')) {
+        move_end--;
+    }
+    // evaluation symbols like += or N aren't moves
+    if (word.substr(0, move_end).find_first_of("0123456789Oabcdefgh") == std::string_view::npos) {
+        token.type = PGN_NAG;
+        token.text = word;
+    } else {
+        token.type = PGN_MOVE;
+        token.text = word.substr(0, move_end);
+        pending_glyphs = word.substr(move_end);
     }
+    pos = end;
+    return true;
 }
 
-bool is_result(const std::string &candidate_move)
+bool is_result(std::string_view candidate_move)
 {
-    return (candidate_move[0] == '1' && (candidate_move == "1-0" || candidate_move == "1/2-1/2")) ||
-        (candidate_move[0] == '0' && candidate_move == "0-1");
+    return candidate_move == "1-0" || candidate_move == "0-1" || candidate_move == "1/2-1/2";
 }
 
-void read_annotation(const std::string &buf, int start_pos, int end_pos, std::string &eval, std::string &clock)
+GameResult parse_game_result(std::string_view result)
 {
-    while (start_pos < end_pos) {
-        int open_bracket = buf.find('[', start_pos);
-        if (open_bracket == std::string::npos || open_bracket >= end_pos) {
+    if (result == "1-0") {
+        return RESULT_WHITE;
+    } else if (result == "0-1") {
+        return RESULT_BLACK;
+    } else if (result == "1/2-1/2") {
+        return RESULT_DRAW;
+    }
+    return RESULT_NONE;
+}
+
+void read_annotation(std::string_view comment, std::string &eval, std::string &clock)
+{
+    size_t pos = 0;
+    while (pos < comment.size()) {
+        size_t open_bracket = comment.find('[', pos);
+        if (open_bracket == std::string_view::npos) {
             break;
         }
-        int space = buf.find(' ', open_bracket);
-        if (space == std::string::npos) {
+        size_t space = comment.find(' ', open_bracket);
+        if (space == std::string_view::npos) {
             break;
         }
-        int close_bracket = buf.find(']', space);
-        if (close_bracket == std::string::npos) {
+        size_t close_bracket = comment.find(']', space);
+        if (close_bracket == std::string_view::npos) {
             break;
         }
-//        std::string key = buf.substr(open_bracket + 1, space - open_bracket - 1);
-        if (buf.compare(open_bracket + 1, space - open_bracket - 1, "%clk") == 0) {
-            std::string val = buf.substr(space + 1, close_bracket - space - 1);
-            clock = val;
+        std::string_view key = comment.substr(open_bracket + 1, space - open_bracket - 1);
+        if (key == "%clk") {
+            clock.assign(comment.substr(space + 1, close_bracket - space - 1));
         }
-        else if (buf.compare(open_bracket + 1, space - open_bracket - 1, "%eval") == 0) {
-            std::string val = buf.substr(space + 1, close_bracket - space - 1);
-            eval = val;
+        else if (key == "%eval") {
+            eval.assign(comment.substr(space + 1, close_bracket - space - 1));
         }
-        start_pos = close_bracket;
+        pos = close_bracket;
     }
 }
 
-void read_pgn(pgn_input_stream *input, std::map<std::string, std::string> &metadata, std::vector<std::pair<move_annot, move_annot> > &movelist, bool want_metadata)
+// Reads the tag pairs of the next game into metadata and joins its movetext
+// lines into the stream's game buffer, which the returned view
+// points into. A blank line after the movetext ends the game.
+static std::string_view read_game_text(pgn_input_stream *input, std::map<std::string, std::string> &metadata, bool want_metadata)
 {
-    std::string line;
-    int pos = 0;
+    std::string &movetext = input->game_buffer;
+    std::string &buf = input->line_buffer;
     bool has_metadata = false;
+    movetext.clear();
     while (input->is_readable()) {
-        std::string buf;
+        buf.clear();
         input->read_line(buf);
-        line.append(buf);
-        while (line[0] == '\xef' || line[0] == '\xbb' || line[0] == '\xbf') {
-            // skip unicode bom
-            line = line.substr(1);
+        std::string_view line(buf);
+        if (movetext.empty()) {
+            while (!line.empty() && (line[0] == '\xef' || line[0] == '\xbb' || line[0] == '\xbf')) {
+                // skip unicode bom
+                line.remove_prefix(1);
+            }
         }
-        if (line[line.length() - 1] == '\r') {
-            line = line.substr(0, line.length() - 1);
+        if (!line.empty() && line.back() == '\r') {
+            line.remove_suffix(1);
         }
-        if (line[0] == '[') {
-            if (!movelist.empty()) {
-                break;
-            }
+        if (movetext.empty() && !line.empty() && line[0] == '[') {
             if (want_metadata) {
-                int spacepos = line.find(' ');
-                int lastquote = line.rfind('"');
-                metadata[line.substr(1, spacepos-1)] = line.substr(spacepos+2, lastquote-spacepos-2);
+                pgn_tokenizer tags(line);
+                pgn_token token;
+                while (tags.next(token)) {
+                    if (token.type == PGN_TAG) {
+                        metadata[std::string(token.text)] = std::string(token.value);
+                    }
+                }
             }
             has_metadata = true;
-            // don't need this content anymore
-            line.clear();
         }
-        else if (buf.size() <= 1 && line.size() > 2) {
+        else if (buf.size() <= 1 && movetext.size() > 2) {
             // newline ends the game
             break;
         }
-        else if (line.size() > 0) {
+        else if (!line.empty()) {
             // process actual moves
-            line.append(" ");
+            movetext.append(line);
+            movetext.push_back('\n');
         }
     }
-    if (!has_metadata && line.size() > 2) {
+    if (!has_metadata && movetext.size() > 2) {
         std::cerr << "Error: no pgn header, are you sure this is pgn? " << std::endl;
         abort();
     }
-    while (pos < line.size() && pos >= 0) {
-        // 1. e4 g6 2. Ne2 Bg7 3.
-        int start_white_move, end_white_move, start_black_move, end_black_move;
+    return movetext;
+}
 
-        pos = line.find('.', pos);
+static void report_unterminated_comment(const pgn_tokenizer &tokenizer, std::string_view movetext)
+{
+    if (tokenizer.had_unterminated_comment()) {
+        size_t open_brace = movetext.rfind('{');
+        std::cerr << "Unterminated move metadata around " << movetext.substr(open_brace < 5 ? 0 : open_brace - 5, 10) << std::endl;
+    }
+}
 
-        if (pos < 0) {
-            break;
+void clean_line(std::vector<move_annot> &moveline) {
+    // removes doubled moves
+    move_annot *min_move;
+    bool is_first = true;
+
+    for (auto iter = moveline.rbegin(); iter != moveline.rend(); iter++) {
+        if (is_first) {
+            min_move = &moveline.back();
+            is_first = false;
+        } else {
+            // case one: moving backwards
+            if (iter->moveno < min_move->moveno || (iter->moveno == min_move->moveno && iter->is_white && !min_move->is_white)) {
+                min_move = &*iter;
+            }
+            // case two: same or forwards -> omit
+            else {
+                // stupid c++ hack because moveline.erase(iter) doesn't work for reverse iter
+                moveline.erase((iter+1).base());
+            }
         }
+    }
+}
 
-        // skip any spaces or extra periods
-        while (line[++pos] == ' ')
-            ;
-        start_white_move = pos;
-        end_white_move = line.find(' ', pos);
-        if (start_white_move == -1 || end_white_move == -1) {
-            break;
+void read_pgn_options(pgn_input_stream *input, std::map<std::string, std::string> &metadata, movelist_tree &movelist)
+{
+    std::string_view movetext = read_game_text(input, metadata, true);
+    pgn_tokenizer tokenizer(movetext);
+    pgn_token token;
+
+    movelist_tree linestack;
+    linestack.push_back(std::vector<move_annot>());
+    // the move number token just read, if any
+    pgn_token move_number{};
+    bool numbered = false;
+    bool annotate_last_move = false;
+
+    while (tokenizer.next(token) && token.type != PGN_RESULT) {
+        if (token.type == PGN_VARIATION_START) {
+            linestack.push_back(linestack.back());
+            annotate_last_move = false;
         }
-        pos = end_white_move;
-        move_annot white_move;
-        white_move.move = line.substr(start_white_move, end_white_move - start_white_move);
-        while (line[++pos] == ' ')
-            ;
-        // lichess move annotations: eg. 1. e4 { [%eval 0.2] [%clk 0:05:00] } 1... e5 { [%eval 0.17] [%clk 0:05:00] }
-        if (line[pos] == '{') {
-            int end_annotation = line.find('}', pos);
-            if (end_annotation > pos) {
-                read_annotation(line, pos, end_annotation, white_move.eval, white_move.clock);
-                pos = end_annotation + 1;
-            } else {
-                std::cerr << "Unterminated move metadata around " << line.substr(pos - 5, 10) << std::endl;
-                return;
+        else if (token.type == PGN_VARIATION_END) {
+            if (linestack.size() > 1) {
+                clean_line(linestack.back());
+                movelist.push_back(std::move(linestack.back()));
+                linestack.pop_back();
             }
+            annotate_last_move = false;
+        }
+        else if (token.type == PGN_MOVE_NUMBER) {
+            move_number = token;
+            numbered = true;
         }
-        // check for restatement of move number, eg. "1..." but don't get tripped by 1/2-1/2
-        int move_pos = pos;
-        bool found_dot = false;
-        bool done = false;
-        while (!done) {
-            char c = line[move_pos];
-            switch(c) {
-                case '.':
-                    found_dot = true;
-                    /* fall through */
-                case ' ': case '0': case '1': case '2': case '3': case '4': case '5': case '6': case '7': case '8': case '9':
-                    move_pos++;
-                    break;
-                default:
-                    done = true;
-                    break;
+        else if (token.type == PGN_MOVE) {
+            std::vector<move_annot> &line = linestack.back();
+            line.emplace_back();
+            move_annot &move = line.back();
+            move.move.assign(token.text);
+            if (numbered) {
+                move.moveno = move_number.number;
+                move.is_white = move_number.is_white;
+            } else if (line.size() > 1 && line[line.size() - 2].is_white) {
+                // guess moveno matches previous move since often omitted
+                move.moveno = line[line.size() - 2].moveno;
+                move.is_white = false;
+            } else {
+                move.moveno = line.size() > 1 ? line[line.size() - 2].moveno + 1 : 0;
+                move.is_white = true;
             }
+            numbered = false;
+            annotate_last_move = true;
         }
-        if (found_dot) {
-            pos = move_pos;
+        else if (token.type == PGN_COMMENT && annotate_last_move) {
+            // lichess move annotations: eg. 1. e4 { [%eval 0.2] [%clk 0:05:00] } 1... e5 { [%eval 0.17] [%clk 0:05:00] }
+            read_annotation(token.text, linestack.back().back().eval, linestack.back().back().clock);
         }
-        start_black_move = pos;
-        end_black_move = line.find(' ', start_black_move);
-        pos = end_black_move;
+    }
+    report_unterminated_comment(tokenizer, movetext);
 
-        move_annot black_move;
-        if (end_black_move >= 0 && start_black_move >= 0) {
-            black_move.move = line.substr(start_black_move, end_black_move - start_black_move);
-            while (line[++pos] == ' ')
-                ;
-            if (line[pos] == '{') {
-                int end_annotation = line.find('}', pos);
-                if (end_annotation > pos) {
-                    read_annotation(line, pos, end_annotation, black_move.eval, black_move.clock);
-                    pos = end_annotation + 1;
-                } else {
-                    std::cerr << "Unterminated move metadata around " << line.substr(pos - 5, 10) << std::endl;
-                    return;
-                }
-            }
+    for (auto iter = linestack.begin(); iter != linestack.end(); iter++) {
+        movelist.push_back(std::move(*iter));
+    }
+}
+
+void read_pgn(pgn_input_stream *input, std::map<std::string, std::string> &metadata, std::vector<std::pair<move_annot, move_annot> > &movelist, bool want_metadata)
+{
+    std::string_view movetext = read_game_text(input, metadata, want_metadata);
+    pgn_tokenizer tokenizer(movetext);
+    pgn_token token;
+    // only the main line is kept
+    int variation_depth = 0;
+    int moveno = 1;
+    bool white_to_move = true;
+    move_annot *last_move = nullptr;
+
+    // 1. e4 g6 2. Ne2 Bg7 3.
+    while (tokenizer.next(token)) {
+        if (token.type == PGN_VARIATION_START) {
+            variation_depth++;
         }
-        if (is_result(white_move.move)) {
+        else if (token.type == PGN_VARIATION_END) {
+            variation_depth = std::max(variation_depth - 1, 0);
+        }
+        else if (variation_depth > 0) {
+            continue;
+        }
+        else if (token.type == PGN_RESULT) {
             break;
         }
-        if (is_result(black_move.move)) {
-            black_move.move = "";
+        else if (token.type == PGN_MOVE_NUMBER) {
+            moveno = token.number;
+        }
+        else if (token.type == PGN_MOVE) {
+            if (white_to_move) {
+                movelist.emplace_back();
+                last_move = &movelist.back().first;
+            } else {
+                last_move = &movelist.back().second;
+            }
+            last_move->move.assign(token.text);
+            last_move->moveno = moveno;
+            last_move->is_white = white_to_move;
+            if (!white_to_move) {
+                moveno++;
+            }
+            white_to_move = !white_to_move;
+        }
+        else if (token.type == PGN_COMMENT && last_move != nullptr) {
+            // lichess move annotations: eg. 1. e4 { [%eval 0.2] [%clk 0:05:00] } 1... e5 { [%eval 0.17] [%clk 0:05:00] }
+            read_annotation(token.text, last_move->eval, last_move->clock);
         }
-
-        movelist.push_back(std::pair<move_annot, move_annot>(white_move, black_move));
     }
+    report_unterminated_comment(tokenizer, movetext);
 }
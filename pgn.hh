@@ -1,6 +1,10 @@
+#ifndef PGN_HH_
+#define PGN_HH_
+
 #include <iostream>
 #include <map>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <utility>
 
@@ -16,6 +20,10 @@ struct pgn_input_stream {
     virtual bool is_readable() const = 0;
     virtual void read_line(std::string &line) = 0;
     virtual ~pgn_input_stream() {}
+
+    // scratch space reused by read_pgn across games so parsing doesn't allocate per game
+    std::string line_buffer;
+    std::string game_buffer;
 };
 
 struct pgn_istream : pgn_input_stream {
@@ -34,5 +42,50 @@ struct pgn_istream : pgn_input_stream {
 
 typedef std::vector<std::vector<move_annot> > movelist_tree;
 
+enum pgn_token_type {
+    PGN_TAG,               // [Name "value"]: text is the name, value the raw text between the quotes
+    PGN_MOVE_NUMBER,       // 12. or 12...: number and is_white are set
+    PGN_MOVE,              // SAN or other move text, without trailing !/? glyphs
+    PGN_COMMENT,           // {...} or ; to end of line, without the delimiters
+    PGN_NAG,               // $12, or glyphs like !? split from a move
+    PGN_VARIATION_START,
+    PGN_VARIATION_END,
+    PGN_RESULT             // 1-0, 0-1, 1/2-1/2 or *
+};
+
+struct pgn_token {
+    pgn_token_type type;
+    std::string_view text;
+    std::string_view value;
+    int number;
+    bool is_white;
+};
+
+// Splits PGN text into tokens that point into the caller's buffer, so the
+// buffer has to outlive the tokens.
+class pgn_tokenizer {
+public:
+    pgn_tokenizer(std::string_view text) : text(text), pos(0), unterminated_comment(false) {}
+    bool next(pgn_token &token);
+    bool had_unterminated_comment() const { return unterminated_comment; }
+
+private:
+    std::string_view text;
+    size_t pos;
+    bool unterminated_comment;
+    std::string_view pending_glyphs;
+};
+
+// reads the [%eval ...] and [%clk ...] commands lichess puts in move comments
+void read_annotation(std::string_view comment, std::string &eval, std::string &clock);
+bool is_result(std::string_view candidate_move);
+
+// how a game ended, as the book and position index tools count it
+enum GameResult { RESULT_WHITE, RESULT_DRAW, RESULT_BLACK, RESULT_NONE };
+// from a Result tag; RESULT_NONE for an unfinished game or anything else
+GameResult parse_game_result(std::string_view result);
+
 void read_pgn_options(pgn_input_stream *input, std::map<std::string, std::string> &metadata, movelist_tree &movelist);
 void read_pgn(pgn_input_stream *input, std::map<std::string, std::string> &metadata, std::vector<std::pair<move_annot, move_annot> > &movelist, bool want_metadata=true);
+
+#endif
@@ -0,0 +1,168 @@
+#include <boost/program_options.hpp>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include "book.hh"
+#include "positionindex.hh"
+
+namespace po = boost::program_options;
+
+// builds a position index from pgn files, or looks positions up in one
+
+void build_index(const std::string &index_file, const std::vector<std::string> &pgnfiles, int max_ply, int jobs)
+{
+    std::vector<PositionIndexBuilder> builders(jobs, PositionIndexBuilder(max_ply));
+    for (auto file_iter = pgnfiles.begin(); file_iter != pgnfiles.end(); file_iter++) {
+        std::ifstream file;
+        if (*file_iter != "-") {
+            file.open(*file_iter);
+            if (!file) {
+                std::cerr << "Cannot load " << *file_iter << std::endl;
+                exit(1);
+            }
+        }
+        pgn_istream input(*file_iter == "-" ? std::cin : file);
+        std::mutex input_lock;
+        std::vector<std::thread> workers;
+        for (int i = 0; i < jobs; i++) {
+            workers.emplace_back([&input, &input_lock](PositionIndexBuilder *builder) {
+                Fenboard b;
+                while (true) {
+                    std::map<std::string, std::string> metadata;
+                    std::vector<std::pair<move_annot, move_annot> > movelist;
+                    {
+                        std::lock_guard<std::mutex> guard(input_lock);
+                        if (!input.is_readable()) {
+                            break;
+                        }
+                        read_pgn(&input, metadata, movelist);
+                    }
+                    if (!movelist.empty()) {
+                        builder->add_game(b, metadata, movelist);
+                    }
+                }
+            }, &builders[i]);
+        }
+        for (auto iter = workers.begin(); iter != workers.end(); iter++) {
+            iter->join();
+        }
+    }
+    for (int i = 1; i < jobs; i++) {
+        builders[0].merge(builders[i]);
+    }
+    std::cout << "Indexed " << builders[0].num_games() << " games, " << builders[0].size() << " positions" << std::endl;
+    if (!builders[0].write(index_file)) {
+        exit(1);
+    }
+}
+
+void query_index(const PositionIndex &index, const std::string &fen)
+{
+    Fenboard b;
+    b.set_fen(fen);
+    std::vector<PositionStats> found;
+    auto start = std::chrono::steady_clock::now();
+    index.find(b, found);
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+    uint32_t total = 0;
+    for (auto iter = found.begin(); iter != found.end(); iter++) {
+        total += iter->count;
+    }
+    std::cout << fen << ": reached " << total << " times (" << elapsed << "us)" << std::endl;
+    for (auto iter = found.begin(); iter != found.end(); iter++) {
+        std::cout << "  ";
+        if (iter->move == 0) {
+            std::cout << "(end)";
+        } else {
+            move_t move = polyglot_to_move(b, iter->move);
+            if (move == 0) {
+                // a key collision with some other position
+                continue;
+            }
+            b.print_move(move, std::cout);
+        }
+        std::cout << " " << iter->count << " +" << iter->white_wins << " =" << iter->draws << " -" << iter->black_wins << std::endl;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    std::string index_file;
+    std::vector<std::string> pgnfiles;
+    std::vector<std::string> fens;
+    bool build = false;
+    int max_ply = 1000;
+    int jobs = std::max(1u, std::thread::hardware_concurrency());
+
+    try {
+        po::options_description desc("Allowed options");
+        desc.add_options()
+            ("help", "produce help message")
+            ("index", po::value<std::string>(), "index file to build or query")
+            ("build", po::bool_switch(), "build the index from pgn files (- for stdin)")
+            ("max-ply", po::value<int>(), "plies of each game to index")
+            ("jobs", po::value<int>(), "number of worker threads when building")
+            ("fen", po::value<std::vector<std::string> >(), "position to look up, otherwise reads fens from stdin")
+            ("input-file", po::value<std::vector<std::string> >(), "input file")
+        ;
+
+        po::positional_options_description p;
+        p.add("input-file", -1);
+        po::variables_map vm;
+        po::store(po::command_line_parser(argc, argv).options(desc).positional(p).run(), vm);
+        po::notify(vm);
+
+        if (vm.count("help") || !vm.count("index")) {
+            std::cout << "Usage: " << argv[0] << " --index games.idx --build games.pgn ..." << std::endl;
+            std::cout << "       " << argv[0] << " --index games.idx [--fen fen ...]" << std::endl;
+            std::cout << desc << std::endl;
+            return vm.count("help") ? 0 : 1;
+        }
+        index_file = vm["index"].as<std::string>();
+        build = vm["build"].as<bool>();
+        if (vm.count("input-file")) {
+            pgnfiles = vm["input-file"].as<std::vector<std::string>>();
+        }
+        if (vm.count("fen")) {
+            fens = vm["fen"].as<std::vector<std::string>>();
+        }
+        if (vm.count("max-ply")) {
+            max_ply = vm["max-ply"].as<int>();
+        }
+        if (vm.count("jobs")) {
+            jobs = std::max(1, vm["jobs"].as<int>());
+        }
+    }
+    catch(std::exception& e) {
+        std::cerr << "error: " << e.what() << "\n";
+        return 1;
+    }
+
+    if (build) {
+        if (pgnfiles.empty()) {
+            pgnfiles.push_back("-");
+        }
+        build_index(index_file, pgnfiles, max_ply, jobs);
+        return 0;
+    }
+
+    PositionIndex index;
+    if (!index.open(index_file)) {
+        return 1;
+    }
+    if (fens.empty()) {
+        std::string fen;
+        while (std::getline(std::cin, fen)) {
+            if (!fen.empty()) {
+                query_index(index, fen);
+            }
+        }
+    }
+    for (auto iter = fens.begin(); iter != fens.end(); iter++) {
+        query_index(index, *iter);
+    }
+    return 0;
+}
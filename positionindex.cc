@@ -0,0 +1,309 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include "book.hh"
+#include "pgn.hh"
+#include "positionindex.hh"
+
+const char INDEX_MAGIC[8] = { 'P', 'O', 'S', 'I', 'N', 'D', 'E', 'X' };
+const uint32_t INDEX_VERSION = 1;
+// small enough that decoding one is cheap, large enough that the block
+// table stays a small fraction of the file
+const uint32_t INDEX_BLOCK_RECORDS = 128;
+
+// native byte order; the block table is read in place from the mapping
+struct IndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t block_records;
+    uint64_t num_records;
+    uint64_t num_blocks;
+    uint64_t blocks_offset;
+};
+
+static void write_varint(std::string &out, uint64_t value)
+{
+    while (value >= 0x80) {
+        out.push_back((char)(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back((char)value);
+}
+
+static uint64_t read_varint(const unsigned char *&pos)
+{
+    uint64_t value = 0;
+    int shift = 0;
+    while (*pos & 0x80) {
+        value |= (uint64_t)(*pos++ & 0x7f) << shift;
+        shift += 7;
+    }
+    value |= (uint64_t)*pos++ << shift;
+    return value;
+}
+
+void PositionIndexBuilder::add(uint64_t key, uint16_t move, int result)
+{
+    std::vector<PositionStats> &moves = stats[key];
+    auto iter = moves.begin();
+    while (iter != moves.end() && iter->move != move) {
+        iter++;
+    }
+    if (iter == moves.end()) {
+        moves.push_back({ key, move, 0, 0, 0, 0 });
+        iter = moves.end() - 1;
+    }
+    iter->count++;
+    switch (result) {
+        case RESULT_WHITE: iter->white_wins++; break;
+        case RESULT_DRAW: iter->draws++; break;
+        case RESULT_BLACK: iter->black_wins++; break;
+    }
+}
+
+void PositionIndexBuilder::add_game(Fenboard &b, std::map<std::string, std::string> &metadata, const std::vector<std::pair<move_annot, move_annot> > &movelist)
+{
+    int result = parse_game_result(metadata["Result"]);
+    if (metadata.count("FEN")) {
+        b.set_fen(metadata["FEN"]);
+    } else {
+        b.set_starting_position();
+    }
+
+    int ply = 0;
+    bool finished = true;
+    for (auto iter = movelist.begin(); iter != movelist.end() && finished; iter++) {
+        for (const move_annot *annot : { &iter->first, &iter->second }) {
+            if (annot->move.length() <= 1) {
+                break;
+            }
+            if (ply >= max_ply) {
+                finished = false;
+                break;
+            }
+            move_t move = b.read_move(annot->move, b.get_side_to_play());
+            add(polyglot_key(b), move_to_polyglot(move), result);
+            b.apply_move(move);
+            ply++;
+        }
+    }
+    if (finished && ply < max_ply) {
+        add(polyglot_key(b), 0, result);
+    }
+    games++;
+}
+
+void PositionIndexBuilder::add_games(pgn_input_stream *input)
+{
+    Fenboard b;
+    std::map<std::string, std::string> metadata;
+    std::vector<std::pair<move_annot, move_annot> > movelist;
+    while (input->is_readable()) {
+        metadata.clear();
+        movelist.clear();
+        read_pgn(input, metadata, movelist);
+        if (!movelist.empty()) {
+            add_game(b, metadata, movelist);
+        }
+    }
+}
+
+void PositionIndexBuilder::merge(const PositionIndexBuilder &other)
+{
+    for (auto iter = other.stats.begin(); iter != other.stats.end(); iter++) {
+        std::vector<PositionStats> &moves = stats[iter->first];
+        for (const PositionStats &from : iter->second) {
+            auto to = std::find_if(moves.begin(), moves.end(), [&](const PositionStats &s) { return s.move == from.move; });
+            if (to == moves.end()) {
+                moves.push_back(from);
+            } else {
+                to->count += from.count;
+                to->white_wins += from.white_wins;
+                to->draws += from.draws;
+                to->black_wins += from.black_wins;
+            }
+        }
+    }
+    games += other.games;
+}
+
+bool PositionIndexBuilder::write(const std::string &filename) const
+{
+    std::vector<PositionStats> records;
+    records.reserve(stats.size());
+    for (auto iter = stats.begin(); iter != stats.end(); iter++) {
+        records.insert(records.end(), iter->second.begin(), iter->second.end());
+    }
+    std::sort(records.begin(), records.end(), [](const PositionStats &a, const PositionStats &b) {
+        if (a.key != b.key) {
+            return a.key < b.key;
+        }
+        return a.count != b.count ? a.count > b.count : a.move < b.move;
+    });
+
+    std::ofstream out(filename, std::ios::binary);
+    if (!out) {
+        std::cerr << "Couldn't write index " << filename << std::endl;
+        return false;
+    }
+    IndexHeader header;
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.version = INDEX_VERSION;
+    header.block_records = INDEX_BLOCK_RECORDS;
+    header.num_records = records.size();
+    header.num_blocks = (records.size() + INDEX_BLOCK_RECORDS - 1) / INDEX_BLOCK_RECORDS;
+    out.write((const char *)&header, sizeof(header));
+
+    // keys are close together once sorted, so they delta code to a few bytes
+    std::vector<uint64_t> block_table;
+    std::string block;
+    uint64_t offset = sizeof(header);
+    for (size_t start = 0; start < records.size(); start += INDEX_BLOCK_RECORDS) {
+        size_t end = std::min(records.size(), start + INDEX_BLOCK_RECORDS);
+        uint64_t prev_key = records[start].key;
+        block.clear();
+        for (size_t i = start; i < end; i++) {
+            const PositionStats &record = records[i];
+            write_varint(block, record.key - prev_key);
+            block.push_back((char)(record.move & 0xff));
+            block.push_back((char)(record.move >> 8));
+            write_varint(block, record.count);
+            write_varint(block, record.white_wins);
+            write_varint(block, record.draws);
+            write_varint(block, record.black_wins);
+            prev_key = record.key;
+        }
+        block_table.push_back(records[start].key);
+        block_table.push_back(offset);
+        out.write(block.data(), block.size());
+        offset += block.size();
+    }
+    // align the block table so it can be used straight from the mapping
+    while (offset % sizeof(uint64_t)) {
+        out.put(0);
+        offset++;
+    }
+    out.write((const char *)block_table.data(), block_table.size() * sizeof(uint64_t));
+    header.blocks_offset = offset;
+    out.seekp(0);
+    out.write((const char *)&header, sizeof(header));
+    if (!out) {
+        std::cerr << "Couldn't write index " << filename << std::endl;
+        return false;
+    }
+    return true;
+}
+
+PositionIndex::PositionIndex() : data(nullptr), mapped_size(0), num_records(0), num_blocks(0), block_records(0), blocks(nullptr)
+{
+}
+
+PositionIndex::~PositionIndex()
+{
+    close();
+}
+
+bool PositionIndex::open(const std::string &filename)
+{
+    close();
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(IndexHeader)) {
+        std::cerr << "Couldn't open index " << filename << std::endl;
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        return false;
+    }
+    void *mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED) {
+        std::cerr << "Couldn't map index " << filename << std::endl;
+        return false;
+    }
+    const IndexHeader *header = (const IndexHeader *)mapped;
+    if (memcmp(header->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0 || header->version != INDEX_VERSION ||
+            header->blocks_offset + header->num_blocks * sizeof(BlockHeader) > (uint64_t)st.st_size) {
+        std::cerr << "Not a position index " << filename << std::endl;
+        munmap(mapped, st.st_size);
+        return false;
+    }
+    madvise(mapped, st.st_size, MADV_RANDOM);
+    data = (const unsigned char *)mapped;
+    mapped_size = st.st_size;
+    num_records = header->num_records;
+    num_blocks = header->num_blocks;
+    block_records = header->block_records;
+    blocks = (const BlockHeader *)(data + header->blocks_offset);
+    return true;
+}
+
+void PositionIndex::close()
+{
+    if (data != nullptr) {
+        munmap((void *)data, mapped_size);
+    }
+    data = nullptr;
+    mapped_size = 0;
+    num_records = 0;
+    num_blocks = 0;
+    blocks = nullptr;
+}
+
+bool PositionIndex::decode_block(uint64_t block, uint64_t key, std::vector<PositionStats> &found) const
+{
+    const unsigned char *pos = data + blocks[block].offset;
+    uint64_t count = std::min<uint64_t>(block_records, num_records - block * block_records);
+    PositionStats record;
+    record.key = blocks[block].first_key;
+    for (uint64_t i = 0; i < count; i++) {
+        record.key += read_varint(pos);
+        record.move = pos[0] | (pos[1] << 8);
+        pos += 2;
+        record.count = read_varint(pos);
+        record.white_wins = read_varint(pos);
+        record.draws = read_varint(pos);
+        record.black_wins = read_varint(pos);
+        if (record.key > key) {
+            return false;
+        } else if (record.key == key) {
+            found.push_back(record);
+        }
+    }
+    return true;
+}
+
+bool PositionIndex::find(uint64_t key, std::vector<PositionStats> &found) const
+{
+    if (!is_open() || num_blocks == 0) {
+        return false;
+    }
+    // the first block starting at or after the key; the key's records may
+    // begin at the end of the block before it
+    uint64_t low = 0, high = num_blocks;
+    while (low < high) {
+        uint64_t mid = low + (high - low) / 2;
+        if (blocks[mid].first_key < key) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    size_t num_found = found.size();
+    for (uint64_t block = low > 0 ? low - 1 : 0; block < num_blocks; block++) {
+        if (!decode_block(block, key, found)) {
+            break;
+        }
+    }
+    return found.size() > num_found;
+}
+
+bool PositionIndex::find(const Fenboard &b, std::vector<PositionStats> &found) const
+{
+    return find(polyglot_key(b), found);
+}
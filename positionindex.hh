@@ -0,0 +1,84 @@
+#ifndef POSITIONINDEX_HH_
+#define POSITIONINDEX_HH_
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "fenboard.hh"
+#include "pgn.hh"
+
+// How often each position in a set of games was reached, what was played
+// from it and how those games ended. Positions are keyed by their Polyglot
+// key so an index lines up with opening books built from the same games.
+
+// one move from a position; move 0 counts games that ended there
+struct PositionStats {
+    uint64_t key;
+    uint16_t move;  // Polyglot encoding, decode with polyglot_to_move
+    uint32_t count;
+    uint32_t white_wins;
+    uint32_t draws;
+    uint32_t black_wins;
+};
+
+class PositionIndexBuilder {
+public:
+    PositionIndexBuilder(int max_ply = 1000) : max_ply(max_ply), games(0) {}
+
+    void add_game(Fenboard &b, std::map<std::string, std::string> &metadata, const std::vector<std::pair<move_annot, move_annot> > &movelist);
+    // reads games until the stream runs out
+    void add_games(pgn_input_stream *input);
+    // folds in counts gathered by another builder, eg. on another thread
+    void merge(const PositionIndexBuilder &other);
+
+    size_t size() const { return stats.size(); }
+    uint64_t num_games() const { return games; }
+    bool write(const std::string &filename) const;
+
+private:
+    void add(uint64_t key, uint16_t move, int result);
+
+    int max_ply;
+    uint64_t games;
+    // key -> move -> stats; most positions are seen once with one move
+    std::unordered_map<uint64_t, std::vector<PositionStats> > stats;
+};
+
+// Reads an index written by PositionIndexBuilder. The file is a header,
+// blocks of delta and varint coded records sorted by key, then a table of
+// the first key and offset of each block. A lookup binary searches the block
+// table and decodes at most a couple of blocks from the mapped file.
+class PositionIndex {
+public:
+    PositionIndex();
+    ~PositionIndex();
+
+    bool open(const std::string &filename);
+    void close();
+    bool is_open() const { return data != nullptr; }
+    uint64_t size() const { return num_records; }
+
+    // all moves played from a position, most played first; false if never seen
+    bool find(uint64_t key, std::vector<PositionStats> &found) const;
+    bool find(const Fenboard &b, std::vector<PositionStats> &found) const;
+
+private:
+    struct BlockHeader {
+        uint64_t first_key;
+        uint64_t offset;
+    };
+
+    // false once past the key
+    bool decode_block(uint64_t block, uint64_t key, std::vector<PositionStats> &found) const;
+
+    const unsigned char *data;
+    size_t mapped_size;
+    uint64_t num_records;
+    uint64_t num_blocks;
+    uint32_t block_records;
+    const BlockHeader *blocks;
+};
+
+#endif
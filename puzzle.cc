@@ -1,13 +1,21 @@
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <memory>
 #include <time.h>
 #include "search.hh"
 #include "evaluate.hh"
 #include "pgn.hh"
 #include "bitboard.hh"
 #include "nnueeval.hh"
+#include "analysiscache.hh"
+#include "tablebase.hh"
 
-bool expect_move(Search &search, Fenboard &b, int depth, const std::string &puzzle_name, const std::vector<std::string> &expected_move, uint64_t &nodecount)
+bool expect_move(Search &search, Fenboard &b, int depth, const std::string &puzzle_name, const std::vector<std::string> &expected_move, uint64_t &nodecount, std::ostream &os = std::cout)
 {
     if (depth != 0) {
         search.max_depth = depth;
@@ -18,7 +26,7 @@ bool expect_move(Search &search, Fenboard &b, int depth, const std::string &puzz
     for (std::vector<std::string>::const_iterator iter = expected_move.begin(); iter != expected_move.end(); iter++) {
         move_t expected_move_parsed = b.read_move(*iter, side_to_play);
         if (expected_move_parsed == move) {
-            std::cout << "Puzzle " << puzzle_name << " passed with " << nodecount << " nodes" << std::endl;
+            os << "Puzzle " << puzzle_name << " passed with " << nodecount << " nodes" << std::endl;
             return true;
         }
     }
@@ -27,11 +35,11 @@ bool expect_move(Search &search, Fenboard &b, int depth, const std::string &puzz
         std::cerr << "Error: couldn't find expected move" << std::endl;
         return false;
     }
-    b.get_fen(std::cout);
-    std::cout << std::endl;
-    std::cout << "at depth=" << depth << " expected " << expected_move.front() << " but got ";
-    b.print_move(move, std::cout);
-    std::cout << std::endl;
+    b.get_fen(os);
+    os << std::endl;
+    os << "at depth=" << depth << " expected " << expected_move.front() << " but got ";
+    b.print_move(move, os);
+    os << std::endl;
     return false;
 }
 
@@ -48,72 +56,199 @@ void get_first_move_choices(Color side_to_play, const movelist_tree &move_choice
 struct Results {
     int passed;
     int attempts;
-    int nodes;
+    uint64_t nodes;
     double elapsed;
+    int64_t elo_scores;
 
-    Results() : passed(0), attempts(0), nodes(0), elapsed(0)
+    Results() : passed(0), attempts(0), nodes(0), elapsed(0), elo_scores(0)
     {}
+
+    void add(bool result, uint64_t puzzle_nodes, int rating) {
+        attempts++;
+        nodes += puzzle_nodes;
+        elo_scores += rating;
+        if (result) {
+            passed++;
+        }
+    }
+
+    void merge(const Results &other) {
+        passed += other.passed;
+        attempts += other.attempts;
+        nodes += other.nodes;
+        elo_scores += other.elo_scores;
+    }
+
+    // performance rating, scoring each puzzle as a game against its rating
+    int elo_rating() const {
+        return attempts > 0 ? (int)((elo_scores - 400 * attempts + 800 * passed) / attempts) : 0;
+    }
 };
 
-void read_csv_puzzles(Fenboard &b, Search &search, std::ifstream &puzzles, int depth, Results &r)
-{
-    //lichess puzzles format
-    //header: PuzzleId,FEN,Moves,Rating,RatingDeviation,Popularity,NbPlays,Themes,GameUrl,OpeningTags
+const int RATING_BUCKET = 200;
 
-    int elo_scores = 0;
+struct PuzzleStats {
+    Results total;
+    std::map<std::string, Results> themes;
+    std::map<int, Results> rating_buckets;
 
-    while (!puzzles.eof()) {
-        std::string line;
-        std::vector<std::string> parts;
-        std::getline(puzzles, line);
+    void add(bool result, uint64_t puzzle_nodes, int rating, const std::string &themes_text) {
+        total.add(result, puzzle_nodes, rating);
+        rating_buckets[rating / RATING_BUCKET * RATING_BUCKET].add(result, puzzle_nodes, rating);
+        std::istringstream theme_stream(themes_text);
+        std::string theme;
+        while (theme_stream >> theme) {
+            themes[theme].add(result, puzzle_nodes, rating);
+        }
+    }
 
-        size_t start = 0, stop;
-        while (true) {
-            stop = line.find(",", start);
-            if (stop == std::string::npos) {
-                break;
-            } else {
-                parts.push_back(line.substr(start, stop - start));
-                start = stop + 1;
-            }
+    void merge(const PuzzleStats &other) {
+        total.merge(other.total);
+        for (auto iter = other.themes.begin(); iter != other.themes.end(); iter++) {
+            themes[iter->first].merge(iter->second);
         }
-        if (parts.size() < 6 || parts[0] == "PuzzleId") {
-            continue;
+        for (auto iter = other.rating_buckets.begin(); iter != other.rating_buckets.end(); iter++) {
+            rating_buckets[iter->first].merge(iter->second);
         }
-        size_t first_move_space = parts[2].find(" ");
-        size_t second_move_space = parts[2].find(" ", first_move_space + 1);
-        if (first_move_space == std::string::npos) {
-            std::cerr << "Error: don't have enough moves in " << parts[0] << std::endl;
+    }
+};
+
+std::ostream &operator<<(std::ostream &os, const Results &r)
+{
+    return os << r.passed << "/" << r.attempts << " (" << (r.attempts > 0 ? r.passed * 100 / r.attempts : 0) << "%)"
+        << " elo " << r.elo_rating() << " nodes " << r.nodes;
+}
+
+// splits a lichess puzzle csv line into fields
+// header: PuzzleId,FEN,Moves,Rating,RatingDeviation,Popularity,NbPlays,Themes,GameUrl,OpeningTags
+bool parse_csv_puzzle(const std::string &line, std::vector<std::string> &parts, std::string &zero_move, std::string &first_move, int &rating)
+{
+    size_t start = 0, stop;
+    while (true) {
+        stop = line.find(",", start);
+        if (stop == std::string::npos) {
             break;
+        } else {
+            parts.push_back(line.substr(start, stop - start));
+            start = stop + 1;
         }
-        if (second_move_space == std::string::npos) {
-            second_move_space = parts[2].size();
+    }
+    if (parts.size() < 8 || parts[0] == "PuzzleId") {
+        return false;
+    }
+    char *rating_end;
+    rating = strtol(parts[3].c_str(), &rating_end, 10);
+    if (parts[3].empty() || *rating_end != '\0') {
+        std::cerr << "Error: bad rating \"" << parts[3] << "\" in " << parts[0] << std::endl;
+        return false;
+    }
+    size_t first_move_space = parts[2].find(" ");
+    size_t second_move_space = parts[2].find(" ", first_move_space + 1);
+    if (first_move_space == std::string::npos) {
+        std::cerr << "Error: don't have enough moves in " << parts[0] << std::endl;
+        return false;
+    }
+    if (second_move_space == std::string::npos) {
+        second_move_space = parts[2].size();
+    }
+    zero_move = parts[2].substr(0, first_move_space);
+    first_move = parts[2].substr(first_move_space + 1, second_move_space - first_move_space - 1);
+    return true;
+}
+
+struct PuzzleRunner {
+    PuzzleRunner(std::istream &puzzles, int depth, int tt_size_log2, AnalysisCache *cache, const Tablebases *tablebases)
+        : puzzles(puzzles), depth(depth), tt_size_log2(tt_size_log2), cache(cache), tablebases(tablebases), completed(0)
+    {}
+
+    // each worker streams lines from the shared csv and solves them with its own engine
+    void worker() {
+        Fenboard b;
+        NNUEEvaluation eval;
+        std::unique_ptr<Search> search = std::make_unique<Search>(&eval, tt_size_log2);
+        search->use_pv = true;
+        search->analysis_cache = cache;
+        search->tablebases = tablebases;
+        PuzzleStats local;
+        std::string line;
+
+        while (true) {
+            {
+                std::lock_guard<std::mutex> lock(input_mutex);
+                if (!std::getline(puzzles, line)) {
+                    break;
+                }
+            }
+            std::vector<std::string> parts;
+            std::string zero_move, first_move;
+            int rating;
+            if (!parse_csv_puzzle(line, parts, zero_move, first_move, rating)) {
+                continue;
+            }
+            std::vector<std::string> first_move_choices;
+            first_move_choices.push_back(first_move);
+            uint64_t puzzle_nodecount = 0;
+            std::ostringstream report;
+
+            b.set_fen(parts[1]);
+            search->reset();
+            b.apply_move(b.read_move(zero_move, b.get_side_to_play()));
+            bool result = expect_move(*search, b, depth, parts[0], first_move_choices, puzzle_nodecount, report);
+            if (!result) {
+                report << " in " << parts[0] << std::endl;
+            }
+            local.add(result, puzzle_nodecount, rating, parts[7]);
+
+            int done = ++completed;
+            std::lock_guard<std::mutex> lock(output_mutex);
+            std::cout << report.str();
+            if (done % 200 == 0) {
+                double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                std::cout << "Puzzles attempted: " << done << " at " << done / elapsed << " puzzles/sec" << std::endl;
+            }
         }
-        std::string zero_move = parts[2].substr(0, first_move_space);
-        std::string first_move = parts[2].substr(first_move_space + 1, second_move_space - first_move_space - 1);
-        std::vector<std::string> first_move_choices;
-        first_move_choices.push_back(first_move);
-        uint64_t puzzle_nodecount = 0;
-        b.set_fen(parts[1]);
-        search.reset();
-        b.apply_move(b.read_move(zero_move, b.get_side_to_play()));
-        clock_t starttime = clock();
-        bool result = expect_move(search, b, depth, parts[0], first_move_choices, puzzle_nodecount);
-        r.elapsed += (clock() - starttime) *1.0 / CLOCKS_PER_SEC;
-        r.attempts++;
-        r.nodes += puzzle_nodecount;
-        elo_scores += std::stoi(parts[3]);
-        if (result) {
-            r.passed++;
-        } else {
-            std::cout << " in " << parts[0] << std::endl;
+        std::lock_guard<std::mutex> lock(output_mutex);
+        stats.merge(local);
+    }
+
+    void run(int jobs) {
+        start = std::chrono::steady_clock::now();
+        std::vector<std::thread> workers;
+        for (int i = 1; i < jobs; i++) {
+            workers.push_back(std::thread(&PuzzleRunner::worker, this));
         }
-        if (r.attempts % 200 == 0) {
-            std::cout << "Puzzles solved: " << r.passed << "/" << r.attempts << " using " << r.nodes << " nodes at " << r.nodes/r.elapsed << " nodes/sec or " << r.attempts/r.elapsed << " puzzles/sec" << std::endl;
+        worker();
+        for (auto iter = workers.begin(); iter != workers.end(); iter++) {
+            iter->join();
         }
+        stats.total.elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    std::istream &puzzles;
+    int depth;
+    int tt_size_log2;
+    AnalysisCache *cache;
+    const Tablebases *tablebases;
+    std::atomic<int> completed;
+    std::mutex input_mutex;
+    std::mutex output_mutex;
+    std::chrono::steady_clock::time_point start;
+    PuzzleStats stats;
+};
+
+void print_stats(const PuzzleStats &stats)
+{
+    std::cout << "By rating:" << std::endl;
+    for (auto iter = stats.rating_buckets.begin(); iter != stats.rating_buckets.end(); iter++) {
+        std::cout << "  " << iter->first << "-" << iter->first + RATING_BUCKET - 1 << ": " << iter->second << std::endl;
+    }
+    std::cout << "By theme:" << std::endl;
+    for (auto iter = stats.themes.begin(); iter != stats.themes.end(); iter++) {
+        std::cout << "  " << iter->first << ": " << iter->second << std::endl;
     }
-    std::cout << "Elo avg " << (int)(elo_scores*1.0/r.attempts) << std::endl;
-    std::cout << "Elo rating " << (int)((elo_scores - 400 * r.attempts + 800 * r.passed) / r.attempts) << std::endl;
+    const Results &r = stats.total;
+    std::cout << "Elo avg " << (r.attempts > 0 ? (int)(r.elo_scores * 1.0 / r.attempts) : 0) << std::endl;
+    std::cout << "Elo rating " << r.elo_rating() << std::endl;
 }
 
 void read_pgn_puzzles(Fenboard &b, Search &search, std::ifstream &puzzles, Results &r)
@@ -166,29 +301,61 @@ void read_pgn_puzzles(Fenboard &b, Search &search, std::ifstream &puzzles, Resul
 
 int main(int argc, char **argv)
 {
-    if (argc != 2) {
-        std::cerr << "Usage: " << argv[0] << " file.pgn" << std::endl;
+    int jobs = 1;
+    int tt_size_log2 = 22;
+    std::string cache_file;
+    std::string tablebase_dir;
+    int argn = 1;
+    while (argn < argc - 1) {
+        std::string arg = argv[argn];
+        if (arg == "--jobs") {
+            jobs = std::max(1, atoi(argv[argn + 1]));
+        } else if (arg == "--tt-size") {
+            tt_size_log2 = atoi(argv[argn + 1]);
+        } else if (arg == "--analysis-cache") {
+            cache_file = argv[argn + 1];
+        } else if (arg == "--tablebases") {
+            tablebase_dir = argv[argn + 1];
+        } else {
+            break;
+        }
+        argn += 2;
+    }
+    if (argn != argc - 1) {
+        std::cerr << "Usage: " << argv[0] << " [--jobs N] [--tt-size log2] [--analysis-cache file] [--tablebases dir] file.pgn|file.csv" << std::endl;
         return 1;
     }
-    std::ifstream puzzles(argv[1]);
+    std::ifstream puzzles(argv[argn]);
     Fenboard b;
 
     if (!puzzles) {
-      std::cerr << "Couldn't read " << argv[1] << std::endl;
+      std::cerr << "Couldn't read " << argv[argn] << std::endl;
       exit(1);
     }
 
-    NNUEEvaluation simple;
-    Search search(&simple);
-    search.use_pv = true;
-
+    AnalysisCache cache;
+    if (!cache_file.empty() && !cache.open(cache_file, 64)) {
+        exit(1);
+    }
+    Tablebases tablebases;
+    if (!tablebase_dir.empty() && tablebases.load(tablebase_dir) == 0) {
+        exit(1);
+    }
+    const Tablebases *tables = tablebases.size() > 0 ? &tablebases : nullptr;
     Results r;
 
-    if (std::string(argv[1]).find(".pgn") != std::string::npos) {
+    if (std::string(argv[argn]).find(".pgn") != std::string::npos) {
+        NNUEEvaluation simple;
+        Search search(&simple);
+        search.use_pv = true;
+        search.analysis_cache = cache.is_open() ? &cache : nullptr;
+        search.tablebases = tables;
         read_pgn_puzzles(b, search, puzzles, r);
     } else {
-        read_csv_puzzles(b, search, puzzles, 8, r);
-
+        PuzzleRunner runner(puzzles, 8, tt_size_log2, cache.is_open() ? &cache : nullptr, tables);
+        runner.run(jobs);
+        print_stats(runner.stats);
+        r = runner.stats.total;
     }
 
     std::cout << "Puzzles solved: " << r.passed << "/" << r.attempts << " using " << r.nodes << " nodes at " << r.nodes/r.elapsed << " nodes/sec or " << r.attempts/r.elapsed << " puzzles/sec" << std::endl;
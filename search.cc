@@ -7,7 +7,11 @@
 #include <set>
 #include <stdlib.h>
 #include <map>
+#include <typeinfo>
 #include "search.hh"
+#include "analysiscache.hh"
+#include "tablebase.hh"
+#include "perft.hh"
 #include "bitboard.hh"
 #include "move.hh"
 #include "net/psqt.h"
@@ -27,6 +31,8 @@ move_t Search::minimax(Fenboard &b)
 {
     nodecount = 0;
     null_nodecount = 0;
+    tbhits = 0;
+    analysis_cache_hit = false;
     bool old_pruning = use_pruning;
     use_pruning = false;
     std::vector<move_t> line;
@@ -43,9 +49,14 @@ move_t Search::alphabeta(Fenboard &b, SearchUpdate *s)
 {
     nodecount = 0;
     null_nodecount = 0;
+    tbhits = 0;
     move_t result = 0;
     low_depth_nodecount = 0;
+    analysis_cache_hit = false;
 
+    if (analysis_cache != nullptr && read_analysis_cache(b, result, s)) {
+        return result;
+    }
     if (use_iterative_deepening) {
         int old_max_depth = max_depth;
         int guess_score = eval->evaluate(b);
@@ -55,6 +66,8 @@ move_t Search::alphabeta(Fenboard &b, SearchUpdate *s)
         if (millis_available > 0) {
             deadline = std::chrono::system_clock::now() + std::chrono::milliseconds(millis_available);
         }
+        int completed_depth = -1;
+        int completed_score = 0;
 
         try {
             for (int iter_depth = (old_max_depth % 2 == 1 ? 1 : 0); iter_depth <= old_max_depth; iter_depth += 2) {
@@ -67,7 +80,7 @@ move_t Search::alphabeta(Fenboard &b, SearchUpdate *s)
                     int backoff = 200;
                     while (true) {
                         uint64_t start_nodecount = nodecount;
-                        sub = negamax_with_memory(b, 0, alpha, beta, line, result);
+                        sub = negamax_with_memory(b, 0, alpha, beta, line, compact_move(result));
                         if (iter_depth < old_max_depth) {
                             low_depth_nodecount = nodecount;
                         }
@@ -94,6 +107,8 @@ move_t Search::alphabeta(Fenboard &b, SearchUpdate *s)
                         }
                     }
                     result = std::get<0>(sub);
+                    completed_depth = iter_depth;
+                    completed_score = score;
                 }
                 if (s != NULL) {
                     (*s)(result, max_depth, nodecount, score);
@@ -107,6 +122,9 @@ move_t Search::alphabeta(Fenboard &b, SearchUpdate *s)
         catch (const std::exception &e) {
             std::cout << "Search interrupted: " << e.what() << std::endl;
         }
+        if (analysis_cache != nullptr && completed_depth >= 0) {
+            analysis_cache->store(analysis_key(b), result, completed_score, completed_depth, TT_EXACT);
+        }
         if (b.get_side_to_play() == Black){
             score = -score;
         }
@@ -116,14 +134,66 @@ move_t Search::alphabeta(Fenboard &b, SearchUpdate *s)
         std::vector<move_t> line;
         sub = negamax_with_memory(b, 0, SCORE_MIN, SCORE_MAX, line);
         score = std::get<2>(sub);
+        result = std::get<0>(sub);
+        if (analysis_cache != nullptr) {
+            analysis_cache->store(analysis_key(b), result, score, max_depth, TT_EXACT);
+        }
         if (b.get_side_to_play() == Black){
             score = -score;
         }
-        result = std::get<0>(sub);
     }
     return result;
 }
 
+// results only carry over between searches with the same eval and settings
+uint64_t Search::analysis_key(const Fenboard &b) const
+{
+    uint64_t settings = std::hash<std::string>()(typeid(*eval).name());
+    settings = settings * 31 + quiescent_depth;
+    settings = settings * 31 + (use_quiescent_search | use_pruning << 1 | use_transposition_table << 2 | use_pv << 3 | use_iterative_deepening << 4);
+    return b.get_hash() ^ (settings * 0x9E3779B97F4A7C15ULL);
+}
+
+bool Search::read_analysis_cache(const Fenboard &b, move_t &move, SearchUpdate *s)
+{
+    AnalysisEntry entry;
+    if (!analysis_cache->lookup(analysis_key(b), max_depth, entry) || entry.bound != TT_EXACT) {
+        return false;
+    }
+    // guard against key collisions
+    std::vector<move_t> legal_moves;
+    get_legal_moves(b, legal_moves);
+    if (std::find(legal_moves.begin(), legal_moves.end(), entry.move) == legal_moves.end()) {
+        return false;
+    }
+    move = entry.move;
+    score = entry.score;
+    analysis_cache_hit = true;
+    if (s != NULL) {
+        (*s)(move, entry.depth, nodecount, score);
+    }
+    if (b.get_side_to_play() == Black) {
+        score = -score;
+    }
+    return true;
+}
+
+bool Search::root_move_score(const Fenboard &b, move_t move, int &value)
+{
+    if (analysis_cache_hit) {
+        return analysis_cache->lookup_played(analysis_key(b), move, value);
+    }
+    compact_move_t tt_move;
+    int alpha = SCORE_MIN, beta = SCORE_MAX;
+    if (!read_transposition(b.get_zobrist_with_move(move), tt_move, 0, alpha, beta, value)) {
+        return false;
+    }
+    if (analysis_cache != nullptr) {
+        analysis_cache->store_played(analysis_key(b), move, value);
+    }
+    return true;
+}
+
 Search::Search(Evaluation *eval, int transposition_table_size_log2)
     : score(0), nodecount(0), qnodecount(0), transposition_table_size_log2(transposition_table_size_log2), use_transposition_table(true),
         use_pruning(true), eval(eval), min_score_prune_sorting(2), use_pv(true), use_iterative_deepening(true),
@@ -147,6 +217,9 @@ Search::Search(Evaluation *eval, int transposition_table_size_log2)
     quiescent_single_capture_square_only = false;
 
     transtable = new TranspositionTable(transposition_table_size_log2);
+    analysis_cache = nullptr;
+    analysis_cache_hit = false;
+    tablebases = nullptr;
     reset();
     for (int i = 0; i < max_depth; i++) {
         move_sorter_pool.push_back(new MoveSorter());
@@ -169,6 +242,7 @@ void Search::reset_counters()
     score = 0;
     nodecount = 0;
     null_nodecount = 0;
+    tbhits = 0;
     qnodecount = 0;
     moves_expanded = 0;
     moves_commenced = 0;
@@ -207,12 +281,12 @@ void emit_sort_feature(const Fenboard &b, move_t move, int alpha, int beta, int
 }
 
 struct Counter {
-    std::map<move_t, int> counts;
-    void add(move_t value) {
+    std::map<compact_move_t, int> counts;
+    void add(compact_move_t value) {
         counts[value] += 1;
     }
-    move_t maximum() {
-        move_t best_move = 0;
+    compact_move_t maximum() {
+        compact_move_t best_move = 0;
         int best_count = -1;
         for (const auto &pair : counts) {
             if (pair.second > best_count) {
@@ -225,7 +299,7 @@ struct Counter {
 };
 
 // principal move, principal reply, cp score
-std::tuple<move_t, move_t, int> Search::negamax_with_memory(Fenboard &b, int depth, int alpha, int beta, std::vector<move_t> &line, move_t hint, int static_score)
+std::tuple<move_t, move_t, int> Search::negamax_with_memory(Fenboard &b, int depth, int alpha, int beta, std::vector<move_t> &line, compact_move_t hint, int static_score)
 {
     if (depth < 3 && millis_available > 0 && !soft_deadline && std::chrono::system_clock::now() > deadline) {
         throw std::runtime_error("Time limit exceeded");
@@ -243,6 +317,14 @@ std::tuple<move_t, move_t, int> Search::negamax_with_memory(Fenboard &b, int dep
     int original_alpha = alpha;
     int original_beta = beta;
 
+    // check the tables before the evaluation's own endgame rules
+    int wdl, plies;
+    if (tablebases != nullptr && depth > 0 && tablebases->probe(b, wdl, plies)) {
+        tbhits++;
+        int score = wdl == 0 ? 0 : (wdl > 0 ? VERY_GOOD - depth - plies : VERY_BAD + depth + plies);
+        return std::tuple<move_t, move_t, int>(-1, -1, score);
+    }
+
     // check for endgames
     int endgame_eval;
     if (eval->endgame(b, endgame_eval)) {
@@ -265,7 +347,7 @@ std::tuple<move_t, move_t, int> Search::negamax_with_memory(Fenboard &b, int dep
     }
 
     bool tt_hint = false;
-    move_t tt_move = 0;
+    compact_move_t tt_move = 0;
 
     // check transposition table
     if (use_transposition_table) {
@@ -274,7 +356,7 @@ std::tuple<move_t, move_t, int> Search::negamax_with_memory(Fenboard &b, int dep
 
         bool found = read_transposition(b.get_hash(), tt_move, max_depth - depth, alpha, beta, exact_value);
         if (found && alpha > beta) {
-            return std::tuple<move_t, move_t, int>(tt_move, 0, exact_value);
+            return std::tuple<move_t, move_t, int>(b.decode_move(tt_move), 0, exact_value);
         }
     }
 
@@ -283,7 +365,7 @@ std::tuple<move_t, move_t, int> Search::negamax_with_memory(Fenboard &b, int dep
     }
 
     if (search_debug > depth) {
-        std::cout << "negamax at depth=" << depth << " [" << alpha << "," << beta << "] " << "tt_hint=" << move_to_uci(tt_move) << " hint0=" << move_to_uci(hint) << std::endl;
+        std::cout << "negamax at depth=" << depth << " [" << alpha << "," << beta << "] " << "tt_hint=" << move_to_uci(b.decode_move(tt_move)) << " hint0=" << move_to_uci(b.decode_move(hint)) << std::endl;
     }
 
     if (depth >= max_depth && !is_quiescent) {
@@ -381,14 +463,14 @@ std::tuple<move_t, move_t, int> Search::negamax_with_memory(Fenboard &b, int dep
                 b.apply_move(move);
 
                 if (use_killer_move && submove != 0) {
-                    killer_move_counter.add(submove);
+                    killer_move_counter.add(compact_move(submove));
                 }
 
                 start_nodecount = nodecount;
                 start_qnodecount = qnodecount;
                 std::tuple<move_t, move_t, int> child;
                 line.push_back(move);
-                move_t killer_move = killer_move_counter.maximum();
+                compact_move_t killer_move = killer_move_counter.maximum();
                 if (use_pv && alpha < beta && !first) {
                     child = negamax_with_memory(b, depth + 1, -alpha, -alpha, line, killer_move, child_static_eval);
                     if (-std::get<2>(child) > alpha) {
@@ -522,7 +604,7 @@ std::tuple<move_t, move_t, int> Search::negamax_with_memory(Fenboard &b, int dep
         print_move_uci(best_move, std::cout) << " score=" << best_score;
         if (hint) {
             std::cout << "(hint=";
-            print_move_uci(hint, std::cout);
+            print_move_uci(b.decode_move(hint), std::cout);
             std::cout << ") ";
         }
         if (tt_hint) {
@@ -558,7 +640,7 @@ void Search::write_transposition(uint64_t board_hash, move_t move, int best_scor
     transtable->insert_tt_entry(board_hash, move, best_score, depth, tt_type);
 }
 
-bool Search::read_transposition(uint64_t board_hash, move_t &tt_move, int depth, int &alpha, int &beta, int &exact_value)
+bool Search::read_transposition(uint64_t board_hash, compact_move_t &tt_move, int depth, int &alpha, int &beta, int &exact_value)
 {
     transposition_checks += 1;
 
@@ -690,7 +772,7 @@ int MoveSorter::get_score_parts_exchange(Color side_to_play, move_t move, uint64
     piece_t actor = get_actor(move);
 
     if (capture != 0) {
-        score = 100 * b->static_exchange_eval(b->get_side_to_play(), dest_sq, capture, actor);
+        score = 100 * b->static_exchange_eval(move);
         // don't double-count captured piece
         if (s->exchange_coeff > 0 && s->psqt_coeff > 0 && capture != 0 && psqt_king_square >= 0 && dest_sq >= 0 && score == 100 * PIECE_VALUE[capture]) {
             score += (s->exchange_coeff / s->psqt_coeff) * psqt_weights[psqt_king_square * (64 * 10) + (capture - 1 + 5) * 64 + dest_sq];
@@ -698,7 +780,12 @@ int MoveSorter::get_score_parts_exchange(Color side_to_play, move_t move, uint64
     }
 
     if (opp_covered_squares & (1ULL << src_sq)) {
-        int null_move_capture = 100 * b->static_exchange_eval(get_opposite_color(b->get_side_to_play()), src_sq, actor, 0);
+        if (!hanging_exchange_computed) {
+            // what the opponent would win taking each covered piece, once for every move
+            b->static_exchange_targets(get_opposite_color(b->get_side_to_play()), b->get_bitmask(b->get_side_to_play(), bb_all), hanging_exchange);
+            hanging_exchange_computed = true;
+        }
+        int null_move_capture = 100 * hanging_exchange[src_sq];
         if (null_move_capture > 0) {
             score += null_move_capture;
         }
@@ -725,7 +812,7 @@ void MoveSorter::get_score_parts_history(move_t move, const std::vector<move_t>
 
 void MoveSorter::get_score_parts(const Fenboard *b, move_t move, const std::vector<move_t> &line, int parts[score_part_len]) const
 {
-    move_t ignore;
+    compact_move_t ignore;
     int16_t tt_value;
     unsigned char tt_depth, tt_type;
 
@@ -761,7 +848,7 @@ void MoveSorter::get_score_parts(const Fenboard *b, move_t move, const std::vect
 int MoveSorter::get_score(const Fenboard *b, move_t move, const std::vector<move_t> &line) const
 {
     if (s != NULL) {
-        move_t tt_move = 0;
+        compact_move_t tt_move = 0;
         int tt_value;
         int tt_alpha = alpha;
         int tt_beta = beta;
@@ -799,21 +886,9 @@ int MoveSorter::get_score(const Fenboard *b, move_t move, const std::vector<move
     return value;
 }
 
-struct MoveCmp {
-    MoveCmp(const std::map<move_t, int> *scores)
-        : scores(scores)
-    {}
-    bool operator()(move_t a, move_t b) const {
-        // sort scores in descending order
-        return scores->at(a) > scores->at(b);
-    }
-    const std::map<move_t, int> *scores;
-};
-
 
 MoveSorter::MoveSorter()
 {
-    buffer.reserve(32);
     index = 0;
 }
 
@@ -822,10 +897,9 @@ void MoveSorter::load_more(const Fenboard *b) {
         switch(phase) {
 
             case P_HINT:
-                if (transposition_hint != 0) {
-                    move_t move = b->reinterpret_move(transposition_hint, opp_covered_squares);
-                    transposition_hint = move;
-                    if (move != 0) {
+                if (compact_transposition_hint != 0) {
+                    transposition_hint = b->decode_move(compact_transposition_hint);
+                    if (transposition_hint != 0) {
                         buffer.push_back(transposition_hint);
                     }
                 }
@@ -835,16 +909,19 @@ void MoveSorter::load_more(const Fenboard *b) {
                 break;
 
             case P_HINT_REINT:
-                if (hint != 0) {
-                    move_t move = b->reinterpret_move(hint, opp_covered_squares);
-                    if (move != 0 && move != transposition_hint) {
-                        buffer.push_back(move);
+                if (compact_hint != 0) {
+                    hint = b->decode_move(compact_hint);
+                    if (hint != 0 && hint != transposition_hint) {
+                        buffer.push_back(hint);
                     }
-                    hint = move;
                 }
                 break;
             case P_CHECK_CAPTURE:
-                b->get_packed_legal_moves(b->get_side_to_play(), move_iter, opp_covered_squares);
+                // start from the captures; the quiet checks and other quiet
+                // moves are generated when their phases come up, so a node
+                // that cuts off early never pays for them
+                gen_type = b->is_in_check() ? GEN_EVASIONS : GEN_CAPTURES;
+                b->get_packed_legal_moves(b->get_side_to_play(), move_iter, opp_covered_squares, -1, bb_all, gen_type);
                 if (s != NULL) {
                     s->moves_expanded += 1;
                 }
@@ -854,24 +931,35 @@ void MoveSorter::load_more(const Fenboard *b) {
                     // skip quiet moves
                     break;
                 }
+                if (phase == P_CHECK_NOCAPTURE && gen_type == GEN_CAPTURES) {
+                    quiet_check_iter.reset();
+                    b->get_packed_legal_moves(b->get_side_to_play(), quiet_check_iter, opp_covered_squares, -1, bb_all, GEN_QUIET_CHECKS);
+                }
 
                 if (opp_covered_squares == 0) {
-                    opp_covered_squares = b->computed_covered_squares(get_opposite_color(b->get_side_to_play()), INCLUDE_ALL);
+                    opp_covered_squares = b->opponent_covered_squares();
                 }
 
                 int start = buffer.size();
 
-                b->get_moves(b->get_side_to_play(),
-                    phase == P_CHECK_CAPTURE || phase == P_CHECK_NOCAPTURE,
-                    phase == P_CHECK_CAPTURE || phase == P_NOCHECK_CAPTURE,
-                    move_iter,
-                    buffer);
+                if (phase == P_NOCHECK_NO_CAPTURE && gen_type == GEN_CAPTURES) {
+                    // no pin or check square work for moves that may never
+                    // be tried; has_more_moves checks each one as it comes up
+                    lazy_start = start;
+                    b->get_pseudo_legal_moves(b->get_side_to_play(), buffer, true);
+                } else {
+                    b->get_moves(b->get_side_to_play(),
+                        phase == P_CHECK_CAPTURE || phase == P_CHECK_NOCAPTURE,
+                        phase == P_CHECK_CAPTURE || phase == P_NOCHECK_CAPTURE,
+                        phase == P_CHECK_NOCAPTURE && gen_type == GEN_CAPTURES ? quiet_check_iter : move_iter,
+                        buffer);
+                }
 
                 if (s != NULL && phase == P_NOCHECK_CAPTURE && captures_checks_only) {
                     // skip moves that don't capture on recapture_on_sq
                     for (auto iter = buffer.begin() + start; iter != buffer.end(); iter++) {
                         bool exclude = false;
-                        if (s->quiescent_positive_capture_only && b->static_exchange_eval(b->get_side_to_play(), get_dest_pos(*iter), get_captured_piece(*iter), get_actor(*iter)) < 0) {
+                        if (s->quiescent_positive_capture_only && !b->see_ge(*iter, 0)) {
                             exclude = true;
                         } else if (s->quiescent_single_capture_square_only && recapture_on_sq != 0 && get_dest_pos(*iter) != recapture_on_sq) {
                             exclude = true;
@@ -895,11 +983,10 @@ void MoveSorter::load_more(const Fenboard *b) {
                     }
                 }
                 if (do_sort && (buffer.size() - start) > 1) {
-                    std::map<move_t, int> move_scores;
-                    for (auto iter = buffer.begin() + start; iter != buffer.end(); iter++) {
-                        move_scores[*iter] = get_score(b, *iter, *line);
+                    for (size_t i = start; i < buffer.size(); i++) {
+                        buffer.score(i) = get_score(b, buffer[i], *line);
                     }
-                    std::sort(buffer.begin() + start, buffer.end(), MoveCmp(&move_scores));
+                    buffer.sort_by_score(start);
                 }
 
                 break;
@@ -907,18 +994,22 @@ void MoveSorter::load_more(const Fenboard *b) {
         phase++;
     }
 }
-void MoveSorter::reset(const Fenboard *b, Search *s, const std::vector<move_t> &line, bool captures_checks_only, int depth, int alpha, int beta, bool do_sort, move_t hint, move_t transposition_hint, bool verbose)
+void MoveSorter::reset(const Fenboard *b, Search *s, const std::vector<move_t> &line, bool captures_checks_only, int depth, int alpha, int beta, bool do_sort, compact_move_t hint, compact_move_t transposition_hint, bool verbose)
 {
     index = 0;
+    lazy_start = INT_MAX;
     last_capture = 0;
     opp_covered_squares = 0;
+    hanging_exchange_computed = false;
     buffer.clear();
     move_iter.reset();
     this->side_to_play = b->get_side_to_play();
     this->do_sort = do_sort;
     this->captures_checks_only = captures_checks_only;
-    this->hint = hint;
-    this->transposition_hint = transposition_hint;
+    this->compact_hint = hint;
+    this->compact_transposition_hint = transposition_hint;
+    this->hint = 0;
+    this->transposition_hint = 0;
     this->s = s;
     this->b = b;
     this->verbose = verbose;
@@ -937,10 +1028,21 @@ void MoveSorter::reset(const Fenboard *b, Search *s, const std::vector<move_t> &
 
 bool MoveSorter::has_more_moves()
 {
-    if (index == buffer.size()) {
-        load_more(b);
+    while (true) {
+        if (index == buffer.size()) {
+            load_more(b);
+        }
+        if (index >= buffer.size() || index < lazy_start) {
+            return index < buffer.size();
+        }
+        // the quiet checks already came out in their own phase
+        move_t move = buffer[index];
+        if (b->is_legal(move) && !b->gives_check(move)) {
+            lazy_start = index + 1;
+            return true;
+        }
+        index++;
     }
-    return index < buffer.size();
 }
 
 move_t MoveSorter::next_move()
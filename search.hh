@@ -36,6 +36,8 @@ struct SearchUpdate {
 };
 
 struct Search;
+class AnalysisCache;
+class Tablebases;
 const int NTH_SORT_FREQ_BUCKETS = 40;
 
 enum {
@@ -60,7 +62,7 @@ struct MoveSorter {
     }
 
     move_t next_move();
-    void reset(const Fenboard *b, Search *s, const std::vector<move_t> &line, bool captures_checks_only=false, int depth_to_go=0, int alpha=INT_MIN, int beta=INT_MAX, bool do_sort=true, move_t hint=0, move_t transposition_hint=0, bool verbose=false);
+    void reset(const Fenboard *b, Search *s, const std::vector<move_t> &line, bool captures_checks_only=false, int depth_to_go=0, int alpha=INT_MIN, int beta=INT_MAX, bool do_sort=true, compact_move_t hint=0, compact_move_t transposition_hint=0, bool verbose=false);
     int get_score(const Fenboard *b, move_t move, const std::vector<move_t> &line) const;
     void get_score_parts(const Fenboard *b, move_t move, const std::vector<move_t> &line, int parts[score_part_len]) const;
 
@@ -86,14 +88,23 @@ private:
     bool operator()(move_t a, move_t b) const;
 
     int index;
+    // buffer entries from here on are pseudo-legal quiet moves that
+    // has_more_moves hasn't yet checked for legality and check
+    int lazy_start;
     int last_capture;
     uint64_t opp_covered_squares;
-    std::vector<move_t> buffer;
+    MoveList buffer;
+    MoveGenType gen_type;
     PackedMoveIterator move_iter;
+    // quiet checks, generated apart from the captures in move_iter
+    PackedMoveIterator quiet_check_iter;
     Color side_to_play;
     bool do_sort;
     bool captures_checks_only;
     char recapture_on_sq;
+    // decoded from compact_hint and compact_transposition_hint in the hint phases
+    compact_move_t compact_hint;
+    compact_move_t compact_transposition_hint;
     move_t hint;
     move_t transposition_hint;
     const std::vector<move_t> *line;
@@ -106,12 +117,18 @@ private:
     mutable uint64_t covered_squares_q = ~0;
     mutable uint64_t covered_squares_r = ~0;
     mutable uint64_t covered_squares_bn = ~0;
+    mutable bool hanging_exchange_computed = false;
+    mutable int hanging_exchange[64];
 };
 
 struct Search {
     Search(Evaluation *eval, int transposition_table_size_log2=29);
     move_t minimax(Fenboard &b);
     move_t alphabeta(Fenboard &b, SearchUpdate *s = NULL);
+    // the transposition table's score for the position after a root move,
+    // from the last alphabeta; kept alongside its analysis cache result so
+    // the answer doesn't change when that search is skipped
+    bool root_move_score(const Fenboard &b, move_t move, int &value);
 
     void reset();
     void reset_counters();
@@ -121,6 +138,7 @@ struct Search {
     uint64_t low_depth_nodecount;
     uint64_t null_nodecount;
     uint64_t qnodecount;
+    uint64_t tbhits;
     // hash -> depth, (max, min)
     int transposition_table_size_log2;
     bool use_transposition_table;
@@ -168,9 +186,17 @@ private:
     void history_cutoff(Color side_to_play, int depth_to_go, move_t move, int move_rank, const std::vector<move_t> &line, bool high);
 public:
     TranspositionTable *transtable;
-    std::tuple<move_t, move_t, int> negamax_with_memory(Fenboard &b, int depth, int alpha, int beta, std::vector<move_t> &line, move_t hint=0, int static_score=0);
-    bool read_transposition(uint64_t board_hash, move_t &move, int depth, int &alpha, int &beta, int &exact_value);
+    // results kept across runs, consulted before searching the root
+    AnalysisCache *analysis_cache;
+    // the last alphabeta was answered from analysis_cache
+    bool analysis_cache_hit;
+    // endgame tables probed below the root
+    const Tablebases *tablebases;
+    std::tuple<move_t, move_t, int> negamax_with_memory(Fenboard &b, int depth, int alpha, int beta, std::vector<move_t> &line, compact_move_t hint=0, int static_score=0);
+    bool read_transposition(uint64_t board_hash, compact_move_t &move, int depth, int &alpha, int &beta, int &exact_value);
 private:
+    uint64_t analysis_key(const Fenboard &b) const;
+    bool read_analysis_cache(const Fenboard &b, move_t &move, SearchUpdate *s);
     void write_transposition(uint64_t board_hash, move_t move, int best_score, int depth, int original_alpha, int original_beta);
 
     std::vector<MoveSorter *> move_sorter_pool;
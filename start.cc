@@ -19,7 +19,6 @@ int main(int argc, char **argv)
     Fenboard b;
     NNUEEvaluation simple;
     Search search(&simple);
-    search.use_mtdf = true;
     search.use_pv = false;
     search.use_quiescent_search = false;
     search.use_iterative_deepening = true;
@@ -28,7 +27,6 @@ int main(int argc, char **argv)
     search.use_transposition_table = true;
     search.quiescent_depth = 4;
     /*
-    search.use_mtdf = false;
     search.use_quiescent_search = false;
     search.use_iterative_deepening = false;
     search.use_pruning = true;
@@ -0,0 +1,742 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include "tablebase.hh"
+
+const char TB_MAGIC[8] = { 'T', 'B', 'L', 'B', 'A', 'S', 'E', 'S' };
+const uint32_t TB_VERSION = 1;
+const uint8_t TB_BROKEN = 255;
+// longest distance to mate a byte can hold
+const int TB_MAX_PLIES = 253;
+const char TB_PIECE_NAMES[] = "?PNBRQK";
+const std::string TB_EXTENSION = ".tb";
+
+struct TbHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_pieces;
+    char signature[8];
+    uint64_t num_positions;
+};
+
+// The pieces of a table in index order: the white king, the black king, then
+// the white and black pieces strongest first. The index is the white king's
+// slot, in the a1-d1-d4 triangle or with pawns the a-d files, followed by the
+// other squares as base 64 digits.
+struct TbLayout {
+    int num_pieces;
+    piece_t type[TB_MAX_PIECES];
+    Color color[TB_MAX_PIECES];
+    bool has_pawns;
+    uint64_t num_positions;
+};
+
+struct TbKingSlots {
+    int slot[2][64];
+    int square[2][32];
+
+    TbKingSlots() {
+        int count[2] = { 0, 0 };
+        for (int sq = 0; sq < 64; sq++) {
+            int rank = sq / 8, file = sq % 8;
+            slot[0][sq] = slot[1][sq] = -1;
+            if (file < 4 && rank <= file) {
+                square[0][count[0]] = sq;
+                slot[0][sq] = count[0]++;
+            }
+            if (file < 4) {
+                square[1][count[1]] = sq;
+                slot[1][sq] = count[1]++;
+            }
+        }
+    }
+};
+
+struct TbAttacks {
+    uint64_t knight[64];
+    uint64_t king[64];
+    uint64_t pawn[2][64];
+
+    TbAttacks() {
+        const int knight_steps[8][2] = { { 1, 2 }, { 2, 1 }, { 2, -1 }, { 1, -2 }, { -1, -2 }, { -2, -1 }, { -2, 1 }, { -1, 2 } };
+        const int king_steps[8][2] = { { 1, 0 }, { 1, 1 }, { 0, 1 }, { -1, 1 }, { -1, 0 }, { -1, -1 }, { 0, -1 }, { 1, -1 } };
+        for (int sq = 0; sq < 64; sq++) {
+            knight[sq] = king[sq] = pawn[White][sq] = pawn[Black][sq] = 0;
+            for (int i = 0; i < 8; i++) {
+                knight[sq] |= step(sq, knight_steps[i][0], knight_steps[i][1]);
+                king[sq] |= step(sq, king_steps[i][0], king_steps[i][1]);
+            }
+            pawn[White][sq] = step(sq, 1, -1) | step(sq, 1, 1);
+            pawn[Black][sq] = step(sq, -1, -1) | step(sq, -1, 1);
+        }
+    }
+
+    static uint64_t step(int sq, int ranks, int files) {
+        int rank = sq / 8 + ranks, file = sq % 8 + files;
+        if (rank < 0 || rank > 7 || file < 0 || file > 7) {
+            return 0;
+        }
+        return 1ULL << (rank * 8 + file);
+    }
+};
+
+static const TbKingSlots king_slots;
+static const TbAttacks tb_attacks;
+
+static Color other_color(Color color)
+{
+    return color == White ? Black : White;
+}
+
+static uint64_t slider_attacks(int square, uint64_t occupied, bool straight, bool diagonal)
+{
+    const int directions[8][2] = { { 1, 0 }, { -1, 0 }, { 0, 1 }, { 0, -1 }, { 1, 1 }, { 1, -1 }, { -1, 1 }, { -1, -1 } };
+    uint64_t result = 0;
+    for (int d = straight ? 0 : 4; d < (diagonal ? 8 : 4); d++) {
+        int rank = square / 8 + directions[d][0], file = square % 8 + directions[d][1];
+        while (rank >= 0 && rank < 8 && file >= 0 && file < 8) {
+            uint64_t bit = 1ULL << (rank * 8 + file);
+            result |= bit;
+            if (occupied & bit) {
+                break;
+            }
+            rank += directions[d][0];
+            file += directions[d][1];
+        }
+    }
+    return result;
+}
+
+// squares attacked, or for pawns captured on
+static uint64_t piece_attacks(piece_t type, Color color, int square, uint64_t occupied)
+{
+    switch (type) {
+        case bb_pawn: return tb_attacks.pawn[color][square];
+        case bb_knight: return tb_attacks.knight[square];
+        case bb_bishop: return slider_attacks(square, occupied, false, true);
+        case bb_rook: return slider_attacks(square, occupied, true, false);
+        case bb_queen: return slider_attacks(square, occupied, true, true);
+        case bb_king: return tb_attacks.king[square];
+    }
+    return 0;
+}
+
+static bool parse_signature(const std::string &signature, TbLayout &layout)
+{
+    size_t second_king = signature.find('K', 1);
+    if (signature.empty() || signature[0] != 'K' || second_king == std::string::npos || signature.size() > TB_MAX_PIECES) {
+        return false;
+    }
+    layout.num_pieces = 2;
+    layout.type[0] = layout.type[1] = bb_king;
+    layout.color[0] = White;
+    layout.color[1] = Black;
+    layout.has_pawns = false;
+    for (size_t i = 1; i < signature.size(); i++) {
+        if (i == second_king) {
+            continue;
+        }
+        const char *name = strchr(TB_PIECE_NAMES + 1, signature[i]);
+        if (name == nullptr || *name == 'K' || *name == '\0') {
+            return false;
+        }
+        layout.type[layout.num_pieces] = name - TB_PIECE_NAMES;
+        layout.color[layout.num_pieces] = i < second_king ? White : Black;
+        layout.has_pawns |= layout.type[layout.num_pieces] == bb_pawn;
+        layout.num_pieces++;
+    }
+    layout.num_positions = (layout.has_pawns ? 32ULL : 10ULL) << (6 * (layout.num_pieces - 1));
+    return true;
+}
+
+// the table holding these pieces, and whether colors must be swapped to match it
+static std::string material_signature(const std::vector<TbPiece> &pieces, bool &swap_colors)
+{
+    std::vector<piece_t> sides[2];
+    for (auto iter = pieces.begin(); iter != pieces.end(); iter++) {
+        if (iter->type != bb_king) {
+            sides[iter->color].push_back(iter->type);
+        }
+    }
+    for (int color = White; color <= Black; color++) {
+        std::sort(sides[color].begin(), sides[color].end(), std::greater<piece_t>());
+    }
+    swap_colors = sides[White] < sides[Black];
+    std::string signature = "K";
+    for (piece_t type : sides[swap_colors ? Black : White]) {
+        signature += TB_PIECE_NAMES[type];
+    }
+    signature += "K";
+    for (piece_t type : sides[swap_colors ? White : Black]) {
+        signature += TB_PIECE_NAMES[type];
+    }
+    return signature;
+}
+
+// one of the 8 symmetries of the board, or with pawns only the mirror image
+static int transform_square(int square, int transform)
+{
+    if (transform & 4) {
+        square = ((square & 7) << 3) | (square >> 3);
+    }
+    if (transform & 1) {
+        square ^= 7;
+    }
+    if (transform & 2) {
+        square ^= 56;
+    }
+    return square;
+}
+
+// The smallest index over the symmetric images of a position, so every
+// image of a position shares one entry; the others are never used.
+static uint64_t canonical_index(const TbLayout &layout, const int *squares)
+{
+    uint64_t best = UINT64_MAX;
+    const int *slots = king_slots.slot[layout.has_pawns];
+    for (int transform = 0; transform < (layout.has_pawns ? 2 : 8); transform++) {
+        int sq[TB_MAX_PIECES];
+        for (int i = 0; i < layout.num_pieces; i++) {
+            sq[i] = transform_square(squares[i], transform);
+        }
+        if (slots[sq[0]] < 0) {
+            continue;
+        }
+        // identical pieces are interchangeable, so list them in square order
+        for (int i = 3; i < layout.num_pieces; i++) {
+            if (layout.type[i] == layout.type[i - 1] && layout.color[i] == layout.color[i - 1] && sq[i] < sq[i - 1]) {
+                std::swap(sq[i], sq[i - 1]);
+            }
+        }
+        uint64_t index = slots[sq[0]];
+        for (int i = 1; i < layout.num_pieces; i++) {
+            index = index * 64 + sq[i];
+        }
+        best = std::min(best, index);
+    }
+    return best;
+}
+
+static void decode_index(const TbLayout &layout, uint64_t index, int *squares)
+{
+    for (int i = layout.num_pieces - 1; i > 0; i--) {
+        squares[i] = index & 63;
+        index >>= 6;
+    }
+    squares[0] = king_slots.square[layout.has_pawns][index];
+}
+
+// captured pieces have square -1
+static bool is_attacked(const TbLayout &layout, const int *squares, uint64_t occupied, int target, Color by)
+{
+    for (int i = 0; i < layout.num_pieces; i++) {
+        if (squares[i] >= 0 && layout.color[i] == by && (piece_attacks(layout.type[i], by, squares[i], occupied) & (1ULL << target))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static uint64_t get_occupied(const TbLayout &layout, const int *squares)
+{
+    uint64_t occupied = 0;
+    for (int i = 0; i < layout.num_pieces; i++) {
+        if (squares[i] >= 0) {
+            occupied |= 1ULL << squares[i];
+        }
+    }
+    return occupied;
+}
+
+// no shared squares, no pawns on the back ranks and the side that just moved not in check
+static bool is_valid(const TbLayout &layout, const int *squares, Color side)
+{
+    uint64_t occupied = 0;
+    for (int i = 0; i < layout.num_pieces; i++) {
+        uint64_t bit = 1ULL << squares[i];
+        if ((occupied & bit) || (layout.type[i] == bb_pawn && (squares[i] < 8 || squares[i] >= 56))) {
+            return false;
+        }
+        occupied |= bit;
+    }
+    return !is_attacked(layout, squares, occupied, squares[other_color(side)], side);
+}
+
+Tablebases::~Tablebases()
+{
+    close();
+}
+
+bool Tablebases::add(const std::string &filename)
+{
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(TbHeader)) {
+        std::cerr << "Couldn't open tablebase " << filename << std::endl;
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        return false;
+    }
+    void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) {
+        std::cerr << "Couldn't map tablebase " << filename << std::endl;
+        return false;
+    }
+    const TbHeader *header = (const TbHeader *)data;
+    std::string signature(header->signature, strnlen(header->signature, sizeof(header->signature)));
+    TbLayout layout;
+    if (memcmp(header->magic, TB_MAGIC, sizeof(TB_MAGIC)) != 0 || header->version != TB_VERSION ||
+            !parse_signature(signature, layout) || layout.num_positions != header->num_positions ||
+            sizeof(TbHeader) + 2 * layout.num_positions > (uint64_t)st.st_size) {
+        std::cerr << "Not a tablebase " << filename << std::endl;
+        munmap(data, st.st_size);
+        return false;
+    }
+    auto existing = tables.find(signature);
+    if (existing != tables.end()) {
+        munmap((void *)existing->second.data, existing->second.mapped_size);
+    }
+    Table &table = tables[signature];
+    table.data = (const unsigned char *)data;
+    table.mapped_size = st.st_size;
+    table.values[White] = table.data + sizeof(TbHeader);
+    table.values[Black] = table.values[White] + layout.num_positions;
+    max_pieces = std::max(max_pieces, layout.num_pieces);
+    return true;
+}
+
+int Tablebases::load(const std::string &directory)
+{
+    DIR *dir = opendir(directory.c_str());
+    if (dir == nullptr) {
+        std::cerr << "Couldn't read tablebase directory " << directory << std::endl;
+        return 0;
+    }
+    int count = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        std::string name = entry->d_name;
+        if (name.size() > TB_EXTENSION.size() && name.compare(name.size() - TB_EXTENSION.size(), TB_EXTENSION.size(), TB_EXTENSION) == 0) {
+            count += add(directory + "/" + name);
+        }
+    }
+    closedir(dir);
+    return count;
+}
+
+void Tablebases::close()
+{
+    for (auto iter = tables.begin(); iter != tables.end(); iter++) {
+        munmap((void *)iter->second.data, iter->second.mapped_size);
+    }
+    tables.clear();
+    max_pieces = 0;
+}
+
+bool Tablebases::probe_value(const std::vector<TbPiece> &pieces, Color side, uint8_t &value) const
+{
+    if (pieces.size() == 2) {
+        value = 0;
+        return true;
+    }
+    bool swap_colors;
+    auto table = tables.find(material_signature(pieces, swap_colors));
+    if (table == tables.end()) {
+        return false;
+    }
+    TbLayout layout;
+    parse_signature(table->first, layout);
+    int squares[TB_MAX_PIECES];
+    bool used[TB_MAX_PIECES] = { false, false, false, false };
+    for (int i = 0; i < layout.num_pieces; i++) {
+        for (size_t j = 0; j < pieces.size(); j++) {
+            Color color = swap_colors ? other_color(pieces[j].color) : pieces[j].color;
+            if (!used[j] && pieces[j].type == layout.type[i] && color == layout.color[i]) {
+                used[j] = true;
+                squares[i] = swap_colors ? pieces[j].square ^ 56 : pieces[j].square;
+                break;
+            }
+        }
+    }
+    value = table->second.values[swap_colors ? other_color(side) : side][canonical_index(layout, squares)];
+    return value != TB_BROKEN;
+}
+
+bool Tablebases::probe(const Fenboard &b, int &wdl, int &plies) const
+{
+    uint64_t occupied = b.piece_bitmasks[bb_all] | b.piece_bitmasks[bb_all + bb_king + 1];
+    if (count_bits(occupied) > max_pieces || b.get_enpassant_file() != -1 ||
+            b.can_castle(White, true) || b.can_castle(White, false) || b.can_castle(Black, true) || b.can_castle(Black, false) ||
+            count_bits(b.get_bitmask(White, bb_king)) != 1 || count_bits(b.get_bitmask(Black, bb_king)) != 1) {
+        return false;
+    }
+    std::vector<TbPiece> pieces;
+    for (Color color : { White, Black }) {
+        for (piece_t type = bb_pawn; type <= bb_king; type++) {
+            uint64_t bits = b.get_bitmask(color, type);
+            int pos = 0;
+            while ((pos = get_low_bit(bits, pos)) > -1) {
+                pieces.push_back({ type, color, pos });
+                pos++;
+            }
+        }
+    }
+    uint8_t value;
+    if (!probe_value(pieces, b.get_side_to_play(), value)) {
+        return false;
+    }
+    plies = value == 0 ? 0 : value - 1;
+    wdl = value == 0 ? 0 : (plies % 2 == 1 ? 1 : -1);
+    return true;
+}
+
+std::vector<std::string> tablebase_signatures(int max_pieces)
+{
+    const std::string names = "QRBNP";
+    std::vector<std::string> signatures;
+    if (max_pieces >= 3) {
+        for (char piece : names) {
+            signatures.push_back(std::string("K") + piece + "K");
+        }
+    }
+    if (max_pieces >= 4) {
+        for (size_t i = 0; i < names.size(); i++) {
+            for (size_t j = i; j < names.size(); j++) {
+                signatures.push_back(std::string("K") + names[i] + names[j] + "K");
+                signatures.push_back(std::string("K") + names[i] + "K" + names[j]);
+            }
+        }
+    }
+    // captures need fewer pieces and promotions fewer pawns
+    std::stable_sort(signatures.begin(), signatures.end(), [](const std::string &a, const std::string &b) {
+        if (a.size() != b.size()) {
+            return a.size() < b.size();
+        }
+        return std::count(a.begin(), a.end(), 'P') < std::count(b.begin(), b.end(), 'P');
+    });
+    return signatures;
+}
+
+// Retrograde analysis of one table. Positions are resolved in order of
+// plies to mate: mates first, then each position that can move into a loss
+// is a win one ply longer, and a position becomes a loss once every move
+// within the table leads to a win for the opponent. Captures and promotions
+// leave the table, so their results come from the smaller tables up front.
+class TbGenerator {
+public:
+    TbGenerator(const TbLayout &layout, const Tablebases &tablebases, int jobs)
+        : layout(layout), tablebases(tablebases), jobs(std::max(1, jobs)), pending(TB_MAX_PLIES + 1), missing_table(false), too_long(false)
+    {
+        for (int side = White; side <= Black; side++) {
+            value[side].assign(layout.num_positions, 0);
+            remaining[side].assign(layout.num_positions, 0);
+            win_level[side].assign(layout.num_positions, 0);
+            loss_level[side].assign(layout.num_positions, 0);
+            can_draw[side].assign(layout.num_positions, 0);
+        }
+    }
+
+    bool generate(const std::string &signature, std::ostream &log) {
+        parallel_for(layout.num_positions, [this](uint64_t index, Pending &local) {
+            init_position(index, White, local);
+            init_position(index, Black, local);
+        });
+        if (missing_table) {
+            std::cerr << "Tablebase " << signature << " needs smaller tables generated first" << std::endl;
+            return false;
+        }
+        for (int level = 0; level <= TB_MAX_PLIES; level++) {
+            std::vector<uint64_t> entries;
+            entries.swap(pending[level]);
+            parallel_for(entries.size(), [this, &entries, level](uint64_t i, Pending &local) {
+                resolve(entries[i], level, local);
+            });
+        }
+        if (too_long) {
+            std::cerr << "Tablebase " << signature << " has mates longer than " << TB_MAX_PLIES << " plies" << std::endl;
+            return false;
+        }
+
+        uint64_t wins = 0, losses = 0, draws = 0;
+        int longest = 0;
+        for (int side = White; side <= Black; side++) {
+            for (uint64_t i = 0; i < layout.num_positions; i++) {
+                uint8_t v = value[side][i];
+                if (v == TB_BROKEN) {
+                    continue;
+                }
+                longest = std::max(longest, v - 1);
+                if (v == 0) {
+                    draws++;
+                } else if ((v - 1) % 2 == 1) {
+                    wins++;
+                } else {
+                    losses++;
+                }
+            }
+        }
+        log << signature << ": " << wins << " wins, " << losses << " losses, " << draws << " draws, longest mate " << longest << " plies" << std::endl;
+        return true;
+    }
+
+    bool write(const std::string &filename, const std::string &signature) const {
+        std::ofstream out(filename, std::ios::binary);
+        TbHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, TB_MAGIC, sizeof(header.magic));
+        header.version = TB_VERSION;
+        header.num_pieces = layout.num_pieces;
+        memcpy(header.signature, signature.data(), std::min(signature.size(), sizeof(header.signature)));
+        header.num_positions = layout.num_positions;
+        out.write((const char *)&header, sizeof(header));
+        out.write((const char *)value[White].data(), layout.num_positions);
+        out.write((const char *)value[Black].data(), layout.num_positions);
+        if (!out) {
+            std::cerr << "Couldn't write tablebase " << filename << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+private:
+    // positions to resolve at each level, as index * 2 + side to move
+    typedef std::vector<std::vector<uint64_t> > Pending;
+
+    // runs f over [0, count) on the worker threads, then merges what they queued
+    template <typename F> void parallel_for(uint64_t count, F f) {
+        std::mutex merge_lock;
+        std::vector<std::thread> workers;
+        for (int job = 0; job < jobs; job++) {
+            workers.emplace_back([this, count, job, &f, &merge_lock]() {
+                Pending local(TB_MAX_PLIES + 1);
+                for (uint64_t i = count * job / jobs; i < count * (job + 1) / jobs; i++) {
+                    f(i, local);
+                }
+                std::lock_guard<std::mutex> guard(merge_lock);
+                for (int level = 0; level <= TB_MAX_PLIES; level++) {
+                    pending[level].insert(pending[level].end(), local[level].begin(), local[level].end());
+                }
+            });
+        }
+        for (auto iter = workers.begin(); iter != workers.end(); iter++) {
+            iter->join();
+        }
+    }
+
+    void queue(Pending &local, int level, uint64_t index, Color side) {
+        if (level > TB_MAX_PLIES) {
+            too_long = true;
+            return;
+        }
+        local[level].push_back(index * 2 + side);
+    }
+
+    void init_position(uint64_t index, Color side, Pending &local) {
+        int squares[TB_MAX_PIECES];
+        decode_index(layout, index, squares);
+        if (canonical_index(layout, squares) != index || !is_valid(layout, squares, side)) {
+            value[side][index] = TB_BROKEN;
+            return;
+        }
+        Color opponent = other_color(side);
+        uint64_t occupied = get_occupied(layout, squares);
+        uint64_t own = 0;
+        for (int i = 0; i < layout.num_pieces; i++) {
+            if (layout.color[i] == side) {
+                own |= 1ULL << squares[i];
+            }
+        }
+
+        uint64_t children[256];
+        int num_children = 0;
+        bool any_legal = false;
+        int best_win = 0, worst_loss = 0;
+        bool draw = false;
+        for (int i = 0; i < layout.num_pieces; i++) {
+            if (layout.color[i] != side) {
+                continue;
+            }
+            uint64_t targets;
+            if (layout.type[i] == bb_pawn) {
+                int forward = side == White ? 8 : -8;
+                int one = squares[i] + forward;
+                targets = tb_attacks.pawn[side][squares[i]] & occupied & ~own;
+                if (!(occupied & (1ULL << one))) {
+                    targets |= 1ULL << one;
+                    int start_rank = side == White ? 1 : 6;
+                    if (squares[i] / 8 == start_rank && !(occupied & (1ULL << (one + forward)))) {
+                        targets |= 1ULL << (one + forward);
+                    }
+                }
+            } else {
+                targets = piece_attacks(layout.type[i], side, squares[i], occupied) & ~own;
+            }
+
+            int dest = 0;
+            while ((dest = get_low_bit(targets, dest)) > -1) {
+                int moved[TB_MAX_PIECES];
+                int captured = -1;
+                for (int j = 0; j < layout.num_pieces; j++) {
+                    moved[j] = squares[j];
+                    if (squares[j] == dest) {
+                        captured = j;
+                    }
+                }
+                moved[i] = dest;
+                if (captured >= 0) {
+                    moved[captured] = -1;
+                }
+                uint64_t after = (occupied & ~(1ULL << squares[i])) | (1ULL << dest);
+                if ((captured >= 0 && layout.type[captured] == bb_king) || is_attacked(layout, moved, after, moved[side], opponent)) {
+                    dest++;
+                    continue;
+                }
+                any_legal = true;
+                bool promotion = layout.type[i] == bb_pawn && (dest < 8 || dest >= 56);
+                if (captured < 0 && !promotion) {
+                    children[num_children++] = canonical_index(layout, moved);
+                    dest++;
+                    continue;
+                }
+
+                // captures and promotions continue in a smaller table
+                for (piece_t promote = bb_queen; promote >= (promotion ? bb_knight : bb_queen); promote--) {
+                    std::vector<TbPiece> child;
+                    for (int j = 0; j < layout.num_pieces; j++) {
+                        if (moved[j] >= 0) {
+                            child.push_back({ j == i && promotion ? promote : layout.type[j], layout.color[j], moved[j] });
+                        }
+                    }
+                    uint8_t child_value;
+                    if (!tablebases.probe_value(child, opponent, child_value)) {
+                        missing_table = true;
+                        return;
+                    }
+                    if (child_value == 0) {
+                        draw = true;
+                    } else if ((child_value - 1) % 2 == 1) {
+                        worst_loss = std::max(worst_loss, (int)child_value);
+                    } else {
+                        best_win = best_win == 0 ? child_value : std::min(best_win, (int)child_value);
+                    }
+                }
+                dest++;
+            }
+        }
+
+        if (!any_legal) {
+            if (is_attacked(layout, squares, occupied, squares[side], opponent)) {
+                queue(local, 0, index, side);
+            }
+            return;
+        }
+        std::sort(children, children + num_children);
+        num_children = std::unique(children, children + num_children) - children;
+        remaining[side][index] = num_children;
+        win_level[side][index] = best_win;
+        loss_level[side][index] = worst_loss;
+        can_draw[side][index] = draw;
+        if (best_win > 0) {
+            queue(local, best_win, index, side);
+        } else if (num_children == 0 && !draw) {
+            queue(local, worst_loss, index, side);
+        }
+    }
+
+    void resolve(uint64_t entry, int level, Pending &local) {
+        Color side = (Color)(entry & 1);
+        uint64_t index = entry >> 1;
+        uint8_t unresolved = 0;
+        if (!std::atomic_ref<uint8_t>(value[side][index]).compare_exchange_strong(unresolved, level + 1)) {
+            return;
+        }
+
+        // positions the other side could have moved here from
+        Color mover = other_color(side);
+        int squares[TB_MAX_PIECES];
+        decode_index(layout, index, squares);
+        uint64_t occupied = get_occupied(layout, squares);
+        uint64_t parents[256];
+        int num_parents = 0;
+        for (int i = 0; i < layout.num_pieces; i++) {
+            if (layout.color[i] != mover) {
+                continue;
+            }
+            uint64_t sources = 0;
+            if (layout.type[i] == bb_pawn) {
+                int back = mover == White ? -8 : 8;
+                int one = squares[i] + back;
+                if (one >= 8 && one < 56 && !(occupied & (1ULL << one))) {
+                    sources |= 1ULL << one;
+                    int double_rank = mover == White ? 3 : 4;
+                    if (squares[i] / 8 == double_rank && !(occupied & (1ULL << (one + back)))) {
+                        sources |= 1ULL << (one + back);
+                    }
+                }
+            } else {
+                sources = piece_attacks(layout.type[i], mover, squares[i], occupied) & ~occupied;
+            }
+            int source = 0;
+            while ((source = get_low_bit(sources, source)) > -1) {
+                int moved[TB_MAX_PIECES];
+                std::copy(squares, squares + layout.num_pieces, moved);
+                moved[i] = source;
+                uint64_t parent = canonical_index(layout, moved);
+                if (std::atomic_ref<uint8_t>(value[mover][parent]).load(std::memory_order_relaxed) != TB_BROKEN) {
+                    parents[num_parents++] = parent;
+                }
+                source++;
+            }
+        }
+        std::sort(parents, parents + num_parents);
+        num_parents = std::unique(parents, parents + num_parents) - parents;
+
+        for (int i = 0; i < num_parents; i++) {
+            uint64_t parent = parents[i];
+            if (level % 2 == 0) {
+                // the side to move here loses, so moving here wins
+                queue(local, level + 1, parent, mover);
+            } else if (std::atomic_ref<uint8_t>(remaining[mover][parent]).fetch_sub(1) == 1 &&
+                    win_level[mover][parent] == 0 && !can_draw[mover][parent]) {
+                queue(local, std::max(level + 1, (int)loss_level[mover][parent]), parent, mover);
+            }
+        }
+    }
+
+    const TbLayout &layout;
+    const Tablebases &tablebases;
+    int jobs;
+    Pending pending;
+    // 0 unresolved or drawn, TB_BROKEN unused, otherwise plies to mate + 1
+    std::vector<uint8_t> value[2];
+    // distinct moves within the table not yet known to lose
+    std::vector<uint8_t> remaining[2];
+    // best and worst results of captures and promotions, as levels
+    std::vector<uint8_t> win_level[2];
+    std::vector<uint8_t> loss_level[2];
+    std::vector<uint8_t> can_draw[2];
+    std::atomic<bool> missing_table;
+    std::atomic<bool> too_long;
+};
+
+bool generate_tablebase(const std::string &signature, const Tablebases &tablebases, const std::string &filename, int jobs, std::ostream &log)
+{
+    TbLayout layout;
+    if (!parse_signature(signature, layout)) {
+        std::cerr << "Not a tablebase signature " << signature << std::endl;
+        return false;
+    }
+    TbGenerator generator(layout, tablebases, jobs);
+    return generator.generate(signature, log) && generator.write(filename, signature);
+}
@@ -0,0 +1,64 @@
+#ifndef TABLEBASE_HH_
+#define TABLEBASE_HH_
+
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "fenboard.hh"
+
+// Endgame tables for up to four pieces, generated locally by retrograde
+// analysis. Each table covers one material balance with the stronger side as
+// white, eg. KQKR, and holds a byte per position and side to move: 0 for a
+// draw, otherwise one more than the number of plies to mate. An odd count is
+// a win for the side to move, an even one a loss. Positions with castling
+// rights or an en passant capture aren't covered, and the fifty move rule is
+// ignored.
+
+const int TB_MAX_PIECES = 4;
+
+struct TbPiece {
+    piece_t type;
+    Color color;
+    int square;
+};
+
+class Tablebases {
+public:
+    Tablebases() : max_pieces(0) {}
+    ~Tablebases();
+    Tablebases(const Tablebases &) = delete;
+    Tablebases &operator=(const Tablebases &) = delete;
+
+    // maps every table in the directory, returning how many
+    int load(const std::string &directory);
+    bool add(const std::string &filename);
+    void close();
+    size_t size() const { return tables.size(); }
+    bool has_table(const std::string &signature) const { return tables.count(signature) > 0; }
+
+    // wdl is 1 when the side to move wins, -1 when it loses and 0 for a
+    // draw, with the plies to mate when decided. false if no table applies
+    bool probe(const Fenboard &b, int &wdl, int &plies) const;
+    // the stored byte for a position in any order of pieces; bare kings are
+    // a draw. false if no table applies
+    bool probe_value(const std::vector<TbPiece> &pieces, Color side, uint8_t &value) const;
+
+private:
+    struct Table {
+        const unsigned char *data;
+        size_t mapped_size;
+        const uint8_t *values[2];
+    };
+    std::map<std::string, Table> tables;
+    int max_pieces;
+};
+
+// every material balance of up to max_pieces, ordered so that each table's
+// captures and promotions lead only to earlier ones
+std::vector<std::string> tablebase_signatures(int max_pieces);
+// builds one table from the smaller ones already loaded and writes it
+bool generate_tablebase(const std::string &signature, const Tablebases &tablebases, const std::string &filename, int jobs, std::ostream &log);
+
+#endif
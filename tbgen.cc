@@ -0,0 +1,73 @@
+#include <boost/program_options.hpp>
+#include <sys/stat.h>
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include "tablebase.hh"
+
+namespace po = boost::program_options;
+
+// generates every endgame table up to a number of pieces, smallest first so
+// each table can look up the captures and promotions leaving it
+
+int main(int argc, char **argv)
+{
+    std::string directory;
+    int pieces = 3;
+    int jobs = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::string> signatures;
+
+    try {
+        po::options_description desc("Allowed options");
+        desc.add_options()
+            ("help", "produce help message")
+            ("output", po::value<std::string>(), "directory to write the tables to")
+            ("pieces", po::value<int>(), "generate all tables with up to this many pieces (3 or 4)")
+            ("jobs", po::value<int>(), "number of worker threads")
+            ("table", po::value<std::vector<std::string> >(), "generate only this table, eg. KQKR")
+        ;
+
+        po::variables_map vm;
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+        po::notify(vm);
+
+        if (vm.count("help") || !vm.count("output")) {
+            std::cout << "Usage: " << argv[0] << " --output dir [--pieces 4] [--table KQKR ...]" << std::endl;
+            std::cout << desc << std::endl;
+            return vm.count("help") ? 0 : 1;
+        }
+        directory = vm["output"].as<std::string>();
+        if (vm.count("pieces")) {
+            pieces = std::min(TB_MAX_PIECES, vm["pieces"].as<int>());
+        }
+        if (vm.count("jobs")) {
+            jobs = std::max(1, vm["jobs"].as<int>());
+        }
+        if (vm.count("table")) {
+            signatures = vm["table"].as<std::vector<std::string>>();
+        }
+    }
+    catch(std::exception& e) {
+        std::cerr << "error: " << e.what() << "\n";
+        return 1;
+    }
+
+    mkdir(directory.c_str(), 0755);
+    Tablebases tablebases;
+    tablebases.load(directory);
+    if (signatures.empty()) {
+        signatures = tablebase_signatures(pieces);
+    }
+    for (auto iter = signatures.begin(); iter != signatures.end(); iter++) {
+        if (tablebases.has_table(*iter)) {
+            continue;
+        }
+        std::string filename = directory + "/" + *iter + ".tb";
+        auto start = std::chrono::steady_clock::now();
+        if (!generate_tablebase(*iter, tablebases, filename, jobs, std::cout) || !tablebases.add(filename)) {
+            return 1;
+        }
+        std::cout << "  " << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count() << "ms" << std::endl;
+    }
+    return 0;
+}
@@ -4,6 +4,8 @@
 #include <sstream>
 #include <fstream>
 #include <set>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "pgn.hh"
 #include "search.hh"
 #include "evaluate.hh"
@@ -11,6 +13,11 @@
 #include "bitboard.hh"
 #include "fenboard.hh"
 #include "matrix.hh"
+#include "perft.hh"
+#include "book.hh"
+#include "positionindex.hh"
+#include "analysiscache.hh"
+#include "tablebase.hh"
 
 void assert_true(bool value)
 {
@@ -495,6 +502,681 @@ void test_static_exchange()
     b.set_fen("r2r2k1/p2n1p1p/b1n1pb2/q7/2ppN3/B2P1NP1/P1P1Q1BP/R4RK1 w - - 6 19");
     assert_equals(1, b.static_exchange_eval(White, algebra_to_square('c', 4), bb_pawn, bb_pawn));
 
+    // the queen recaptures through the pawn once it has taken
+    b.set_fen("6k1/5q2/4p3/3p4/8/1BN5/8/6K1 w - - 0 1");
+    move_t capture = b.read_move("Nxd5", White);
+    assert_equals(-2, b.static_exchange_eval(capture));
+    assert_equals(true, b.see_ge(capture, -2));
+    assert_equals(false, b.see_ge(capture, -1));
+    int scores[64];
+    b.static_exchange_targets(White, 1ULL << algebra_to_square('d', 5), scores);
+    assert_equals(-2, scores[algebra_to_square('d', 5)]);
+    // squares black doesn't reach come straight from the cached attack map
+    scores[algebra_to_square('b', 3)] = scores[algebra_to_square('c', 3)] = -99;
+    b.static_exchange_targets(Black, b.get_bitmask(White, bb_all), scores);
+    assert_equals(0, scores[algebra_to_square('b', 3)]);
+    assert_equals(0, scores[algebra_to_square('c', 3)]);
+    assert_equals(0, b.static_exchange_eval(Black, algebra_to_square('b', 3), bb_bishop, 0));
+    b.set_fen("6k1/5q2/8/8/8/1BN5/8/6K1 w - - 0 1");
+    b.static_exchange_targets(Black, b.get_bitmask(White, bb_all), scores);
+    assert_equals(3, scores[algebra_to_square('b', 3)]);
+    assert_equals(3, b.static_exchange_eval(Black, algebra_to_square('b', 3), bb_bishop, 0));
+
+}
+
+void test_pawn_hash()
+{
+    Fenboard b, fresh;
+    b.set_fen("r1bqkb1r/pp1p1ppp/2n2n2/2p1p3/4P3/2N2N2/PPPP1PPP/R1BQKB1R w KQkq - 0 4");
+    uint64_t pawn_hash = b.get_pawn_hash();
+
+    // piece moves leave the pawn key alone, pawn moves change it and undo restores it
+    move_t move = b.read_move("Bb5", White);
+    b.apply_move(move);
+    assert_equals(pawn_hash, b.get_pawn_hash());
+    b.undo_move(move);
+    move = b.read_move("d4", White);
+    b.apply_move(move);
+    assert_not_equals(pawn_hash, b.get_pawn_hash());
+    fresh.set_fen("r1bqkb1r/pp1p1ppp/2n2n2/2p1p3/3PP3/2N2N2/PPP2PPP/R1BQKB1R b KQkq - 0 4");
+    assert_equals(fresh.get_pawn_hash(), b.get_pawn_hash());
+    b.undo_move(move);
+    assert_equals(pawn_hash, b.get_pawn_hash());
+
+    // cached pawn terms must not leak between positions sharing a table slot
+    SimpleEvaluation cached(0);
+    const char *fens[] = {
+        "r1bqkb1r/pp1p1ppp/2n2n2/2p1p3/4P3/2N2N2/PPPP1PPP/R1BQKB1R w KQkq - 0 4",
+        "8/5P2/1p6/pP6/P6p/8/5k2/7K w - - 0 67",
+        "r3k1r1/1p3p1p/p1n1pq2/3p4/3P1bb1/2N2NP1/PP1Q1PBP/3R1RK1 w q - 0 16",
+        "1Q6/8/8/8/8/k2K4/8/8 w - - 0 1",
+    };
+    for (int i = 0; i < 2; i++) {
+        for (const char *fen : fens) {
+            SimpleEvaluation uncached;
+            b.set_fen(fen);
+            assert_equals(uncached.evaluate(b), cached.evaluate(b));
+        }
+    }
+}
+
+void test_pgn_tokenizer()
+{
+    std::istringstream game("[Event \"Test \\\"quoted\\\"\"]\n\n1. e4 {[%eval 0.2] [%clk 0:05:00]} e5 (1... c5 2. Nf3) 2.Nf3 $1 Nc6!? ; comment\n3. Bb5 += 1-0\n\n");
+    pgn_istream pgn(game);
+    std::map<std::string, std::string> game_metadata;
+    std::vector<std::pair<move_annot, move_annot> > movelist;
+    read_pgn(&pgn, game_metadata, movelist);
+
+    // variations, glyphs and comments stay out of the main line
+    assert_equals<size_t>(3, movelist.size());
+    assert_equals(std::string("Test \\\"quoted\\\""), game_metadata["Event"]);
+    assert_equals(std::string("e5"), movelist[0].second.move);
+    assert_equals(std::string("0.2"), movelist[0].first.eval);
+    assert_equals(std::string("0:05:00"), movelist[0].first.clock);
+    assert_equals(std::string("Nc6"), movelist[1].second.move);
+    assert_equals(std::string("Bb5"), movelist[2].first.move);
+    assert_equals(std::string(""), movelist[2].second.move);
+
+    game.clear();
+    game.str("[Event \"Test\"]\n\n1. e4 e5 (1... c5 2. Nf3) 2. Nf3 *\n\n");
+    movelist_tree lines;
+    read_pgn_options(&pgn, game_metadata, lines);
+    assert_equals<size_t>(2, lines.size());
+    assert_equals(std::string("c5"), lines[0][1].move);
+    assert_equals(2, lines[0][2].moveno);
+    assert_equals<size_t>(3, lines[1].size());
+}
+
+void test_read_move()
+{
+    Fenboard b;
+    // pins, en passant, promotions and checks: resolving each legal move by name gives the generated move back
+    const char *fens[] = {
+        "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",
+        "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1",
+        "8/8/3p4/KPp4r/1R3p1k/8/4P1P1/8 w - c6 0 2",
+        "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1",
+        "rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8",
+    };
+    for (const char *fen : fens) {
+        b.set_fen(fen);
+        std::vector<move_t> moves;
+        get_legal_moves(b, moves);
+        for (auto iter = moves.begin(); iter != moves.end(); iter++) {
+            assert_equals(*iter, b.read_move(move_to_uci(*iter), b.get_side_to_play()));
+        }
+    }
+
+    // ambiguous SAN needs the disambiguation, pinned knights don't count
+    b.set_fen("4k3/8/8/8/8/2N3N1/8/4K3 w - - 0 1");
+    assert_equals(b.read_move("c3e4", White), b.read_move("Nce4", White));
+    assert_equals(b.read_move("g3e4", White), b.read_move("Nge4", White));
+    b.set_fen("4k3/8/8/8/7b/2N3N1/8/4K3 w - - 0 1");
+    assert_equals(b.read_move("c3e4", White), b.read_move("Ne4", White));
+}
+
+void write_book_entry(std::ostream &os, uint64_t key, uint16_t move, uint16_t weight)
+{
+    // big-endian key, move, weight and learn fields
+    for (int shift = 56; shift >= 0; shift -= 8) {
+        os.put((key >> shift) & 0xff);
+    }
+    os.put(move >> 8).put(move & 0xff);
+    os.put(weight >> 8).put(weight & 0xff);
+    os.put(0).put(0).put(0).put(0);
+}
+
+void test_polyglot_book()
+{
+    Fenboard b;
+    // reference keys from the Polyglot book format description
+    std::pair<const char *, uint64_t> keys[] = {
+        { "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1", 0x463b96181691fc9cULL },
+        { "rnbqkbnr/pppppppp/8/8/4P3/8/PPPP1PPP/RNBQKBNR b KQkq e3 0 1", 0x823c9b50fd114196ULL },
+        { "rnbqkbnr/ppp1pppp/8/3p4/4P3/8/PPPP1PPP/RNBQKBNR w KQkq d6 0 2", 0x0756b94461c50fb0ULL },
+        { "rnbqkbnr/ppp1pppp/8/3pP3/8/8/PPPP1PPP/RNBQKBNR b KQkq - 0 2", 0x662fafb965db29d4ULL },
+        { "rnbqkbnr/ppp1p1pp/8/3pPp2/8/8/PPPP1PPP/RNBQKBNR w KQkq f6 0 3", 0x22a48b5a8e47ff78ULL },
+        { "rnbqkbnr/ppp1p1pp/8/3pPp2/8/8/PPPPKPPP/RNBQ1BNR b kq - 0 3", 0x652a607ca3f242c1ULL },
+        { "rnbq1bnr/ppp1pkpp/8/3pPp2/8/8/PPPPKPPP/RNBQ1BNR w - - 0 4", 0x00fdd303c946bdd9ULL },
+        { "rnbqkbnr/p1pppppp/8/8/PpP4P/8/1P1PPPP1/RNBQKBNR b KQkq c3 0 3", 0x3c8123ea7b067637ULL },
+        { "rnbqkbnr/p1pppppp/8/8/P6P/R1p5/1P1PPPP1/1NBQKBNR b Kkq - 0 4", 0x5c3f9b829b279560ULL },
+    };
+    for (auto &key : keys) {
+        b.set_fen(key.first);
+        assert_equals(key.second, polyglot_key(b));
+    }
+
+    // e2e4 weight 3, d2d4 weight 1 from the start; castling as king takes rook
+    b.set_fen("r3k2r/pppppppp/8/8/8/8/PPPPPPPP/R3K2R w KQkq - 0 1");
+    uint64_t castle_key = polyglot_key(b);
+    b.set_starting_position();
+    uint64_t start_key = polyglot_key(b);
+    std::string filename = "test-book.bin";
+    {
+        std::ofstream out(filename, std::ios::binary);
+        std::vector<std::pair<uint64_t, uint16_t> > entries = { { start_key, 0x031c }, { start_key, 0x02db }, { castle_key, 0x0107 } };
+        std::sort(entries.begin(), entries.end());
+        for (auto &entry : entries) {
+            write_book_entry(out, entry.first, entry.second, entry.second == 0x031c ? 3 : 1);
+        }
+    }
+    PolyglotBook book;
+    assert_equals(true, book.open(filename));
+    assert_equals<size_t>(3, book.size());
+    assert_equals(b.read_move("e4", White), book.probe(b, true));
+    std::set<move_t> chosen;
+    for (int i = 0; i < 50; i++) {
+        chosen.insert(book.probe(b));
+    }
+    assert_equals<size_t>(2, chosen.size());
+    assert_equals<size_t>(1, chosen.count(b.read_move("d4", White)));
+    b.set_fen("r3k2r/pppppppp/8/8/8/8/PPPPPPPP/R3K2R w KQkq - 0 1");
+    assert_equals(b.read_move("e1g1", White), book.probe(b));
+    b.apply_move(b.read_move("e1g1", White));
+    assert_equals<move_t>(0, book.probe(b));
+    book.close();
+    remove(filename.c_str());
+}
+
+void test_position_index()
+{
+    // every two ply opening, so positions spread over many blocks
+    Fenboard b;
+    std::ostringstream games;
+    std::vector<move_t> first_moves, second_moves;
+    b.set_starting_position();
+    get_legal_moves(b, first_moves);
+    for (move_t first : first_moves) {
+        std::ostringstream first_text;
+        b.print_move(first, first_text);
+        b.apply_move(first);
+        second_moves.clear();
+        get_legal_moves(b, second_moves);
+        for (move_t second : second_moves) {
+            games << "[Result \"1-0\"]\n\n1. " << first_text.str() << " ";
+            b.print_move(second, games);
+            games << " 1-0\n\n";
+        }
+        b.undo_move(first);
+    }
+    games << "[Result \"0-1\"]\n\n1. e4 e5 2. Nf3 0-1\n\n";
+    games << "[Result \"1/2-1/2\"]\n\n1. e4 e5 2. Nf3 1/2-1/2\n\n";
+
+    std::istringstream input(games.str());
+    pgn_istream pgn_input(input);
+    PositionIndexBuilder builder;
+    builder.add_games(&pgn_input);
+    assert_equals<uint64_t>(402, builder.num_games());
+    std::string filename = "test-positions.idx";
+    assert_equals(true, builder.write(filename));
+
+    PositionIndex index;
+    assert_equals(true, index.open(filename));
+    std::vector<PositionStats> found;
+    b.set_starting_position();
+    assert_equals(true, index.find(b, found));
+    assert_equals<size_t>(20, found.size());
+    assert_equals(polyglot_to_move(b, found[0].move), b.read_move("e4", White));
+    assert_equals<uint32_t>(22, found[0].count);
+    assert_equals<uint32_t>(20, found[0].white_wins);
+    assert_equals<uint32_t>(1, found[0].draws);
+    assert_equals<uint32_t>(1, found[0].black_wins);
+    uint32_t total = 0;
+    for (auto &stats : found) {
+        total += stats.count;
+    }
+    assert_equals<uint32_t>(402, total);
+
+    // every position after one move has each reply played once
+    for (move_t first : first_moves) {
+        b.apply_move(first);
+        found.clear();
+        assert_equals(true, index.find(b, found));
+        second_moves.clear();
+        get_legal_moves(b, second_moves);
+        size_t replies = 0;
+        for (auto &stats : found) {
+            replies += stats.move != 0;
+        }
+        assert_equals(second_moves.size(), replies);
+        b.undo_move(first);
+    }
+    b.set_fen("8/8/8/8/8/8/8/K6k w - - 0 1");
+    found.clear();
+    assert_equals(false, index.find(b, found));
+    index.close();
+    remove(filename.c_str());
+}
+
+void test_analysis_cache()
+{
+    std::string filename = "test-analysis.cache";
+    remove(filename.c_str());
+    AnalysisEntry entry;
+    {
+        AnalysisCache cache;
+        assert_equals(true, cache.open(filename, 1));
+        assert_equals<size_t>(32768, cache.capacity());
+        assert_equals(false, cache.lookup(0x1234567800000001ULL, 0, entry));
+        cache.store(0x1234567800000001ULL, 0x1234, -50, 6, TT_EXACT);
+        // a shallower result doesn't replace a deeper one
+        cache.store(0x1234567800000001ULL, 0x4321, 20, 4, TT_EXACT);
+        assert_equals(false, cache.lookup(0x1234567800000001ULL, 7, entry));
+        assert_equals(false, cache.lookup(0x8765432100000001ULL, 0, entry));
+    }
+    // results survive reopening, whatever size is asked for
+    AnalysisCache cache;
+    assert_equals(true, cache.open(filename, 4));
+    assert_equals<size_t>(32768, cache.capacity());
+    assert_equals(true, cache.lookup(0x1234567800000001ULL, 6, entry));
+    assert_equals<move_t>(0x1234, entry.move);
+    assert_equals<int>(-50, entry.score);
+    assert_equals<int>(6, entry.depth);
+
+    // filling the bucket evicts the least recently used entry
+    for (uint64_t i = 2; i <= 4; i++) {
+        cache.store((i << 32) | 1, 0x100 + i, 0, 2, TT_EXACT);
+    }
+    assert_equals(true, cache.lookup(0x1234567800000001ULL, 0, entry));
+    cache.store((5ULL << 32) | 1, 0x105, 0, 2, TT_EXACT);
+    assert_equals(true, cache.lookup(0x1234567800000001ULL, 0, entry));
+    assert_equals(false, cache.lookup((2ULL << 32) | 1, 0, entry));
+    assert_equals(true, cache.lookup((5ULL << 32) | 1, 0, entry));
+
+    // a search consults the cache before searching
+    SimpleEvaluation eval;
+    Search search(&eval, 16);
+    search.analysis_cache = &cache;
+    search.max_depth = 2;
+    Fenboard b;
+    b.set_fen("r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1");
+    move_t searched = search.alphabeta(b);
+    int searched_score = search.score;
+    assert_equals<bool>(true, search.nodecount > 0);
+    // the score annotate reports for the played move survives a cache hit
+    std::vector<move_t> moves;
+    get_legal_moves(b, moves);
+    move_t played = 0;
+    int played_value = 0;
+    for (auto iter = moves.begin(); iter != moves.end() && played == 0; iter++) {
+        if (search.root_move_score(b, *iter, played_value)) {
+            played = *iter;
+        }
+    }
+    assert_equals<bool>(true, played != 0);
+    search.reset();
+    assert_equals(searched, search.alphabeta(b));
+    assert_equals(searched_score, search.score);
+    assert_equals<uint64_t>(0, search.nodecount);
+    int cached_value = 0;
+    assert_equals(true, search.root_move_score(b, played, cached_value));
+    assert_equals(played_value, cached_value);
+    cache.close();
+    remove(filename.c_str());
+}
+
+void test_tablebase()
+{
+    std::string directory = "test-tablebases";
+    mkdir(directory.c_str(), 0755);
+    Tablebases tablebases;
+    std::ostringstream log;
+    std::vector<std::string> signatures = tablebase_signatures(3);
+    for (auto iter = signatures.begin(); iter != signatures.end(); iter++) {
+        std::string filename = directory + "/" + *iter + ".tb";
+        assert_equals(true, generate_tablebase(*iter, tablebases, filename, 2, log));
+        assert_equals(true, tablebases.add(filename));
+    }
+    assert_equals<size_t>(5, tablebases.size());
+    // the longest mates with a queen and a rook
+    assert_equals(true, log.str().find("KQK: 18081 wins, 25160 losses, 2896 draws, longest mate 20 plies") != std::string::npos);
+    assert_equals(true, log.str().find("KRK: 21959 wins, 25260 losses, 2796 draws, longest mate 32 plies") != std::string::npos);
+
+    Fenboard b;
+    int wdl, plies;
+    b.set_fen("k7/8/1K6/8/8/8/8/6Q1 w - - 0 1");
+    assert_equals(true, tablebases.probe(b, wdl, plies));
+    assert_equals(1, wdl);
+    assert_equals(1, plies);
+    b.set_fen("k7/1Q6/1K6/8/8/8/8/8 b - - 0 1");
+    assert_equals(true, tablebases.probe(b, wdl, plies));
+    assert_equals(-1, wdl);
+    assert_equals(0, plies);
+    // the queen hangs
+    b.set_fen("k7/1Q6/8/8/8/8/8/7K b - - 0 1");
+    assert_equals(true, tablebases.probe(b, wdl, plies));
+    assert_equals(0, wdl);
+    b.set_fen("k7/8/8/8/8/8/P7/K7 w - - 0 1");
+    assert_equals(true, tablebases.probe(b, wdl, plies));
+    assert_equals(0, wdl);
+    // black's pawn is looked up with the colors swapped
+    b.set_fen("4k3/8/4K3/4P3/8/8/8/8 b - - 0 1");
+    assert_equals(true, tablebases.probe(b, wdl, plies));
+    assert_equals(-1, wdl);
+    int pawn_plies = plies;
+    b.set_fen("8/8/8/8/4p3/4k3/8/4K3 w - - 0 1");
+    assert_equals(true, tablebases.probe(b, wdl, plies));
+    assert_equals(-1, wdl);
+    assert_equals(pawn_plies, plies);
+    // not covered
+    b.set_fen("4k3/8/8/8/8/8/8/R3K3 w Q - 0 1");
+    assert_equals(false, tablebases.probe(b, wdl, plies));
+    b.set_fen("4k3/8/8/8/8/8/8/2Q1K2R w - - 0 1");
+    assert_equals(false, tablebases.probe(b, wdl, plies));
+
+    // a shallow search sees the whole mate
+    SimpleEvaluation eval;
+    Search search(&eval, 16);
+    search.tablebases = &tablebases;
+    search.max_depth = 2;
+    b.set_fen("8/8/8/4k3/8/8/8/R3K3 w - - 0 1");
+    assert_equals(true, tablebases.probe(b, wdl, plies));
+    search.alphabeta(b);
+    assert_equals(VERY_GOOD - plies, search.score);
+    assert_equals<bool>(true, search.tbhits > 0);
+
+    tablebases.close();
+    for (auto iter = signatures.begin(); iter != signatures.end(); iter++) {
+        remove((directory + "/" + *iter + ".tb").c_str());
+    }
+    rmdir(directory.c_str());
+}
+
+void test_square_tables()
+{
+    // a1-h8, a1-a8, a1-b3, b2-c3
+    assert_equals<uint64_t>(0x0040201008040200ULL, between_squares[0][63]);
+    assert_equals<uint64_t>(0x0001010101010100ULL, between_squares[56][0]);
+    assert_equals<uint64_t>(0, between_squares[0][17]);
+    assert_equals<uint64_t>(0, between_squares[9][18]);
+    assert_equals<uint64_t>(0x8040201008040201ULL, line_squares[9][18]);
+    assert_equals<uint64_t>(0xffULL << 24, line_squares[27][30]);
+    assert_equals<uint64_t>(0, line_squares[0][17]);
+    assert_equals<uint64_t>(0, line_squares[5][5]);
+}
+
+void test_move_list()
+{
+    Fenboard b;
+    b.set_starting_position();
+    MoveList moves;
+    get_legal_moves(b, moves);
+    assert_equals<size_t>(20, moves.size());
+
+    for (size_t i = 0; i < moves.size(); i++) {
+        moves.score(i) = i % 3;
+    }
+    move_t first = moves[0];
+    moves.erase(moves.begin());
+    assert_equals<size_t>(19, moves.size());
+    assert_equals(true, std::find(moves.begin(), moves.end(), first) == moves.end());
+    moves.sort_by_score(1);
+    for (size_t i = 2; i < moves.size(); i++) {
+        assert_equals(true, moves.score(i - 1) >= moves.score(i));
+    }
+}
+
+void test_compact_move()
+{
+    // castling both ways, en passant, promotions and positions in check
+    const char *fens[] = {
+        "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",
+        "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1",
+        "rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8",
+        "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1",
+    };
+    for (const char *fen : fens) {
+        Fenboard b;
+        b.set_fen(fen);
+        MoveList moves;
+        get_legal_moves(b, moves);
+        for (auto iter = moves.begin(); iter != moves.end(); iter++) {
+            assert_equals(*iter, b.decode_move(compact_move(*iter)));
+            b.apply_move(*iter);
+            MoveList replies;
+            get_legal_moves(b, replies);
+            for (auto reply = replies.begin(); reply != replies.end(); reply++) {
+                assert_equals(*reply, b.decode_move(compact_move(*reply)));
+            }
+            b.undo_move(*iter);
+        }
+    }
+
+    Fenboard b;
+    b.set_starting_position();
+    // not the side to play's piece, or not a legal move
+    assert_equals<move_t>(0, b.decode_move(algebra_to_square('e', 5) | algebra_to_square('e', 7) << 6));
+    assert_equals<move_t>(0, b.decode_move(algebra_to_square('e', 5) | algebra_to_square('e', 2) << 6));
+
+    TranspositionTable table(10);
+    table.reset();
+    move_t move = b.read_move("Nf3", White);
+    table.insert_tt_entry(b.get_hash(), move, -123, 7, TT_LOWER);
+    compact_move_t tt_move;
+    int16_t value;
+    unsigned char depth, type;
+    assert_equals(true, table.fetch_tt_entry(b.get_hash(), tt_move, value, depth, type));
+    assert_equals(move, b.decode_move(tt_move));
+    assert_equals<int16_t>(-123, value);
+    assert_equals<int>(7, depth);
+    assert_equals<int>(TT_LOWER, type);
+    // 2^10 entries are 128 buckets: the 25 bits above the 7 bit bucket index
+    // are checked, the rest aren't
+    assert_equals(false, table.fetch_tt_entry(b.get_hash() ^ (1ULL << 7), tt_move, value, depth, type));
+    assert_equals(false, table.fetch_tt_entry(b.get_hash() ^ (1ULL << 31), tt_move, value, depth, type));
+    assert_equals(true, table.fetch_tt_entry(b.get_hash() ^ (1ULL << 32), tt_move, value, depth, type));
+    // one bucket holds eight positions that differ only in their key bits
+    for (uint64_t i = 1; i < 8; i++) {
+        table.insert_tt_entry(b.get_hash() ^ (i << 7), move, i, 7, TT_EXACT);
+    }
+    for (uint64_t i = 1; i < 8; i++) {
+        assert_equals(true, table.fetch_tt_entry(b.get_hash() ^ (i << 7), tt_move, value, depth, type));
+        assert_equals<int16_t>(i, value);
+    }
+}
+
+// the moves of one kind a generation mode produces, as get_moves splits them
+std::vector<move_t> generated_moves(const Fenboard &b, MoveGenType gen_type, bool checks, bool captures)
+{
+    PackedMoveIterator packed;
+    uint64_t opp_covered_squares = 0;
+    b.get_packed_legal_moves(b.get_side_to_play(), packed, opp_covered_squares, -1, bb_all, gen_type);
+    MoveList moves;
+    b.get_moves(b.get_side_to_play(), checks, captures, packed, moves);
+    std::vector<move_t> sorted(moves.begin(), moves.end());
+    std::sort(sorted.begin(), sorted.end());
+    return sorted;
+}
+
+void test_move_gen_types()
+{
+    const char *fens[] = {
+        "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",
+        "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1",
+        "rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8",
+        "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1",
+    };
+    int evasion_positions = 0;
+    for (const char *fen : fens) {
+        Fenboard b;
+        b.set_fen(fen);
+        MoveList moves;
+        get_legal_moves(b, moves);
+        for (auto iter = moves.begin(); iter != moves.end(); iter++) {
+            b.apply_move(*iter);
+            if (b.is_in_check()) {
+                evasion_positions++;
+                for (int kind = 0; kind < 4; kind++) {
+                    assert_equals(generated_moves(b, GEN_ALL, kind & 1, kind & 2) == generated_moves(b, GEN_EVASIONS, kind & 1, kind & 2), true);
+                }
+            } else {
+                assert_equals(generated_moves(b, GEN_ALL, true, true) == generated_moves(b, GEN_CAPTURES, true, true), true);
+                assert_equals(generated_moves(b, GEN_ALL, false, true) == generated_moves(b, GEN_CAPTURES, false, true), true);
+                assert_equals(generated_moves(b, GEN_ALL, true, false) == generated_moves(b, GEN_QUIET_CHECKS, true, false), true);
+                assert_equals<size_t>(0, generated_moves(b, GEN_CAPTURES, true, false).size() + generated_moves(b, GEN_CAPTURES, false, false).size());
+                assert_equals<size_t>(0, generated_moves(b, GEN_QUIET_CHECKS, false, false).size() + generated_moves(b, GEN_QUIET_CHECKS, true, true).size()
+                    + generated_moves(b, GEN_QUIET_CHECKS, false, true).size());
+            }
+            b.undo_move(*iter);
+        }
+    }
+    assert_equals(evasion_positions > 0, true);
+}
+
+void test_perft()
+{
+    Fenboard b;
+    PerftHashTable table(16);
+
+    b.set_starting_position();
+    assert_equals<uint64_t>(8902, perft(b, 3));
+    // kiwipete: castling, pins and en passant
+    b.set_fen("r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1");
+    assert_equals<uint64_t>(97862, perft(b, 3));
+    assert_equals<uint64_t>(97862, perft(b, 3, &table));
+    b.set_fen("8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1");
+    assert_equals<uint64_t>(43238, perft(b, 4, &table));
+    b.set_fen("r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1");
+    assert_equals<uint64_t>(9467, perft(b, 3));
+    b.set_fen("rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8");
+    assert_equals<uint64_t>(62379, perft(b, 3));
+
+    b.set_fen("r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10");
+    auto divided = perft_divide(b, 3, 4, &table);
+    uint64_t total = 0;
+    for (auto iter = divided.begin(); iter != divided.end(); iter++) {
+        total += iter->second;
+    }
+    assert_equals<size_t>(46, divided.size());
+    assert_equals<uint64_t>(89890, total);
+
+    // both slider lookups see the same attacks
+    SliderBackend backend = Bitboard::get_slider_backend();
+    for (SliderBackend sliders : { slider_magic, slider_pext }) {
+        if (!Bitboard::set_slider_backend(sliders)) {
+            continue;
+        }
+        b.set_fen("r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1");
+        assert_equals<uint64_t>(97862, perft(b, 3));
+        b.set_fen("8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1");
+        assert_equals<uint64_t>(43238, perft(b, 4));
+    }
+    Bitboard::set_slider_backend(backend);
+}
+
+void test_pseudo_legal()
+{
+    Fenboard b;
+    b.set_starting_position();
+    assert_equals<uint64_t>(8902, perft(b, 3, nullptr, true));
+    b.set_fen("r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1");
+    assert_equals<uint64_t>(97862, perft(b, 3, nullptr, true));
+    b.set_fen("8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1");
+    assert_equals<uint64_t>(43238, perft(b, 4, nullptr, true));
+    b.set_fen("r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1");
+    assert_equals<uint64_t>(9467, perft(b, 3, nullptr, true));
+    b.set_fen("rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8");
+    assert_equals<uint64_t>(62379, perft(b, 3, nullptr, true));
+
+    // the same moves as the legal generator, with the same check flags
+    for (const char *fen : { "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1", "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1",
+            "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1", "rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8" }) {
+        b.set_fen(fen);
+        MoveList moves;
+        get_legal_moves(b, moves);
+        for (auto iter = moves.begin(); iter != moves.end(); iter++) {
+            b.apply_move(*iter);
+            MoveList legal, pseudo_legal;
+            get_legal_moves(b, legal);
+            b.get_pseudo_legal_moves(b.get_side_to_play(), pseudo_legal);
+            std::vector<move_t> expected(legal.begin(), legal.end());
+            std::vector<move_t> found;
+            for (auto move = pseudo_legal.begin(); move != pseudo_legal.end(); move++) {
+                if (b.is_legal(*move)) {
+                    found.push_back(b.gives_check(*move) ? *move | GIVES_CHECK : *move);
+                }
+            }
+            std::sort(expected.begin(), expected.end());
+            std::sort(found.begin(), found.end());
+            assert_equals(expected == found, true);
+            // the move sorter hands out the same moves, checking its quiet
+            // ones only as they come up
+            std::vector<move_t> sorted;
+            legal_moves(&b, sorted);
+            std::sort(sorted.begin(), sorted.end());
+            assert_equals(expected == sorted, true);
+            b.undo_move(*iter);
+
+            // is_legal finds checkers on the board, so it doesn't matter if
+            // the move before came without its GIVES_CHECK flag
+            b.apply_move(*iter & ~GIVES_CHECK);
+            std::vector<move_t> unflagged;
+            for (auto move = pseudo_legal.begin(); move != pseudo_legal.end(); move++) {
+                if (b.is_legal(*move)) {
+                    unflagged.push_back(b.gives_check(*move) ? *move | GIVES_CHECK : *move);
+                }
+            }
+            std::sort(unflagged.begin(), unflagged.end());
+            assert_equals(found == unflagged, true);
+            b.undo_move(*iter & ~GIVES_CHECK);
+        }
+    }
+}
+
+void test_state_stack()
+{
+    // undo restores the board and its hash exactly, en passant and castling included
+    const char *fen = "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1";
+    Fenboard b, fresh;
+    b.set_fen(fen);
+    uint64_t hash = b.get_hash();
+    MoveList moves;
+    get_legal_moves(b, moves);
+    for (auto iter = moves.begin(); iter != moves.end(); iter++) {
+        b.apply_move(*iter);
+        std::string child_fen = board_to_fen(&b);
+        uint64_t child_hash = b.get_hash();
+        MoveList replies;
+        get_legal_moves(b, replies);
+        for (auto reply = replies.begin(); reply != replies.end(); reply++) {
+            b.apply_move(*reply);
+            b.undo_move(*reply);
+            assert_equals(child_fen, board_to_fen(&b));
+            assert_equals(child_hash, b.get_hash());
+        }
+        fresh.set_fen(child_fen);
+        assert_equals(fresh.get_hash(), b.get_hash());
+        assert_equals(fresh.is_in_check(), b.is_in_check());
+        b.undo_move(*iter);
+        assert_equals(std::string(fen), board_to_fen(&b));
+        assert_equals(hash, b.get_hash());
+    }
+
+    // a null move only passes the turn
+    b.set_fen("rnbqkbnr/ppp2ppp/8/3pp3/4P3/5N2/PPPP1PPP/RNBQKB1R w KQkq d6 0 3");
+    hash = b.get_hash();
+    b.apply_null_move();
+    fresh.set_fen("rnbqkbnr/ppp2ppp/8/3pp3/4P3/5N2/PPPP1PPP/RNBQKB1R b KQkq - 0 3");
+    assert_equals(fresh.get_hash(), b.get_hash());
+    assert_equals(Black, b.get_side_to_play());
+    b.undo_null_move();
+    assert_equals(hash, b.get_hash());
+    assert_equals(White, b.get_side_to_play());
+
+    // repetitions are counted back to the last irreversible move
+    b.set_starting_position();
+    for (int round = 0; round < 2; round++) {
+        for (const char *san : { "Nf3", "Nf6", "Ng1", "Ng8" }) {
+            b.apply_move(b.read_move(san, b.get_side_to_play()));
+        }
+        assert_equals(round + 2, b.times_seen());
+    }
+    move_t move = b.read_move("e4", White);
+    b.apply_move(move);
+    assert_equals(1, b.times_seen());
+    b.undo_move(move);
+    assert_equals(3, b.times_seen());
 }
 
 void test_matrix()
@@ -527,6 +1209,20 @@ int main(int argc, char **argv)
     test_legal_moves(argv[1]);
     test_move_finding();
     test_static_exchange();
+    test_pawn_hash();
+    test_pgn_tokenizer();
+    test_read_move();
+    test_polyglot_book();
+    test_position_index();
+    test_analysis_cache();
+    test_tablebase();
+    test_square_tables();
+    test_move_list();
+    test_compact_move();
+    test_move_gen_types();
+    test_perft();
+    test_pseudo_legal();
+    test_state_stack();
     // test_matrix();
     return 0;
 }
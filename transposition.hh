@@ -2,9 +2,19 @@
 #include <cstdint>
 #include <cstring>
 
-struct TTEntry {
-    uint64_t hash;
-    uint64_t value;
+// One 8 byte word per entry, eight to a cache line: the bound type in bits
+// 0-1, depth in bits 2-6, the 25 hash bits directly above the bucket index in
+// bits 7-31, the score in bits 32-47 and the best move's compact_move_t in
+// bits 48-63. A table of 2^n entries is 2^(n-3) aligned buckets of eight, so a
+// probe reads a single cache line; hash bits n+22 and up go unchecked. An
+// empty entry is all zero; stored entries always have a type.
+typedef uint64_t TTEntry;
+
+const int TT_KEY_BITS = 25;
+const int TT_BUCKET_BITS = 3;
+
+struct alignas(64) TTBucket {
+    TTEntry entries[1 << TT_BUCKET_BITS];
 };
 
 class TranspositionTable {
@@ -12,17 +22,17 @@ public:
     TranspositionTable(int size_log2)
         : transposition_conflicts(0), transposition_table_size_log2(size_log2)
     {
-        transposition_table = new TTEntry[1ULL << transposition_table_size_log2];
+        transposition_table = new TTBucket[1ULL << bucket_bits()];
     }
     ~TranspositionTable() {
         delete[] transposition_table;
     }
     void reset() {
-        std::memset(transposition_table, 0, sizeof(TTEntry) * (1ULL << transposition_table_size_log2));
+        std::memset(transposition_table, 0, sizeof(TTBucket) * (1ULL << bucket_bits()));
     }
     uint64_t transposition_conflicts;
 
-    bool fetch_tt_entry(uint64_t hash, move_t &move, int16_t &value, unsigned char &depth, unsigned char &type) const {
+    bool fetch_tt_entry(uint64_t hash, compact_move_t &move, int16_t &value, unsigned char &depth, unsigned char &type) const {
         uint64_t storage = tt_entry(hash);
         if (storage == 0) {
             return false;
@@ -32,13 +42,13 @@ public:
             return false;
         }
         depth = (storage >> 2) & 0x1f;
-        value = (storage >> 16) & 0xffff;
-        move = (storage >> 32);
+        value = (storage >> 32) & 0xffff;
+        move = (storage >> 48);
 
         return true;
     }
     void insert_tt_entry(uint64_t hash, move_t move, int16_t value, unsigned char depth, unsigned char type) {
-        move_t old_move;
+        compact_move_t old_move;
         int16_t old_value;
         unsigned char old_depth, old_type;
 
@@ -47,39 +57,50 @@ public:
             return;
         }
 
-        uint64_t storage = (static_cast<uint64_t>(move) << 32) | (0xffff0000ULL & (static_cast<int16_t>(value) << 16));
+        uint64_t storage = (static_cast<uint64_t>(compact_move(move)) << 48) | (static_cast<uint64_t>(static_cast<uint16_t>(value)) << 32);
+        storage |= key_bits(hash);
         storage |= (depth & 0x1f) << 2;
         storage |= type & 0x3;
         set_tt_entry(hash, storage);
     }
 private:
+    int bucket_bits() const {
+        return transposition_table_size_log2 - TT_BUCKET_BITS;
+    }
+    uint64_t key_bits(uint64_t hash) const {
+        return ((hash >> bucket_bits()) & ((1ULL << TT_KEY_BITS) - 1)) << 7;
+    }
+    bool matches(TTEntry entry, uint64_t hash) const {
+        return entry != 0 && (entry & 0xffffff80ULL) == key_bits(hash);
+    }
+    // probe i of a bucket; the starting slot comes from the low key bits so
+    // positions sharing a bucket spread across it
+    TTEntry &slot(uint64_t hash, int i) const {
+        TTBucket &bucket = transposition_table[hash & ((1ULL << bucket_bits()) - 1)];
+        uint64_t start = hash >> bucket_bits();
+        return bucket.entries[(start + (1 << i) - 1) & ((1 << TT_BUCKET_BITS) - 1)];
+    }
+
     void set_tt_entry(uint64_t hash, uint64_t value) {
-        int table_size = (1ULL << transposition_table_size_log2);
-        int index = hash & (table_size-1);
         for (int i = 0; i < 4; i++) {
-            TTEntry &entry = transposition_table[(index + (1<<i)-1) % table_size];
-            if (entry.hash == hash || entry.hash == 0) {
-                entry.hash = hash;
-                entry.value = value;
+            TTEntry &entry = slot(hash, i);
+            if (entry == 0 || matches(entry, hash)) {
+                entry = value;
             }
         }
-        TTEntry &entry = transposition_table[index];
-        entry.hash = hash;
-        entry.value = value;
+        slot(hash, 0) = value;
     }
 
     uint64_t tt_entry(uint64_t hash) const {
-        int table_size = (1ULL << transposition_table_size_log2);
-        int index = hash & (table_size-1);
         for (int i = 0; i < 4; i++) {
-            TTEntry &entry = transposition_table[(index + (1<<i)-1) % table_size];
-            if (entry.hash == hash) {
-                return entry.value;
+            TTEntry entry = slot(hash, i);
+            if (matches(entry, hash)) {
+                return entry;
             }
         }
         return 0;
     }
 
-    TTEntry *transposition_table;
+    TTBucket *transposition_table;
     int transposition_table_size_log2;
 };
\ No newline at end of file
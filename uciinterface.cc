@@ -8,6 +8,9 @@
 #include "nnueeval.hh"
 #include "pgn.hh"
 #include "bitboard.hh"
+#include "bench.hh"
+#include "book.hh"
+#include "tablebase.hh"
 
 void tokenize(const std::string &s, unsigned char delimiter, std::vector<std::string> &tokens)
 {
@@ -43,6 +46,12 @@ struct UciSearchUpdate : public SearchUpdate {
 
 int main(int argc, char **argv)
 {
+    if (argc > 1 && std::string(argv[1]) == "bench") {
+        // bench [depth]
+        run_bench(std::cout, argc > 2 ? atoi(argv[2]) : BENCH_DEPTH);
+        return 0;
+    }
+
     Fenboard b;
     b.set_starting_position();
     UciSearchUpdate searchUpdate;
@@ -64,6 +73,11 @@ int main(int argc, char **argv)
     search.quiescent_depth = 4;
     search.max_depth = 12;
 
+    PolyglotBook book;
+    bool own_book = false;
+    Tablebases tablebases;
+    book.seed(time(NULL));
+
     while (true) {
         std::getline(*input, line);
         logging << line << std::endl;
@@ -87,6 +101,9 @@ int main(int argc, char **argv)
             std::cout << "option name exchange type spin default 1 min 0 max 2000" << std::endl;
             std::cout << "option name history type spin default 1 min 0 max 2000" << std::endl;
             std::cout << "option name hint type spin default 1 min 0 max 2000" << std::endl;
+            std::cout << "option name OwnBook type check default false" << std::endl;
+            std::cout << "option name BookFile type string default <empty>" << std::endl;
+            std::cout << "option name TablebasePath type string default <empty>" << std::endl;
 
             std::cout << "uciok" << std::endl;
         }
@@ -125,6 +142,27 @@ int main(int argc, char **argv)
                 else if (tokens[2] == "hint" && tokens.size() > 4) {
                     search.hint_coeff = stoi(tokens[4]);
                 }
+                else if (tokens[2] == "OwnBook" && tokens.size() > 4) {
+                    own_book = tokens[4] == "true";
+                }
+                else if (tokens[2] == "BookFile" && tokens.size() > 4) {
+                    // the path may contain spaces
+                    std::string filename = line.substr(line.find(" value ") + 7);
+                    if (filename == "<empty>") {
+                        book.close();
+                    } else if (book.open(filename)) {
+                        std::cout << "info string book " << filename << " has " << book.size() << " entries" << std::endl;
+                    }
+                }
+                else if (tokens[2] == "TablebasePath" && tokens.size() > 4) {
+                    std::string directory = line.substr(line.find(" value ") + 7);
+                    tablebases.close();
+                    search.tablebases = nullptr;
+                    if (directory != "<empty>" && tablebases.load(directory) > 0) {
+                        search.tablebases = &tablebases;
+                        std::cout << "info string found " << tablebases.size() << " tablebases" << std::endl;
+                    }
+                }
             } catch(std::exception& e) {
                 std::cerr << "error: " << e.what() << " from " << line << std::endl;
             }
@@ -169,6 +207,16 @@ int main(int argc, char **argv)
                     movemillisecs = std::stoi(value);
                 }
             }
+            if (own_book) {
+                // book moves are played instantly
+                move_t move = book.probe(b);
+                if (move != 0) {
+                    std::cout << "info string book move" << std::endl;
+                    std::cout << "bestmove ";
+                    print_move_uci(move, std::cout) << std::endl;
+                    continue;
+                }
+            }
             // find a move
             int time_millis = 30000;
             if (movemillisecs == 0) {
@@ -201,10 +249,20 @@ int main(int argc, char **argv)
                     << " score cp " << search.score
                     << " time " << elapsed_usecs / 1000
                     << " nodes " << search.nodecount
+                    << " tbhits " << search.tbhits
                     << " nps " << static_cast<uint64_t>(search.nodecount) * 1000 * 1000 / elapsed_usecs << std::endl;
             std::cout << "bestmove ";
             print_move_uci(move, std::cout) << std::endl;
         }
+        else if (line.rfind("bench", 0) == 0) {
+            std::vector<std::string> tokens;
+            tokenize(line, ' ', tokens);
+            int depth = BENCH_DEPTH;
+            if (tokens.size() > 1) {
+                depth = stoi(tokens[1]);
+            }
+            run_bench(std::cout, depth);
+        }
         else if (line.rfind("quit", 0) == 0) {
             break;
         }